@@ -11,7 +11,9 @@
 
 #include <onyx/device_tree.h>
 #include <onyx/init.h>
+#include <onyx/intrinsics.h>
 #include <onyx/mm/kasan.h>
+#include <onyx/numa.h>
 #include <onyx/paging.h>
 #include <onyx/percpu.h>
 #include <onyx/random.h>
@@ -27,6 +29,18 @@ void riscv_cpu_init();
 void plic_init();
 void arm64_setup_trap_handling();
 
+/**
+ * @brief Map the boot CPU to its NUMA node
+ * The device tree's cpu@ reg holds the MPIDR affinity fields, which is what handle_cpu_node
+ * recorded as the hardware ID.
+ */
+static void arm64_set_boot_cpu_node()
+{
+    int nid = numa_hwid_to_node(mrs(REG_MPIDR) & 0xffffff);
+    if (nid != NUMA_NO_NODE)
+        numa_set_cpu_node(0, nid);
+}
+
 extern "C" void kernel_entry(void *fdt)
 {
     write_per_cpu(__cpu_base, (unsigned long) &percpu_base);
@@ -37,6 +51,8 @@ extern "C" void kernel_entry(void *fdt)
 
     device_tree::init(fdt);
 
+    arm64_set_boot_cpu_node();
+
     initialize_entropy();
 
     vm_update_addresses(arch_high_half);
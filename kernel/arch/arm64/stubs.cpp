@@ -32,7 +32,12 @@ void cpu_kill_other_cpus()
 }
 
 int platform_allocate_msi_interrupts(unsigned int num_vectors, bool addr64,
-                                     struct pci_msi_data *data)
+                                     struct pci_msi_data *data, int cpu)
+{
+    UNIMPLEMENTED;
+}
+
+int platform_msi_retarget(struct pci_msi_data *data, unsigned int cpu)
 {
     UNIMPLEMENTED;
 }
@@ -87,6 +92,16 @@ void platform_mask_irq(unsigned int irq)
     UNIMPLEMENTED;
 }
 
+bool platform_irq_can_mask(unsigned int irq)
+{
+    return false;
+}
+
+void platform_unmask_irq(unsigned int irq)
+{
+    /* Nothing can be masked (see platform_irq_can_mask), so there's never anything to unmask */
+}
+
 namespace smp
 {
 
@@ -10,6 +10,7 @@
 #include <stdio.h>
 
 #include <onyx/cpu.h>
+#include <onyx/mm/mmu_gather.h>
 #include <onyx/page.h>
 #include <onyx/paging.h>
 #include <onyx/panic.h>
@@ -795,64 +796,6 @@ public:
     }
 };
 
-struct tlb_invalidation_tracker
-{
-    unsigned long virt_start;
-    unsigned long virt_end;
-    bool is_started, is_flushed;
-
-    explicit tlb_invalidation_tracker() : virt_start{}, virt_end{}, is_started{}, is_flushed{}
-    {
-    }
-
-    void invalidate_tracker()
-    {
-        virt_start = 0xDEADDAD;
-        virt_end = 0xB0;
-        is_started = false;
-        is_flushed = false;
-    }
-
-    void flush()
-    {
-        if (!is_started)
-            return;
-
-        vm_invalidate_range(virt_start, (virt_end - virt_start) >> PAGE_SHIFT);
-        invalidate_tracker();
-    }
-
-    constexpr void init(unsigned long vaddr, size_t size)
-    {
-        is_started = true;
-        virt_start = vaddr;
-        virt_end = vaddr + size;
-        is_flushed = false;
-    }
-
-    void add_page(unsigned long vaddr, size_t size)
-    {
-        /* If we've already started on a run of pages and this one is contiguous, just set the tail
-         */
-        if (is_started && virt_end == vaddr)
-        {
-            virt_end = vaddr + size;
-        }
-        else
-        {
-            /* Else, try flushing if is_started == true and restart the page run */
-            flush();
-            init(vaddr, size);
-        }
-    }
-
-    ~tlb_invalidation_tracker()
-    {
-        if (is_started && !is_flushed)
-            flush();
-    }
-};
-
 enum page_table_levels : unsigned int
 {
     PT_LEVEL,
@@ -886,14 +829,14 @@ constexpr unsigned int addr_get_index(unsigned long virt, unsigned int pt_level)
 #define MMU_UNMAP_CAN_FREE_PML 1
 #define MMU_UNMAP_OK           0
 
-static int riscv_mmu_unmap(PML *table, unsigned int pt_level, page_table_iterator &it)
+static int riscv_mmu_unmap(PML *table, unsigned int pt_level, page_table_iterator &it,
+                           mmu_gather &tlb)
 {
     unsigned int index = addr_get_index(it.curr_addr(), pt_level);
 
     /* Get the size that each entry represents here */
     auto entry_size = level_to_entry_size(pt_level);
 
-    tlb_invalidation_tracker invd_tracker;
     unsigned int i;
 
 #ifdef CONFIG_PT_ITERATOR_HAVE_DEBUG
@@ -946,7 +889,7 @@ static int riscv_mmu_unmap(PML *table, unsigned int pt_level, page_table_iterato
 
             if (val & RISCV_MMU_ACCESSED)
             {
-                invd_tracker.add_page(it.curr_addr(), entry_size);
+                tlb.add_range(it.as_, it.curr_addr(), entry_size);
             }
 
             it.adjust_length(entry_size);
@@ -956,7 +899,7 @@ static int riscv_mmu_unmap(PML *table, unsigned int pt_level, page_table_iterato
         {
             assert((pt_entry & RISCV_MMU_VALID) != 0);
             PML *next_table = (PML *) PHYS_TO_VIRT(PML_EXTRACT_ADDRESS(pt_entry));
-            int st = riscv_mmu_unmap(next_table, pt_level - 1, it);
+            int st = riscv_mmu_unmap(next_table, pt_level - 1, it, tlb);
 
             if (st == MMU_UNMAP_CAN_FREE_PML)
             {
@@ -966,7 +909,9 @@ static int riscv_mmu_unmap(PML *table, unsigned int pt_level, page_table_iterato
 
                 COMPILER_BARRIER();
 
-                free_page(page);
+                /* Other CPUs may still be walking this table through their paging-structure
+                 * caches, so it can only be freed after the shootdown */
+                tlb.remove_page_table(page);
                 __atomic_sub_fetch(&allocated_page_tables, 1, __ATOMIC_RELAXED);
                 decrement_vm_stat(it.as_, page_tables_size, PAGE_SIZE);
             }
@@ -991,8 +936,12 @@ static int riscv_mmu_unmap(PML *table, unsigned int pt_level, page_table_iterato
     return MMU_UNMAP_OK;
 }
 
-int vm_mmu_unmap(struct mm_address_space *as, void *addr, size_t pages)
+int vm_mmu_unmap(struct mm_address_space *as, void *addr, size_t pages, mmu_gather *tlb)
 {
+    mmu_gather local_tlb;
+    if (!tlb)
+        tlb = &local_tlb;
+
     unsigned long virt = (unsigned long) addr;
     size_t size = pages << PAGE_SHIFT;
 
@@ -1000,73 +949,13 @@ int vm_mmu_unmap(struct mm_address_space *as, void *addr, size_t pages)
 
     PML *first_level = (PML *) PHYS_TO_VIRT(as->arch_mmu.top_pt);
 
-    riscv_mmu_unmap(first_level, riscv_paging_levels - 1, it);
+    riscv_mmu_unmap(first_level, riscv_paging_levels - 1, it, *tlb);
 
     assert(it.length() == 0);
 
     return 0;
 }
 
-static inline bool is_higher_half(unsigned long address)
-{
-    return address >= VM_HIGHER_HALF;
-}
-
-PER_CPU_VAR(unsigned long tlb_nr_invals) = 0;
-PER_CPU_VAR(unsigned long nr_tlb_shootdowns) = 0;
-
-struct mm_shootdown_info
-{
-    unsigned long addr;
-    size_t pages;
-    mm_address_space *mm;
-};
-
-void riscv_invalidate_tlb(void *context)
-{
-    auto info = (mm_shootdown_info *) context;
-    auto addr = info->addr;
-    auto pages = info->pages;
-    auto addr_space = info->mm;
-
-    auto curr_thread = get_current_thread();
-
-    if (is_higher_half(addr) ||
-        (curr_thread->owner && curr_thread->owner->get_aspace() == addr_space))
-    {
-        paging_invalidate((void *) addr, pages);
-        add_per_cpu(tlb_nr_invals, 1);
-    }
-}
-
-/**
- * @brief Invalidates a memory range.
- *
- * @param addr The start of the memory range.
- * @param pages The size of the memory range, in pages.
- * @param mm The target address space.
- */
-void mmu_invalidate_range(unsigned long addr, size_t pages, mm_address_space *mm)
-{
-    add_per_cpu(nr_tlb_shootdowns, 1);
-    mm_shootdown_info info{addr, pages, mm};
-
-    auto our_cpu = get_cpu_nr();
-    cpumask mask;
-
-    if (addr >= VM_HIGHER_HALF)
-    {
-        mask = cpumask::all_but_one(our_cpu);
-    }
-    else
-    {
-        mask = mm->active_mask;
-        mask.remove_cpu(our_cpu);
-    }
-
-    smp::sync_call_with_local(riscv_invalidate_tlb, &info, mask, riscv_invalidate_tlb, &info);
-}
-
 struct mmu_acct
 {
     size_t page_table_size;
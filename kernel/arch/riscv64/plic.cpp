@@ -229,6 +229,18 @@ void platform_mask_irq(unsigned int irq)
     irqchip->mask(irq);
 }
 
+void platform_unmask_irq(unsigned int irq)
+{
+    if (!irqchip)
+        return;
+    irqchip->unmask(irq);
+}
+
+bool platform_irq_can_mask(unsigned int irq)
+{
+    return irqchip != nullptr;
+}
+
 unsigned int plic_claim()
 {
     if (!irqchip)
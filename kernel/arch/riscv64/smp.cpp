@@ -12,6 +12,7 @@
 #include <onyx/device_tree.h>
 #include <onyx/fpu.h>
 #include <onyx/init.h>
+#include <onyx/numa.h>
 #include <onyx/riscv/features.h>
 #include <onyx/riscv/sbi.h>
 #include <onyx/riscv/smp.h>
@@ -190,6 +191,14 @@ void riscv_mp_init()
     smp::set_number_of_cpus(cpus.size());
     smp::set_online(0);
     riscv_fixup_harts();
+
+    for (unsigned int i = 0; i < cpu2hart.size(); i++)
+    {
+        int nid = numa_hwid_to_node(cpu2hart[i]);
+        if (nid != NUMA_NO_NODE)
+            numa_set_cpu_node(i, nid);
+    }
+
     smp::boot_cpus();
 }
 
@@ -19,7 +19,12 @@ void cpu_kill_other_cpus()
 }
 
 int platform_allocate_msi_interrupts(unsigned int num_vectors, bool addr64,
-                                     struct pci_msi_data *data)
+                                     struct pci_msi_data *data, int cpu)
+{
+    UNIMPLEMENTED;
+}
+
+int platform_msi_retarget(struct pci_msi_data *data, unsigned int cpu)
 {
     UNIMPLEMENTED;
 }
@@ -109,6 +109,33 @@ fault:
     return -EFAULT;
 }
 
+long cmpxchg_user32(unsigned int *uaddr, unsigned int *expected, unsigned int newval)
+{
+    DO_USER_POINTER_CHECKS(uaddr, sizeof(uint32_t));
+    ALLOW_USER_MEMORY_ACCESS;
+    // Same as get_user32, *expected is written by the asm itself
+    __asm__ goto("    lw t0, %0\n\t"
+                 "1:  lr.w.aqrl t1, 0(%1)\n\t"
+                 "    bne t1, t0, 3f\n\t"
+                 "2:  sc.w.rl t2, %2, 0(%1)\n\t"
+                 "    bnez t2, 1b\n\t"
+                 "3:  sw t1, %0\n\t"
+                 ".pushsection .ehtable\n\t"
+                 ".dword 1b\n\t"
+                 ".dword %l3\n\t"
+                 ".dword 2b\n\t"
+                 ".dword %l3\n\t"
+                 ".popsection\n\t" ::"m"(*expected),
+                 "r"(uaddr), "r"(newval)
+                 : "t0", "t1", "t2", "memory"
+                 : fault);
+    CLEAR_USER_MEMORY_ACCESS;
+    return 0;
+fault:
+    CLEAR_USER_MEMORY_ACCESS;
+    return -EFAULT;
+}
+
 long get_user64(unsigned long *uaddr, unsigned long *dest)
 {
     DO_USER_POINTER_CHECKS(uaddr, sizeof(uint64_t));
@@ -15,6 +15,7 @@
 #include <onyx/cpu.h>
 #include <onyx/irq.h>
 #include <onyx/log.h>
+#include <onyx/numa.h>
 #include <onyx/panic.h>
 #include <onyx/percpu.h>
 #include <onyx/process.h>
@@ -239,6 +240,18 @@ void ioapic_mask_pin(uint32_t pin)
     write_redirection_entry(pin, entry);
 }
 
+/**
+ * @brief Unmasks a previously masked interrupt pin, keeping its current routing.
+ *
+ * @param pin Pin to unmask.
+ */
+void ioapic_clear_pin_mask(uint32_t pin)
+{
+    uint64_t entry = read_redirection_entry(pin);
+    entry &= ~IOAPIC_PIN_MASKED;
+    write_redirection_entry(pin, entry);
+}
+
 #ifndef CONFIG_ACPI
 
 acpi_status acpi_get_table(acpi_string signature, u32 instance,
@@ -315,6 +328,13 @@ static void parse_lapics()
 
     x86_fixup_lapic_list(x86_get_current_lapic_id());
 
+    for (unsigned int i = 0; i < lapic_ids.size(); i++)
+    {
+        int nid = numa_hwid_to_node(lapic_ids[i]);
+        if (nid != NUMA_NO_NODE)
+            numa_set_cpu_node(i, nid);
+    }
+
     // Take this time to do brief init of some SMP stuff that needed the number of CPUs
 
     smp::set_number_of_cpus(nr_cpus);
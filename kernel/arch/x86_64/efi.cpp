@@ -7,6 +7,7 @@
  */
 
 #include <onyx/acpi.h>
+#include <onyx/numa.h>
 #include <onyx/page.h>
 #include <onyx/paging.h>
 #include <onyx/smbios.h>
@@ -102,15 +103,21 @@ static void efi_enumerate_memory_map()
 
     paging_map_all_phys();
 
+#ifdef CONFIG_ACPI
+    acpi_numa_init();
+#endif
+
     page_init(memory, maxpfn);
 }
 
 void efi_boot_init(EFI_SYSTEM_TABLE *systable)
 {
-    efi_enumerate_memory_map();
-
+    /* Set the RSDP before enumerating memory, as NUMA discovery needs it before page_init */
     if (efi_state.acpi_table)
         acpi_set_rsdp((uintptr_t) efi_state.acpi_table);
+
+    efi_enumerate_memory_map();
+
     smbios_set_tables((unsigned long) efi_state.smbios_table,
                       (unsigned long) efi_state.smbios30_table);
 }
@@ -73,31 +73,40 @@ unsigned long irq_handler(struct registers *regs)
     return (unsigned long) context.registers;
 }
 
+static unsigned int msi_next_cpu;
+
+static uint32_t x86_msi_address(unsigned int cpu)
+{
+    /* See section 10.11.1 of the intel software developer manuals */
+    return PCI_MSI_BASE_ADDRESS | (cpu2lapicid(cpu) << PCI_MSI_APIC_ID_SHIFT);
+}
+
 int platform_allocate_msi_interrupts(unsigned int num_vectors, bool addr64,
-                                     struct pci_msi_data *data)
+                                     struct pci_msi_data *data, int cpu)
 {
-    /* TODO: Balance IRQs between processors, since it's not ok to assume
-     * the current CPU, since then, IRQs become unbalanced
-     *
-     * TODO: Magenta hardcodes some of this stuff. Is it dangerous that things
+    /* TODO: Magenta hardcodes some of this stuff. Is it dangerous that things
      * are hardcoded like that?
      */
     int vecs = x86_allocate_vectors(num_vectors);
     if (vecs < 0)
         return -1;
-    /* See section 10.11.1 of the intel software developer manuals */
-    uint32_t address = PCI_MSI_BASE_ADDRESS;
-    address |= (cpu2lapicid(get_cpu_nr())) << PCI_MSI_APIC_ID_SHIFT;
 
-    printf("x86/msi: Routing %u vectors to cpu%u\n", num_vectors, get_cpu_nr());
+    /* Don't pile every device's interrupts on the CPU that happened to probe it, round-robin them
+     * instead. The IDT is shared, so any vector can be taken on any CPU.
+     */
+    if (cpu < 0)
+        cpu = __atomic_fetch_add(&msi_next_cpu, 1, __ATOMIC_RELAXED) % get_nr_cpus();
+
+    printf("x86/msi: Routing %u vectors to cpu%u\n", num_vectors, cpu);
 
     /* See section 10.11.2 of the intel software developer manuals */
     uint32_t data_val = vecs;
 
-    data->address = address;
+    data->address = x86_msi_address(cpu);
     data->address_high = 0;
     data->data = data_val;
     data->vector_start = vecs;
+    data->cpu = cpu;
 
     size_t irq_stub_size = 12;
     unsigned int irq_offset = vecs - 32;
@@ -115,6 +124,13 @@ int platform_allocate_msi_interrupts(unsigned int num_vectors, bool addr64,
     return 0;
 }
 
+int platform_msi_retarget(struct pci_msi_data *data, unsigned int cpu)
+{
+    data->address = x86_msi_address(cpu);
+    data->cpu = cpu;
+    return 0;
+}
+
 void platform_send_eoi(uint64_t irq)
 {
     /* Note: MSI interrupts also require EOIs */
@@ -123,5 +139,18 @@ void platform_send_eoi(uint64_t irq)
 
 void platform_mask_irq(unsigned int irq)
 {
-    ioapic_mask_pin(irq);
+    /* MSIs can't be masked here, only through the device */
+    if (irq < NUM_IOAPIC_PINS)
+        ioapic_mask_pin(irq);
+}
+
+void platform_unmask_irq(unsigned int irq)
+{
+    if (irq < NUM_IOAPIC_PINS)
+        ioapic_clear_pin_mask(irq);
+}
+
+bool platform_irq_can_mask(unsigned int irq)
+{
+    return irq < NUM_IOAPIC_PINS;
 }
@@ -32,6 +32,7 @@
 #include <onyx/log.h>
 #include <onyx/mm/kasan.h>
 #include <onyx/modules.h>
+#include <onyx/numa.h>
 #include <onyx/page.h>
 #include <onyx/pagecache.h>
 #include <onyx/paging.h>
@@ -334,6 +335,9 @@ extern "C" void multiboot2_kernel_entry(uintptr_t addr, uint32_t magic)
     max_pfn = mb2_get_maxpfn();
 
     paging_map_all_phys();
+#ifdef CONFIG_ACPI
+    acpi_numa_init();
+#endif
     page_init(total_mem, max_pfn);
     x86_late_vm_init();
 
@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2023 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include <onyx/acpi.h>
+#include <onyx/numa.h>
+#include <onyx/vm.h>
+
+/* This runs before page_init (and thus, before ACPICA gets initialized), so we walk the root tables
+ * by hand. All of physical memory is already mapped at this point, so PHYS_TO_VIRT is enough.
+ */
+
+void acpi_find_rsdp();
+
+/* Proximity domains are arbitrary 32-bit values, so we map them to compact node IDs */
+static u32 nid_to_pxm[MAX_NUMA_NODES];
+static unsigned int nr_pxms;
+
+static int acpi_pxm_to_nid(u32 pxm)
+{
+    for (unsigned int i = 0; i < nr_pxms; i++)
+    {
+        if (nid_to_pxm[i] == pxm)
+            return i;
+    }
+
+    if (nr_pxms == MAX_NUMA_NODES)
+    {
+        printf("acpi/numa: Too many proximity domains, folding pxm %u into node 0\n", pxm);
+        return 0;
+    }
+
+    nid_to_pxm[nr_pxms] = pxm;
+    return nr_pxms++;
+}
+
+static int acpi_pxm_lookup(u32 pxm)
+{
+    for (unsigned int i = 0; i < nr_pxms; i++)
+    {
+        if (nid_to_pxm[i] == pxm)
+            return i;
+    }
+
+    return NUMA_NO_NODE;
+}
+
+static acpi_table_header *acpi_early_find_table(const char *sig)
+{
+    const auto rsdp = (acpi_table_rsdp *) PHYS_TO_VIRT(acpi_get_rsdp());
+    bool xsdt = rsdp->revision >= 2 && rsdp->xsdt_physical_address;
+    const auto root = (acpi_table_header *) PHYS_TO_VIRT(
+        xsdt ? rsdp->xsdt_physical_address : (unsigned long) rsdp->rsdt_physical_address);
+    const size_t entry_size = xsdt ? ACPI_XSDT_ENTRY_SIZE : ACPI_RSDT_ENTRY_SIZE;
+    const size_t nr_entries = (root->length - sizeof(acpi_table_header)) / entry_size;
+    const u8 *entries = (const u8 *) (root + 1);
+
+    for (size_t i = 0; i < nr_entries; i++)
+    {
+        unsigned long addr;
+        if (xsdt)
+        {
+            u64 entry;
+            memcpy(&entry, entries + i * entry_size, sizeof(entry));
+            addr = entry;
+        }
+        else
+        {
+            u32 entry;
+            memcpy(&entry, entries + i * entry_size, sizeof(entry));
+            addr = entry;
+        }
+
+        const auto table = (acpi_table_header *) PHYS_TO_VIRT(addr);
+        if (!memcmp(table->signature, sig, ACPI_NAMESEG_SIZE))
+            return table;
+    }
+
+    return nullptr;
+}
+
+static void acpi_parse_srat(acpi_table_srat *srat)
+{
+    const auto end = (char *) srat + srat->header.length;
+
+    for (auto sub = (acpi_subtable_header *) (srat + 1); (char *) sub < end;
+         sub = (acpi_subtable_header *) ((char *) sub + sub->length))
+    {
+        if (sub->length == 0)
+            break;
+
+        switch (sub->type)
+        {
+            case ACPI_SRAT_TYPE_CPU_AFFINITY: {
+                auto cpu = (acpi_srat_cpu_affinity *) sub;
+                if (!(cpu->flags & ACPI_SRAT_CPU_USE_AFFINITY))
+                    break;
+                u32 pxm = cpu->proximity_domain_lo;
+                if (srat->header.revision >= 2)
+                {
+                    pxm |= cpu->proximity_domain_hi[0] << 8 | cpu->proximity_domain_hi[1] << 16 |
+                           cpu->proximity_domain_hi[2] << 24;
+                }
+
+                numa_add_cpu_hwid(cpu->apic_id, acpi_pxm_to_nid(pxm));
+                break;
+            }
+
+            case ACPI_SRAT_TYPE_X2APIC_CPU_AFFINITY: {
+                auto cpu = (acpi_srat_x2apic_cpu_affinity *) sub;
+                if (!(cpu->flags & ACPI_SRAT_CPU_ENABLED))
+                    break;
+                numa_add_cpu_hwid(cpu->apic_id, acpi_pxm_to_nid(cpu->proximity_domain));
+                break;
+            }
+
+            case ACPI_SRAT_TYPE_MEMORY_AFFINITY: {
+                auto mem = (acpi_srat_mem_affinity *) sub;
+                if (!(mem->flags & ACPI_SRAT_MEM_ENABLED) || !mem->length)
+                    break;
+                u32 pxm = mem->proximity_domain;
+                if (srat->header.revision < 2)
+                    pxm &= 0xff;
+                numa_add_memblk(acpi_pxm_to_nid(pxm), mem->base_address,
+                                mem->base_address + mem->length);
+                break;
+            }
+        }
+    }
+}
+
+static void acpi_parse_slit(acpi_table_slit *slit)
+{
+    const u64 count = slit->locality_count;
+
+    for (u64 i = 0; i < count; i++)
+    {
+        int from = acpi_pxm_lookup(i);
+        if (from == NUMA_NO_NODE)
+            continue;
+
+        for (u64 j = 0; j < count; j++)
+        {
+            int to = acpi_pxm_lookup(j);
+            if (to == NUMA_NO_NODE)
+                continue;
+            numa_set_distance(from, to, slit->entry[i * count + j]);
+        }
+    }
+}
+
+/**
+ * @brief Parse the ACPI SRAT and SLIT tables, before page_init
+ *
+ */
+void acpi_numa_init()
+{
+    acpi_find_rsdp();
+
+    if (!acpi_get_rsdp())
+        return;
+
+    auto srat = (acpi_table_srat *) acpi_early_find_table(ACPI_SIG_SRAT);
+    if (!srat)
+        return;
+
+    acpi_parse_srat(srat);
+
+    auto slit = (acpi_table_slit *) acpi_early_find_table(ACPI_SIG_SLIT);
+    if (slit)
+        acpi_parse_slit(slit);
+
+    printf("acpi/numa: Found %u node(s)\n", nr_pxms);
+}
@@ -52,57 +52,96 @@ MODULE_INSERT_VERSION();
     } while (0);
 #endif
 
-void ahci_io_queue::do_irq(u16 slot, u32 irq_status)
+/**
+ * @brief Finish a request, and queue the next one from the io_queue (if any)
+ *
+ * @param req Request (with BIO_REQ_DONE or BIO_REQ_EIO set)
+ */
+void ahci_io_queue::finish_request(bio_req *req)
 {
-    scoped_lock<spinlock, true> g{lock_};
+    wake_address(req);
 
+    // Note: req may be gone by now
+    auto next = complete_request(req);
+
+    // Don't issue it directly, kick_deferred() sorts out ordering and NCQ vs non-queued
+    if (next)
+        list_add_tail(&next->list_node, &deferred_);
+}
+
+/**
+ * @brief Complete the request on a slot, and free the slot
+ *
+ * @param slot Command slot
+ * @param irq_status Port interrupt status
+ */
+void ahci_io_queue::complete_slot(u16 slot, u32 irq_status)
+{
     auto list = &cmdslots[slot];
     list->received_interrupt = true;
     list->last_interrupt_status = irq_status;
     list->status = port->port->status;
     list->tfd = port->port->tfd;
 
+    auto breq = list->breq;
+
+    free_slot(slot);
+    port->issued &= ~(1U << slot);
+    ncq_issued_ &= ~(1U << slot);
+
     // TODO: Understand why this fires and fix it
     // assert(list->breq != nullptr);
-    if (!list->breq)
+    if (!breq)
         return;
 
-    if (list->last_interrupt_status & AHCI_INTST_ERROR)
-    {
-        list->breq->flags |= BIO_REQ_EIO;
-    }
-    else if (list->last_interrupt_status & AHCI_PORT_INTERRUPT_DHRE)
-    {
-        list->breq->flags |= BIO_REQ_DONE;
-    }
+    list->breq = nullptr;
+    breq->flags |= (irq_status & AHCI_INTST_ERROR) ? BIO_REQ_EIO : BIO_REQ_DONE;
+    finish_request(breq);
+}
 
-    auto breq = list->breq;
+/**
+ * @brief Handle a port interrupt
+ *
+ * @param irq_status Port interrupt status
+ */
+void ahci_io_queue::handle_irq(u32 irq_status)
+{
+    scoped_lock<spinlock, true> g{lock_};
 
-    wake_address(breq);
+    // A slot is done once the HBA has cleared its PxCI bit and, for NCQ commands, the device has
+    // cleared its PxSACT bit (through a Set Device Bits FIS).
+    const uint32_t outstanding = port->port->command_issue | port->port->active;
+    uint32_t done = port->issued & ~outstanding;
 
-    auto next = complete_request(breq);
+    // Commands that completed before the error are fine, only what's left is in trouble
+    const uint32_t status = irq_status & ~AHCI_INTST_ERROR;
 
-    free_slot(slot);
+    while (done)
+    {
+        u16 slot = __builtin_ctz(done);
+        done &= ~(1U << slot);
+        complete_slot(slot, status);
+    }
 
-    port->issued &= ~(1UL << slot);
+    if (irq_status & AHCI_INTST_ERROR && port->issued)
+    {
+        start_recovery();
+        return;
+    }
 
-    if (next)
-        device_io_submit(next);
+    kick_deferred();
 }
 
 void ahci_do_port_irqs(struct ahci_port *port, u32 irq_status)
 {
-    uint32_t cmd_done = port->issued ^ port->port->command_issue;
-
-    for (unsigned int j = 0; j < 32; j++)
-    {
-        if (cmd_done & (1U << j))
-        {
-            port->io_queue->do_irq(j, irq_status);
-        }
-    }
+    port->io_queue->handle_irq(irq_status);
 }
 
+/**
+ * @brief AHCI hard irq handler
+ * Acks the interrupt and stashes every port's interrupt status; completions are walked in the irq
+ * thread (ahci_irq_thread).
+ */
 irqstatus_t ahci_irq(struct irq_context *ctx, void *cookie)
 {
     UNUSED(ctx);
@@ -119,7 +158,6 @@ irqstatus_t ahci_irq(struct irq_context *ctx, void *cookie)
     for (unsigned int i = 0; i < 32; i++)
     {
         struct ahci_port *port = &dev->ports[i];
-        unsigned long cpu_flags = spin_lock_irqsave(&port->port_lock);
 
         if (ports & (1U << i))
         {
@@ -132,13 +170,32 @@ irqstatus_t ahci_irq(struct irq_context *ctx, void *cookie)
             uint32_t port_is = port->port->interrupt_status;
             port->port->interrupt_status = port_is;
             dev->hba->interrupt_status = (1U << i);
-            ahci_do_port_irqs(port, port_is);
+            __atomic_or_fetch(&port->pending_is, port_is, __ATOMIC_RELAXED);
         }
-
-        spin_unlock_irqrestore(&port->port_lock, cpu_flags);
     }
 
-    return IRQ_HANDLED;
+    return IRQ_WAKE_THREAD;
+}
+
+/**
+ * @brief AHCI irq thread
+ * Walks the completions of every port the hard irq handler saw an interrupt on.
+ */
+void ahci_irq_thread(void *cookie)
+{
+    struct ahci_device *dev = (ahci_device *) cookie;
+
+    for (unsigned int i = 0; i < 32; i++)
+    {
+        struct ahci_port *port = &dev->ports[i];
+
+        uint32_t port_is = __atomic_exchange_n(&port->pending_is, 0, __ATOMIC_RELAXED);
+        if (!port_is)
+            continue;
+
+        scoped_lock<spinlock, true> g{port->port_lock};
+        ahci_do_port_irqs(port, port_is);
+    }
 }
 
 #define ATA_CMD_ERR_BAD_REQ 0xff
@@ -161,6 +218,9 @@ static uint8_t bio_req_to_ata_command(struct bio_req *req)
 
 long ahci_setup_prdt_bio(prdt_t *prdt, struct bio_req *r, size_t *size);
 void ahci_set_lba(uint64_t lba, cfis_t *cfis);
+int ahci_wait_bit(volatile uint32_t *reg, uint32_t mask, unsigned long timeout, bool clear);
+int ahci_port_set_idle(ahci_port_t *port);
+int ahci_port_comreset(ahci_port_t *port);
 
 /**
  * @brief Allocate a command list slow
@@ -189,6 +249,57 @@ void ahci_io_queue::free_slot(u16 slot)
     list_bitmap &= ~(1 << slot);
 }
 
+/**
+ * @brief Check if a request is going to be issued as an NCQ command
+ *
+ * @param req Request
+ * @return True if so, else false
+ */
+bool ahci_io_queue::is_ncq(const bio_req *req) const
+{
+    auto op = req->flags & BIO_REQ_OP_MASK;
+    return ncq_ && (op == BIO_REQ_READ_OP || op == BIO_REQ_WRITE_OP);
+}
+
+/**
+ * @brief Check if a request can be issued to the device right now
+ *
+ * @param ncq True if the request is an NCQ command
+ * @return True if so, else false
+ */
+bool ahci_io_queue::can_issue(bool ncq) const
+{
+    if (recovering_)
+        return false;
+
+    if (!port->issued)
+        return true;
+
+    // NCQ commands can be issued alongside other NCQ commands, but non-queued commands need
+    // the device all for themselves.
+    return ncq && ncq_issued_ == port->issued;
+}
+
+/**
+ * @brief Issue as many deferred requests as we can
+ */
+void ahci_io_queue::kick_deferred()
+{
+    while (!list_is_empty(&deferred_))
+    {
+        auto req = container_of(list_first_element(&deferred_), bio_req, list_node);
+        const bool ncq = is_ncq(req);
+
+        if (!can_issue(ncq))
+            break;
+
+        list_remove(&req->list_node);
+
+        if (issue(req, ncq) < 0)
+            finish_request(req);
+    }
+}
+
 /**
  * @brief Submits IO to a device
  *
@@ -200,8 +311,28 @@ int ahci_io_queue::device_io_submit(bio_req *req)
     auto bdev = req->bdev;
     req->sector_number += (bdev->offset / 512);
 
+    const bool ncq = is_ncq(req);
+
+    // Keep things in order: if something is already waiting, get behind it
+    if (!list_is_empty(&deferred_) || !can_issue(ncq))
+    {
+        list_add_tail(&req->list_node, &deferred_);
+        return 0;
+    }
+
+    return issue(req, ncq);
+}
+
+/**
+ * @brief Issue a request on a command slot
+ *
+ * @param req Request
+ * @param ncq True if the request should be issued as an NCQ command
+ * @return 0 on success, negative error codes
+ */
+int ahci_io_queue::issue(bio_req *req, bool ncq)
+{
     const uint16_t fis_len = 5;
-    (void) fis_len;
 
     auto [list, list_index] = allocate_clist();
 
@@ -231,7 +362,6 @@ int ahci_io_queue::device_io_submit(bio_req *req)
 
     table->cfis.port_mult = 0;
     table->cfis.c = 1;
-    table->cfis.feature_low = 1;
 
     /* Load the LBA */
     uint64_t lba = req->sector_number;
@@ -247,8 +377,22 @@ int ahci_io_queue::device_io_submit(bio_req *req)
         table->cfis.device = 0;
 
     size_t num_sectors = size / 512;
-    table->cfis.count = (uint16_t) num_sectors;
-    table->cfis.command = bio_req_to_ata_command(req);
+
+    if (ncq)
+    {
+        // FPDMA QUEUED commands take the sector count in the features register, and the tag in
+        // bits 7:3 of the count register. We use the slot number as the tag.
+        table->cfis.feature_low = (uint8_t) num_sectors;
+        table->cfis.feature_high = (uint8_t) (num_sectors >> 8);
+        table->cfis.count = list_index << 3;
+        table->cfis.command = op == BIO_REQ_READ_OP ? ATA_CMD_READ_FPDMA : ATA_CMD_WRITE_FPDMA;
+    }
+    else
+    {
+        table->cfis.feature_low = 1;
+        table->cfis.count = (uint16_t) num_sectors;
+        table->cfis.command = bio_req_to_ata_command(req);
+    }
 
     struct command_list *l = &cmdslots[list_index];
 
@@ -256,12 +400,190 @@ int ahci_io_queue::device_io_submit(bio_req *req)
 
     COMPILER_BARRIER();
 
-    port->port->command_issue = (1U << list_index);
     port->issued |= (1U << list_index);
 
+    if (ncq)
+    {
+        // PxSACT needs to be set before PxCI
+        ncq_issued_ |= (1U << list_index);
+        port->port->active = (1U << list_index);
+    }
+
+    port->port->command_issue = (1U << list_index);
+
     return 0;
 }
 
+/**
+ * @brief Enable Native Command Queueing
+ * Must be called with no commands outstanding.
+ *
+ * @param depth Queue depth supported by the drive
+ */
+void ahci_io_queue::enable_ncq(unsigned int depth)
+{
+    scoped_lock<spinlock, true> g{lock_};
+    assert(port->issued == 0);
+
+    // Tags are slot numbers, so don't use slots the drive can't take tags for
+    if (depth < nr_entries_)
+    {
+        list_bitmap |= -(1U << depth);
+        nr_entries_ = depth;
+    }
+
+    ncq_ = true;
+}
+
+/**
+ * @brief Start error recovery, from IRQ context
+ */
+void ahci_io_queue::start_recovery()
+{
+    if (recovering_)
+        return;
+
+    recovering_ = true;
+
+    // Keep the port quiet until we're done
+    port->port->pxie = 0;
+
+    struct dpc_work work = {};
+    work.funcptr = [](void *ctx) { ((ahci_io_queue *) ctx)->recover(); };
+    work.context = this;
+    if (dpc_schedule_work(&work, DPC_PRIORITY_HIGH) < 0)
+        panic("ahci: Could not schedule error recovery");
+}
+
+/**
+ * @brief Read the NCQ command error log
+ *
+ * @return Tag of the failed command, or -1 if it couldn't be found
+ */
+int ahci_io_queue::read_ncq_error_log()
+{
+    // Every slot may be taken by an aborted command, so borrow slot 0 and put it back
+    // afterwards.
+    page *p = alloc_page(0);
+    if (!p)
+        return -1;
+
+    command_table_t *table = (command_table_t *) PHYS_TO_VIRT(ctables[0]);
+    prdt_t *prdt = (prdt_t *) (table + 1);
+    command_list_t saved_list;
+    memcpy((void *) &saved_list, (const void *) &clist[0], sizeof(command_list_t));
+    u8 saved_table[sizeof(command_table_t) + sizeof(prdt_t)];
+    memcpy(saved_table, table, sizeof(saved_table));
+
+    memset(table, 0, sizeof(command_table_t));
+    prdt->address = (unsigned long) page_to_phys(p);
+    prdt->dw3 = 512 - 1;
+    prdt->res0 = 0;
+
+    table->cfis.fis_type = FIS_TYPE_REG_H2D;
+    table->cfis.c = 1;
+    table->cfis.command = ATA_CMD_READ_LOG_EXT;
+    table->cfis.lba0 = ATA_LOG_NCQ_ERROR;
+    table->cfis.count = 1;
+
+    clist[0].desc_info = 5;
+    clist[0].prdtl = 1;
+    clist[0].prdbc = 0;
+
+    COMPILER_BARRIER();
+    port->port->command_issue = 1;
+
+    int tag = -1;
+    bool timedout = ahci_wait_bit(&port->port->command_issue, 1, 500, true) < 0;
+
+    if (!timedout && !(port->port->tfd & ATA_SR_ERR))
+    {
+        u8 *log = (u8 *) PAGE_TO_VIRT(p);
+        if (!(log[0] & ATA_NCQ_LOG_NQ))
+            tag = ATA_NCQ_LOG_TAG(log[0]);
+        MPRINTF("NCQ error on tag %u: status %x, error %x\n", ATA_NCQ_LOG_TAG(log[0]), log[2],
+                log[3]);
+    }
+    else
+        MPRINTF("READ LOG EXT failed (tfd %x)\n", port->port->tfd);
+
+    memcpy(table, saved_table, sizeof(saved_table));
+    memcpy((void *) &clist[0], (const void *) &saved_list, sizeof(command_list_t));
+    free_page(p);
+
+    return tag;
+}
+
+/**
+ * @brief Recover the port from an error, fail the offending command and reissue the rest
+ * Runs in thread context, from a DPC.
+ */
+void ahci_io_queue::recover()
+{
+    ahci_port_t *regs = port->port;
+    uint32_t outstanding, ncq_outstanding;
+
+    {
+        scoped_lock<spinlock, true> g{lock_};
+        outstanding = port->issued;
+        ncq_outstanding = ncq_issued_;
+    }
+
+    MPRINTF("error on port %d: is %x tfd %x serr %x ci %x sact %x\n", port->port_nr,
+            regs->interrupt_status, regs->tfd, regs->error, regs->command_issue, regs->active);
+
+    // Stopping the command engine clears PxCI and PxSACT. recovering_ keeps anyone else from
+    // touching the port while we don't hold the lock.
+    ahci_port_set_idle(regs);
+    regs->error = UINT32_MAX;
+    regs->interrupt_status = UINT32_MAX;
+
+    if (regs->tfd & (ATA_SR_BSY | ATA_SR_DRQ))
+        ahci_port_comreset(regs);
+
+    regs->pxcmd = regs->pxcmd | AHCI_PORT_CMD_FRE;
+    regs->pxcmd = regs->pxcmd | AHCI_PORT_CMD_START;
+
+    int failed_tag = -1;
+    if (ncq_outstanding)
+        failed_tag = read_ncq_error_log();
+
+    // Clear whatever READ LOG EXT left behind before turning interrupts back on
+    regs->interrupt_status = UINT32_MAX;
+
+    scoped_lock<spinlock, true> g{lock_};
+    uint32_t reissue = 0;
+
+    for (u16 slot = 0; slot < 32; slot++)
+    {
+        if (!(outstanding & (1U << slot)))
+            continue;
+
+        // If we know which NCQ command failed, the rest were just aborted by the device and can
+        // be retried. Otherwise, fail everything.
+        if (failed_tag >= 0 && slot != failed_tag && ncq_outstanding & (1U << slot))
+        {
+            clist[slot].prdbc = 0;
+            reissue |= (1U << slot);
+            continue;
+        }
+
+        complete_slot(slot, AHCI_PORT_INTERRUPT_TFEE);
+    }
+
+    recovering_ = false;
+    regs->pxie = AHCI_PORT_ENABLED_INTERRUPTS;
+
+    if (reissue)
+    {
+        // The command tables are still intact, so we can just reissue them
+        regs->active = reissue;
+        regs->command_issue = reissue;
+    }
+
+    kick_deferred();
+}
+
 int ahci_submit_request_new(struct blockdev *dev, struct bio_req *req)
 {
     struct ahci_port *port = (ahci_port *) dev->device_info;
@@ -591,6 +913,38 @@ int ahci_port_set_idle(ahci_port_t *port)
     return 0;
 }
 
+/**
+ * @brief Reset the link (COMRESET), for when the device is stuck busy
+ *
+ * @param port AHCI port regs
+ * @return 0 on success, negative error codes
+ */
+int ahci_port_comreset(ahci_port_t *port)
+{
+    MPRINTF("resetting the link\n");
+
+    port->control = (port->control & ~0xf) | 1;
+    // COMRESET needs to be asserted for at least 1ms
+    sched_sleep_ms(2);
+    port->control = port->control & ~0xf;
+
+    hrtime_t start = clocksource_get_time();
+    // Wait for the device to come back (DET = 3)
+    while (AHCI_PORT_STATUS_DET(port->status) != 3 || port->tfd & ATA_SR_BSY)
+    {
+        if (clocksource_get_time() - start >= 1000 * NS_PER_MS)
+        {
+            MPRINTF("error: timeout waiting for the device after COMRESET\n");
+            return -ETIMEDOUT;
+        }
+
+        sched_yield();
+    }
+
+    port->error = UINT32_MAX;
+    return 0;
+}
+
 bool ahci_port_has_device(ahci_port_t *port)
 {
     uint32_t status = port->status;
@@ -918,16 +1272,15 @@ int ahci_probe(struct device *dev)
         goto ret;
     }
 
-    if (ahci_dev->enable_msi(ahci_irq, device))
-    {
-        /* If we couldn't enable MSI, use normal I/O APIC pins */
-
-        /* Get the interrupt number */
+    /* If we couldn't enable MSI, use normal I/O APIC pins */
+    if (ahci_dev->alloc_irq_vectors(1, 1, PCI_IRQ_MSIX | PCI_IRQ_MSI) < 0)
         irq = ahci_dev->get_intn();
-        /* and install a handler */
-        assert(install_irq(irq, ahci_irq, (struct device *) ahci_dev, IRQ_FLAG_REGULAR, device) ==
-               0);
-    }
+    else
+        irq = ahci_dev->irq_vector(0);
+
+    /* Completion walks are done in the irq thread, so they don't hold off other irqs */
+    assert(install_threaded_irq(irq, ahci_irq, ahci_irq_thread, (struct device *) ahci_dev,
+                                IRQ_FLAG_REGULAR, device) == 0);
 
     nr_ports = AHCI_CAP_NR_PORTS(hba->host_cap);
     if (nr_ports == 0)
@@ -944,6 +1297,15 @@ int ahci_probe(struct device *dev)
 
         ahci_do_identify(&device->ports[i]);
 
+        const auto &identify = device->ports[i].identify;
+        if (hba->host_cap & AHCI_CAP_SNCQ && identify.sata_capabilities & ATA_SATA_CAP_NCQ)
+        {
+            unsigned int depth = ATA_QUEUE_DEPTH(identify.queue_depth);
+            MPRINTF("%s: Using NCQ with queue depth %u\n", device->ports[i].bdev->name.c_str(),
+                    depth);
+            device->ports[i].io_queue->enable_ncq(depth);
+        }
+
         VERBOSE_MPRINTF("Identify done on %s\n", device->ports[i].bdev->name.c_str());
         blkdev_init(device->ports[i].bdev.get());
 
@@ -243,6 +243,14 @@ protected:
     uint32_t list_bitmap;
     command_list_t *clist;
     struct command_list cmdslots[32];
+    // Slots issued as FPDMA QUEUED commands (a subset of port->issued)
+    uint32_t ncq_issued_{0};
+    bool ncq_{false};
+    // Set while error recovery runs, during which nothing gets issued
+    bool recovering_{false};
+    // Requests that can't be issued yet, either because we're recovering or because NCQ and
+    // non-queued commands can't be outstanding at the same time
+    struct list_head deferred_;
 
     /**
      * @brief Allocate a command list slow
@@ -263,10 +271,74 @@ protected:
 
     void free_slot(u16 pos);
 
+    /**
+     * @brief Check if a request can be issued to the device right now
+     *
+     * @param ncq True if the request is an NCQ command
+     * @return True if so, else false
+     */
+    bool can_issue(bool ncq) const;
+
+    /**
+     * @brief Check if a request is going to be issued as an NCQ command
+     *
+     * @param req Request
+     * @return True if so, else false
+     */
+    bool is_ncq(const bio_req *req) const;
+
+    /**
+     * @brief Issue a request on a command slot
+     *
+     * @param req Request
+     * @param ncq True if the request should be issued as an NCQ command
+     * @return 0 on success, negative error codes
+     */
+    int issue(bio_req *req, bool ncq);
+
+    /**
+     * @brief Complete the request on a slot, and free the slot
+     *
+     * @param slot Command slot
+     * @param irq_status Port interrupt status
+     */
+    void complete_slot(u16 slot, u32 irq_status);
+
+    /**
+     * @brief Finish a request, and queue the next one from the io_queue (if any)
+     *
+     * @param req Request (with BIO_REQ_DONE or BIO_REQ_EIO set)
+     */
+    void finish_request(bio_req *req);
+
+    /**
+     * @brief Issue as many deferred requests as we can
+     */
+    void kick_deferred();
+
+    /**
+     * @brief Start error recovery, from IRQ context
+     */
+    void start_recovery();
+
+    /**
+     * @brief Recover the port from an error, fail the offending command and reissue the rest
+     * Runs in thread context, from a DPC.
+     */
+    void recover();
+
+    /**
+     * @brief Read the NCQ command error log
+     *
+     * @return Tag of the failed command, or -1 if it couldn't be found
+     */
+    int read_ncq_error_log();
+
 public:
     ahci_io_queue(ahci_port *port, uint32_t ncs)
-        : io_queue{ncs}, port{port}, list_bitmap{-(1U << ncs)}
+        : io_queue{ncs}, port{port}, list_bitmap{ncs == 32 ? 0 : -(1U << ncs)}
     {
+        INIT_LIST_HEAD(&deferred_);
     }
 
     /**
@@ -281,7 +353,20 @@ public:
 
     int configure_port_dma();
 
-    void do_irq(u16 slot, u32 irq_status);
+    /**
+     * @brief Handle a port interrupt
+     *
+     * @param irq_status Port interrupt status
+     */
+    void handle_irq(u32 irq_status);
+
+    /**
+     * @brief Enable Native Command Queueing
+     * Must be called with no commands outstanding.
+     *
+     * @param depth Queue depth supported by the drive
+     */
+    void enable_ncq(unsigned int depth);
 };
 
 struct ahci_port
@@ -298,6 +383,8 @@ struct ahci_port
     ata_identify_response identify;
     uint32_t issued;
     unique_ptr<blockdev> bdev;
+    // Interrupt status acked by the hard irq handler, waiting for the irq thread
+    uint32_t pending_is;
 };
 
 struct ahci_device
@@ -324,7 +411,7 @@ struct ahci_command_ata
 #define AHCI_CAP_SXS                  (1 << 5)
 #define AHCI_CAP_EMS                  (1 << 6)
 #define AHCI_CAP_CCCS                 (1 << 7)
-#define AHCI_CAP_NCS(val)             ((val >> 8) & 0xF)
+#define AHCI_CAP_NCS(val)             (((val >> 8) & 0x1F) + 1)
 #define AHCI_CAP_PSC                  (1 << 13)
 #define AHCI_CAP_SSC                  (1 << 14)
 #define AHCI_CAP_PMD                  (1 << 15)
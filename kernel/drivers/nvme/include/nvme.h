@@ -25,6 +25,8 @@
 
 #define NVME_DEFAULT_ADMIN_SUBMISSION_QUEUE_SIZE (PAGE_SIZE / 64)
 #define NVME_DEFAULT_ADMIN_COMPLETION_QUEUE_SIZE (PAGE_SIZE / 16)
+// Number of PRP list pages each queue keeps around, so big IOs don't hit the page allocator
+#define NVME_PRP_POOL_SIZE                       8
 
 struct nvmesqe;
 struct nvmecmd;
@@ -59,6 +61,11 @@ private:
         bool phase{true};
         cul::vector<nvmecmd *> queued_commands_{};
         Bitmap<0> queued_bitmap_;
+        // Free PRP list pages, linked through next_un.next_allocation
+        struct page *prp_pool_{nullptr};
+        unsigned int nr_prp_pool_{0};
+        // Interrupt vector index this queue's completions are signalled on
+        uint16_t irq_vector_{0};
 
     public:
         /**
@@ -81,6 +88,12 @@ private:
                 free_pages(sq_pages_);
             if (cq_pages_)
                 free_pages(cq_pages_);
+            while (prp_pool_)
+            {
+                struct page *next = prp_pool_->next_un.next_allocation;
+                free_page(prp_pool_);
+                prp_pool_ = next;
+            }
         }
 
         nvme_queue &operator=(nvme_queue &&q)
@@ -104,6 +117,10 @@ private:
             phase = q.phase;
             queued_commands_ = cul::move(q.queued_commands_);
             queued_bitmap_ = cul::move(q.queued_bitmap_);
+            prp_pool_ = q.prp_pool_;
+            q.prp_pool_ = nullptr;
+            nr_prp_pool_ = q.nr_prp_pool_;
+            irq_vector_ = q.irq_vector_;
             return *this;
         }
 
@@ -128,6 +145,10 @@ private:
             phase = q.phase;
             queued_commands_ = cul::move(q.queued_commands_);
             queued_bitmap_ = cul::move(q.queued_bitmap_);
+            prp_pool_ = q.prp_pool_;
+            q.prp_pool_ = nullptr;
+            nr_prp_pool_ = q.nr_prp_pool_;
+            irq_vector_ = q.irq_vector_;
         }
 
         CLASS_DISALLOW_COPY(nvme_queue);
@@ -207,10 +228,48 @@ private:
          * @return 0 on sucess, negative error codes
          */
         int device_io_submit(bio_req *req) override;
+
+        /**
+         * @brief Get a PRP list page from the queue's pool
+         *
+         * @return Page, or nullptr if out of memory
+         */
+        struct page *alloc_prp_page();
+
+        /**
+         * @brief Give PRP list pages back to the queue's pool
+         *
+         * @param list Pages, linked through next_un.next_allocation
+         */
+        void free_prp_pages(struct page *list);
+
+        /**
+         * @brief Wait for a running handle_cq() to let go of the queue
+         * Completions are posted to commands that live on the submitter's stack, so the
+         * submitter needs to call this before returning.
+         */
+        void sync_cq()
+        {
+            scoped_lock<spinlock, true> g{lock_};
+        }
+
+        uint16_t get_irq_vector() const
+        {
+            return irq_vector_;
+        }
+
+        void set_irq_vector(uint16_t vector)
+        {
+            irq_vector_ = vector;
+        }
     };
     page *identify_page_;
 
     cul::vector<unique_ptr<nvme_queue>> queues_;
+    // Number of interrupt vectors we got. Queue N uses vector N % nr_irq_vecs_.
+    unsigned int nr_irq_vecs_{1};
+    // IO queue (1-based index into queues_) each CPU submits on
+    cul::vector<uint16_t> cpu_to_queue_;
 
     /**
      * @brief Identify and list namespaces
@@ -302,7 +361,8 @@ private:
         size_t xfer_blocks;
         size_t nr_entries;
         uint64_t first;
-        cul::vector<unique_page> indirect_list;
+        // PRP list pages, linked through next_un.next_allocation
+        struct page *list;
     };
 
     /**
@@ -310,9 +370,26 @@ private:
      *
      * @param req Request
      * @param ns NVMe namespace
-     * @return Expected object containing a prp_setup, or a negative error code
+     * @param queue Queue the request will be submitted on (PRP list pages come from its pool)
+     * @param s PRP setup to fill
+     * @return 0 on success, negative error code
+     */
+    int setup_prp(bio_req *req, nvme_namespace *ns, nvme_queue *queue, prp_setup &s);
+
+    /**
+     * @brief Set up the interrupt vectors (one per queue, if we can get them)
+     *
+     * @return 0 on success, negative error codes
+     */
+    int init_irqs();
+
+    /**
+     * @brief Map every CPU to an IO queue, and point each queue's vector at its CPUs
+     *
+     * @param nr_io_queues Number of IO queues
+     * @return 0 on success, negative error codes
      */
-    expected<prp_setup *, int> setup_prp(bio_req *req, nvme_namespace *ns);
+    int map_io_queues(uint16_t nr_io_queues);
 
     /**
      * @brief Pick an IO queue for this request
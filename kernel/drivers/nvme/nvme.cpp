@@ -198,18 +198,10 @@ int nvme_device::probe()
 
     printf("Doorbell stride: %u\n", NVME_CAP_DSTRD(caps));
 
-    const auto handler = [](irq_context *ctx, void *cookie) -> irqstatus_t {
-        return ((nvme_device *) cookie)->handle_irq(ctx);
-    };
-
-    if (dev_->enable_msi(handler, this) < 0)
+    if (int st = init_irqs(); st < 0)
     {
-        int st = install_irq(dev_->get_intn(), handler, dev_, IRQ_FLAG_REGULAR, this);
-        if (st < 0)
-        {
-            printf("nvme: Failed to enable IRQs, status %d\n", st);
-            return st;
-        }
+        printf("nvme: Failed to enable IRQs, status %d\n", st);
+        return st;
     }
 
     if (int st = identify(); st < 0)
@@ -224,6 +216,40 @@ int nvme_device::probe()
     return 0;
 }
 
+/**
+ * @brief Set up the interrupt vectors (one per queue, if we can get them)
+ *
+ * @return 0 on success, negative error codes
+ */
+int nvme_device::init_irqs()
+{
+    const auto handler = [](irq_context *ctx, void *cookie) -> irqstatus_t {
+        return ((nvme_device *) cookie)->handle_irq(ctx);
+    };
+
+    // We don't know how many IO queues the controller will give us yet, so ask for one vector for
+    // the admin queue plus one per CPU. Vectors we don't end up using just stay quiet.
+    int nr_vecs = dev_->alloc_irq_vectors(1, get_nr_cpus() + 1, PCI_IRQ_MSIX | PCI_IRQ_MSI);
+
+    if (nr_vecs < 0)
+    {
+        nr_irq_vecs_ = 1;
+        return install_irq(dev_->get_intn(), handler, dev_, IRQ_FLAG_REGULAR, this);
+    }
+
+    nr_irq_vecs_ = nr_vecs;
+
+    for (int i = 0; i < nr_vecs; i++)
+    {
+        if (int st = install_irq(dev_->irq_vector(i), handler, dev_, IRQ_FLAG_REGULAR, this);
+            st < 0)
+            return st;
+    }
+
+    printf("nvme%u: Using %u interrupt vectors\n", device_index_, nr_irq_vecs_);
+    return 0;
+}
+
 /**
  * @brief Create an NVME-like(nvme{ID}n{NamespaceId}) block device
  *
@@ -315,9 +341,11 @@ int nvme_device::init_drive(uint32_t nsid, unique_page identify_namespace_data)
  *
  * @param req Request
  * @param ns NVMe namespace
- * @return Expected object containing a prp_setup pointer, or a negative error code
+ * @param queue Queue the request will be submitted on (PRP list pages come from its pool)
+ * @param s PRP setup to fill
+ * @return 0 on success, negative error code
  */
-auto nvme_device::setup_prp(bio_req *req, nvme_namespace *ns) -> expected<prp_setup *, int>
+int nvme_device::setup_prp(bio_req *req, nvme_namespace *ns, nvme_queue *queue, prp_setup &s)
 {
     size_t xfer_size = 0;
 
@@ -329,40 +357,36 @@ auto nvme_device::setup_prp(bio_req *req, nvme_namespace *ns) -> expected<prp_se
         {
             // If the PRP entry is not the first PRP entry and not a PRP list pointer
             // we can't have an offset here.
-            return unexpected{-EINVAL};
+            return -EINVAL;
         }
 
         if (req->vec[i].page_off + req->vec[i].length != PAGE_SIZE && i != 0)
         {
             // Same as above. We're basically forced to guarantee all these page_iov are actual full
             // pages
-            return unexpected{-EINVAL};
+            return -EINVAL;
         }
     }
 
-    auto s = make_unique<prp_setup>();
-
-    if (!s)
-        return unexpected{-ENOMEM};
-
-    s->xfer_blocks = xfer_size / ns->dev_->sector_size;
+    s.list = nullptr;
+    s.xfer_blocks = xfer_size / ns->dev_->sector_size;
 
     // An empty transfer is invalid, and so is a request with a xfer_size % sector_size
-    if (s->xfer_blocks == 0 || xfer_size % ns->dev_->sector_size)
-        return unexpected{-EIO};
+    if (s.xfer_blocks == 0 || xfer_size % ns->dev_->sector_size)
+        return -EIO;
 
     // Check if we can transfer this number of sectors
     // This is limited by the command dword 12 (Number of logical blocks)
-    if (s->xfer_blocks - 1 > 0xffff)
-        return unexpected{-EIO};
+    if (s.xfer_blocks - 1 > 0xffff)
+        return -EIO;
 
-    s->nr_entries = req->nr_vecs;
-    s->first = (prp_entry_t) page_to_phys(req->vec[0].page) + req->vec[0].page_off;
+    s.nr_entries = req->nr_vecs;
+    s.first = (prp_entry_t) page_to_phys(req->vec[0].page) + req->vec[0].page_off;
 
-    if (s->nr_entries == 1) [[likely]]
+    if (s.nr_entries == 1) [[likely]]
     {
         // Fast path. Get out
-        return s.release();
+        return 0;
     }
 
     size_t nr_entries = req->nr_vecs - 1;
@@ -381,19 +405,26 @@ auto nvme_device::setup_prp(bio_req *req, nvme_namespace *ns) -> expected<prp_se
         // allocate another page
         if (!current_list_page || (list_index == prp_entries - 1 && has_next))
         {
-            current_list_page = alloc_page(PAGE_ALLOC_NO_ZERO);
-            if (!current_list_page)
-                return unexpected{-ENOMEM};
+            page *p = queue->alloc_prp_page();
+            if (!p)
+            {
+                queue->free_prp_pages(s.list);
+                s.list = nullptr;
+                return -ENOMEM;
+            }
 
-            if (!s->indirect_list.push_back(current_list_page))
-                return free_page(current_list_page), unexpected{-ENOMEM};
+            p->next_un.next_allocation = nullptr;
 
             if (current_list)
             {
                 // We had a previous list, so link it with this one
-                current_list[prp_entries - 1] = (prp_entry_t) page_to_phys(current_list_page);
+                current_list[prp_entries - 1] = (prp_entry_t) page_to_phys(p);
+                current_list_page->next_un.next_allocation = p;
             }
+            else
+                s.list = p;
 
+            current_list_page = p;
             current_list = (prp_entry_t *) PAGE_TO_VIRT(current_list_page);
             list_index = 0;
         }
@@ -405,7 +436,7 @@ auto nvme_device::setup_prp(bio_req *req, nvme_namespace *ns) -> expected<prp_se
         v++;
     }
 
-    return s.release();
+    return 0;
 }
 
 /**
@@ -416,8 +447,8 @@ auto nvme_device::setup_prp(bio_req *req, nvme_namespace *ns) -> expected<prp_se
  */
 uint16_t nvme_device::pick_io_queue(bio_req *r)
 {
-    // Primitive algo: Use the cpu nr as an index
-    return (get_cpu_nr() % (queues_.size() - 1)) + 1;
+    // Submit on our CPU's queue, whose completions are also routed back to us
+    return cpu_to_queue_[get_cpu_nr()];
 }
 
 /**
@@ -451,48 +482,59 @@ int nvme_device::submit_request(nvme_namespace *ns, struct bio_req *req)
     cmd.cmd.cdw12 = 0;
     cmd.req = req;
 
-    auto ex = setup_prp(req, ns);
+    auto &queue = queues_[pick_io_queue(req)];
+    prp_setup prp;
 
-    if (ex.has_error())
+    if (int st = setup_prp(req, ns, queue.get(), prp); st < 0)
     {
-        printf("nvme: Error setting up PRPs: %d\n", ex.error());
+        printf("nvme: Error setting up PRPs: %d\n", st);
         req->flags |= BIO_REQ_EIO;
-        return ex.error();
+        return st;
     }
 
-    const auto prp = ex.value();
-
-    cmd.cmd.dptr.prp[0] = prp->first;
+    cmd.cmd.dptr.prp[0] = prp.first;
 
-    if (prp->nr_entries > 1)
-        cmd.cmd.dptr.prp[1] = (prp_entry_t) page_to_phys(prp->indirect_list[0]);
+    if (prp.nr_entries > 1)
+        cmd.cmd.dptr.prp[1] = (prp_entry_t) page_to_phys(prp.list);
 
     // Set up the starting LBA and number of sectors
     cmd.cmd.cdw10 = (uint32_t) req->sector_number;
     cmd.cmd.cdw11 = (uint32_t) (req->sector_number >> 32);
-    cmd.cmd.cdw12 = (uint16_t) prp->xfer_blocks - 1; // TODO: FUA
+    cmd.cmd.cdw12 = (uint16_t) prp.xfer_blocks - 1; // TODO: FUA
     cmd.cmd.cdw13 = 0;
     cmd.cmd.cdw14 = 0;
 
+    const bool polled = req->flags & BIO_REQ_POLLED;
     wait_queue wq;
     init_wait_queue_head(&wq);
-    cmd.wq = &wq;
+    // Polled submitters reap their own completion, so nobody needs to wake them
+    cmd.wq = polled ? nullptr : &wq;
 
-    auto &queue = queues_[pick_io_queue(req)];
     req->device_specific[0] = (unsigned long) &cmd;
-    req->device_specific[1] = (unsigned long) prp;
+    req->device_specific[1] = (unsigned long) &prp;
 
     int st = queue->submit_request(req);
 
     if (st < 0)
     {
-        delete prp;
+        queue->free_prp_pages(prp.list);
         return st;
     }
 
-    wait_for_event(&wq, cmd.has_response);
+    if (polled)
+    {
+        while (!__atomic_load_n(&cmd.has_response, __ATOMIC_ACQUIRE))
+        {
+            if (!queue->handle_cq())
+                cpu_relax();
+        }
+    }
+    else
+        wait_for_event(&wq, cmd.has_response);
 
-    delete prp;
+    // handle_cq() may still be touching cmd (and wq)
+    queue->sync_cq();
+    queue->free_prp_pages(prp.list);
 
     if (auto status = NVME_CQE_STATUS_CODE(cmd.response.dw3); status != 0)
     {
@@ -609,8 +651,8 @@ int nvme_device::create_io_queue(uint16_t queue_index)
     if (!q->init(needs_contiguous))
         return -ENOMEM;
 
-    // TODO: Proper MSI and MSI-X multi-vector support
-    const uint16_t interrupt_vector = 0;
+    const uint16_t interrupt_vector = (queue_index + 1) % nr_irq_vecs_;
+    q->set_irq_vector(interrupt_vector);
     if (int st = cmd_create_io_completion_queue(queue_index + 1,
                                                 (uint64_t) page_to_phys(q->get_cq_pages()),
                                                 q->get_cq_queue_size(), interrupt_vector);
@@ -703,6 +745,44 @@ int nvme_device::init_io_queues()
         }
     }
 
+    return map_io_queues(allocated_queues);
+}
+
+/**
+ * @brief Map every CPU to an IO queue, and point each queue's vector at its CPUs
+ *
+ * @param nr_io_queues Number of IO queues
+ * @return 0 on success, negative error codes
+ */
+int nvme_device::map_io_queues(uint16_t nr_io_queues)
+{
+    const unsigned int nr_cpus = get_nr_cpus();
+
+    if (!cpu_to_queue_.resize(nr_cpus))
+        return -ENOMEM;
+
+    // If the controller gave us fewer queues than CPUs, neighbouring CPUs share a queue
+    for (unsigned int cpu = 0; cpu < nr_cpus; cpu++)
+        cpu_to_queue_[cpu] = (uint16_t) (1 + (unsigned long) cpu * nr_io_queues / nr_cpus);
+
+    if (nr_irq_vecs_ == 1)
+        return 0;
+
+    for (uint16_t q = 1; q <= nr_io_queues; q++)
+    {
+        const uint16_t vector = queues_[q]->get_irq_vector();
+        // Vectors shared between queues (and the admin queue's) stay where the platform put them
+        if (vector == 0 || nr_irq_vecs_ <= nr_io_queues)
+            continue;
+
+        // First CPU that submits on this queue
+        const unsigned int cpu =
+            ((unsigned long) (q - 1) * nr_cpus + nr_io_queues - 1) / nr_io_queues;
+        if (int st = dev_->set_irq_vector_affinity(vector, cpu); st < 0)
+            printf("nvme%u: Failed to bind vector %u to cpu%u: %d\n", device_index_, vector, cpu,
+                   st);
+    }
+
     return 0;
 }
 
@@ -834,10 +914,73 @@ bool nvme_device::nvme_queue::init(bool needs_contiguous)
     if (!queued_commands_.resize(sq_size_))
         return false;
 
+    // The admin queue never does big transfers
+    if (index_ != 0)
+    {
+        for (unsigned int i = 0; i < NVME_PRP_POOL_SIZE; i++)
+        {
+            page *p = alloc_page(PAGE_ALLOC_NO_ZERO);
+            if (!p)
+                return false;
+            p->next_un.next_allocation = prp_pool_;
+            prp_pool_ = p;
+            nr_prp_pool_++;
+        }
+    }
+
     queued_bitmap_.set_size(sq_size_);
     return queued_bitmap_.allocate_bitmap();
 }
 
+/**
+ * @brief Get a PRP list page from the queue's pool
+ *
+ * @return Page, or nullptr if out of memory
+ */
+page *nvme_device::nvme_queue::alloc_prp_page()
+{
+    {
+        scoped_lock<spinlock, true> g{lock_};
+        if (prp_pool_)
+        {
+            page *p = prp_pool_;
+            prp_pool_ = p->next_un.next_allocation;
+            nr_prp_pool_--;
+            return p;
+        }
+    }
+
+    return alloc_page(PAGE_ALLOC_NO_ZERO);
+}
+
+/**
+ * @brief Give PRP list pages back to the queue's pool
+ *
+ * @param list Pages, linked through next_un.next_allocation
+ */
+void nvme_device::nvme_queue::free_prp_pages(page *list)
+{
+    while (list)
+    {
+        page *next = list->next_un.next_allocation;
+
+        {
+            scoped_lock<spinlock, true> g{lock_};
+            if (nr_prp_pool_ < NVME_PRP_POOL_SIZE)
+            {
+                list->next_un.next_allocation = prp_pool_;
+                prp_pool_ = list;
+                nr_prp_pool_++;
+                list = nullptr;
+            }
+        }
+
+        if (list)
+            free_page(list);
+        list = next;
+    }
+}
+
 /**
  * @brief (Try to) handle a completion IRQ
  *
@@ -845,67 +988,69 @@ bool nvme_device::nvme_queue::init(bool needs_contiguous)
  */
 bool nvme_device::nvme_queue::handle_cq()
 {
-    scoped_lock<spinlock, true> g{lock_};
     bool handled = false;
+    unsigned int nr_done = 0;
 
-    while (true)
     {
-        auto cqe = cq_ + cq_head_;
-        if (bool(NVME_CQE_STATUS_PHASE(cqe->dw3)) == phase)
+        scoped_lock<spinlock, true> g{lock_};
+
+        while (true)
         {
+            auto cqe = cq_ + cq_head_;
+            if (bool(NVME_CQE_STATUS_PHASE(cqe->dw3)) != phase)
+                break;
+
             handled = true;
             auto cid = NVME_CQE_STATUS_CID(cqe->dw3);
             auto command = queued_commands_[cid];
             if (!command)
                 panic("nvme: bad cid %u doesn't exist", cid);
 
+            // The command lives on the submitter's stack, so grab everything we need before
+            // telling it we're done.
+            wait_queue *wq = command->wq;
+            const bool is_bio = command->req != nullptr;
+
             memcpy(&command->response, cqe, sizeof(nvmecqe));
-            command->has_response = true;
-            bio_req *next = nullptr;
+            __atomic_store_n(&command->has_response, true, __ATOMIC_RELEASE);
 
-            if (command->req)
-            {
-                next = complete_request(command->req);
-            }
+            if (is_bio)
+                nr_done++;
 
-            if (command->wq)
-                wait_queue_wake_all(command->wq);
+            if (wq)
+                wait_queue_wake_all(wq);
             queued_commands_[cid] = nullptr;
             queued_bitmap_.free_bit(cid);
             sq_head_ = NVME_CQE_SQHD(cqe->dw2);
 
-            if (next)
-                device_io_submit(next);
-        }
-        else
-            break;
+            cq_head_ = (cq_head_ + 1) % cq_size_;
 
-        cq_head_ = (cq_head_ + 1) % cq_size_;
-
-        if (cq_head_ == 0)
-        {
-            // Flip the phase
-            phase = !phase;
+            if (cq_head_ == 0)
+            {
+                // Flip the phase
+                phase = !phase;
+            }
         }
+
+        if (handled)
+            *cq_head_doorbell_ = cq_head_;
     }
 
-    if (handled)
-        *cq_head_doorbell_ = cq_head_;
+    // Now that the SQ slots are free, kick off whatever was waiting on them. This needs the
+    // io_queue's lock, which nests outside ours (see io_queue::submit_request). Note that the
+    // completed requests may already be gone (their submitters were woken up above), so we only
+    // count them.
+    while (nr_done--)
+    {
+        scoped_lock<spinlock, true> g{io_queue::lock_};
+        bio_req *next = complete_request(nullptr);
+        if (next)
+            device_io_submit(next);
+    }
 
     return handled;
 }
 
-/**
- * @brief Submits IO to a device
- *
- * @param req bio_req to submit
- * @return 0 on sucess, negative error codes
- */
-int nvme_device::nvme_queue::device_io_submit(bio_req *req)
-{
-    return submit_command((nvmecmd *) req->device_specific[0]);
-}
-
 /**
  * @brief Handle an IRQ
  *
@@ -914,16 +1059,31 @@ int nvme_device::nvme_queue::device_io_submit(bio_req *req)
  */
 irqstatus_t nvme_device::handle_irq(const irq_context *ctx)
 {
-    // Handle every queue's possible IRQs
     bool handled = false;
+    // With a single vector (or legacy INTx), every queue signals on it
+    const unsigned int vector = nr_irq_vecs_ > 1 ? ctx->irq_nr - dev_->irq_vector(0) : 0;
+
     for (auto &q : queues_)
     {
+        if (nr_irq_vecs_ > 1 && q->get_irq_vector() != vector)
+            continue;
         handled |= q->handle_cq();
     }
 
     return handled ? IRQ_HANDLED : IRQ_UNHANDLED;
 }
 
+/**
+ * @brief Submits IO to a device
+ *
+ * @param req bio_req to submit
+ * @return 0 on sucess, negative error codes
+ */
+int nvme_device::nvme_queue::device_io_submit(bio_req *req)
+{
+    return submit_command((nvmecmd *) req->device_specific[0]);
+}
+
 /**
  * @brief Initialise the admin queue of the controller
  *
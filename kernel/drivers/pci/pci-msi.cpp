@@ -1,7 +1,9 @@
 /*
- * Copyright (c) 2017 Pedro Falcato
+ * Copyright (c) 2017 - 2023 Pedro Falcato
  * This file is part of Onyx, and is released under the terms of the MIT License
  * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
  */
 
 #include <assert.h>
@@ -11,6 +13,8 @@
 #include <stdio.h>
 
 #include <onyx/acpi.h>
+#include <onyx/cpu.h>
+#include <onyx/hwregister.hpp>
 #include <onyx/page.h>
 #include <onyx/platform.h>
 
@@ -22,52 +26,261 @@ extern char irq0_end;
 namespace pci
 {
 
-int pci_device::enable_msi(irq_t handler, void *cookie)
+void pci_device::msix_write_entry(unsigned int vec, const pci_msi_data &msg)
 {
-    if (!platform_has_msi())
-        return errno = EIO, -1;
+    mmio_range entry{msix_table + vec * PCI_MSIX_ENTRY_SIZE};
+    entry.write32(PCI_MSIX_ENTRY_ADDR_LO, msg.address);
+    entry.write32(PCI_MSIX_ENTRY_ADDR_HI, msg.address_high);
+    entry.write32(PCI_MSIX_ENTRY_DATA, msg.data + vec);
+}
 
-    bool msix = false;
-    (void) msix;
-    /* TODO: Try to prioritize finding MSI-X capabiltiies */
-    size_t offset = find_capability(PCI_CAP_ID_MSI, 0);
+void pci_device::msi_write_message(const pci_msi_data &msg)
+{
+    const uint16_t offset = msi_cap_off;
+    uint16_t message_control = read(offset + PCI_MSI_MESSAGE_CONTROL_OFF, sizeof(uint16_t));
+    bool addr64 = message_control & PCI_MSI_MSGCTRL_64BIT;
+
+    off_t message_data_off = addr64 ? offset + PCI_MSI_MESSAGE_ADDRESS_OFF + 8
+                                    : offset + PCI_MSI_MESSAGE_ADDRESS_OFF + 4;
+    write(msg.address, offset + PCI_MSI_MESSAGE_ADDRESS_OFF, sizeof(uint32_t));
+    if (addr64)
+        write(msg.address_high, offset + PCI_MSI_MESSAGE_ADDRESS_OFF + 4, sizeof(uint32_t));
+    write(msg.data, message_data_off, sizeof(uint16_t));
+}
+
+int pci_device::msi_set_affinity(unsigned int irq, unsigned int cpu, void *ctx)
+{
+    pci_device *dev = (pci_device *) ctx;
+    const unsigned int vec = irq - dev->msi_data.irq_offset;
+    pci_msi_data msg = dev->msi_data;
+
+    if (int st = platform_msi_retarget(&msg, cpu); st < 0)
+        return st;
+
+    if (!dev->msix_enabled)
+    {
+        // Plain MSI has a single message for every vector, so we can only move them all at once
+        if (dev->nr_irq_vecs != 1)
+            return -EOPNOTSUPP;
+        dev->msi_write_message(msg);
+        dev->msi_data = msg;
+        return 0;
+    }
+
+    // Mask the vector while we rewrite it, so the device never sees a torn message
+    mmio_range entry{dev->msix_table + vec * PCI_MSIX_ENTRY_SIZE};
+    uint32_t ctrl = entry.read32(PCI_MSIX_ENTRY_VECTOR_CTRL);
+    entry.write32(PCI_MSIX_ENTRY_VECTOR_CTRL, ctrl | PCI_MSIX_ENTRY_CTRL_MASKBIT);
+    dev->msix_write_entry(vec, msg);
+    entry.write32(PCI_MSIX_ENTRY_VECTOR_CTRL, ctrl);
+    return 0;
+}
+
+int pci_device::enable_msix_vectors(unsigned int min_vecs, unsigned int max_vecs,
+                                    unsigned int flags)
+{
+    size_t offset = find_capability(PCI_CAP_ID_MSI_X, 0);
     if (offset == 0)
+        return -ENOENT;
+
+    uint16_t message_control = read(offset + PCI_MSIX_MESSAGE_CONTROL_OFF, sizeof(uint16_t));
+    unsigned int table_size = PCI_MSIX_MSGCTRL_TABLE_SIZE(message_control);
+    if (table_size < min_vecs)
+        return -ENOSPC;
+
+    unsigned int num_vecs = cul::min(table_size, max_vecs);
+
+    uint32_t table_reg = read(offset + PCI_MSIX_TABLE_OFF, sizeof(uint32_t));
+    auto ex = get_bar(PCI_MSIX_BIR(table_reg));
+    if (ex.has_error())
+        return ex.error();
+
+    pci_bar bar = ex.value();
+    if (bar.is_iorange)
+        return -EIO;
+
+    unsigned long table_phys = bar.address + PCI_MSIX_OFFSET(table_reg);
+    size_t table_len = table_size * PCI_MSIX_ENTRY_SIZE;
+    size_t pgoff = table_phys & (PAGE_SIZE - 1);
+
+    volatile uint8_t *table = (volatile uint8_t *) mmiomap(
+        (void *) (table_phys - pgoff), pgoff + table_len, VM_READ | VM_WRITE | VM_NOCACHE);
+    if (!table)
+        return -ENOMEM;
+
+    struct pci_msi_data data;
+    if (platform_allocate_msi_interrupts(num_vecs, true, &data) < 0)
+    {
+        mmiounmap((void *) table, pgoff + table_len);
+        return -ENOSPC;
+    }
+
+    msix_table = table + pgoff;
+    msi_cap_off = offset;
+    msix_enabled = true;
+    nr_irq_vecs = num_vecs;
+    msi_data = data;
+
+    // Enable MSI-X with the whole function masked while we program the table
+    disable_irq();
+    message_control |= PCI_MSIX_MSGCTRL_ENABLE | PCI_MSIX_MSGCTRL_FUNCTION_MASK;
+    write(message_control, offset + PCI_MSIX_MESSAGE_CONTROL_OFF, sizeof(uint16_t));
+
+    const unsigned int nr_cpus = get_nr_cpus();
+
+    for (unsigned int i = 0; i < table_size; i++)
     {
-        msix = false;
-        if ((offset = find_capability(PCI_CAP_ID_MSI, 0)) == 0)
-            return -1;
+        mmio_range entry{msix_table + i * PCI_MSIX_ENTRY_SIZE};
+
+        if (i >= num_vecs)
+        {
+            // Unused entries stay masked
+            entry.write32(PCI_MSIX_ENTRY_VECTOR_CTRL, PCI_MSIX_ENTRY_CTRL_MASKBIT);
+            continue;
+        }
+
+        pci_msi_data msg = data;
+        if (flags & PCI_IRQ_AFFINITY)
+            platform_msi_retarget(&msg, i % nr_cpus);
+
+        entry.write32(PCI_MSIX_ENTRY_VECTOR_CTRL, PCI_MSIX_ENTRY_CTRL_MASKBIT);
+        msix_write_entry(i, msg);
+        irq_init_affinity(irq_vector(i), msg.cpu, msi_set_affinity, this);
+        entry.write32(PCI_MSIX_ENTRY_VECTOR_CTRL, 0);
     }
 
+    message_control &= ~PCI_MSIX_MSGCTRL_FUNCTION_MASK;
+    write(message_control, offset + PCI_MSIX_MESSAGE_CONTROL_OFF, sizeof(uint16_t));
+
+    return num_vecs;
+}
+
+int pci_device::enable_msi_vectors(unsigned int min_vecs, unsigned int max_vecs,
+                                   unsigned int flags)
+{
+    size_t offset = find_capability(PCI_CAP_ID_MSI, 0);
+    if (offset == 0)
+        return -ENOENT;
+
     uint16_t message_control = read(offset + PCI_MSI_MESSAGE_CONTROL_OFF, sizeof(uint16_t));
 
     bool addr64 = message_control & PCI_MSI_MSGCTRL_64BIT;
 
+    // MSI vectors come in powers of 2
     unsigned int num_vecs = 1 << PCI_MSI_MSGCTRL_MMC(message_control);
+    if (num_vecs < min_vecs)
+        return -ENOSPC;
+
+    while (num_vecs > max_vecs && num_vecs > 1)
+        num_vecs >>= 1;
 
     struct pci_msi_data data;
     if (platform_allocate_msi_interrupts(num_vecs, addr64, &data) < 0)
-        return -1;
+        return -ENOSPC;
+
+    msi_cap_off = offset;
+    msix_enabled = false;
+    nr_irq_vecs = num_vecs;
+    msi_data = data;
 
     for (unsigned int i = 0; i < num_vecs; i++)
-    {
-        assert(install_irq(data.irq_offset + i, handler, this, IRQ_FLAG_REGULAR, cookie) == 0);
-    }
+        irq_init_affinity(irq_vector(i), data.cpu, msi_set_affinity, this);
 
+    message_control &= ~(0x7 << 4);
     message_control |= ilog2(num_vecs) << 4;
     message_control |= PCI_MSI_MSGCTRL_ENABLE;
-    uint32_t message_addr = data.address;
-    uint32_t message_addr_hi = data.address_high;
-    uint32_t message_data = data.data;
 
-    off_t message_data_off = addr64 ? offset + PCI_MSI_MESSAGE_ADDRESS_OFF + 8
-                                    : offset + PCI_MSI_MESSAGE_ADDRESS_OFF + 4;
     /* Now write everything back */
-    write(message_addr, offset + PCI_MSI_MESSAGE_ADDRESS_OFF, sizeof(uint32_t));
-    if (addr64)
-        write(message_addr_hi, offset + PCI_MSI_MESSAGE_ADDRESS_OFF + 4, sizeof(uint32_t));
-    write(message_data, message_data_off, sizeof(uint16_t));
+    disable_irq();
+    msi_write_message(data);
     write(message_control, offset + PCI_MSI_MESSAGE_CONTROL_OFF, sizeof(uint16_t));
 
+    return num_vecs;
+}
+
+int pci_device::alloc_irq_vectors(unsigned int min_vecs, unsigned int max_vecs,
+                                  unsigned int flags)
+{
+    if (!platform_has_msi())
+        return -EIO;
+
+    if (nr_irq_vecs)
+        return -EBUSY;
+
+    if (min_vecs == 0 || min_vecs > max_vecs)
+        return -EINVAL;
+
+    int st = -ENOENT;
+
+    if (flags & PCI_IRQ_MSIX)
+    {
+        st = enable_msix_vectors(min_vecs, max_vecs, flags);
+        if (st >= 0)
+            return st;
+    }
+
+    if (flags & PCI_IRQ_MSI)
+        st = enable_msi_vectors(min_vecs, max_vecs, flags);
+
+    return st;
+}
+
+void pci_device::mask_irq_vector(unsigned int vec)
+{
+    assert(vec < nr_irq_vecs);
+
+    if (msix_enabled)
+    {
+        mmio_range entry{msix_table + vec * PCI_MSIX_ENTRY_SIZE};
+        entry.write32(PCI_MSIX_ENTRY_VECTOR_CTRL, entry.read32(PCI_MSIX_ENTRY_VECTOR_CTRL) |
+                                                      PCI_MSIX_ENTRY_CTRL_MASKBIT);
+        return;
+    }
+
+    uint16_t message_control = read(msi_cap_off + PCI_MSI_MESSAGE_CONTROL_OFF, sizeof(uint16_t));
+    if (!(message_control & PCI_MSI_MSGCTRL_PERVECTOR_MSK))
+        return;
+
+    uint16_t mask_off = msi_cap_off + (message_control & PCI_MSI_MSGCTRL_64BIT ? 0x10 : 0xc);
+    uint32_t mask = read(mask_off, sizeof(uint32_t));
+    write(mask | (1U << vec), mask_off, sizeof(uint32_t));
+}
+
+void pci_device::unmask_irq_vector(unsigned int vec)
+{
+    assert(vec < nr_irq_vecs);
+
+    if (msix_enabled)
+    {
+        mmio_range entry{msix_table + vec * PCI_MSIX_ENTRY_SIZE};
+        entry.write32(PCI_MSIX_ENTRY_VECTOR_CTRL, entry.read32(PCI_MSIX_ENTRY_VECTOR_CTRL) &
+                                                      ~PCI_MSIX_ENTRY_CTRL_MASKBIT);
+        return;
+    }
+
+    uint16_t message_control = read(msi_cap_off + PCI_MSI_MESSAGE_CONTROL_OFF, sizeof(uint16_t));
+    if (!(message_control & PCI_MSI_MSGCTRL_PERVECTOR_MSK))
+        return;
+
+    uint16_t mask_off = msi_cap_off + (message_control & PCI_MSI_MSGCTRL_64BIT ? 0x10 : 0xc);
+    uint32_t mask = read(mask_off, sizeof(uint32_t));
+    write(mask & ~(1U << vec), mask_off, sizeof(uint32_t));
+}
+
+int pci_device::set_irq_vector_affinity(unsigned int vec, unsigned int cpu)
+{
+    if (vec >= nr_irq_vecs)
+        return -EINVAL;
+    return irq_set_affinity(irq_vector(vec), cpu);
+}
+
+int pci_device::enable_msi(irq_t handler, void *cookie)
+{
+    int st = alloc_irq_vectors(1, 1, PCI_IRQ_MSIX | PCI_IRQ_MSI);
+    if (st < 0)
+        return errno = -st, -1;
+
+    assert(install_irq(irq_vector(0), handler, this, IRQ_FLAG_REGULAR, cookie) == 0);
     return 0;
 }
 
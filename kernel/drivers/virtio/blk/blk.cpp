@@ -8,6 +8,7 @@
 
 #include "blk.hpp"
 
+#include <onyx/cpu.h>
 #include <onyx/id.h>
 #include <onyx/log.h>
 
@@ -17,7 +18,8 @@ namespace virtio
 static blk_features supported_features[] = {blk_features::size_max, blk_features::seg_max,
                                             blk_features::geometry, blk_features::ro,
                                             blk_features::blk_size, blk_features::topology,
-                                            blk_features::discard,  blk_features::write_zeroes};
+                                            blk_features::discard,  blk_features::write_zeroes,
+                                            blk_features::mq};
 
 static uint32_t bio_req_to_virtio_blk_type(uint8_t op)
 {
@@ -59,7 +61,7 @@ int blk_vdev::submit_request(struct bio_req *req)
     breq->reserved = 0;
     btail->status = 0;
 
-    const auto &requestq = get_vq(0);
+    const auto &requestq = get_vq(cpu_to_queue[get_cpu_nr()]);
 
     virtio_allocation_info alloc_info;
     virtio_completion completion;
@@ -149,6 +151,48 @@ int blk_submit_request(struct blockdev *dev, struct bio_req *req)
 
 } // namespace blk
 
+/**
+ * @brief Create the request queues, one per CPU if the device lets us
+ *
+ * @return True on success, else false
+ */
+bool blk_vdev::setup_queues()
+{
+    const unsigned int nr_cpus = get_nr_cpus();
+
+    if (has_feature((unsigned long) blk_features::mq))
+    {
+        unsigned int max_queues = read<uint16_t>((unsigned long) blk_registers::num_queues);
+        nr_queues = cul::clamp(max_queues, nr_cpus);
+        if (nr_queues == 0)
+            nr_queues = 1;
+    }
+
+    if (!setup_irqs(nr_queues))
+        return false;
+
+    for (unsigned int i = 0; i < nr_queues; i++)
+    {
+        if (!create_virtqueue(i, get_max_virtq_size(i)))
+            return false;
+    }
+
+    if (!cpu_to_queue.resize(nr_cpus))
+        return false;
+
+    // If we have fewer queues than CPUs, neighbouring CPUs share a queue. Each queue's
+    // interrupt goes to the first CPU that submits on it.
+    for (unsigned int cpu = 0; cpu < nr_cpus; cpu++)
+    {
+        uint16_t queue = (unsigned long) cpu * nr_queues / nr_cpus;
+        if (cpu == 0 || queue != cpu_to_queue[cpu - 1])
+            set_vq_affinity(queue, cpu);
+        cpu_to_queue[cpu] = queue;
+    }
+
+    return true;
+}
+
 bool blk_vdev::perform_subsystem_initialization()
 {
     for (auto f : supported_features)
@@ -163,8 +207,7 @@ bool blk_vdev::perform_subsystem_initialization()
         return false;
     }
 
-    // Create the requestq queue
-    if (!create_virtqueue(0, get_max_virtq_size(0)))
+    if (!setup_queues())
     {
         set_failure();
         return false;
@@ -178,7 +221,9 @@ bool blk_vdev::perform_subsystem_initialization()
         return false;
 
     dev->submit_request = blk::blk_submit_request;
+    dev->device_info = this;
     dev->sector_size = 512;
+    dev->nr_sectors = read64((unsigned long) blk_registers::capacity);
 
     if (blkdev_init(dev.get()) < 0)
         return false;
@@ -33,6 +33,7 @@ enum class blk_registers
     topo_opt_io_size = 28,
     writeback = 32,
     unused0 = 33,
+    num_queues = 34,
     max_discard_sectors = 36,
     max_discard_seg = 40,
     discard_sector_alignment = 44,
@@ -52,7 +53,8 @@ enum class blk_features
     flush = 9,
     topology = 10,
     wce = 11,
-    discard = 12,
+    mq = 12,
+    discard = 13,
     write_zeroes = 14
 };
 
@@ -62,9 +64,15 @@ private:
     size_t block_size;
     size_t disk_size;
     size_t size_max, seg_max;
+    unsigned int nr_queues;
+    /* Request queue each CPU submits on */
+    cul::vector<uint16_t> cpu_to_queue;
+
+    bool setup_queues();
 
 public:
-    blk_vdev(pci::pci_device *d) : vdev(d), block_size{512}, disk_size{}, size_max{0}, seg_max{0}
+    blk_vdev(pci::pci_device *d)
+        : vdev(d), block_size{512}, disk_size{}, size_max{0}, seg_max{0}, nr_queues{1}
     {
     }
     ~blk_vdev();
@@ -33,7 +33,7 @@ bool gpu_vdev::perform_subsystem_initialization()
         return false;
     }
 
-    if (!create_virtqueue(controlq_nr, get_max_virtq_size(controlq_nr)) ||
+    if (!setup_irqs(0) || !create_virtqueue(controlq_nr, get_max_virtq_size(controlq_nr)) ||
         !create_virtqueue(cursorq_nr, get_max_virtq_size(cursorq_nr)))
     {
         set_failure();
@@ -13,6 +13,7 @@
 #include <onyx/net/ethernet.h>
 #include <onyx/net/network.h>
 #include <onyx/page.h>
+#include <onyx/random.h>
 
 #include "../virtio.hpp"
 #include <onyx/slice.hpp>
@@ -56,29 +57,49 @@ void network_vdev::__rx_end(netif *nif)
     dev->rx_end();
 }
 
-int network_vdev::__poll_rx(netif *nif)
+int network_vdev::__poll_rx(netif *nif, int budget)
 {
     auto dev = static_cast<network_vdev *>(nif->priv);
 
-    return dev->poll_rx();
+    return dev->poll_rx(budget);
 }
 
-static constexpr unsigned int network_receiveq = 0;
-static constexpr unsigned int network_transmitq = 1;
+static constexpr unsigned int network_receiveq(unsigned int pair)
+{
+    return pair * 2;
+}
+
+static constexpr unsigned int network_transmitq(unsigned int pair)
+{
+    return pair * 2 + 1;
+}
 
 void network_vdev::rx_end()
 {
-    auto &vq = get_vq(network_receiveq);
+    unsigned long pending = __atomic_exchange_n(&rx_pending, 0, __ATOMIC_ACQ_REL);
 
-    vq->enable_interrupts();
+    while (pending)
+    {
+        unsigned int pair = __builtin_ctzl(pending);
+        pending &= ~(1UL << pair);
+        get_vq(network_receiveq(pair))->enable_interrupts();
+    }
 }
 
-int network_vdev::poll_rx()
+int network_vdev::poll_rx(int budget)
 {
-    auto &vq = get_vq(network_receiveq);
+    // netif has a single rx poll context, so poll every rx queue that signalled
+    unsigned long pending = __atomic_load_n(&rx_pending, __ATOMIC_ACQUIRE);
+    int work = 0;
 
-    vq->handle_irq();
-    return 0;
+    while (pending && work < budget)
+    {
+        unsigned int pair = __builtin_ctzl(pending);
+        pending &= ~(1UL << pair);
+        work += get_vq(network_receiveq(pair))->handle_irq(budget - work);
+    }
+
+    return work;
 }
 
 int network_vdev::send_packet(packetbuf *buf)
@@ -95,7 +116,7 @@ int network_vdev::send_packet(packetbuf *buf)
         hdr->csum_start = buf->csum_start - buf->data;
         hdr->csum_offset = buf->csum_offset_bytes();
     }
-    auto &transmit = virtqueue_list[network_transmitq];
+    auto &transmit = virtqueue_list[network_transmitq(cpu_to_pair[get_cpu_nr()])];
 
     virtio_completion completion;
     virtio_allocation_info info;
@@ -132,19 +153,19 @@ int network_vdev::send_packet(packetbuf *buf)
 
 static constexpr unsigned int rx_buf_size = 2048;
 
-bool network_vdev::setup_rx()
+bool network_vdev::setup_rx(unsigned int pair)
 {
-    auto &vq = virtqueue_list[network_receiveq];
+    auto &vq = virtqueue_list[network_receiveq(pair)];
     auto qsize = vq->get_queue_size();
 
-    rx_pages = alloc_page_list(vm_size_to_pages(rx_buf_size * qsize), PAGE_ALLOC_NO_ZERO);
-    if (!rx_pages)
+    rx_pages[pair] = alloc_page_list(vm_size_to_pages(rx_buf_size * qsize), PAGE_ALLOC_NO_ZERO);
+    if (!rx_pages[pair])
     {
         return false;
     }
 
     struct page_frag_alloc_info alloc_info;
-    alloc_info.curr = alloc_info.page_list = rx_pages;
+    alloc_info.curr = alloc_info.page_list = rx_pages[pair];
     alloc_info.off = 0;
 
     for (unsigned int i = 0; i < qsize; i++)
@@ -202,15 +223,16 @@ void network_vdev::handle_used_buffer(const virtq_used_elem &elem, virtq *vq)
 {
     auto nr = vq->get_nr();
 
-    if (nr == network_receiveq)
+    if (is_rxq(nr))
     {
         auto [paddr, len] = vq->get_buf_from_id(elem.id);
         process_packet(paddr, len);
 
         vq->resubmit_buffer(elem.id, true);
     }
-    else if (nr == network_transmitq)
+    else
     {
+        // Transmit and control queues
         auto completion = vq->get_completion(elem.id);
 
         completion->wake();
@@ -219,13 +241,14 @@ void network_vdev::handle_used_buffer(const virtq_used_elem &elem, virtq *vq)
 
 handle_vq_irq_result network_vdev::driver_handle_vq_irq(unsigned int nr)
 {
-    if (nr == network_receiveq)
+    if (is_rxq(nr))
     {
         const auto &vq = get_vq(nr);
 
-        netif_signal_rx(nif.get());
-
         vq->disable_interrupts();
+        __atomic_or_fetch(&rx_pending, 1UL << (nr / 2), __ATOMIC_RELEASE);
+
+        netif_signal_rx(nif.get());
 
         return handle_vq_irq_result::DELAY;
     }
@@ -233,6 +256,134 @@ handle_vq_irq_result network_vdev::driver_handle_vq_irq(unsigned int nr)
     return handle_vq_irq_result::HANDLE;
 }
 
+int network_vdev::send_ctrl_command(uint8_t cls, uint8_t cmd, const void *data, size_t len)
+{
+    // Header, then the ack, then the data, all in a single page
+    constexpr size_t ack_off = 8;
+    constexpr size_t data_off = 16;
+
+    if (!ctrl_vq)
+        return -EOPNOTSUPP;
+
+    if (len > PAGE_SIZE - data_off)
+        return -EINVAL;
+
+    struct page *p = alloc_page(0);
+    if (!p)
+        return -ENOMEM;
+
+    u8 *buf = (u8 *) PAGE_TO_VIRT(p);
+    auto hdr = (virtio_net_ctrl_hdr *) buf;
+    hdr->cls = cls;
+    hdr->cmd = cmd;
+    buf[ack_off] = VIRTIO_NET_ERR;
+    memcpy(buf + data_off, data, len);
+
+    page_iov vec[3];
+    vec[0] = {p, sizeof(virtio_net_ctrl_hdr), 0};
+    vec[1] = {p, (unsigned int) len, data_off};
+    vec[2] = {p, 1, ack_off};
+
+    virtio_completion completion;
+    virtio_allocation_info info;
+    info.completion = &completion;
+    info.vec = vec;
+    info.nr_vecs = 3;
+    info.fill_function = [](size_t vec_nr, virtio_allocation_info &info_) -> virtio_desc_info {
+        // Only the ack is device-writable
+        return {info_.vec[vec_nr],
+                vec_nr == info_.nr_vecs - 1 ? VIRTIO_ALLOCATION_FLAG_WRITE : 0U};
+    };
+
+    auto &vq = get_vq(ctrl_vq);
+    vq->allocate_descriptors(info, false);
+    vq->put_buffer(info, true);
+
+    completion.wait();
+
+    int st = buf[ack_off] == VIRTIO_NET_OK ? 0 : -EIO;
+    free_page(p);
+    return st;
+}
+
+int network_vdev::configure_mq(bool use_rss)
+{
+    if (!use_rss)
+    {
+        // Without RSS, the device steers flows to the rx queue paired with the tx queue they were
+        // last sent on.
+        uint16_t pairs = nr_pairs;
+        return send_ctrl_command(VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET, &pairs,
+                                 sizeof(pairs));
+    }
+
+    unsigned int table_len = read<uint16_t>(network_registers::rss_max_indirection_table_length);
+    const unsigned int key_len = cul::clamp(read<uint8_t>(network_registers::rss_max_key_size), 40);
+    const uint32_t hash_types =
+        read<uint32_t>(network_registers::supported_hash_types) &
+        (VIRTIO_NET_RSS_HASH_TYPE_IPV4 | VIRTIO_NET_RSS_HASH_TYPE_TCPV4 |
+         VIRTIO_NET_RSS_HASH_TYPE_UDPV4 | VIRTIO_NET_RSS_HASH_TYPE_IPV6 |
+         VIRTIO_NET_RSS_HASH_TYPE_TCPV6 | VIRTIO_NET_RSS_HASH_TYPE_UDPV6);
+
+    // The indirection table needs a power of 2 length
+    table_len = cul::clamp(table_len, 128U);
+    if (table_len == 0)
+        return -EIO;
+    table_len = 1U << ilog2(table_len);
+
+    // struct virtio_net_rss_config, which has two variable length arrays in it:
+    //  le32 hash_types; le16 indirection_table_mask; le16 unclassified_queue;
+    //  le16 indirection_table[mask + 1]; le16 max_tx_vq; u8 hash_key_length;
+    //  u8 hash_key_data[hash_key_length];
+    u8 config[8 + 128 * sizeof(uint16_t) + 3 + 40];
+    u8 *ptr = config;
+
+    memcpy(ptr, &hash_types, sizeof(uint32_t));
+    ptr += sizeof(uint32_t);
+    uint16_t mask = table_len - 1;
+    memcpy(ptr, &mask, sizeof(uint16_t));
+    ptr += sizeof(uint16_t);
+    uint16_t unclassified = 0;
+    memcpy(ptr, &unclassified, sizeof(uint16_t));
+    ptr += sizeof(uint16_t);
+
+    // Spread the hash buckets evenly across the rx queues
+    for (unsigned int i = 0; i < table_len; i++)
+    {
+        uint16_t queue = i % nr_pairs;
+        memcpy(ptr, &queue, sizeof(uint16_t));
+        ptr += sizeof(uint16_t);
+    }
+
+    uint16_t max_tx_vq = nr_pairs;
+    memcpy(ptr, &max_tx_vq, sizeof(uint16_t));
+    ptr += sizeof(uint16_t);
+    *ptr++ = key_len;
+    arc4random_buf(ptr, key_len);
+    ptr += key_len;
+
+    return send_ctrl_command(VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_RSS_CONFIG, config,
+                             ptr - config);
+}
+
+void network_vdev::map_queues()
+{
+    const unsigned int nr_cpus = get_nr_cpus();
+
+    for (unsigned int cpu = 0; cpu < nr_cpus; cpu++)
+    {
+        uint16_t pair = (unsigned long) cpu * nr_pairs / nr_cpus;
+        if (cpu == 0 || pair != cpu_to_pair[cpu - 1])
+        {
+            // Route the pair's interrupts to the first CPU transmitting on it
+            set_vq_affinity(network_receiveq(pair), cpu);
+            set_vq_affinity(network_transmitq(pair), cpu);
+        }
+
+        cpu_to_pair[cpu] = pair;
+    }
+}
+
 static virtio::network_features supported_features[] = {
     network_features::csum,
     /*network_features::guest_csum,
@@ -258,6 +409,18 @@ bool network_vdev::perform_subsystem_initialization()
         return false;
     }
 
+    bool use_rss = false;
+
+    if (raw_has_feature(network_features::ctrl_vq))
+    {
+        signal_feature(network_features::ctrl_vq);
+
+        if (raw_has_feature(network_features::feature_mq))
+            signal_feature(network_features::feature_mq);
+        if (raw_has_feature(network_features::rss))
+            signal_feature(network_features::rss);
+    }
+
     for (auto feature : supported_features)
     {
         if (raw_has_feature(feature))
@@ -283,23 +446,78 @@ bool network_vdev::perform_subsystem_initialization()
         return false;
     }
 
-    /* TODO: Support VIRTIO_NET_F_MQ */
-    if (!create_virtqueue(0, get_max_virtq_size(0)) ||
-        !create_virtqueue(1, get_max_virtq_size(1)) || !create_virtqueue(2, get_max_virtq_size(2)))
+    const unsigned int nr_cpus = get_nr_cpus();
+    unsigned int max_pairs = 1;
+
+    if (has_feature(network_features::ctrl_vq))
+    {
+        if (has_feature(network_features::feature_mq) || has_feature(network_features::rss))
+            max_pairs = read<uint16_t>(network_registers::max_virtqueue_pairs);
+        // The control queue comes after every possible queue pair
+        ctrl_vq = max_pairs * 2;
+    }
+
+    use_rss = has_feature(network_features::rss);
+    nr_pairs = cul::clamp(cul::clamp(max_pairs, nr_cpus), (unsigned int) VIRTIO_NET_MAX_PAIRS);
+    if (nr_pairs == 0)
+        nr_pairs = 1;
+
+    if (!rx_pages.resize(nr_pairs) || !cpu_to_pair.resize(nr_cpus))
     {
-        printk("virtio: Failed to create virtqueues\n");
         set_failure();
         return false;
     }
 
-    finalise_driver_init();
+    for (auto &p : rx_pages)
+        p = nullptr;
 
-    if (!setup_rx())
+    if (!setup_irqs(nr_pairs * 2 + (ctrl_vq ? 1 : 0)))
     {
         set_failure();
         return false;
     }
 
+    for (unsigned int i = 0; i < nr_pairs; i++)
+    {
+        if (!create_virtqueue(network_receiveq(i), get_max_virtq_size(network_receiveq(i))) ||
+            !create_virtqueue(network_transmitq(i), get_max_virtq_size(network_transmitq(i))))
+        {
+            printk("virtio: Failed to create virtqueues\n");
+            set_failure();
+            return false;
+        }
+    }
+
+    if (ctrl_vq && !create_virtqueue(ctrl_vq, get_max_virtq_size(ctrl_vq)))
+    {
+        printk("virtio: Failed to create virtqueues\n");
+        set_failure();
+        return false;
+    }
+
+    finalise_driver_init();
+
+    for (unsigned int i = 0; i < nr_pairs; i++)
+    {
+        if (!setup_rx(i))
+        {
+            set_failure();
+            return false;
+        }
+    }
+
+    if (nr_pairs > 1)
+    {
+        if (int st = configure_mq(use_rss); st < 0)
+        {
+            // The device keeps using a single queue pair
+            printk("virtio: Failed to enable %u queue pairs: %d\n", nr_pairs, st);
+            nr_pairs = 1;
+        }
+    }
+
+    map_queues();
+
     nif = make_unique<netif>();
     if (!nif)
     {
@@ -326,8 +544,11 @@ bool network_vdev::perform_subsystem_initialization()
 
 network_vdev::~network_vdev()
 {
-    if (rx_pages)
-        free_page_list(rx_pages);
+    for (auto p : rx_pages)
+    {
+        if (p)
+            free_page_list(p);
+    }
 }
 
 unique_ptr<vdev> create_network_device(pci::pci_device *dev)
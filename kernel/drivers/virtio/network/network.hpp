@@ -37,32 +37,91 @@ struct virtio_net_hdr
     uint16_t num_buffers;
 } __attribute__((packed));
 
+struct virtio_net_ctrl_hdr
+{
+    uint8_t cls;
+    uint8_t cmd;
+} __attribute__((packed));
+
+#define VIRTIO_NET_OK  0
+#define VIRTIO_NET_ERR 1
+
+#define VIRTIO_NET_CTRL_MQ              4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET 0
+#define VIRTIO_NET_CTRL_MQ_RSS_CONFIG   1
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX 0x8000
+
+#define VIRTIO_NET_RSS_HASH_TYPE_IPV4  (1 << 0)
+#define VIRTIO_NET_RSS_HASH_TYPE_TCPV4 (1 << 1)
+#define VIRTIO_NET_RSS_HASH_TYPE_UDPV4 (1 << 2)
+#define VIRTIO_NET_RSS_HASH_TYPE_IPV6  (1 << 3)
+#define VIRTIO_NET_RSS_HASH_TYPE_TCPV6 (1 << 4)
+#define VIRTIO_NET_RSS_HASH_TYPE_UDPV6 (1 << 5)
+
+/* Max number of queue pairs we'll use (one bit each in rx_pending) */
+#define VIRTIO_NET_MAX_PAIRS 64
+
 class network_vdev : public vdev
 {
 private:
     void get_mac(cul::slice<uint8_t, 6> &mac_buf);
     unique_ptr<netif> nif;
-    struct page *rx_pages;
+    /* rx buffers, per rx queue */
+    cul::vector<struct page *> rx_pages;
+    /* Number of queue pairs in use */
+    unsigned int nr_pairs;
+    /* Virtqueue number of the control queue, or 0 if we don't have one */
+    unsigned int ctrl_vq;
+    /* Queue pair each CPU transmits on */
+    cul::vector<uint16_t> cpu_to_pair;
+    /* rx queues that signalled and have their interrupts disabled, one bit per queue pair */
+    unsigned long rx_pending;
 
     static int __sendpacket(packetbuf *buf, netif *nif);
     static void __rx_end(netif *nif);
-    static int __poll_rx(netif *nif);
+    static int __poll_rx(netif *nif, int budget);
 
     int send_packet(packetbuf *buf);
 
     void rx_end();
-    int poll_rx();
+    int poll_rx(int budget);
 
     void process_packet(unsigned long paddr, unsigned long len);
 
+    bool is_rxq(unsigned int nr) const
+    {
+        return (nr & 1) == 0 && (!ctrl_vq || nr != ctrl_vq);
+    }
+
+    /**
+     * @brief Send a command through the control queue
+     *
+     * @param cls Command class
+     * @param cmd Command
+     * @param data Command-specific data
+     * @param len Length of data
+     * @return 0 on success, negative error codes
+     */
+    int send_ctrl_command(uint8_t cls, uint8_t cmd, const void *data, size_t len);
+
+    /**
+     * @brief Tell the device how many queue pairs we use, and how to steer rx traffic to them
+     *
+     * @param use_rss True if VIRTIO_NET_F_RSS was negotiated
+     * @return 0 on success, negative error codes
+     */
+    int configure_mq(bool use_rss);
+
+    void map_queues();
+
 public:
-    network_vdev(pci::pci_device *d) : vdev(d)
+    network_vdev(pci::pci_device *d) : vdev(d), nr_pairs{1}, ctrl_vq{0}, rx_pending{0}
     {
     }
     ~network_vdev();
 
     bool perform_subsystem_initialization() override;
-    bool setup_rx();
+    bool setup_rx(unsigned int pair);
 
     void handle_used_buffer(const virtq_used_elem &elem, virtq *vq) override;
     handle_vq_irq_result driver_handle_vq_irq(unsigned int nr) override;
@@ -75,7 +134,10 @@ enum network_registers
     max_virtqueue_pairs = 8,
     mtu = 10,
     speed = 12,
-    duplex = 16
+    duplex = 16,
+    rss_max_key_size = 17,
+    rss_max_indirection_table_length = 18,
+    supported_hash_types = 20
 };
 
 enum network_features
@@ -101,6 +163,7 @@ enum network_features
     guest_announce = 21,
     feature_mq = 22,
     ctrl_mac_addr = 23,
+    rss = 60,
     rsc_ext = 61,
     standby = 62
 };
@@ -285,6 +285,18 @@ bool virtq_split::init()
 
     device->write_config<uint16_t>(pci_common_cfg::queue_select, nr);
     device->write_config<uint16_t>(pci_common_cfg::queue_size, queue_size);
+
+    msix_vector = device->vq_msix_vector(nr);
+    device->write_config<uint16_t>(pci_common_cfg::queue_msix_vector, msix_vector);
+    /* The device tells us it couldn't allocate resources for the vector by reading back
+     * VIRTIO_MSI_NO_VECTOR.
+     */
+    if (device->read_config<uint16_t>(pci_common_cfg::queue_msix_vector) != msix_vector)
+    {
+        free_pages(vq_pages);
+        vq_pages = nullptr;
+        return false;
+    }
     device->write_config<uint32_t>(pci_common_cfg::queue_desc_low, static_cast<uint32_t>(_descs));
     device->write_config<uint32_t>(pci_common_cfg::queue_desc_high,
                                    static_cast<uint32_t>(_descs << 32));
@@ -411,6 +423,8 @@ void virtq_split::allocate_buffer_list(virtio_allocation_info &info)
 
 void virtq_split::put_buffer(const virtio_allocation_info &info, bool should_notify)
 {
+    scoped_lock<spinlock, true> g{avail_lock};
+
     write_memory_barrier();
 
     avail->ring[avail->idx % this->queue_size] = info.first_desc;
@@ -464,11 +478,25 @@ void virtq_split::free_chain(uint32_t id)
         wait_queue_wake_all(&desc_alloc_wq);
 }
 
-void virtq_split::handle_irq()
+unsigned int virtq_split::handle_irq(unsigned int budget)
 {
-    while (used->idx != last_seen_used_idx)
+    unsigned int handled = 0;
+
+    while (handled < budget)
     {
-        auto &elem = used->ring[last_seen_used_idx % this->queue_size];
+        virtq_used_elem elem;
+
+        {
+            // Only the consumption of the used ring needs to be serialised, the buffers themselves
+            // can be handled in parallel (e.g from the IRQ handler and a poller).
+            scoped_lock<spinlock, true> g{used_lock};
+            if (used->idx == last_seen_used_idx)
+                break;
+
+            read_memory_barrier();
+            elem = used->ring[last_seen_used_idx % this->queue_size];
+            last_seen_used_idx++;
+        }
 
         device->handle_used_buffer(elem, this);
         {
@@ -477,8 +505,10 @@ void virtq_split::handle_irq()
             free_chain(elem.id);
         }
 
-        last_seen_used_idx++;
+        handled++;
     }
+
+    return handled;
 }
 
 void virtq_split::disable_interrupts()
@@ -491,13 +521,16 @@ void virtq_split::enable_interrupts()
     avail->flags &= ~VIRTQ_AVAIL_F_NO_INTERRUPT;
 }
 
+void vdev::handle_vq_irq(virtq *vq)
+{
+    if (driver_handle_vq_irq(vq->get_nr()) == handle_vq_irq_result::HANDLE)
+        vq->handle_irq();
+}
+
 void vdev::handle_vq_irq()
 {
     for (auto &c : virtqueue_list)
-    {
-        if (driver_handle_vq_irq(c->get_nr()) == handle_vq_irq_result::HANDLE)
-            c->handle_irq();
-    }
+        handle_vq_irq(c.get());
 }
 
 static bool our_irq(uint32_t status)
@@ -522,24 +555,113 @@ irqstatus_t vdev::handle_irq()
     if (status & VIRTIO_ISR_CFG_QUEUE_INTERRUPT)
         handle_vq_irq();
 
-    /* TODO: Handle cfg interrupts */
+    if (status & VIRTIO_ISR_CFG_DEVICE_CFG_INT)
+        handle_config_irq();
 
     return IRQ_HANDLED;
 }
 
-} // namespace virtio
+/**
+ * @brief Handle a configuration change interrupt
+ * Devices also use these to tell us they hit an error and need a reset.
+ */
+void vdev::handle_config_irq()
+{
+    auto st = pci_common_cfg().read<uint8_t>(pci_common_cfg::device_status);
+    if (st & device_status::vdev_needs_reset)
+    {
+        printk("virtio: Device %04x:%02x:%02x.%x needs a reset\n", dev->addr().segment,
+               dev->addr().bus, dev->addr().device, dev->addr().function);
+        return;
+    }
 
-struct pci::pci_id virtio_pci_ids[] = {{PCI_ID_DEVICE(VIRTIO_VENDOR_ID, PCI_ANY_ID, NULL)},
-                                       {PCI_ID_DEVICE(VIRTIO_VENDOR_ID2, PCI_ANY_ID, NULL)},
-                                       {0}};
+    handle_config_change();
+}
+
+irqstatus_t vdev::handle_msix_irq(unsigned int vector)
+{
+    /* MSI-X interrupts aren't shared, and the ISR status isn't used. Vector 0 is the config
+     * change vector.
+     */
+    if (vector == 0)
+    {
+        handle_config_irq();
+        return IRQ_HANDLED;
+    }
+
+    for (auto &c : virtqueue_list)
+    {
+        if (c && c->get_msix_vector() == vector)
+            handle_vq_irq(c.get());
+    }
+
+    return IRQ_HANDLED;
+}
+
+static irqstatus_t virtio_intx_irq(struct irq_context *context, void *cookie)
+{
+    return static_cast<vdev *>(cookie)->handle_irq();
+}
+
+static irqstatus_t virtio_msix_irq(struct irq_context *context, void *cookie)
+{
+    auto *vdv = static_cast<vdev *>(cookie);
+    return vdv->handle_msix_irq(context->irq_nr - vdv->get_irq_vector_base());
+}
+
+bool vdev::setup_irqs(unsigned int nr_vqs)
+{
+    if (nr_vqs)
+    {
+        /* Ideally, one vector for config changes plus one per virtqueue. If we get fewer, the
+         * virtqueues share the ones we get.
+         */
+        int nr = dev->alloc_irq_vectors(2, nr_vqs + 1, PCI_IRQ_MSIX | PCI_IRQ_AFFINITY);
+        if (nr >= 2)
+        {
+            for (int i = 0; i < nr; i++)
+            {
+                if (install_irq(dev->irq_vector(i), virtio_msix_irq, dev, IRQ_FLAG_REGULAR, this) <
+                    0)
+                    return false;
+            }
 
-irqstatus_t virtio_handle_irq(struct irq_context *context, void *cookie)
+            nr_irq_vecs = nr;
+            nr_irq_vqs = nr_vqs;
+
+            write_config<uint16_t>(pci_common_cfg::msix_config, 0);
+            if (read_config<uint16_t>(pci_common_cfg::msix_config) != 0)
+                write_config<uint16_t>(pci_common_cfg::msix_config, VIRTIO_MSI_NO_VECTOR);
+
+            return true;
+        }
+    }
+
+    return install_irq(dev->get_intn(), virtio_intx_irq, dev, IRQ_FLAG_REGULAR, this) == 0;
+}
+
+uint16_t vdev::vq_msix_vector(unsigned int nr) const
 {
-    virtio::vdev *vdv = static_cast<virtio::vdev *>(cookie);
+    if (!nr_irq_vecs)
+        return VIRTIO_MSI_NO_VECTOR;
+    return 1 + nr % (nr_irq_vecs - 1);
+}
 
-    return vdv->handle_irq();
+int vdev::set_vq_affinity(unsigned int nr, unsigned int cpu)
+{
+    /* Shared vectors serve queues that want different CPUs, so leave them alone */
+    if (!nr_irq_vecs || nr_irq_vecs - 1 < nr_irq_vqs)
+        return -EOPNOTSUPP;
+
+    return dev->set_irq_vector_affinity(vq_msix_vector(nr), cpu);
 }
 
+} // namespace virtio
+
+struct pci::pci_id virtio_pci_ids[] = {{PCI_ID_DEVICE(VIRTIO_VENDOR_ID, PCI_ANY_ID, NULL)},
+                                       {PCI_ID_DEVICE(VIRTIO_VENDOR_ID2, PCI_ANY_ID, NULL)},
+                                       {0}};
+
 int virtio_probe(struct device *_dev)
 {
     pci::pci_device *device = (pci::pci_device *) _dev;
@@ -582,9 +704,6 @@ int virtio_probe(struct device *_dev)
             return -1;
     }
 
-    assert(install_irq(device->get_intn(), virtio_handle_irq, _dev, IRQ_FLAG_REGULAR,
-                       virtio_device.get_data()) == 0);
-
     virtio_device->perform_base_virtio_initialization();
     virtio_device->perform_subsystem_initialization();
 
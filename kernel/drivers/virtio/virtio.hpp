@@ -7,6 +7,7 @@
 #ifndef _VIRTIO_HPP_
 #define _VIRTIO_HPP_
 
+#include <limits.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -69,6 +70,10 @@ struct virtq_desc
 };
 
 #define VIRTQ_AVAIL_F_NO_INTERRUPT (1 << 0)
+
+/* Written to msix_config/queue_msix_vector when we don't want interrupts for it */
+#define VIRTIO_MSI_NO_VECTOR 0xffff
+
 struct virtq_avail
 {
     uint16_t flags;
@@ -169,6 +174,12 @@ protected:
     /* Descriptor allocation lock */
     spinlock desc_alloc_lock;
     wait_queue desc_alloc_wq;
+    /* Serialises producers on the available ring */
+    spinlock avail_lock;
+    /* Serialises consumers of the used ring (the IRQ handler and pollers) */
+    spinlock used_lock;
+    /* MSI-X vector, or VIRTIO_MSI_NO_VECTOR */
+    uint16_t msix_vector;
 
     bool has_available_descriptors(size_t nr) const;
     unsigned int alloc_descriptor_internal();
@@ -178,9 +189,12 @@ public:
 
     virtual unsigned int get_queue_size() = 0;
     virtq(vdev *dev, unsigned int nr)
-        : device{dev}, nr{nr}, desc_bitmap{}, avail_descs(), desc_alloc_lock{}
+        : device{dev}, nr{nr}, desc_bitmap{}, avail_descs(), desc_alloc_lock{}, avail_lock{},
+          used_lock{}, msix_vector{VIRTIO_MSI_NO_VECTOR}
     {
         spinlock_init(&desc_alloc_lock);
+        spinlock_init(&avail_lock);
+        spinlock_init(&used_lock);
         init_wait_queue_head(&desc_alloc_wq);
     }
 
@@ -197,11 +211,23 @@ public:
      */
     virtual void allocate_buffer_list(virtio_allocation_info &info) = 0;
     virtual void notify() = 0;
-    virtual void handle_irq() = 0;
+
+    /**
+     * @brief Handle used buffers
+     *
+     * @param budget Max number of used buffers to handle
+     * @return Number of handled buffers
+     */
+    virtual unsigned int handle_irq(unsigned int budget = UINT_MAX) = 0;
     unsigned int get_nr() const
     {
         return nr;
     }
+
+    uint16_t get_msix_vector() const
+    {
+        return msix_vector;
+    }
     virtual cul::pair<unsigned long, size_t> get_buf_from_id(uint16_t id) const = 0;
     virtual void disable_interrupts() = 0;
     virtual void enable_interrupts() = 0;
@@ -244,8 +270,10 @@ private:
     struct virtq_used *used;
     /* Note: this has been calculated from queue_mult * queue_notify_off */
     unsigned long eff_queue_notify_off;
-    /* The driver keeps track of the last used_idx in order to track progress for used buffers */
-    unsigned int last_seen_used_idx;
+    /* The driver keeps track of the last used_idx in order to track progress for used buffers.
+     * Note that it wraps around at 65536, just like used->idx.
+     */
+    uint16_t last_seen_used_idx;
 
     void free_chain(uint32_t id);
 
@@ -278,7 +306,7 @@ public:
 
     void notify() override;
 
-    void handle_irq() override;
+    unsigned int handle_irq(unsigned int budget = UINT_MAX) override;
 
     cul::pair<unsigned long, size_t> get_buf_from_id(uint16_t id) const override;
 
@@ -381,6 +409,12 @@ protected:
     void *bars[PCI_NR_BARS];
     virtio_structure structures[5];
     cul::vector<unique_ptr<virtq>> virtqueue_list;
+    /* Number of MSI-X vectors (vector 0 is for config changes, the rest are for the vqs).
+     * 0 if we're using INTx.
+     */
+    unsigned int nr_irq_vecs;
+    /* Number of virtqueues we asked vectors for */
+    unsigned int nr_irq_vqs;
 
     virtual bool supports_legacy()
     {
@@ -410,7 +444,8 @@ protected:
     }
 
 public:
-    vdev(pci::pci_device *dev) : dev(dev), bars{}, structures{}, feature_cache{}
+    vdev(pci::pci_device *dev)
+        : dev(dev), bars{}, structures{}, nr_irq_vecs{0}, nr_irq_vqs{0}, feature_cache{}
     {
     }
     virtual ~vdev()
@@ -466,6 +501,28 @@ public:
         device_cfg().write(offset, val);
     }
 
+    /**
+     * @brief Read a 64-bit device config field
+     * Not every transport can do 64-bit accesses, so read it in two halves, and retry if the
+     * device changed its config in between (see config_generation).
+     *
+     * @param offset Offset of the field
+     * @return Value
+     */
+    uint64_t read64(unsigned long offset)
+    {
+        uint8_t gen;
+        uint64_t val;
+
+        do
+        {
+            gen = read_config<uint8_t>(pci_common_cfg::config_generation);
+            val = read<uint32_t>(offset) | (uint64_t) read<uint32_t>(offset + 4) << 32;
+        } while (gen != read_config<uint8_t>(pci_common_cfg::config_generation));
+
+        return val;
+    }
+
     bool raw_has_feature(unsigned long feature);
 
     /* To be used by drivers to negotiate features */
@@ -484,9 +541,53 @@ public:
     void finalise_driver_init();
     void set_failure();
 
+    /**
+     * @brief Set up the device's interrupts
+     * Tries to get an MSI-X vector per virtqueue (plus one for config changes), and falls back
+     * to sharing vectors, and then to INTx. Needs to be called before creating virtqueues.
+     *
+     * @param nr_vqs Number of virtqueues the driver is going to create (0 for INTx)
+     * @return True on success, else false
+     */
+    bool setup_irqs(unsigned int nr_vqs);
+
+    /**
+     * @brief Get the MSI-X vector a virtqueue should use
+     *
+     * @param nr Virtqueue number
+     * @return Vector, or VIRTIO_MSI_NO_VECTOR if not using MSI-X
+     */
+    uint16_t vq_msix_vector(unsigned int nr) const;
+
+    /**
+     * @brief Route a virtqueue's interrupts to a CPU
+     * Only works if the virtqueue has a vector of its own.
+     *
+     * @param nr Virtqueue number
+     * @param cpu CPU
+     * @return 0 on success, negative error codes
+     */
+    int set_vq_affinity(unsigned int nr, unsigned int cpu);
+
+    unsigned int get_irq_vector_base()
+    {
+        return dev->irq_vector(0);
+    }
+
     irqstatus_t handle_irq();
+    irqstatus_t handle_msix_irq(unsigned int vector);
 
     void handle_vq_irq();
+    void handle_vq_irq(virtq *vq);
+    void handle_config_irq();
+
+    /**
+     * @brief Called (from IRQ context) when the device's configuration space changes
+     *
+     */
+    virtual void handle_config_change()
+    {
+    }
 
     virtual void handle_used_buffer(const virtq_used_elem &elem, virtq *vq)
     {
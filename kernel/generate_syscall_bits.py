@@ -73,7 +73,7 @@ def output_syscall_thunk(syscall, output_file):
 def output_thunk_file_prologue(syscall_thunk):
     headers = ["unistd.h", "dirent.h", "uapi/signal.h", "stdint.h", "stddef.h", "stdio.h", "uapi/errno.h", "uapi/fcntl.h", "uapi/poll.h",
                "uapi/time.h", "onyx/types.h", "uapi/mman.h", "uapi/resource.h", "uapi/posix-types.h", "sys/utsname.h", "uapi/socket.h", "sys/times.h",
-               "sys/sysinfo.h", "platform/syscall.h", "uapi/select.h"]
+               "sys/sysinfo.h", "platform/syscall.h", "uapi/select.h", "uapi/io_ring.h", "uapi/futex.h"]
     
     for header in headers:
         syscall_thunk.write(f'#include <{header}>\n')
@@ -55,6 +55,21 @@
 #define ATAPI_CMD_READ          0xA8
 #define ATAPI_CMD_EJECT         0x1B
 #define ATA_CMD_EXEC_DRIVE_DIAG 0x90
+#define ATA_CMD_READ_LOG_EXT    0x2F
+#define ATA_CMD_READ_FPDMA      0x60
+#define ATA_CMD_WRITE_FPDMA     0x61
+
+/* General purpose log addresses */
+#define ATA_LOG_NCQ_ERROR 0x10
+
+/* NCQ command error log (page 10h), byte 0 */
+#define ATA_NCQ_LOG_NQ         (1 << 7)
+#define ATA_NCQ_LOG_TAG(byte0) ((byte0) &0x1f)
+
+/* Identify word 76 (SATA capabilities) */
+#define ATA_SATA_CAP_NCQ (1 << 8)
+/* Identify word 75 */
+#define ATA_QUEUE_DEPTH(word) (((word) &0x1f) + 1)
 
 #define ATA_TYPE_ATA   1
 #define ATA_TYPE_ATAPI 2
@@ -29,6 +29,7 @@ static inline void mov_non_temporal(volatile Type *p, Type val)
 
 #define REG_TTBR0 "ttbr0_el1"
 #define REG_TTBR1 "ttbr1_el1"
+#define REG_MPIDR "mpidr_el1"
 
 #define dsb() __asm__ __volatile__("dsb sy" ::: "memory")
 #endif
@@ -41,6 +41,10 @@ using sector_t = uint64_t;
 #define BIO_REQ_EIO      (1 << 9)
 #define BIO_REQ_TIMEOUT  (1 << 10)
 #define BIO_REQ_NOT_SUPP (1 << 11)
+/* The submitter busy-polls for completion instead of sleeping, if the driver supports it.
+ * bio_submit_request sets it for threads with THREAD_IO_POLL (see IORING_SETUP_IOPOLL).
+ */
+#define BIO_REQ_POLLED   (1 << 12)
 
 struct bio_req
 {
@@ -52,6 +56,11 @@ struct bio_req
     blockdev *bdev;
     struct list_head list_node;
     unsigned long device_specific[4];
+    /* Completion callback for requests submitted with bio_submit_async. Called from thread
+     * context, with BIO_REQ_EIO set in flags if the request failed.
+     */
+    void (*b_end_io)(struct bio_req *req);
+    void *b_private;
 };
 
 using __blkread = ssize_t (*)(size_t, size_t, void *, struct blockdev *);
@@ -144,6 +153,16 @@ int blkdev_power(int op, struct blockdev *dev);
 
 int bio_submit_request(struct blockdev *dev, struct bio_req *req);
 
+/**
+ * @brief Submit a request without waiting for it to complete
+ * req->b_end_io gets called once it does. The request (and its vecs) must stay valid until then.
+ *
+ * @param dev Block device
+ * @param req Request
+ * @return 0 on success, negative error code (in which case b_end_io is not called)
+ */
+int bio_submit_async(struct blockdev *dev, struct bio_req *req);
+
 static inline bool block_get_device_letter_from_id(unsigned int id, cul::slice<char> buffer)
 {
     if (id > 26)
@@ -43,6 +43,7 @@ struct block_buf
 
 #define MAX_BLOCK_SIZE PAGE_SIZE
 
+struct inode;
 struct superblock;
 
 struct block_buf *page_add_blockbuf(struct page *page, unsigned int page_off);
@@ -53,6 +54,7 @@ vmo_status_t bbuffer_commit(struct vm_object *vmo, size_t off, struct page **ppa
 void block_buf_dirty(struct block_buf *buf);
 struct block_buf *block_buf_from_page(struct page *p);
 void page_destroy_block_bufs(struct page *page);
+ssize_t block_buf_writepage(struct page *page, size_t offset, struct inode *ino);
 
 static inline void block_buf_get(struct block_buf *buf)
 {
@@ -69,6 +71,11 @@ static inline void block_buf_put(struct block_buf *buf)
         block_buf_free(buf);
 }
 
+static inline sector_t block_buf_sector(struct block_buf *buf)
+{
+    return (buf->block_nr * buf->block_size) / buf->dev->sector_size;
+}
+
 static inline void *block_buf_data(struct block_buf *b)
 {
     return (void *) (((unsigned long) PAGE_TO_VIRT(b->this_page)) + b->page_off);
@@ -15,7 +15,9 @@
 #include <onyx/fnv.h>
 #include <onyx/limits.h>
 #include <onyx/list.h>
+#include <onyx/rcupdate.h>
 #include <onyx/rwlock.h>
+#include <onyx/seqlock.h>
 #include <onyx/vfs.h>
 
 #include <onyx/atomic.hpp>
@@ -44,8 +46,23 @@ struct dentry
     struct list_head d_children_head;
     struct dentry *d_mount_dentry;
     atomic<uint16_t> d_flags;
+    /* Offset of this dentry in its parent's d_children_head, for getdirent. Children are appended
+     * in increasing offset order.
+     */
+    off_t d_dir_offset;
+    off_t d_next_dir_offset;
+    /* Bumped whenever the name, parent or hashing of the dentry change. Lets RCU walkers validate
+     * what they read off the dentry without taking d_lock.
+     */
+    seqcount_t d_seq;
+    struct rcu_head d_rcu;
 };
 
+/* Write-held across every operation that moves a dentry between hash buckets (renames, moves and
+ * dcache resizes). RCU walkers sample it to detect that they may have missed an entry.
+ */
+extern seqlock_t dentry_rename_lock;
+
 struct dentry *dentry_open(char *path, struct dentry *base);
 struct dentry *dentry_mount(const char *mountpoint, struct inode *inode);
 void dentry_init();
@@ -66,6 +83,26 @@ using dentry_lookup_flags_t = uint16_t;
 
 dentry *dentry_lookup_internal(std::string_view v, dentry *dir, dentry_lookup_flags_t flags = 0);
 
+/**
+ * @brief Look up a name in the dcache without taking locks or references.
+ * Must be called inside an RCU read-side section. The returned dentry is only guaranteed to not be
+ * freed until rcu_read_unlock(); anything read off it must be validated against *seqp.
+ *
+ * @param dir Parent directory
+ * @param name Name to look up
+ * @param seqp Pointer to where the dentry's d_seq is stored
+ * @return The dentry, or nullptr if not found or if we raced with a writer
+ */
+dentry *dentry_lookup_rcu(dentry *dir, std::string_view name, unsigned int *seqp);
+
+/**
+ * @brief Try to grab a reference to a dentry found under RCU
+ *
+ * @param d Dentry
+ * @return True if we got a reference, false if the dentry is already being destroyed
+ */
+bool dentry_tryget(dentry *d);
+
 struct nameidata;
 dentry *dentry_resolve(nameidata &data);
 void dentry_destroy(dentry *d);
@@ -219,6 +256,24 @@ void dentry_do_unlink(dentry *entry);
 void dentry_rename(dentry *dent, const char *name);
 void dentry_move(dentry *target, dentry *new_parent);
 
+/**
+ * @brief Read a directory entry straight out of the dcache, for filesystems whose directories
+ * live entirely in it (like tmpfs).
+ *
+ * @param buf Dirent to fill
+ * @param off Offset to read from
+ * @param file Directory file
+ * @return Offset of the next entry, 0 on EOF
+ */
+off_t dcache_getdirent(struct dirent *buf, off_t off, struct file *file);
+
+/**
+ * @brief Release the dcache_getdirent cursor held by a file
+ *
+ * @param file File being released
+ */
+void dcache_readdir_release(struct file *file);
+
 #endif
 
 #endif
@@ -21,11 +21,18 @@
 
 #define IRQ_HANDLED   0
 #define IRQ_UNHANDLED -1
+/* Handled, but the rest of the work needs to run in the handler's irq thread */
+#define IRQ_WAKE_THREAD 1
 
 #define IRQ_FLAG_REGULAR 0
+/* Keep the irq masked while the irq thread runs. For lines the hard handler can't silence. */
+#define IRQ_FLAG_ONESHOT (1 << 0)
 
 typedef int irqstatus_t;
 typedef irqstatus_t (*irq_t)(struct irq_context *context, void *cookie);
+typedef void (*irq_thread_t)(void *cookie);
+
+struct irq_thread;
 
 struct interrupt_handler
 {
@@ -35,6 +42,8 @@ struct interrupt_handler
     unsigned long handled_irqs;
     unsigned int flags;
     struct interrupt_handler *next;
+    irq_thread_t thread_fn;
+    struct irq_thread *thread;
 };
 
 struct irqstats
@@ -43,12 +52,22 @@ struct irqstats
     unsigned long spurious;
 };
 
+/* Retargets an irq to a CPU. Provided by whoever programmed the irq's routing (e.g MSI-X). */
+typedef int (*irq_affinity_t)(unsigned int irq, unsigned int cpu, void *ctx);
+
+#define IRQ_AFFINITY_NONE ((unsigned int) -1)
+
 struct irq_line
 {
     struct interrupt_handler *irq_handlers;
     /* Here to stop race conditions with uninstalling and installing irq handlers */
     struct spinlock list_lock;
     struct irqstats stats;
+    /* CPU the irq is routed to. Only meaningful if affinity_known. */
+    unsigned int affinity;
+    bool affinity_known;
+    irq_affinity_t set_affinity;
+    void *affinity_ctx;
 };
 
 extern bool in_irq;
@@ -61,7 +80,63 @@ __always_inline __nocov bool is_in_interrupt()
 void dispatch_irq(unsigned int irq, struct irq_context *context);
 int install_irq(unsigned int irq, irq_t handler, struct device *device, unsigned int flags,
                 void *cookie);
+
+/**
+ * @brief Install an irq handler with a threaded bottom half
+ * The hard handler runs in irq context and returns IRQ_WAKE_THREAD to have thread_fn run in a
+ * dedicated kernel thread. The thread runs at SCHED_PRIO_HIGH, on the CPU the irq is routed to
+ * at install time.
+ *
+ * @param irq IRQ number
+ * @param handler Hard irq handler, or nullptr to always wake the thread (requires
+ * IRQ_FLAG_ONESHOT, which in turn requires an irq the platform can mask)
+ * @param thread_fn Threaded handler
+ * @param device Device
+ * @param flags IRQ_FLAG_*
+ * @param cookie Passed to both handlers
+ * @return 0 on success, negative error code
+ */
+int install_threaded_irq(unsigned int irq, irq_t handler, irq_thread_t thread_fn,
+                         struct device *device, unsigned int flags, void *cookie);
+
+/**
+ * @brief Set the scheduler priority of an irq's threads
+ *
+ * @param irq IRQ number
+ * @param prio SCHED_PRIO_*
+ * @return 0 on success, negative error code
+ */
+int irq_set_thread_priority(unsigned int irq, int prio);
+
 void free_irq(unsigned int irq, struct device *device);
+
+/**
+ * @brief Register how an irq is retargeted, and where it's currently routed to
+ *
+ * @param irq IRQ number
+ * @param cpu CPU the irq is currently routed to
+ * @param set_affinity Callback used to retarget the irq (or nullptr if it can't be moved)
+ * @param ctx Context passed to set_affinity
+ */
+void irq_init_affinity(unsigned int irq, unsigned int cpu, irq_affinity_t set_affinity,
+                       void *ctx);
+
+/**
+ * @brief Route an irq to a CPU
+ *
+ * @param irq IRQ number
+ * @param cpu Target CPU
+ * @return 0 on success, negative error code
+ */
+int irq_set_affinity(unsigned int irq, unsigned int cpu);
+
+/**
+ * @brief Get the CPU an irq is routed to
+ *
+ * @param irq IRQ number
+ * @return CPU number, or IRQ_AFFINITY_NONE
+ */
+unsigned int irq_get_affinity(unsigned int irq);
 void irq_init(void);
 
 #endif
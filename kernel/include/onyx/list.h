@@ -111,6 +111,26 @@ static inline void list_remove(struct list_head *node)
     node->prev = node->next = LIST_REMOVE_POISON;
 }
 
+/* RCU variants: writers still serialize among themselves, but readers may concurrently walk the
+ * list forwards (->next) inside an RCU read-side section.
+ */
+static inline void list_add_tail_rcu(struct list_head *_new, struct list_head *head)
+{
+    struct list_head *prev = head->prev;
+    _new->next = head;
+    _new->prev = prev;
+    head->prev = _new;
+    /* Publish the node only after it's fully initialized */
+    __atomic_store_n(&prev->next, _new, __ATOMIC_RELEASE);
+}
+
+static inline void list_remove_rcu(struct list_head *node)
+{
+    list_remove_bulk(node->prev, node->next);
+    /* Leave ->next alone, readers might still be standing on this node */
+    node->prev = LIST_REMOVE_POISON;
+}
+
 static inline bool list_is_empty(const struct list_head *head)
 {
     return head->next == head;
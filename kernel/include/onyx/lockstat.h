@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2023 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _ONYX_LOCKSTAT_H
+#define _ONYX_LOCKSTAT_H
+
+#include <stdbool.h>
+
+#include <onyx/compiler.h>
+#include <onyx/types.h>
+#include <onyx/utils.h>
+
+/**
+ * lockstat - lock contention statistics
+ * With CONFIG_LOCKSTAT, every lock primitive reports its acquisitions (and releases, for exclusive
+ * locks) here. Stats are kept per (lock type, acquisition call site) in per-cpu tables, and are
+ * read and controlled through /sys/lockstat. Recording is off until enabled at runtime, at which
+ * point the cost on the fast paths is a single branch.
+ */
+
+enum lockstat_type
+{
+    LOCKSTAT_SPINLOCK = 0,
+    LOCKSTAT_MUTEX,
+    LOCKSTAT_RWLOCK_READ,
+    LOCKSTAT_RWLOCK_WRITE,
+    LOCKSTAT_RWSLOCK_READ,
+    LOCKSTAT_RWSLOCK_WRITE,
+    LOCKSTAT_NR_TYPES
+};
+
+/* The lock could not be acquired right away */
+#define LOCKSTAT_CONTENDED (1 << 0)
+/* The lock was contended, but we got it by spinning on the owner (without sleeping) */
+#define LOCKSTAT_SPUN (1 << 1)
+
+#define LOCKSTAT_RET_IP() ((unsigned long) __builtin_return_address(0))
+
+/* Embedded in exclusive locks, to measure hold time */
+struct lockstat_hold
+{
+    u64 acquired_at;
+    unsigned long ip;
+};
+
+#ifdef CONFIG_LOCKSTAT
+
+/* Locks keep their lockstat_hold in a member named stat */
+#define LOCKSTAT_HOLD(lock) (&(lock)->stat)
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+extern bool lockstat_enabled;
+
+u64 __lockstat_wait_start(void);
+void __lockstat_acquired(struct lockstat_hold *hold, unsigned long ip, enum lockstat_type type,
+                         unsigned int flags, u64 wait_start);
+void __lockstat_release(struct lockstat_hold *hold, enum lockstat_type type);
+
+#ifdef __cplusplus
+}
+#endif
+
+CONSTEXPR static inline void lockstat_hold_init(struct lockstat_hold *hold)
+{
+    hold->acquired_at = 0;
+    hold->ip = 0;
+}
+
+/**
+ * @brief Get a timestamp to measure contended wait time from
+ *
+ * @return Timestamp, or 0 if lockstat is disabled
+ */
+static inline u64 lockstat_wait_start(void)
+{
+    if (unlikely(__atomic_load_n(&lockstat_enabled, __ATOMIC_RELAXED)))
+        return __lockstat_wait_start();
+    return 0;
+}
+
+/**
+ * @brief Record a lock acquisition
+ *
+ * @param hold Lock's hold time tracking, or NULL for shared acquisitions
+ * @param ip Acquisition call site
+ * @param type Lock type
+ * @param flags LOCKSTAT_CONTENDED, LOCKSTAT_SPUN
+ * @param wait_start Timestamp from lockstat_wait_start, for contended acquisitions
+ */
+static inline void lockstat_acquired(struct lockstat_hold *hold, unsigned long ip,
+                                     enum lockstat_type type, unsigned int flags, u64 wait_start)
+{
+    if (unlikely(__atomic_load_n(&lockstat_enabled, __ATOMIC_RELAXED)))
+        __lockstat_acquired(hold, ip, type, flags, wait_start);
+}
+
+/**
+ * @brief Record the release of an exclusive lock
+ *
+ * @param hold Lock's hold time tracking
+ * @param type Lock type
+ */
+static inline void lockstat_release(struct lockstat_hold *hold, enum lockstat_type type)
+{
+    /* Look at the hold and not at lockstat_enabled, so holds always get cleared */
+    if (unlikely(hold->acquired_at))
+        __lockstat_release(hold, type);
+}
+
+#else
+
+#define LOCKSTAT_HOLD(lock) ((struct lockstat_hold *) NULL)
+
+static inline u64 lockstat_wait_start(void)
+{
+    return 0;
+}
+
+static inline void lockstat_acquired(struct lockstat_hold *hold, unsigned long ip,
+                                     enum lockstat_type type, unsigned int flags, u64 wait_start)
+{
+}
+
+static inline void lockstat_release(struct lockstat_hold *hold, enum lockstat_type type)
+{
+}
+
+#endif
+
+#endif
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2023 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _ONYX_MM_COMPACTION_H
+#define _ONYX_MM_COMPACTION_H
+
+/* Maximum number of blocks a single compaction pass isolates */
+#define COMPACT_MAX_BLOCKS 8
+
+struct compact_control
+{
+    /* Order we're trying to make available */
+    unsigned int order;
+    /* Order of the isolated blocks, at least a pageblock */
+    unsigned int block_order;
+    unsigned int nr_blocks;
+    /* First pfn of every isolated block */
+    unsigned long blocks[COMPACT_MAX_BLOCKS];
+    unsigned long nr_migrated;
+    unsigned long nr_failed;
+};
+
+/**
+ * @brief Pick the blocks that are the cheapest to compact and isolate them.
+ * Isolated free pages can't be allocated, and pages freed into isolated blocks stay in the buddy
+ * lists.
+ *
+ * @param cc Compaction control. cc->order must be set; the isolated blocks get filled in.
+ */
+void page_isolate_for_compaction(struct compact_control *cc);
+
+/**
+ * @brief Undo page_isolate_for_compaction, giving the blocks back to the movable free lists
+ *
+ * @param cc Compaction control
+ */
+void page_unisolate(struct compact_control *cc);
+
+/**
+ * @brief Give back every page sitting in a pcpu queue to the buddy lists
+ *
+ */
+void page_drain_pcpu();
+
+/**
+ * @brief Do a compaction pass, migrating movable pages out of the blocks that are closest to
+ * being free.
+ *
+ * @param order Order we're trying to make available
+ * @return Number of pages migrated
+ */
+unsigned long compact_memory(unsigned int order);
+
+/**
+ * @brief Compact as much of memory as we can
+ *
+ */
+void compact_all();
+
+/**
+ * @brief Try to compact memory after a failed higher-order allocation.
+ * Does nothing if we can't sleep, or if recent attempts were not fruitful.
+ *
+ * @param order Order of the failed allocation
+ * @return True if it's worth retrying the allocation, else false
+ */
+bool compact_direct(unsigned int order);
+
+#endif
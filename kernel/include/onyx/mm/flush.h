@@ -12,10 +12,14 @@
 #include <onyx/semaphore.h>
 #include <onyx/spinlock.h>
 #include <onyx/vm.h>
+#include <onyx/wait_queue.h>
 
 /* TODO: This file started as mm specific but it's quite fs now, no? */
 
+struct blockdev;
 struct inode;
+struct mmu_gather;
+struct wb_cluster;
 
 struct flush_object;
 /* Implemented by users of the flush subsystem */
@@ -24,6 +28,25 @@ struct flush_ops
     ssize_t (*flush)(struct flush_object *fmd);
     bool (*is_dirty)(struct flush_object *fmd);
     void (*set_dirty)(bool value, struct flush_object *fmd);
+    /* Optional: write-protect any user mappings before flushing, gathering TLB invalidations
+     * in tlb. Lets writeback batch shootdowns over a whole run instead of one per object.
+     */
+    void (*write_protect)(struct flush_object *fmd, struct mmu_gather *tlb);
+    /* Optional: queue the object's blocks in wbc with wb_cluster_add (at most WB_OBJ_MAX_BLOCKS
+     * of them), instead of writing it back with flush(). Returns false if the object can't be
+     * clustered, in which case flush() gets used.
+     */
+    bool (*queue)(struct flush_object *fmd, struct wb_cluster *wbc);
+    /* Optional: called right before the first of the object's queued blocks gets submitted.
+     * Objects should mark themselves as under writeback here, and not in queue(), since queued
+     * blocks can sit in the cluster for a while.
+     */
+    void (*start_wb)(struct flush_object *fmd);
+    /* Optional: writing the object back failed with err. The object stays dirty (and gets retried
+     * later); it should drop its under-writeback state and record the error wherever fsync will
+     * find it. Objects without it get marked clean, losing the data.
+     */
+    void (*wb_error)(struct flush_object *fmd, int err);
 };
 
 struct flush_object
@@ -33,6 +56,9 @@ struct flush_object
     const struct flush_ops *ops;
 };
 
+/* Max number of blocks a single object can queue (a page worth of the smallest sectors) */
+#define WB_OBJ_MAX_BLOCKS (PAGE_SIZE / 512)
+
 /* Keep C APIs here */
 
 void flush_init(void);
@@ -43,6 +69,29 @@ void flush_remove_inode(struct inode *ino);
 ssize_t flush_sync_one(struct flush_object *obj);
 void flush_do_sync(void);
 
+/**
+ * @brief Queue a block for clustered writeback
+ * The owner's set_dirty(false) gets called once all of its queued blocks are written back, or
+ * wb_error() if any of them failed to.
+ *
+ * @param wbc Writeback cluster
+ * @param owner Object the block belongs to
+ * @param dev Block device
+ * @param sector First sector of the block
+ * @param page Page the block's data is in
+ * @param page_off Offset of the data in the page
+ * @param length Length of the block, in bytes
+ */
+void wb_cluster_add(struct wb_cluster *wbc, struct flush_object *owner, struct blockdev *dev,
+                    uint64_t sector, struct page *page, unsigned int page_off, unsigned int length);
+
+/**
+ * @brief Throttle a task that's dirtying pages.
+ * Kicks writeback if there's too much dirty data around, and waits for it if there's way too much.
+ * Must be called without any locks held.
+ */
+void flush_throttle_dirty(void);
+
 #ifdef __cplusplus
 
 #include <onyx/atomic.hpp>
@@ -61,11 +110,15 @@ private:
     /* Each flush dev also is associated with a thread that runs every x seconds */
     struct thread *thread;
     struct semaphore thread_sem;
+    /* Used to kick the thread into writing back early, when there's too much dirty data */
+    struct wait_queue kick_wq;
+    bool kicked;
 
 public:
     static constexpr unsigned long wb_run_delta_ms = 10000;
     constexpr flush_dev()
-        : dirty_bufs{}, dirty_inodes{}, block_load{0}, __lock{}, thread{}, thread_sem{}
+        : dirty_bufs{}, dirty_inodes{}, block_load{0}, __lock{}, thread{}, thread_sem{}, kick_wq{},
+          kicked{false}
     {
         mutex_init(&__lock);
         INIT_LIST_HEAD(&dirty_bufs);
@@ -95,6 +148,7 @@ public:
 
     void init();
     void run();
+    void kick();
     bool add_buf(struct flush_object *buf);
     void remove_buf(struct flush_object *buf);
     void add_inode(struct inode *ino);
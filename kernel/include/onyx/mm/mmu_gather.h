@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2023 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _ONYX_MM_MMU_GATHER_H
+#define _ONYX_MM_MMU_GATHER_H
+
+#include <stddef.h>
+
+#include <onyx/page.h>
+#include <onyx/vm.h>
+
+#define MMU_GATHER_MAX_RANGES 8
+
+/* Ranges of the same address space that are at most this far apart get merged into a single
+ * range, as it's cheaper to over-invalidate a bit than to keep track of every hole.
+ */
+#define MMU_GATHER_MERGE_GAP (32 * PAGE_SIZE)
+
+struct mmu_gather_range
+{
+    struct mm_address_space *mm;
+    unsigned long start;
+    unsigned long end;
+    /* If true, we hold a reference to mm that gets dropped after the shootdown */
+    bool pinned;
+};
+
+/**
+ * @brief mmu_gather accumulates TLB invalidations (and pages that can only be freed once no
+ * CPU can reference them through the TLB anymore) across a whole MM operation, and issues
+ * a single shootdown round when flushed.
+ * The gather is flushed when destroyed, so stack-allocating one around an operation is enough.
+ */
+struct mmu_gather
+{
+    struct mmu_gather_range ranges[MMU_GATHER_MAX_RANGES];
+    unsigned int nr_ranges{0};
+    /* Pages to free after the shootdown, chained through next_un.next_allocation */
+    struct page *free_pages{nullptr};
+
+    mmu_gather() = default;
+
+    mmu_gather(const mmu_gather &) = delete;
+    mmu_gather &operator=(const mmu_gather &) = delete;
+
+    ~mmu_gather()
+    {
+        flush();
+    }
+
+    /**
+     * @brief Queues an invalidation of [addr, addr + size) in \p mm
+     *
+     * @param mm The target address space
+     * @param addr The start of the range
+     * @param size The size of the range, in bytes
+     * @param pin If true, keep a reference to \p mm until the shootdown. Required when the
+     * caller does not otherwise keep \p mm alive until the gather is flushed.
+     */
+    void add_range(struct mm_address_space *mm, unsigned long addr, size_t size,
+                   bool pin = false);
+
+    /**
+     * @brief Queues an invalidation of a single page in \p mm
+     *
+     * @param mm The target address space
+     * @param addr The address of the page
+     * @param pin If true, keep a reference to \p mm until the shootdown
+     */
+    void add_page(struct mm_address_space *mm, unsigned long addr, bool pin = false)
+    {
+        add_range(mm, addr, PAGE_SIZE, pin);
+    }
+
+    /**
+     * @brief Queues a page table for freeing, after the shootdown
+     *
+     * @param page The page table's page
+     */
+    void remove_page_table(struct page *page)
+    {
+        page->next_un.next_allocation = free_pages;
+        free_pages = page;
+    }
+
+    /**
+     * @brief Issues the accumulated invalidations and frees any queued pages
+     *
+     */
+    void flush();
+
+    bool empty() const
+    {
+        return nr_ranges == 0 && !free_pages;
+    }
+};
+
+/**
+ * @brief Catch up on shootdowns this CPU missed while holding \p mm lazily.
+ * Called when \p mm is loaded on the current CPU, after it gets set in the active mask.
+ *
+ * @param mm The address space being loaded
+ */
+void mmu_tlb_catch_up(struct mm_address_space *mm);
+
+#endif
@@ -24,6 +24,9 @@ struct CAPABILITY("mutex") mutex
     struct spinlock llock;
     struct list_head waiters;
     unsigned long counter;
+#ifdef CONFIG_LOCKSTAT
+    struct lockstat_hold stat;
+#endif
 
 #ifdef __cplusplus
     constexpr mutex() : llock{}, waiters{}, counter{}
@@ -57,10 +60,14 @@ CONSTEXPR static inline void mutex_init(struct mutex *mutex)
     spinlock_init(&mutex->llock);
     mutex->counter = 0;
     INIT_LIST_HEAD(&mutex->waiters);
+#ifdef CONFIG_LOCKSTAT
+    lockstat_hold_init(&mutex->stat);
+#endif
 }
 
 void mutex_lock(struct mutex *m) ACQUIRE(m);
 void mutex_unlock(struct mutex *m) RELEASE(m);
+bool mutex_trylock(struct mutex *m) TRY_ACQUIRE(true, m);
 int mutex_lock_interruptible(struct mutex *mutex) TRY_ACQUIRE(false, mutex);
 bool mutex_holds_lock(struct mutex *m);
 struct thread *mutex_owner(struct mutex *mtx);
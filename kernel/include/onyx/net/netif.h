@@ -31,6 +31,9 @@ struct netif;
 #define NETIF_DOING_RX_POLL         (1 << 7)
 #define NETIF_MISSED_RX             (1 << 8)
 
+/* Max packets a netif may process per poll, before other netifs get a turn */
+#define NETIF_RX_WEIGHT 64
+
 struct packetbuf;
 
 struct netif_inet6_addr
@@ -79,7 +82,10 @@ struct netif
     struct list_head inet6_addr_list;
 
     int (*sendpacket)(packetbuf *buf, struct netif *nif);
-    int (*poll_rx)(struct netif *nif);
+    /* Process at most budget received packets, and return how many were processed. Returning
+     * budget means there may be more, and we'll poll again later (without calling rx_end).
+     */
+    int (*poll_rx)(struct netif *nif, int budget);
     void (*rx_end)(struct netif *nif);
 
     struct list_head list_node;
@@ -139,7 +145,7 @@ netif *netif_from_if(uint32_t oif);
 cul::vector<netif *> &netif_lock_and_get_list(void);
 void netif_unlock_list(void);
 struct netif *netif_from_name(const char *name);
-int netif_do_rx(void);
+bool netif_do_rx(void);
 void netif_signal_rx(netif *nif);
 int netif_process_pbuf(netif *nif, packetbuf *buf);
 
@@ -254,6 +254,11 @@ sockaddr &sa_generic(T &s)
 
 void socket_init(struct socket *socket);
 
+socket *file_to_socket(struct file *f);
+bool file_is_socket(struct file *f);
+int socket_accept_file(struct file *f, struct sockaddr *addr, socklen_t *slen, int flags,
+                       unsigned int fflags);
+
 // Internal representations of the shutdown state of the socket
 #define SHUTDOWN_RD   (1 << 0)
 #define SHUTDOWN_WR   (1 << 1)
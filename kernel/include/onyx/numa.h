@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2023 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _ONYX_NUMA_H
+#define _ONYX_NUMA_H
+
+#include <stddef.h>
+
+#include <onyx/types.h>
+
+#ifndef CONFIG_NUMA_MAX_NODES
+#define CONFIG_NUMA_MAX_NODES 8
+#endif
+
+#define MAX_NUMA_NODES CONFIG_NUMA_MAX_NODES
+
+#define NUMA_NO_NODE -1
+
+/* Distances as defined by the ACPI SLIT: 10 is local, anything higher is relatively farther */
+#define NUMA_LOCAL_DISTANCE  10
+#define NUMA_REMOTE_DISTANCE 20
+
+/**
+ * @brief Register a range of physical memory as belonging to a node.
+ * Must be called before page_init.
+ *
+ * @param nid Node ID
+ * @param start Start of the range
+ * @param end End of the range (exclusive)
+ * @return 0 on success, negative error code
+ */
+int numa_add_memblk(int nid, unsigned long start, unsigned long end);
+
+/**
+ * @brief Set the distance between two nodes
+ *
+ * @param from Source node
+ * @param to Destination node
+ * @param distance Distance, with NUMA_LOCAL_DISTANCE being the node itself
+ */
+void numa_set_distance(int from, int to, unsigned int distance);
+
+/**
+ * @brief Get the distance between two nodes
+ *
+ * @param from Source node
+ * @param to Destination node
+ * @return The distance
+ */
+unsigned int numa_distance(int from, int to);
+
+/**
+ * @brief Record the node a hardware CPU ID (e.g the x86 APIC ID) belongs to.
+ * Used by firmware parsing code that runs before logical CPU numbers are assigned.
+ *
+ * @param hwid Hardware CPU ID
+ * @param nid Node ID
+ */
+void numa_add_cpu_hwid(u32 hwid, int nid);
+
+/**
+ * @brief Find the node of a hardware CPU ID
+ *
+ * @param hwid Hardware CPU ID
+ * @return The node, or NUMA_NO_NODE if unknown
+ */
+int numa_hwid_to_node(u32 hwid);
+
+/**
+ * @brief Set the node of a logical CPU
+ *
+ * @param cpu CPU number
+ * @param nid Node ID
+ */
+void numa_set_cpu_node(unsigned int cpu, int nid);
+
+/**
+ * @brief Get the node of a logical CPU
+ *
+ * @param cpu CPU number
+ * @return The node ID
+ */
+int cpu_to_node(unsigned int cpu);
+
+/**
+ * @brief Get the node a physical address belongs to
+ *
+ * @param phys Physical address
+ * @return The node ID. Memory not described by firmware belongs to node 0.
+ */
+int phys_to_nid(unsigned long phys);
+
+/**
+ * @brief Get the number of nodes in the system
+ *
+ * @return Number of nodes (at least 1)
+ */
+unsigned int numa_nr_nodes();
+
+/**
+ * @brief Check if a node is online (has memory registered)
+ *
+ * @param nid Node ID
+ * @return True if online, else false
+ */
+bool numa_node_online(int nid);
+
+/**
+ * @brief Fill \p order with every online node, sorted by distance from \p nid
+ *
+ * @param nid Node we're allocating from
+ * @param order Array of at least MAX_NUMA_NODES entries
+ * @return Number of entries filled
+ */
+unsigned int numa_node_fallback_order(int nid, int *order);
+
+/**
+ * @brief Split [start, start + size) by node, calling \p cb for every piece
+ *
+ * @param start Start of the range
+ * @param size Size of the range
+ * @param cb Callback, called with (nid, start, size, context)
+ * @param context Context passed to the callback
+ */
+void numa_for_each_range(unsigned long start, size_t size,
+                         void (*cb)(int nid, unsigned long start, size_t size, void *context),
+                         void *context);
+
+#ifdef CONFIG_ACPI
+/**
+ * @brief Parse the ACPI SRAT and SLIT tables, before page_init
+ *
+ */
+void acpi_numa_init();
+#endif
+
+#endif
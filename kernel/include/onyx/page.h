@@ -64,6 +64,8 @@
 #define PAGE_FLAG_FLUSHING    (1 << 5)
 #define PAGE_FLAG_FILESYSTEM1 (1 << 6) /* Filesystem private flag */
 #define PAGE_FLAG_WAITERS     (1 << 7)
+/* The page is free, sitting in a zone's zero pool, and known to be zeroed */
+#define PAGE_FLAG_ZEROED      (1 << 8)
 
 /* struct page - Represents every usable page on the system
  * Everything is native-word-aligned in order to allow atomic changes
@@ -97,6 +99,15 @@ struct memstat;
 
 void page_get_stats(struct memstat *memstat);
 
+/**
+ * @brief Get memory statistics for a single NUMA node
+ *
+ * @param nid Node ID
+ * @param m Pointer to a memstat, where total_pages and allocated_pages are filled.
+ * @return 0 on success, -EINVAL if the node is not online
+ */
+int page_get_node_stats(int nid, struct memstat *m);
+
 struct bootmodule
 {
     uintptr_t base;
@@ -141,6 +152,11 @@ struct page *page_add_page_late(void *paddr);
 #define PAGE_ALLOC_4GB_LIMIT           (1 << 2)
 #define PAGE_ALLOC_INTERNAL_DEBUG      (1 << 3)
 #define PAGE_ALLOC_NO_SANITIZER_SHADOW (1 << 4)
+/* Migratetype hints, used to group pages by mobility. Movable pages may be migrated by compaction,
+ * reclaimable ones can be freed on demand. Everything else is unmovable.
+ */
+#define PAGE_ALLOC_MOVABLE     (1 << 5)
+#define PAGE_ALLOC_RECLAIMABLE (1 << 6)
 
 #define GFP_KERNEL 0
 
@@ -181,6 +197,27 @@ struct page *alloc_page_list(size_t nr_pages, unsigned int gfp_flags);
  */
 void free_page_list(struct page *pages);
 
+/**
+ * @brief Allocate order-0 pages in bulk
+ * This is a lot cheaper than calling alloc_page() in a loop, as it hits the pcpu queues and the
+ * buddy lists in one pass.
+ *
+ * @param nr_pages Number of pages wanted
+ * @param gfp_flags GFP flags
+ * @param pages Array of at least nr_pages entries, filled with the allocated pages
+ * @return Number of pages allocated, which may be less than nr_pages if we ran out of memory
+ */
+unsigned long alloc_pages_bulk(unsigned long nr_pages, unsigned int gfp_flags, struct page **pages);
+
+/**
+ * @brief Free pages in bulk
+ * Drops a reference to every page, and frees the ones that hit zero in a single pass.
+ *
+ * @param pages Array of pages
+ * @param nr_pages Number of pages in the array
+ */
+void free_pages_bulk(struct page **pages, unsigned long nr_pages);
+
 void free_page(struct page *p);
 void free_pages(struct page *p);
 
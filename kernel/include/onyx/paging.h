@@ -85,7 +85,30 @@ int is_invalid_arch_range(void *address, size_t pages);
 void paging_protect_kernel(void);
 void paging_free_page_tables(struct mm_address_space *mm);
 bool paging_write_protect(void *addr, struct mm_address_space *mm);
-int vm_mmu_unmap(struct mm_address_space *as, void *addr, size_t pages);
+
+struct mmu_gather;
+
+/**
+ * @brief Unmaps a range of pages from the page tables.
+ *
+ * @param as The target address space.
+ * @param addr The start of the range.
+ * @param pages The number of pages to unmap.
+ * @param tlb If not null, TLB invalidations and page table frees are accumulated in \p tlb instead
+ * of being issued before returning.
+ * @return 0 on success
+ */
+int vm_mmu_unmap(struct mm_address_space *as, void *addr, size_t pages,
+                 struct mmu_gather *tlb = nullptr);
+
+/**
+ * @brief Invalidates a range of pages in the local TLB.
+ *
+ * @param page The start of the range.
+ * @param pages The number of pages.
+ */
+void paging_invalidate(void *page, size_t pages);
+
 void *paging_unmap(void *memory);
 
 #ifdef __x86_64__
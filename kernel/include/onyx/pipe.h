@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2023 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _ONYX_PIPE_H
+#define _ONYX_PIPE_H
+
+#include <stddef.h>
+
+#include <onyx/types.h>
+
+struct file;
+
+/**
+ * @brief Check if a file is a pipe (anonymous or named)
+ *
+ * @param filp File pointer
+ * @return True if it's a pipe, else false
+ */
+bool file_is_pipe(struct file *filp);
+
+/**
+ * @brief Splice data from a file into a pipe
+ * Page cache backed files have their pages referenced by the pipe instead of copied.
+ *
+ * @param pipe_filp Pipe file (write end)
+ * @param in File to read from
+ * @param off Offset into in, advanced by the amount spliced
+ * @param len Maximum length to splice
+ * @param flags SPLICE_F_* flags
+ * @return Spliced bytes, or negative error code
+ */
+ssize_t pipe_splice_from_file(struct file *pipe_filp, struct file *in, size_t *off, size_t len,
+                              unsigned int flags);
+
+/**
+ * @brief Splice data from a pipe into a file
+ *
+ * @param pipe_filp Pipe file (read end)
+ * @param out File to write to
+ * @param off Offset into out, advanced by the amount spliced
+ * @param len Maximum length to splice
+ * @param flags SPLICE_F_* flags
+ * @return Spliced bytes, or negative error code
+ */
+ssize_t pipe_splice_to_file(struct file *pipe_filp, struct file *out, size_t *off, size_t len,
+                            unsigned int flags);
+
+/**
+ * @brief Move (splice) or duplicate (tee) data between two pipes
+ *
+ * @param in Pipe file to read from
+ * @param out Pipe file to write to
+ * @param len Maximum length to transfer
+ * @param flags SPLICE_F_* flags
+ * @param consume If true, consume the data from in (splice), else leave it there (tee)
+ * @return Transferred bytes, or negative error code
+ */
+ssize_t pipe_splice_pipe(struct file *in, struct file *out, size_t len, unsigned int flags,
+                         bool consume);
+
+#endif
@@ -14,11 +14,38 @@
 
 #include <pci/pci-msi.h>
 
+/**
+ * @brief Allocate MSI(-X) vectors, routed to a single CPU
+ *
+ * @param num_vectors Number of vectors
+ * @param addr64 True if the device supports 64-bit message addresses
+ * @param data Resulting message (and irq numbers); data->cpu is the target CPU on return
+ * @param cpu Target CPU, or -1 to let the platform spread vectors between CPUs
+ * @return 0 on success, -1 on error
+ */
 int platform_allocate_msi_interrupts(unsigned int num_vectors, bool addr64,
-                                     struct pci_msi_data *data);
+                                     struct pci_msi_data *data, int cpu = -1);
+
+/**
+ * @brief Recompose an MSI message so it targets another CPU
+ *
+ * @param data Message, as given by platform_allocate_msi_interrupts
+ * @param cpu New target CPU
+ * @return 0 on success, negative error code
+ */
+int platform_msi_retarget(struct pci_msi_data *data, unsigned int cpu);
 
 int platform_install_irq(unsigned int irqn, struct interrupt_handler *h);
 void platform_mask_irq(unsigned int irq);
+void platform_unmask_irq(unsigned int irq);
+
+/**
+ * @brief Check if an irq can be masked with platform_mask_irq
+ *
+ * @param irq IRQ number
+ * @return True if it can, false if it can only be masked at the device (or not at all)
+ */
+bool platform_irq_can_mask(unsigned int irq);
 
 void platform_init_acpi(void);
 
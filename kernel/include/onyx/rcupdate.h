@@ -7,6 +7,8 @@
 #ifndef _ONYX_RCUPDATE_H
 #define _ONYX_RCUPDATE_H
 
+#include <stddef.h>
+
 #include <onyx/preempt.h>
 
 #define rcu_read_lock()   sched_disable_preempt()
@@ -21,6 +23,31 @@ struct rcu_head
 void call_rcu(struct rcu_head *head, void (*callback)(struct rcu_head *head));
 void synchronize_rcu();
 
+/**
+ * @brief Wait for a grace period, expedited
+ * Forces a quiescent state out of every CPU using IPIs, instead of waiting for them to
+ * context switch. Much lower latency than synchronize_rcu, at the expense of disturbing every CPU
+ * on the system. Meant for latency-sensitive updaters only.
+ *
+ */
+void synchronize_rcu_expedited();
+
+void __kfree_rcu(struct rcu_head *head, unsigned long offset);
+
+/**
+ * @brief kfree an object after a grace period
+ * Frees get batched per-cpu and go through a single grace period together. Must not be called
+ * from hard irq context.
+ *
+ * @param ptr Pointer to the object, allocated with kmalloc/malloc
+ * @param field Name of the object's struct rcu_head member
+ */
+#define kfree_rcu(ptr, field)                                                          \
+    ({                                                                                 \
+        static_assert(offsetof(__typeof__(*(ptr)), field) < 4096, "rcu_head too far"); \
+        __kfree_rcu(&(ptr)->field, offsetof(__typeof__(*(ptr)), field));               \
+    })
+
 /**
  * @brief Handle a quiescent state
  * Raises the softirq if required.
@@ -26,8 +26,6 @@ struct irq_context
     registers_t *registers;
 };
 
-void softirq_try_handle(void);
-
 static inline unsigned long irq_save_and_disable()
 {
     unsigned long status = riscv_read_csr(RISCV_SSTATUS);
@@ -41,6 +41,9 @@ struct rwlock
     unsigned long lock{0};
     struct list_head waiting_list;
     struct spinlock llock;
+#ifdef CONFIG_LOCKSTAT
+    struct lockstat_hold stat{};
+#endif
 
     constexpr rwlock()
     {
@@ -53,6 +56,9 @@ struct CAPABILITY("rwslock") rwslock
 {
 private:
     unsigned long lock{0};
+#ifdef CONFIG_LOCKSTAT
+    struct lockstat_hold stat{};
+#endif
 
 public:
     constexpr rwslock() = default;
@@ -80,6 +86,9 @@ static inline void rwlock_init(struct rwlock *lock)
     lock->lock = 0;
     INIT_LIST_HEAD(&lock->waiting_list);
     spinlock_init(&lock->llock);
+#ifdef CONFIG_LOCKSTAT
+    lockstat_hold_init(&lock->stat);
+#endif
 }
 
 #ifdef __cplusplus
@@ -121,6 +121,8 @@ using thread_t = struct thread
 #define THREAD_SHOULD_DIE    (1 << 3)
 #define THREAD_ACTIVE        (1 << 4)
 #define THREAD_RUNNING       (1 << 5)
+/* Block IO submitted by this thread should be polled (BIO_REQ_POLLED) */
+#define THREAD_IO_POLL       (1 << 6)
 
 int sched_init(void);
 
@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2023 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _ONYX_SEQLOCK_H
+#define _ONYX_SEQLOCK_H
+
+#include <stdbool.h>
+
+#include <onyx/cpu.h>
+#include <onyx/spinlock.h>
+
+/* A sequence count lets readers run concurrently with writers, and detect that they raced with
+ * one. The count is odd while a write is in progress; readers snapshot it before reading and
+ * retry (or fall back to a locked path) if it changed. Writers need to be serialized by the
+ * caller.
+ */
+typedef struct seqcount
+{
+    unsigned int seq;
+} seqcount_t;
+
+#define SEQCOUNT_INIT \
+    {                 \
+        0             \
+    }
+
+static inline void seqcount_init(seqcount_t *s)
+{
+    s->seq = 0;
+}
+
+/**
+ * @brief Start a read-side section, waiting out any writer in progress
+ *
+ * @param s Sequence count
+ * @return Sequence to pass to read_seqcount_retry
+ */
+static inline unsigned int read_seqcount_begin(const seqcount_t *s)
+{
+    unsigned int seq;
+
+    while ((seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE)) & 1)
+        cpu_relax();
+
+    return seq;
+}
+
+/**
+ * @brief Check if a read-side section raced with a writer
+ *
+ * @param s Sequence count
+ * @param start Sequence returned by read_seqcount_begin
+ * @return True if the reader needs to retry, else false
+ */
+static inline bool read_seqcount_retry(const seqcount_t *s, unsigned int start)
+{
+    /* Order the reader's loads before the re-read of the sequence */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&s->seq, __ATOMIC_RELAXED) != start;
+}
+
+static inline void write_seqcount_begin(seqcount_t *s)
+{
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+    /* Order the sequence bump before the writer's stores */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void write_seqcount_end(seqcount_t *s)
+{
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* A seqlock is a sequence count with a spinlock to serialize the writers */
+typedef struct seqlock
+{
+    seqcount_t seqcount;
+    struct spinlock lock;
+} seqlock_t;
+
+static inline void seqlock_init(seqlock_t *sl)
+{
+    seqcount_init(&sl->seqcount);
+    spinlock_init(&sl->lock);
+}
+
+static inline unsigned int read_seqbegin(const seqlock_t *sl)
+{
+    return read_seqcount_begin(&sl->seqcount);
+}
+
+static inline bool read_seqretry(const seqlock_t *sl, unsigned int start)
+{
+    return read_seqcount_retry(&sl->seqcount, start);
+}
+
+static inline void write_seqlock(seqlock_t *sl)
+{
+    spin_lock(&sl->lock);
+    write_seqcount_begin(&sl->seqcount);
+}
+
+static inline void write_sequnlock(seqlock_t *sl)
+{
+    write_seqcount_end(&sl->seqcount);
+    spin_unlock(&sl->lock);
+}
+
+#endif
@@ -25,6 +25,10 @@
 
 #endif
 
+#ifdef CONFIG_LOCKSTAT
+#include <onyx/lockstat.h>
+#endif
+
 // #include <onyx/lock_annotations.h>
 #define __ACQUIRE(...)
 #define __RELEASE(...)
@@ -32,13 +36,25 @@
 
 typedef unsigned int raw_spinlock_t;
 
+/* The lock word is split in two halves: the low half holds the owner (cpu nr + 1), and the high
+ * half holds the tail of the queue of waiters ((cpu nr + 1) << 2 | nesting level). Waiters spin on
+ * their own per-cpu queue node, and get the lock in FIFO order. An uncontended lock is a plain
+ * cmpxchg from 0 to the owner.
+ */
+#define SPINLOCK_OWNER_MASK 0xffffU
+#define SPINLOCK_TAIL_SHIFT 16
+#define SPINLOCK_TAIL_MASK  (0xffffU << SPINLOCK_TAIL_SHIFT)
+
 struct __CAPABILITY("spinlock") spinlock
 {
-    /* TODO: Conditionally have these debug features, and have owner_cpu be in lock */
+    /* TODO: Conditionally have these debug features */
     raw_spinlock_t lock;
 #ifdef CONFIG_SPINLOCK_DEBUG
     unsigned long holder;
 #endif
+#ifdef CONFIG_LOCKSTAT
+    struct lockstat_hold stat;
+#endif
 };
 
 #ifdef __cplusplus
@@ -61,6 +77,9 @@ CONSTEXPR static inline void spinlock_init(struct spinlock *s)
 #ifdef CONFIG_SPINLOCK_DEBUG
     s->holder = 0xDEADCAFEDEADCAFE;
 #endif
+#ifdef CONFIG_LOCKSTAT
+    lockstat_hold_init(&s->stat);
+#endif
 
     s->lock = 0;
 }
@@ -85,7 +104,7 @@ static inline void spin_unlock_irqrestore(struct spinlock *lock, unsigned long o
 
 static inline bool spin_lock_held(struct spinlock *lock)
 {
-    return lock->lock == get_cpu_nr() + 1;
+    return (lock->lock & SPINLOCK_OWNER_MASK) == get_cpu_nr() + 1;
 }
 
 static inline void spin_lock(struct spinlock *lock) __ACQUIRE(lock)
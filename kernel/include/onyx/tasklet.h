@@ -27,7 +27,12 @@ struct tasklet
     }
 };
 
-void tasklet_run();
+/**
+ * @brief Run pending tasklets
+ *
+ * @return True if we ran out of budget and there are tasklets left
+ */
+bool tasklet_run();
 void tasklet_schedule(tasklet *t);
 
 #endif
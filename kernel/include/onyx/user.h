@@ -22,6 +22,17 @@ ssize_t strlen_user(const char *user);
 long get_user32(unsigned int *uaddr, unsigned int *dest);
 long get_user64(unsigned long *uaddr, unsigned long *dest);
 
+/**
+ * @brief Atomically compare and exchange a 32-bit user space value.
+ *
+ * @param uaddr User space pointer.
+ * @param expected Value to compare against. On return, holds the value that was found.
+ * @param newval Value to store if *uaddr == *expected.
+ * @return 0 if the access went through (the exchange happened iff *expected is unchanged),
+ *         -EFAULT if we faulted.
+ */
+long cmpxchg_user32(unsigned int *uaddr, unsigned int *expected, unsigned int newval);
+
 #ifdef __cplusplus
 }
 #endif
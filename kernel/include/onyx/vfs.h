@@ -74,6 +74,9 @@ struct file_ops
     ssize_t (*writepage)(struct page *page, size_t offset, struct inode *ino);
     int (*prepare_write)(struct inode *ino, struct page *page, size_t page_off, size_t offset,
                          size_t len);
+    /* Optional: called before prepare_write with a larger chunk of the write, so the fs can
+     * allocate blocks for it in big runs instead of a page at a time. */
+    int (*prepare_write_range)(struct inode *ino, size_t offset, size_t len);
     int (*fcntl)(struct file *filp, int cmd, unsigned long arg);
     void (*release)(struct file *filp);
     ssize_t (*read_iter)(struct file *filp, size_t offset, iovec_iter *iter, unsigned int flags);
@@ -120,6 +123,8 @@ struct inode
     struct file_ops *i_fops;
 
     struct vm_object *i_pages;
+    /* First writeback error since the last fsync, reported (and cleared) by inode_sync */
+    int i_wb_error;
     struct list_head i_dirty_inode_node;
     void *i_flush_dev;
 
@@ -133,6 +138,7 @@ struct inode
 
     // For FIFOs
     pipe *i_pipe;
+    struct rcu_head i_rcu;
 
 #ifdef __cplusplus
     int init(mode_t mode)
@@ -162,6 +168,12 @@ struct file
 
 int inode_create_vmo(struct inode *ino);
 
+/**
+ * @brief Set up the inode cache's hashtable, sized from the amount of memory
+ *
+ */
+void inode_cache_init();
+
 struct file *open_vfs_with_flags(struct file *dir, const char *path, unsigned int flags);
 struct file *open_vfs(struct file *dir, const char *path);
 
@@ -179,6 +191,8 @@ struct file *creat_vfs(struct dentry *node, const char *path, int mode);
 int getdents_vfs(unsigned int count, putdir_t putdir, struct dirent *dirp, off_t off,
                  struct getdents_ret *ret, struct file *file);
 
+off_t do_getdirent(struct dirent *buf, off_t off, struct file *file);
+
 int ioctl_vfs(int request, char *argp, struct file *file);
 
 int stat_vfs(struct stat *buf, struct file *node);
@@ -219,6 +233,8 @@ void inode_mark_dirty(struct inode *ino);
 
 int inode_flush(struct inode *ino);
 
+ssize_t inode_sync(struct inode *inode);
+
 int inode_special_init(struct inode *ino);
 
 /**
@@ -171,6 +171,11 @@ struct mm_address_space : public refcountable
     // limit the shootdowns to CPUs where the address space is active instead of every CPU.
     cpumask active_mask{};
 
+    // Bumped on every user TLB shootdown. CPUs that were lazily holding this address space (and
+    // thus were skipped by the shootdown) compare it against the generation they last saw when
+    // switching back in, and flush their TLB if they fell behind.
+    unsigned long tlb_gen{};
+
     spinlock page_table_lock{};
 
     mm_address_space &operator=(mm_address_space &&as)
@@ -188,6 +193,7 @@ struct mm_address_space : public refcountable
         vmo_tail = as.vmo_tail;
         arch_mmu = as.arch_mmu;
         active_mask = cul::move(as.active_mask);
+        tlb_gen = as.tlb_gen;
         return *this;
     }
 
@@ -702,14 +708,19 @@ struct kernel_limits
  */
 void get_kernel_limits(struct kernel_limits *l);
 
+struct mmu_gather;
+
 /**
  * @brief Write-protects a page in each of its mappings.
  *
  * @param page The page that needs to be write-protected.
  * @param offset The offset of the page in the VMO.
  * @param vmo A pointer to its VMO.
+ * @param tlb If not null, TLB invalidations are gathered in \p tlb instead of being issued
+ * before returning.
  */
-void vm_wp_page_for_every_region(page *page, size_t offset, vm_object *vmo);
+void vm_wp_page_for_every_region(page *page, size_t offset, vm_object *vmo,
+                                 struct mmu_gather *tlb = nullptr);
 
 /**
  * @brief Invalidates a memory range.
@@ -33,6 +33,7 @@ void set_pin_handlers();
 void ioapic_set_pin(bool active_high, bool level, uint32_t pin);
 void ioapic_unmask_pin(uint32_t pin);
 void ioapic_mask_pin(uint32_t pin);
+void ioapic_clear_pin_mask(uint32_t pin);
 uint32_t read_io_apic(uint32_t reg);
 void write_io_apic(uint32_t reg, uint32_t value);
 void lapic_init();
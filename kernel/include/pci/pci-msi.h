@@ -34,6 +34,28 @@ struct pci_msi_data
     uint32_t vector_start;
     uint32_t irq_offset; // Note: This is hacky and should be replaced by something like IRQ domains
                          // or something
+    /* CPU the vectors are routed to */
+    uint32_t cpu;
 };
 
+/* MSI-X capability */
+#define PCI_MSIX_MESSAGE_CONTROL_OFF 2
+#define PCI_MSIX_TABLE_OFF           4
+#define PCI_MSIX_PBA_OFF             8
+
+#define PCI_MSIX_MSGCTRL_TABLE_SIZE(ctrl) (((ctrl) &0x7ff) + 1)
+#define PCI_MSIX_MSGCTRL_FUNCTION_MASK    (1 << 14)
+#define PCI_MSIX_MSGCTRL_ENABLE           (1 << 15)
+
+#define PCI_MSIX_BIR(reg)    ((reg) &0x7)
+#define PCI_MSIX_OFFSET(reg) ((reg) & ~0x7)
+
+/* MSI-X table entries */
+#define PCI_MSIX_ENTRY_SIZE         16
+#define PCI_MSIX_ENTRY_ADDR_LO      0
+#define PCI_MSIX_ENTRY_ADDR_HI      4
+#define PCI_MSIX_ENTRY_DATA         8
+#define PCI_MSIX_ENTRY_VECTOR_CTRL  12
+#define PCI_MSIX_ENTRY_CTRL_MASKBIT (1 << 0)
+
 #endif
@@ -15,6 +15,7 @@
 #include <onyx/port_io.h>
 #include <onyx/spinlock.h>
 
+#include <pci/pci-msi.h>
 #include <pci/pcie.h>
 
 #include <onyx/expected.hpp>
@@ -153,6 +154,12 @@ struct pci_bar
     bool may_prefetch;
 };
 
+/* alloc_irq_vectors flags */
+#define PCI_IRQ_MSI      (1 << 0)
+#define PCI_IRQ_MSIX     (1 << 1)
+/* Spread vectors across CPUs (vector i goes to CPU i % nr_cpus) */
+#define PCI_IRQ_AFFINITY (1 << 2)
+
 #define PCI_ID_BY_CLASS 0
 #define PCI_ID_BY_ID    1
 
@@ -184,6 +191,12 @@ protected:
     struct pci_irq pin_to_gsi[4];
     void *driver_data;
     pcie_allocation *alloc;
+    /* MSI(-X) state */
+    uint16_t msi_cap_off;
+    bool msix_enabled;
+    unsigned int nr_irq_vecs;
+    volatile uint8_t *msix_table;
+    struct pci_msi_data msi_data;
 
     void find_supported_capabilities();
     int wait_for_tp(off_t cap_start);
@@ -191,13 +204,20 @@ protected:
 
     bool enum_bars();
 
+    int enable_msix_vectors(unsigned int min_vecs, unsigned int max_vecs, unsigned int flags);
+    int enable_msi_vectors(unsigned int min_vecs, unsigned int max_vecs, unsigned int flags);
+    void msix_write_entry(unsigned int vec, const pci_msi_data &msg);
+    void msi_write_message(const pci_msi_data &msg);
+    static int msi_set_affinity(unsigned int irq, unsigned int cpu, void *ctx);
+
 public:
     pci_device(const char *name, struct bus *b, device *parent, uint16_t did_, uint16_t vid_,
                const device_address &addr)
         : device{name, b, parent}, device_id{did_}, vendor_id{vid_}, address{addr}, pci_class_{},
           sub_class_{}, prog_if_{}, type{}, has_power_management{}, pm_cap_off{},
           supported_power_states{}, current_power_state{}, next{}, pin_to_gsi{},
-          driver_data{}, alloc{}
+          driver_data{}, alloc{}, msi_cap_off{}, msix_enabled{}, nr_irq_vecs{}, msix_table{},
+          msi_data{}
     {
     }
 
@@ -262,6 +282,45 @@ public:
     void disable_irq();
     size_t find_capability(uint8_t cap, int instance = 0);
     int enable_msi(irq_t handler, void *cookie);
+
+    /**
+     * @brief Allocate and enable MSI-X or MSI vectors
+     * Nothing is installed on the vectors; use install_irq(irq_vector(i), ...) for that.
+     *
+     * @param min_vecs Minimum number of vectors the driver can work with
+     * @param max_vecs Maximum number of vectors the driver wants
+     * @param flags PCI_IRQ_* flags
+     * @return Number of vectors allocated, or negative error code
+     */
+    int alloc_irq_vectors(unsigned int min_vecs, unsigned int max_vecs, unsigned int flags);
+
+    /**
+     * @brief Get the irq number of a vector
+     *
+     * @param vec Vector index
+     * @return IRQ number
+     */
+    unsigned int irq_vector(unsigned int vec) const
+    {
+        return msi_data.irq_offset + vec;
+    }
+
+    unsigned int nr_irq_vectors() const
+    {
+        return nr_irq_vecs;
+    }
+
+    void mask_irq_vector(unsigned int vec);
+    void unmask_irq_vector(unsigned int vec);
+
+    /**
+     * @brief Route a vector to a CPU
+     *
+     * @param vec Vector index
+     * @param cpu Target CPU
+     * @return 0 on success, negative error code
+     */
+    int set_irq_vector_affinity(unsigned int vec, unsigned int cpu);
     expected<pci_bar, int> get_bar(unsigned int index);
     void *map_bar(unsigned int index, unsigned int caching);
     void set_bar(const pci_bar &bar, unsigned int index);
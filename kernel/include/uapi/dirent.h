@@ -9,6 +9,7 @@
 #define _UAPI_DIRENT_H
 
 #include <uapi/posix-types.h>
+#include <uapi/stat.h>
 
 #define DT_UNKNOWN 0
 #define DT_FIFO    1
@@ -31,4 +32,20 @@ struct dirent
     char d_name[256];
 };
 
+/* getdents_plus record. Like struct dirent, but carrying the entry's lstat() data. */
+struct dirent_plus
+{
+    struct stat dp_stat;
+    ino_t d_ino;
+    off_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    /* DIRENT_PLUS_* flags */
+    unsigned char dp_flags;
+    char d_name[256];
+};
+
+/* dp_stat is valid. Not set if the entry went away between reading it and looking it up. */
+#define DIRENT_PLUS_STAT_VALID (1 << 0)
+
 #endif
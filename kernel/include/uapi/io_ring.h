@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2023 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef _UAPI_IO_RING_H
+#define _UAPI_IO_RING_H
+
+#include <onyx/types.h>
+
+/* Submission queue entry. Filled by userspace at sqes[sq_tail & sq_mask]. */
+struct io_ring_sqe
+{
+    __u8 opcode;
+    __u8 flags;
+    __u16 ioprio;
+    __s32 fd;
+    union {
+        /* File offset. -1 means "use (and update) the file position". */
+        __u64 off;
+        /* Second address, for ops that need it (e.g accept's socklen_t *) */
+        __u64 addr2;
+    };
+    /* Buffer, iovec array, struct timespec *, or struct sockaddr * */
+    __u64 addr;
+    /* Buffer length or number of iovecs */
+    __u32 len;
+    union {
+        /* POLL_ADD */
+        __u32 poll_events;
+        /* RECV, SEND */
+        __u32 msg_flags;
+        /* ACCEPT */
+        __u32 accept_flags;
+        /* FSYNC */
+        __u32 fsync_flags;
+        __u32 op_flags;
+    };
+    /* Passed back untouched in the completion */
+    __u64 user_data;
+    /* Registered buffer index, for READ_FIXED and WRITE_FIXED */
+    __u16 buf_index;
+    __u16 __pad0;
+    __u32 __pad1;
+    __u64 __pad2[2];
+};
+
+/* Completion queue entry. Consumed by userspace at cqes[cq_head & cq_mask]. */
+struct io_ring_cqe
+{
+    __u64 user_data;
+    /* Result, as the equivalent syscall would return it */
+    __s32 res;
+    __u32 flags;
+};
+
+/* Shared ring header, at offset 0 of the ring mapping. Userspace owns sq_tail and cq_head, the
+ * kernel owns sq_head and cq_tail. Indices are free running and masked on access.
+ */
+struct io_ring_header
+{
+    __u32 sq_head;
+    __u32 sq_tail;
+    __u32 sq_mask;
+    __u32 sq_entries;
+    __u32 cq_head;
+    __u32 cq_tail;
+    __u32 cq_mask;
+    __u32 cq_entries;
+    __u32 flags;
+    /* Completions dropped because the CQ was full */
+    __u32 cq_overflow;
+    __u32 __resv[6];
+};
+
+struct io_ring_params
+{
+    /* In: requested number of SQ entries (rounded up to a power of 2). Out: actual number. */
+    __u32 sq_entries;
+    /* Out: number of CQ entries (twice the SQ entries) */
+    __u32 cq_entries;
+    /* In: IORING_SETUP_* flags */
+    __u32 flags;
+    __u32 __resv0;
+    /* Out: size to mmap (MAP_SHARED, offset 0) and the offsets of the SQE and CQE arrays in it */
+    __u64 ring_size;
+    __u64 sqes_off;
+    __u64 cqes_off;
+    __u64 __resv1[4];
+};
+
+enum io_ring_op
+{
+    IORING_OP_NOP = 0,
+    IORING_OP_READ,
+    IORING_OP_WRITE,
+    IORING_OP_READV,
+    IORING_OP_WRITEV,
+    IORING_OP_READ_FIXED,
+    IORING_OP_WRITE_FIXED,
+    IORING_OP_FSYNC,
+    IORING_OP_POLL_ADD,
+    IORING_OP_TIMEOUT,
+    IORING_OP_ACCEPT,
+    IORING_OP_RECV,
+    IORING_OP_SEND,
+    IORING_OP_LAST
+};
+
+/* io_ring_params->flags */
+/* Block IO done on behalf of this ring's reads and writes busy-polls for completion instead of
+ * sleeping, if the driver supports it. Trades CPU time for latency.
+ */
+#define IORING_SETUP_IOPOLL (1 << 0)
+
+/* sqe->flags */
+/* sqe->fd is an index into the registered files */
+#define IOSQE_FIXED_FILE (1 << 0)
+
+/* io_ring_enter flags */
+/* Wait for min_complete completions (and run deferred requests while doing so) */
+#define IORING_ENTER_GETEVENTS (1 << 0)
+
+/* io_ring_register opcodes */
+#define IORING_REGISTER_BUFFERS   0
+#define IORING_UNREGISTER_BUFFERS 1
+#define IORING_REGISTER_FILES     2
+#define IORING_UNREGISTER_FILES   3
+
+#define IORING_MAX_ENTRIES    4096
+#define IORING_MAX_REG_BUFS   1024
+#define IORING_MAX_REG_FILES  4096
+#define IORING_MAX_REG_BUFLEN (1UL << 30)
+
+#endif
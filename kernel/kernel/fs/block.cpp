@@ -15,9 +15,13 @@
 
 #include <onyx/block.h>
 #include <onyx/buffer.h>
+#include <onyx/init.h>
 #include <onyx/page.h>
 #include <onyx/page_iov.h>
 #include <onyx/rwlock.h>
+#include <onyx/scheduler.h>
+#include <onyx/spinlock.h>
+#include <onyx/wait_queue.h>
 
 static struct rwlock dev_list_lock;
 static struct list_head dev_list = LIST_HEAD_INIT(dev_list);
@@ -385,9 +389,104 @@ int bio_submit_request(struct blockdev *dev, struct bio_req *req)
     if (unlikely(dev->submit_request == nullptr))
         return -EIO;
 
+    struct thread *curr = get_current_thread();
+    if (curr && curr->flags & THREAD_IO_POLL)
+        req->flags |= BIO_REQ_POLLED;
+
     return dev->submit_request(dev, req);
 }
 
+/* Our drivers' submit_request() only returns once the request is done. To get more than one
+ * request in flight, async requests get handed off to a pool of kbio threads, each of which
+ * submits (and sleeps on) one request at a time.
+ */
+#define BIO_ASYNC_THREADS 8
+
+static struct spinlock bio_async_lock;
+static struct list_head bio_async_queue = LIST_HEAD_INIT(bio_async_queue);
+static struct wait_queue bio_async_wq;
+static bool bio_async_ready;
+
+static void bio_async_complete(struct bio_req *req, int st)
+{
+    if (st < 0)
+        req->flags |= BIO_REQ_EIO;
+    req->b_end_io(req);
+}
+
+static struct bio_req *bio_async_dequeue()
+{
+    struct bio_req *req = nullptr;
+
+    spin_lock(&bio_async_lock);
+
+    if (!list_is_empty(&bio_async_queue))
+    {
+        req = container_of(list_first_element(&bio_async_queue), struct bio_req, list_node);
+        list_remove(&req->list_node);
+    }
+
+    spin_unlock(&bio_async_lock);
+
+    return req;
+}
+
+/**
+ * @brief Submit a request without waiting for it to complete
+ * req->b_end_io gets called once it does. The request (and its vecs) must stay valid until then.
+ *
+ * @param dev Block device
+ * @param req Request
+ * @return 0 on success, negative error code (in which case b_end_io is not called)
+ */
+int bio_submit_async(struct blockdev *dev, struct bio_req *req)
+{
+    if (unlikely(dev->submit_request == nullptr))
+        return -EIO;
+
+    req->bdev = dev;
+
+    if (!__atomic_load_n(&bio_async_ready, __ATOMIC_ACQUIRE)) [[unlikely]]
+    {
+        /* Too early, do it ourselves */
+        bio_async_complete(req, bio_submit_request(dev, req));
+        return 0;
+    }
+
+    spin_lock(&bio_async_lock);
+    list_add_tail(&req->list_node, &bio_async_queue);
+    spin_unlock(&bio_async_lock);
+
+    wait_queue_wake(&bio_async_wq);
+    return 0;
+}
+
+static void kbio(void *)
+{
+    while (true)
+    {
+        struct bio_req *req;
+        wait_for_event(&bio_async_wq, (req = bio_async_dequeue()) != nullptr);
+
+        /* The request's list_node is free again, the driver may use it */
+        bio_async_complete(req, bio_submit_request(req->bdev, req));
+    }
+}
+
+static void bio_async_init()
+{
+    for (unsigned int i = 0; i < BIO_ASYNC_THREADS; i++)
+    {
+        struct thread *t = sched_create_thread(kbio, THREAD_KERNEL, nullptr);
+        CHECK(t != nullptr);
+        sched_start_thread(t);
+    }
+
+    __atomic_store_n(&bio_async_ready, true, __ATOMIC_RELEASE);
+}
+
+INIT_LEVEL_CORE_AFTER_SCHED_ENTRY(bio_async_init);
+
 atomic<unsigned int> next_scsi_dev_num = 0;
 /**
  * @brief Create a SCSI-like(sdX) block device
@@ -18,9 +18,16 @@ memory_pool<block_buf, 0> block_buf_pool;
 ssize_t block_buf_flush(flush_object *fo);
 bool block_buf_is_dirty(flush_object *fo);
 static void block_buf_set_dirty(bool dirty, flush_object *fo);
+static bool block_buf_queue(flush_object *fo, struct wb_cluster *wbc);
+static void block_buf_start_wb(flush_object *fo);
+static void block_buf_wb_error(flush_object *fo, int err);
 
-const struct flush_ops blockbuf_fops = {
-    .flush = block_buf_flush, .is_dirty = block_buf_is_dirty, .set_dirty = block_buf_set_dirty};
+const struct flush_ops blockbuf_fops = {.flush = block_buf_flush,
+                                        .is_dirty = block_buf_is_dirty,
+                                        .set_dirty = block_buf_set_dirty,
+                                        .queue = block_buf_queue,
+                                        .start_wb = block_buf_start_wb,
+                                        .wb_error = block_buf_wb_error};
 
 #define block_buf_from_flush_obj(fo) container_of(fo, block_buf, flush_obj)
 
@@ -28,7 +35,7 @@ ssize_t block_buf_flush(flush_object *fo)
 {
     auto buf = block_buf_from_flush_obj(fo);
 
-    sector_t disk_sect = (buf->block_nr * buf->block_size) / buf->dev->sector_size;
+    sector_t disk_sect = block_buf_sector(buf);
 
     struct page_iov vec;
     vec.length = buf->block_size;
@@ -56,6 +63,75 @@ ssize_t block_buf_flush(flush_object *fo)
     return buf->block_size;
 }
 
+static bool block_buf_queue(flush_object *fo, struct wb_cluster *wbc)
+{
+    auto buf = block_buf_from_flush_obj(fo);
+
+    wb_cluster_add(wbc, fo, buf->dev, block_buf_sector(buf), buf->this_page, buf->page_off,
+                   buf->block_size);
+    return true;
+}
+
+static void block_buf_start_wb(flush_object *fo)
+{
+    auto buf = block_buf_from_flush_obj(fo);
+
+    __atomic_fetch_or(&buf->flags, BLOCKBUF_FLAG_UNDER_WB, __ATOMIC_RELAXED);
+    __atomic_fetch_or(&buf->this_page->flags, PAGE_FLAG_FLUSHING, __ATOMIC_RELAXED);
+}
+
+static void block_buf_wb_error(flush_object *fo, int err)
+{
+    auto buf = block_buf_from_flush_obj(fo);
+
+    /* Stay dirty, so we get written back again */
+    __atomic_and_fetch(&buf->flags, ~BLOCKBUF_FLAG_UNDER_WB, __ATOMIC_RELAXED);
+    __atomic_and_fetch(&buf->this_page->flags, ~PAGE_FLAG_FLUSHING, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Write back a page cache page through its block buffers.
+ * Filesystems whose page cache pages are made of block_bufs should use this as their writepage,
+ * which also lets writeback cluster the page's blocks with everyone else's.
+ *
+ * @param page The page
+ * @param offset Offset of the page in the file
+ * @param ino The inode
+ * @return PAGE_SIZE on success, negative error code
+ */
+ssize_t block_buf_writepage(struct page *page, size_t offset, struct inode *ino)
+{
+    auto buf = block_buf_from_page(page);
+
+    assert(buf != nullptr);
+
+    while (buf)
+    {
+        page_iov v[1];
+        v->length = buf->block_size;
+        v->page = buf->this_page;
+        v->page_off = buf->page_off;
+
+        struct bio_req r
+        {
+        };
+        r.nr_vecs = 1;
+        r.vec = v;
+        r.sector_number = block_buf_sector(buf);
+        r.flags = BIO_REQ_WRITE_OP;
+
+        if (bio_submit_request(buf->dev, &r) < 0)
+        {
+            printf("block_buf_writepage: Error writing back block %lu\n", buf->block_nr);
+            return -EIO;
+        }
+
+        buf = buf->next;
+    }
+
+    return PAGE_SIZE;
+}
+
 bool block_buf_is_dirty(flush_object *fo)
 {
     auto buf = block_buf_from_flush_obj(fo);
@@ -17,26 +17,23 @@
 #include <onyx/file.h>
 #include <onyx/mm/slab.h>
 #include <onyx/mtable.h>
+#include <onyx/mutex.h>
 #include <onyx/namei.h>
+#include <onyx/page.h>
 #include <onyx/user.h>
 #include <onyx/vfs.h>
+#include <onyx/vm.h>
 #include <onyx/wait.h>
 
+#include <uapi/memstat.h>
+
 #include <onyx/expected.hpp>
-#include <onyx/hashtable.hpp>
 #include <onyx/list.hpp>
 #include <onyx/string_view.hpp>
 
 static struct slab_cache *dentry_cache;
 dentry *root_dentry = nullptr;
 
-fnv_hash_t hash_dentry(dentry *&d)
-{
-    auto hash = fnv_hash(&d->d_parent, sizeof(dentry *));
-    hash = fnv_hash_cont(d->d_name, d->d_name_length, hash);
-    return hash;
-}
-
 fnv_hash_t hash_dentry_fields(dentry *parent, std::string_view name)
 {
     auto hash = fnv_hash(&parent, sizeof(dentry *));
@@ -44,8 +41,118 @@ fnv_hash_t hash_dentry_fields(dentry *parent, std::string_view name)
     return hash;
 }
 
-cul::hashtable2<dentry *, 1024, fnv_hash_t, hash_dentry> dentry_ht;
-static rwslock dentry_ht_locks[1024];
+/* The dcache's hashtable is sized from the amount of memory at boot, and doubles whenever it gets
+ * too loaded. Buckets are covered by a fixed set of lock stripes: since both counts are powers of
+ * two and there are never fewer buckets than stripes, a given hash always maps to the same stripe,
+ * no matter the table's size. RCU walkers don't take the locks at all.
+ */
+#define DENTRY_HT_NR_LOCKS  1024
+#define DENTRY_HT_MIN_SHIFT 10
+#define DENTRY_HT_MAX_SHIFT 22
+/* One bucket per this many pages of memory, at boot */
+#define DENTRY_HT_PAGES_PER_BUCKET 4
+/* Grow when we average more than this many entries per bucket */
+#define DENTRY_HT_MAX_LOAD 2UL
+
+struct dentry_hashtable
+{
+    unsigned int shift;
+    struct list_head buckets[];
+};
+
+static dentry_hashtable *dentry_ht;
+static rwslock dentry_ht_locks[DENTRY_HT_NR_LOCKS];
+static unsigned long dentry_ht_nr_entries;
+static mutex dentry_ht_resize_lock;
+
+seqlock_t dentry_rename_lock;
+
+static size_t dentry_ht_pages(unsigned int shift)
+{
+    return vm_size_to_pages(sizeof(dentry_hashtable) + (sizeof(list_head) << shift));
+}
+
+static dentry_hashtable *dentry_ht_alloc(unsigned int shift)
+{
+    auto ht = (dentry_hashtable *) vmalloc(dentry_ht_pages(shift), VM_TYPE_REGULAR,
+                                           VM_READ | VM_WRITE, GFP_KERNEL);
+    if (!ht)
+        return nullptr;
+
+    ht->shift = shift;
+    for (size_t i = 0; i < (1UL << shift); i++)
+        INIT_LIST_HEAD(&ht->buckets[i]);
+    return ht;
+}
+
+static inline rwslock &dentry_ht_lock(fnv_hash_t hash)
+{
+    return dentry_ht_locks[hash & (DENTRY_HT_NR_LOCKS - 1)];
+}
+
+/* Must hold the bucket's lock stripe, or be inside an RCU read-side section */
+static inline list_head *dentry_ht_bucket(dentry_hashtable *ht, fnv_hash_t hash)
+{
+    return &ht->buckets[hash & ((1UL << ht->shift) - 1)];
+}
+
+/**
+ * @brief Double the size of the dcache's hashtable, if it's too loaded.
+ * Called from lookup paths, without any spinlocks held, since we need to allocate and sleep.
+ *
+ */
+static void dentry_ht_maybe_grow()
+{
+    auto ht = __atomic_load_n(&dentry_ht, __ATOMIC_RELAXED);
+    if (ht->shift == DENTRY_HT_MAX_SHIFT ||
+        __atomic_load_n(&dentry_ht_nr_entries, __ATOMIC_RELAXED) <=
+            (DENTRY_HT_MAX_LOAD << ht->shift))
+        return;
+
+    /* Someone else is already on it */
+    if (!mutex_trylock(&dentry_ht_resize_lock))
+        return;
+
+    ht = dentry_ht;
+    auto new_ht = dentry_ht_alloc(ht->shift + 1);
+    if (!new_ht)
+    {
+        mutex_unlock(&dentry_ht_resize_lock);
+        return;
+    }
+
+    for (auto &lock : dentry_ht_locks)
+        lock.lock_write();
+
+    /* Moving entries over sends RCU walkers standing on them into the new table; they notice it
+     * through the rename lock and fall back to ref-walk.
+     */
+    write_seqlock(&dentry_rename_lock);
+
+    for (size_t i = 0; i < (1UL << ht->shift); i++)
+    {
+        list_for_every_safe (&ht->buckets[i])
+        {
+            dentry *d = container_of(l, dentry, d_cache_node);
+            auto hash = hash_dentry_fields(d->d_parent, {d->d_name, d->d_name_length});
+            list_remove(&d->d_cache_node);
+            list_add_tail(&d->d_cache_node, dentry_ht_bucket(new_ht, hash));
+        }
+    }
+
+    rcu_assign_pointer(dentry_ht, new_ht);
+
+    write_sequnlock(&dentry_rename_lock);
+
+    for (auto &lock : dentry_ht_locks)
+        lock.unlock_write();
+
+    /* We're stalling a lookup, don't wait for every CPU to context switch */
+    synchronize_rcu_expedited();
+    vfree(ht, dentry_ht_pages(ht->shift));
+
+    mutex_unlock(&dentry_ht_resize_lock);
+}
 
 [[gnu::always_inline]] static inline bool dentry_compare_name(dentry *dent,
                                                               std::string_view &to_cmp)
@@ -59,8 +166,7 @@ dentry *dentry_open_from_cache_unlocked(dentry *dent, std::string_view name)
 {
     auto namehash = fnv_hash(name.data(), name.length());
     auto hash = hash_dentry_fields(dent, name);
-    auto index = dentry_ht.get_hashtable_index(hash);
-    auto list = dentry_ht.get_hashtable(index);
+    auto list = dentry_ht_bucket(dentry_ht, hash);
 
     list_for_every (list)
     {
@@ -84,28 +190,102 @@ dentry *dentry_open_from_cache_unlocked(dentry *dent, std::string_view name)
 dentry *dentry_open_from_cache(dentry *dent, std::string_view name)
 {
     auto hash = hash_dentry_fields(dent, name);
-    auto index = dentry_ht.get_hashtable_index(hash);
-    scoped_rwslock<rw_lock::read> g{dentry_ht_locks[index]};
+    scoped_rwslock<rw_lock::read> g{dentry_ht_lock(hash)};
 
     return dentry_open_from_cache_unlocked(dent, name);
 }
 
+dentry *dentry_lookup_rcu(dentry *dir, std::string_view name, unsigned int *seqp)
+{
+    const auto namehash = fnv_hash(name.data(), name.length());
+    const auto hash = hash_dentry_fields(dir, name);
+    const unsigned int rseq = read_seqbegin(&dentry_rename_lock);
+    const auto head = dentry_ht_bucket(rcu_dereference(dentry_ht), hash);
+
+    for (list_head *l = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE); l != head;
+         l = __atomic_load_n(&l->next, __ATOMIC_ACQUIRE))
+    {
+        /* If the entry we were standing on got moved to another bucket, we might never see our
+         * list head again. Bail before touching it.
+         */
+        if (read_seqretry(&dentry_rename_lock, rseq))
+            return nullptr;
+
+        dentry *d = container_of(l, dentry, d_cache_node);
+
+        if (d->d_parent != dir || d->d_name_hash != namehash)
+            continue;
+
+        const unsigned int seq = read_seqcount_begin(&d->d_seq);
+        if (d->d_parent != dir || !dentry_compare_name(d, name))
+            continue;
+
+        if (read_seqcount_retry(&d->d_seq, seq))
+            return nullptr;
+
+        *seqp = seq;
+        return d;
+    }
+
+    return nullptr;
+}
+
+bool dentry_tryget(dentry *d)
+{
+    unsigned long ref = __atomic_load_n(&d->d_ref, __ATOMIC_RELAXED);
+
+    do
+    {
+        if (ref == 0)
+            return false;
+    } while (!__atomic_compare_exchange_n(&d->d_ref, &ref, ref + 1, false, __ATOMIC_ACQUIRE,
+                                          __ATOMIC_RELAXED));
+
+    return true;
+}
+
 void dentry_remove_from_cache(dentry *dent, dentry *parent)
 {
     auto hash = hash_dentry_fields(parent, std::string_view{dent->d_name, dent->d_name_length});
-    auto index = dentry_ht.get_hashtable_index(hash);
-    scoped_rwslock<rw_lock::write> g{dentry_ht_locks[index]};
+    scoped_rwslock<rw_lock::write> g{dentry_ht_lock(hash)};
 
-    list_remove(&dent->d_cache_node);
+    list_remove_rcu(&dent->d_cache_node);
+    __atomic_sub_fetch(&dentry_ht_nr_entries, 1, __ATOMIC_RELAXED);
 }
 
 static void dentry_add_to_cache(dentry *dent, dentry *parent)
 {
     auto hash = hash_dentry_fields(parent, std::string_view{dent->d_name, dent->d_name_length});
-    auto index = dentry_ht.get_hashtable_index(hash);
-    scoped_rwslock<rw_lock::write> g{dentry_ht_locks[index]};
+    scoped_rwslock<rw_lock::write> g{dentry_ht_lock(hash)};
+
+    list_add_tail_rcu(&dent->d_cache_node, dentry_ht_bucket(dentry_ht, hash));
+    __atomic_add_fetch(&dentry_ht_nr_entries, 1, __ATOMIC_RELAXED);
+}
+
+/* Names too long to be inlined are allocated with an rcu_head in front, since RCU walkers might
+ * still be comparing against the old name after a rename.
+ */
+struct dentry_external_name
+{
+    struct rcu_head rcu;
+    char name[];
+};
 
-    list_add_tail(&dent->d_cache_node, dentry_ht.get_hashtable(index));
+static char *dentry_alloc_name(const char *name, size_t length)
+{
+    auto ext = (dentry_external_name *) malloc(sizeof(dentry_external_name) + length + 1);
+    if (!ext)
+        return nullptr;
+    memcpy(ext->name, name, length + 1);
+    return ext->name;
+}
+
+static void dentry_free_name_rcu(char *name)
+{
+    auto ext = container_of(name, dentry_external_name, name);
+    call_rcu(&ext->rcu, [](struct rcu_head *head) {
+        free(container_of(head, dentry_external_name, rcu));
+    });
 }
 
 void dentry_get(dentry *d)
@@ -139,13 +319,16 @@ void dentry_destroy(dentry *d)
 
     // printk("Dentry %s dead\n", d->d_name);
 
-    if (d->d_name_length > INLINE_NAME_MAX)
-    {
-        free((void *) d->d_name);
-    }
+    /* RCU walkers might still be looking at us */
+    call_rcu(&d->d_rcu, [](struct rcu_head *head) {
+        dentry *dead = container_of(head, dentry, d_rcu);
+
+        if (dead->d_name != dead->d_inline_name)
+            free(container_of(dead->d_name, dentry_external_name, name));
 
-    d->~dentry();
-    kmem_cache_free(dentry_cache, d);
+        dead->~dentry();
+        kmem_cache_free(dentry_cache, dead);
+    });
 }
 
 /**
@@ -185,6 +368,9 @@ void dentry_kill_unlocked(dentry *entry)
 {
     assert(entry->d_ref == 1);
 
+    /* Unhash it while d_parent still matches the hash */
+    dentry_remove_from_cache(entry, entry->d_parent);
+
     if (entry->d_parent)
     {
         list_remove(&entry->d_parent_dir_node);
@@ -192,8 +378,6 @@ void dentry_kill_unlocked(dentry *entry)
         entry->d_parent = nullptr;
     }
 
-    dentry_remove_from_cache(entry, entry->d_parent);
-
     dentry_destroy(entry);
 }
 
@@ -214,13 +398,13 @@ dentry *dentry_create(const char *name, inode *inode, dentry *parent)
 
     size_t name_length = strlen(name);
 
-    if (name_length <= INLINE_NAME_MAX)
+    if (name_length < INLINE_NAME_MAX)
     {
         strlcpy(new_dentry->d_name, name, INLINE_NAME_MAX);
     }
     else
     {
-        char *dname = (char *) memdup((void *) name, name_length + 1);
+        char *dname = dentry_alloc_name(name, name_length);
         if (!dname)
         {
             kmem_cache_free(dentry_cache, new_dentry);
@@ -241,14 +425,19 @@ dentry *dentry_create(const char *name, inode *inode, dentry *parent)
 
     if (parent) [[likely]]
     {
+        new_dentry->d_dir_offset =
+            __atomic_fetch_add(&parent->d_next_dir_offset, 1, __ATOMIC_RELAXED);
         list_add_tail(&new_dentry->d_parent_dir_node, &parent->d_children_head);
         dentry_get(parent);
     }
 
     INIT_LIST_HEAD(&new_dentry->d_children_head);
+    /* 0 and 1 are . and .. */
+    new_dentry->d_next_dir_offset = 2;
 
     new_dentry->d_mount_dentry = nullptr;
     new_dentry->d_flags = 0;
+    seqcount_init(&new_dentry->d_seq);
 
     return new_dentry;
 }
@@ -278,10 +467,8 @@ expected<dentry *, int> __dentry_create_pending_lookup(const char *name, inode *
                                                        bool check_existance)
 {
     auto hash = hash_dentry_fields(parent, name);
-    auto index = dentry_ht.get_hashtable_index(hash);
     scoped_rwslock<rw_lock::write> g2{parent->d_lock};
-    scoped_rwslock<rw_lock::write> g{dentry_ht_locks[index]};
-    auto list = dentry_ht.get_hashtable(index);
+    scoped_rwslock<rw_lock::write> g{dentry_ht_lock(hash)};
 
     auto dent = dentry_open_from_cache_unlocked(parent, std::string_view(name));
 
@@ -303,14 +490,17 @@ expected<dentry *, int> __dentry_create_pending_lookup(const char *name, inode *
 
     d->d_flags |= DENTRY_FLAG_PENDING;
 
-    list_add_tail(&d->d_cache_node, list);
+    list_add_tail_rcu(&d->d_cache_node, dentry_ht_bucket(dentry_ht, hash));
+    __atomic_add_fetch(&dentry_ht_nr_entries, 1, __ATOMIC_RELAXED);
     return d;
 }
 
 expected<dentry *, int> dentry_create_pending_lookup(const char *name, inode *ino, dentry *parent,
                                                      bool check_existance)
 {
-    return __dentry_create_pending_lookup(name, ino, parent, check_existance);
+    auto ex = __dentry_create_pending_lookup(name, ino, parent, check_existance);
+    dentry_ht_maybe_grow();
+    return ex;
 }
 
 dentry *__dentry_try_to_open(std::string_view name, dentry *dir, bool lock_ino)
@@ -339,6 +529,8 @@ dentry *__dentry_try_to_open(std::string_view name, dentry *dir, bool lock_ino)
     if (ex.has_error())
         return errno = -ex.error(), nullptr;
 
+    dentry_ht_maybe_grow();
+
     auto dent = ex.value();
 
     if (!(dent->d_flags & DENTRY_FLAG_PENDING))
@@ -550,6 +742,19 @@ void dentry_init()
 {
     dentry_cache = kmem_cache_create("dentry", sizeof(dentry), 0, KMEM_CACHE_HWALIGN, nullptr);
     CHECK(dentry_cache != nullptr);
+
+    struct memstat stat;
+    page_get_stats(&stat);
+
+    unsigned int shift = ilog2(stat.total_pages / DENTRY_HT_PAGES_PER_BUCKET | 1);
+    if (shift < DENTRY_HT_MIN_SHIFT)
+        shift = DENTRY_HT_MIN_SHIFT;
+    if (shift > DENTRY_HT_MAX_SHIFT)
+        shift = DENTRY_HT_MAX_SHIFT;
+
+    dentry_ht = dentry_ht_alloc(shift);
+    CHECK(dentry_ht != nullptr);
+    seqlock_init(&dentry_rename_lock);
 }
 
 struct path_element
@@ -638,9 +843,13 @@ void dentry_do_unlink(dentry *entry)
 {
     /* Perform the actual unlink, by write-locking, nulling d_parent */
     entry->d_lock.lock_write();
+    write_seqcount_begin(&entry->d_seq);
 
     auto parent = entry->d_parent;
 
+    /* Unhash it while d_parent still matches the hash */
+    dentry_remove_from_cache(entry, parent);
+
     entry->d_parent = nullptr;
 
     inode_dec_nlink(entry->d_inode);
@@ -653,8 +862,7 @@ void dentry_do_unlink(dentry *entry)
         inode_dec_nlink(entry->d_inode);
     }
 
-    dentry_remove_from_cache(entry, parent);
-
+    write_seqcount_end(&entry->d_seq);
     entry->d_lock.unlock_write();
 
     // We can do this because we're holding the parent dir's lock
@@ -691,10 +899,20 @@ void dentry_move(dentry *target, dentry *new_parent)
 {
     list_remove(&target->d_parent_dir_node);
 
+    /* Keep new_parent's children sorted by offset */
+    target->d_dir_offset = __atomic_fetch_add(&new_parent->d_next_dir_offset, 1, __ATOMIC_RELAXED);
     list_add_tail(&target->d_parent_dir_node, &new_parent->d_children_head);
 
     auto old = target->d_parent;
+
+    /* Rehash it under the new parent */
+    write_seqlock(&dentry_rename_lock);
+    write_seqcount_begin(&target->d_seq);
+    dentry_remove_from_cache(target, old);
     target->d_parent = new_parent;
+    dentry_add_to_cache(target, new_parent);
+    write_seqcount_end(&target->d_seq);
+    write_sequnlock(&dentry_rename_lock);
 
     if (dentry_is_dir(target))
         inode_dec_nlink(old->d_inode);
@@ -705,42 +923,114 @@ void dentry_move(dentry *target, dentry *new_parent)
 void dentry_rename(dentry *dent, const char *name)
 {
     size_t name_length = strlen(name);
+    char *dname = nullptr;
 
-    if (name_length <= INLINE_NAME_MAX)
-    {
-        strlcpy(dent->d_name, name, INLINE_NAME_MAX);
-
-        /* It's in this exact order so we don't accidentally touch free'd memory or
-         * an invalid d_name that resulted from a non-filled inline d_name.
-         */
-        if (dent->d_name != dent->d_inline_name)
-        {
-            auto old = dent->d_name;
-            dent->d_name = dent->d_inline_name;
-            free(old);
-        }
-    }
-    else
+    if (name_length >= INLINE_NAME_MAX)
     {
-        char *dname = (char *) memdup(name, name_length + 1);
+        dname = dentry_alloc_name(name, name_length);
         /* TODO: Ugh, how do I handle this? */
         assert(dname != nullptr);
+    }
 
-        auto old = dent->d_name;
+    write_seqlock(&dentry_rename_lock);
+    write_seqcount_begin(&dent->d_seq);
 
-        dent->d_name = dname;
+    dentry_remove_from_cache(dent, dent->d_parent);
 
-        if (old != dent->d_inline_name)
-        {
-            free(old);
-        }
+    /* The old name may still be in use by RCU walkers, so it's only freed after a grace period */
+    auto old = dent->d_name;
+
+    if (dname)
+        dent->d_name = dname;
+    else
+    {
+        strlcpy(dent->d_inline_name, name, INLINE_NAME_MAX);
+        dent->d_name = dent->d_inline_name;
     }
 
+    if (old != dent->d_inline_name)
+        dentry_free_name_rcu(old);
+
     dent->d_name_length = name_length;
     dent->d_name_hash = fnv_hash(dent->d_name, dent->d_name_length);
 
-    dentry_remove_from_cache(dent, dent->d_parent);
     dentry_add_to_cache(dent, dent->d_parent);
+
+    write_seqcount_end(&dent->d_seq);
+    write_sequnlock(&dentry_rename_lock);
+}
+
+/* Children get monotonically increasing offsets as they're linked in, so offsets stay valid
+ * across concurrent creates and unlinks. The last entry we returned is kept in the file as a
+ * cursor, which makes reading a directory sequentially O(1) per entry instead of O(n).
+ */
+off_t dcache_getdirent(struct dirent *buf, off_t off, struct file *file)
+{
+    auto dent = file->f_dentry;
+
+    buf->d_off = off;
+
+    if (off == 0)
+    {
+        put_dentry_to_dirent(buf, dent, ".");
+        return 1;
+    }
+
+    if (off == 1)
+    {
+        auto parent = dentry_parent(dent);
+        if (!parent) // We're root, so use ourselves
+            parent = dent;
+        put_dentry_to_dirent(buf, parent, "..");
+        if (parent != dent)
+            dentry_put(parent);
+        return 2;
+    }
+
+    auto cursor = (dentry *) file->private_data;
+    dentry *found = nullptr;
+
+    {
+        scoped_rwslock<rw_lock::read> g{dent->d_lock};
+        const auto head = &dent->d_children_head;
+        auto l = head->next;
+
+        /* Pick up where we left off, if the cursor is still linked in */
+        if (cursor && cursor->d_parent == dent && off >= cursor->d_dir_offset)
+            l = &cursor->d_parent_dir_node;
+
+        for (; l != head; l = l->next)
+        {
+            dentry *d = container_of(l, dentry, d_parent_dir_node);
+
+            if (d->d_dir_offset < off || !d->d_inode ||
+                d->d_flags & (DENTRY_FLAG_PENDING | DENTRY_FLAG_FAILED))
+                continue;
+
+            found = d;
+            break;
+        }
+
+        if (!found)
+            return 0;
+
+        dentry_get(found);
+        put_dentry_to_dirent(buf, found);
+    }
+
+    /* Drop the old cursor outside d_lock, since putting it may kill it */
+    file->private_data = found;
+    if (cursor)
+        dentry_put(cursor);
+
+    return found->d_dir_offset + 1;
+}
+
+void dcache_readdir_release(struct file *file)
+{
+    if (file->private_data)
+        dentry_put((dentry *) file->private_data);
+    file->private_data = nullptr;
 }
 
 bool dentry_is_empty(dentry *dir)
@@ -73,7 +73,9 @@ void ext2_superblock::free_inode(ext2_inode_no inode)
     block_groups[bg_no].free_inode(inode, this);
 }
 
-ext2_block_no ext2_superblock::try_allocate_block_from_bg(ext2_block_group_no nr)
+ext2_block_no ext2_superblock::try_allocate_from_bg(ext2_block_group_no nr, uint32_t goal,
+                                                    uint32_t count, ext2_rsv_window *rsv,
+                                                    bool use_windows, uint32_t *nr_out)
 {
     if (nr >= number_of_block_groups)
     {
@@ -85,7 +87,11 @@ ext2_block_no ext2_superblock::try_allocate_block_from_bg(ext2_block_group_no nr
     if (bg.get_bgd()->unallocated_blocks_in_group == 0)
         return EXT2_ERR_INV_BLOCK;
 
-    auto res = bg.allocate_block(this);
+    /* A window lives in a single block group, so drop the one we have somewhere else */
+    if (rsv && use_windows && rsv->bg != EXT2_RSV_NO_BG && rsv->bg != nr)
+        release_rsv(rsv);
+
+    auto res = bg.allocate_blocks(this, goal, count, rsv, use_windows, nr_out);
 
 #if 0
 	printk("Allocated block %u from bg %u\n", res.value_or(EXT2_ERR_INV_BLOCK), nr);
@@ -94,12 +100,16 @@ ext2_block_no ext2_superblock::try_allocate_block_from_bg(ext2_block_group_no nr
 }
 
 /**
- * @brief Allocates a block, taking into account the preferred block group
+ * @brief Allocates a run of contiguous blocks, as close to the goal as possible
  *
- * @param preferred The preferred block group. If -1, no preferrence
- * @return Block number, or EXT2_ERR_INV_BLOCK if we couldn't allocate one.
+ * @param goal Block we'd like to get
+ * @param count Max number of blocks to allocate
+ * @param rsv Reservation window of the inode we're allocating for, or nullptr
+ * @param nr_out Number of blocks allocated (at least 1, on success)
+ * @return First block of the run, or EXT2_ERR_INV_BLOCK if we couldn't allocate any.
  */
-ext2_block_no ext2_superblock::allocate_block(ext2_block_group_no preferred)
+ext2_block_no ext2_superblock::allocate_blocks(ext2_block_no goal, uint32_t count,
+                                               ext2_rsv_window *rsv, uint32_t *nr_out)
 {
     if (sb->s_free_blocks_count == 0) [[unlikely]]
         return EXT2_ERR_INV_BLOCK;
@@ -116,41 +126,85 @@ ext2_block_no ext2_superblock::allocate_block(ext2_block_group_no preferred)
             return EXT2_ERR_INV_BLOCK;
     }
 
-    if (preferred == (ext2_block_group_no) -1)
-        preferred = 0;
+    ext2_block_group_no preferred = 0;
+    uint32_t goal_bit = 0;
+
+    if (goal >= first_data_block() && goal < total_blocks)
+    {
+        preferred = (goal - first_data_block()) / blocks_per_block_group;
+        goal_bit = (goal - first_data_block()) % blocks_per_block_group;
+    }
 
     /* Our algorithm works like this: We take the preferred block group, and then we'll
      * iterate the block groups inside-out, trying them according to the distance.
+     * The first round respects everyone's reservation windows. If it fails, we're close to
+     * running out of space, so the second one ignores them.
      */
 
-    auto max_block_group = this->number_of_block_groups - 1;
-    int dist_start = preferred;
-    int dist_end = max_block_group - preferred;
+    for (int round = 0; round < 2; round++)
+    {
+        const bool use_windows = round == 0;
+        auto max_block_group = this->number_of_block_groups - 1;
+        int dist_start = preferred;
+        int dist_end = max_block_group - preferred;
 
-    auto max_distance = cul::max(dist_start, dist_end);
-    ext2_block_no block = EXT2_ERR_INV_BLOCK;
+        auto max_distance = cul::max(dist_start, dist_end);
+        ext2_block_no block = EXT2_ERR_INV_BLOCK;
 
-    for (int dist = 0; dist <= max_distance; dist++, dist_start--, dist_end--)
-    {
-        /* We're testing against dist here because if dist is zero(opening round)
-         * we'll only need to try once, since both tries will point to the same block group.
-         */
-        if (dist && dist_start >= 0)
-            block = try_allocate_block_from_bg(preferred - dist);
+        for (int dist = 0; dist <= max_distance; dist++, dist_start--, dist_end--)
+        {
+            /* We're testing against dist here because if dist is zero(opening round)
+             * we'll only need to try once, since both tries will point to the same block group.
+             */
+            if (dist && dist_start >= 0)
+                block = try_allocate_from_bg(preferred - dist, 0, count, rsv, use_windows, nr_out);
 
-        if (block != EXT2_ERR_INV_BLOCK)
-            return block;
+            if (block != EXT2_ERR_INV_BLOCK)
+                return block;
 
-        if (dist_end >= 0)
-            block = try_allocate_block_from_bg(preferred + dist);
+            if (dist_end >= 0)
+            {
+                block = try_allocate_from_bg(preferred + dist, dist ? 0 : goal_bit, count, rsv,
+                                             use_windows, nr_out);
+            }
 
-        if (block != EXT2_ERR_INV_BLOCK)
-            return block;
+            if (block != EXT2_ERR_INV_BLOCK)
+                return block;
+        }
     }
 
     return EXT2_ERR_INV_BLOCK;
 }
 
+/**
+ * @brief Allocates a block, taking into account the preferred block group
+ *
+ * @param preferred The preferred block group. If -1, no preferrence
+ * @return Block number, or EXT2_ERR_INV_BLOCK if we couldn't allocate one.
+ */
+ext2_block_no ext2_superblock::allocate_block(ext2_block_group_no preferred)
+{
+    if (preferred == (ext2_block_group_no) -1)
+        preferred = 0;
+
+    uint32_t nr;
+    return allocate_blocks(preferred * blocks_per_block_group + first_data_block(), 1, nullptr,
+                           &nr);
+}
+
+/**
+ * @brief Drops a reservation window, if there's one
+ *
+ * @param rsv The window
+ */
+void ext2_superblock::release_rsv(ext2_rsv_window *rsv)
+{
+    const ext2_block_group_no bg = rsv->bg;
+
+    if (bg != EXT2_RSV_NO_BG)
+        block_groups[bg].release_rsv(rsv);
+}
+
 /**
  * @brief Frees a block
  *
@@ -74,7 +74,126 @@ expected<ext2_inode_no, int> ext2_block_group::allocate_inode(ext2_superblock *s
     return nr * sb->inodes_per_block_group + bit + 1;
 }
 
-expected<ext2_inode_no, int> ext2_block_group::allocate_block(ext2_superblock *sb)
+static constexpr auto bits_per_long = WORD_SIZE * CHAR_BIT;
+
+static inline bool ext2_test_bit(const unsigned long *bitmap, uint32_t bit)
+{
+    return bitmap[bit / bits_per_long] & (1UL << (bit % bits_per_long));
+}
+
+/* Find the first clear bit in [start, end), or end if there's none */
+static uint32_t ext2_find_next_zero(const unsigned long *bitmap, uint32_t start, uint32_t end)
+{
+    uint32_t bit = start;
+
+    while (bit < end)
+    {
+        unsigned long word = ~bitmap[bit / bits_per_long] & (~0UL << (bit % bits_per_long));
+        bit &= ~(bits_per_long - 1);
+
+        if (word)
+        {
+            bit += __builtin_ctzl(word);
+            return bit < end ? bit : end;
+        }
+
+        bit += bits_per_long;
+    }
+
+    return end;
+}
+
+ext2_rsv_window *ext2_block_group::find_rsv(uint32_t bit, const ext2_rsv_window *self)
+{
+    list_for_every (&rsv_windows)
+    {
+        auto w = container_of(l, ext2_rsv_window, list_node);
+        if (w->start > bit)
+            break;
+        if (w != self && bit < w->end)
+            return w;
+    }
+
+    return nullptr;
+}
+
+/* Find a free bit in [start, end) that's not in someone else's window, or end if there's none */
+uint32_t ext2_block_group::find_free_bit(const unsigned long *bitmap, uint32_t start,
+                                         uint32_t end, const ext2_rsv_window *self,
+                                         bool use_windows)
+{
+    uint32_t bit = start;
+
+    while ((bit = ext2_find_next_zero(bitmap, bit, end)) < end)
+    {
+        ext2_rsv_window *w = use_windows ? find_rsv(bit, self) : nullptr;
+        if (!w)
+            return bit;
+        bit = w->end;
+    }
+
+    return end;
+}
+
+/* Same as above, but wraps around to the start of the block group */
+uint32_t ext2_block_group::find_free_bit_wrap(const unsigned long *bitmap, uint32_t goal,
+                                              uint32_t end, const ext2_rsv_window *self,
+                                              bool use_windows)
+{
+    uint32_t bit = find_free_bit(bitmap, goal, end, self, use_windows);
+
+    if (bit == end && goal != 0)
+    {
+        bit = find_free_bit(bitmap, 0, goal, self, use_windows);
+        if (bit == goal)
+            bit = end;
+    }
+
+    return bit;
+}
+
+/* Find where the next window after bit (that's not ours) starts, capped at end */
+uint32_t ext2_block_group::next_rsv_start(uint32_t bit, uint32_t end, const ext2_rsv_window *self)
+{
+    list_for_every (&rsv_windows)
+    {
+        auto w = container_of(l, ext2_rsv_window, list_node);
+        if (w != self && w->start > bit)
+            return w->start < end ? w->start : end;
+    }
+
+    return end;
+}
+
+void ext2_block_group::insert_rsv(ext2_rsv_window *rsv)
+{
+    list_for_every (&rsv_windows)
+    {
+        auto w = container_of(l, ext2_rsv_window, list_node);
+        if (w->start > rsv->start)
+        {
+            list_add_tail(&rsv->list_node, l);
+            return;
+        }
+    }
+
+    list_add_tail(&rsv->list_node, &rsv_windows);
+}
+
+void ext2_block_group::release_rsv(ext2_rsv_window *rsv)
+{
+    scoped_mutex g{block_bitmap_lock};
+
+    if (rsv->bg == nr)
+    {
+        list_remove(&rsv->list_node);
+        rsv->bg = EXT2_RSV_NO_BG;
+    }
+}
+
+expected<ext2_block_no, int> ext2_block_group::allocate_blocks(ext2_superblock *sb, uint32_t goal,
+                                                               uint32_t count, ext2_rsv_window *rsv,
+                                                               bool use_windows, uint32_t *nr_out)
 {
     scoped_mutex g{block_bitmap_lock};
 
@@ -88,30 +207,76 @@ expected<ext2_inode_no, int> ext2_block_group::allocate_block(ext2_superblock *s
     }
 
     auto bitmap = static_cast<unsigned long *>(block_buf_data(buf));
+    const uint32_t nbits = sb->blocks_in_group(nr);
+    uint32_t bit = nbits;
+    uint32_t limit = nbits;
 
-    auto bit = ext2_scan_zero(bitmap, sb->s_block_size);
+    if (goal >= nbits)
+        goal = 0;
 
-    if (bit == SCAN_ZERO_NOT_FOUND)
-        return unexpected{-ENOSPC};
+    if (rsv && use_windows)
+    {
+        /* Try our own window first */
+        if (rsv->bg == nr && goal < rsv->end)
+        {
+            bit = ext2_find_next_zero(bitmap, goal > rsv->start ? goal : rsv->start, rsv->end);
+            limit = rsv->end;
+        }
+
+        if (bit >= limit)
+        {
+            /* Grab a new window. If we ran past the end of the old one, the file is most likely
+             * growing sequentially, so make the next one bigger.
+             */
+            if (rsv->bg == nr)
+            {
+                if (goal >= rsv->start && rsv->goal_size < EXT2_RSV_MAX_BLOCKS)
+                    rsv->goal_size *= 2;
+                list_remove(&rsv->list_node);
+                rsv->bg = EXT2_RSV_NO_BG;
+            }
+
+            bit = find_free_bit_wrap(bitmap, goal, nbits, rsv, true);
+            if (bit == nbits)
+                return unexpected{-ENOSPC};
+
+            limit = bit + rsv->goal_size < nbits ? bit + rsv->goal_size : nbits;
+            limit = next_rsv_start(bit, limit, rsv);
+
+            rsv->bg = nr;
+            rsv->start = bit;
+            rsv->end = limit;
+            insert_rsv(rsv);
+        }
+    }
+    else
+    {
+        bit = find_free_bit_wrap(bitmap, goal, nbits, rsv, use_windows);
+        if (bit == nbits)
+            return unexpected{-ENOSPC};
 
-    static constexpr auto bits_per_long = WORD_SIZE * CHAR_BIT;
+        /* Don't run into someone else's window */
+        if (use_windows)
+            limit = next_rsv_start(bit, nbits, rsv);
+    }
 
-    /* Set the corresponding bit */
-#if 0
-	printk("Got bit %lu\n", bit);
-	printk("setting %lu on word %lu\n", (bit % bits_per_long), bit / bits_per_long);
-#endif
+    /* Take as many free blocks as we can, starting at bit */
+    uint32_t nr_blocks = 0;
 
-    bitmap[bit / bits_per_long] |= (1UL << (bit % bits_per_long));
+    while (nr_blocks < count && bit + nr_blocks < limit && !ext2_test_bit(bitmap, bit + nr_blocks))
+    {
+        const uint32_t b = bit + nr_blocks++;
+        bitmap[b / bits_per_long] |= (1UL << (b % bits_per_long));
+    }
 
-    assert(ext2_scan_zero(bitmap, sb->s_block_size) != bit);
+    DCHECK(nr_blocks > 0);
 
     /* Change the block group and superblock
        structures in order to reflect it */
 
-    dec_unallocated_blocks();
+    dec_unallocated_blocks(nr_blocks);
 
-    EXT2_ATOMIC_SUB(sb->sb->s_free_blocks_count, 1);
+    EXT2_ATOMIC_SUB(sb->sb->s_free_blocks_count, nr_blocks);
     /* Actually register the changes on disk */
     /* We give the bitmap priority here,
      * since there can be a disk failure or a
@@ -121,6 +286,7 @@ expected<ext2_inode_no, int> ext2_block_group::allocate_block(ext2_superblock *s
     block_buf_dirty(buf);
     ext2_dirty_sb(sb);
 
+    *nr_out = nr_blocks;
     return nr * sb->blocks_per_block_group + bit + sb->first_data_block();
 }
 
@@ -0,0 +1,1130 @@
+/*
+ * Copyright (c) 2023 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <onyx/log.h>
+#include <onyx/pagecache.h>
+#include <onyx/types.h>
+#include <onyx/vfs.h>
+#include <onyx/vm.h>
+
+#include "ext2.h"
+
+/* Hashed directory indexes (htree). The first block of an indexed directory holds "." and "..",
+ * where ".." spans the whole block and hides the index root behind its name. The root is a sorted
+ * array of (hash, block) pairs; with one level of indirection, it points to index nodes instead,
+ * which look like a single empty dirent spanning the block to anyone walking the directory
+ * linearly. The blocks at the bottom are regular directory blocks, each holding the names whose
+ * hashes fall in its range.
+ *
+ * The on-disk format is shared with ext3/4, so we can use directories indexed by them (and they
+ * can use ours). Index blocks past the first are always appended to the directory, never
+ * reclaimed.
+ */
+
+struct dx_fake_dirent
+{
+    uint32_t inode;
+    uint16_t rec_len;
+    uint8_t name_len;
+    uint8_t file_type;
+};
+
+struct dx_root_info
+{
+    uint32_t reserved_zero;
+    uint8_t hash_version;
+    uint8_t info_length;
+    uint8_t indirect_levels;
+    uint8_t unused_flags;
+};
+
+struct dx_entry
+{
+    uint32_t hash;
+    uint32_t block;
+};
+
+/* Overlays the first dx_entry of every index block, whose hash is implicitly 0 */
+struct dx_countlimit
+{
+    uint16_t limit;
+    uint16_t count;
+};
+
+struct dx_root
+{
+    dx_fake_dirent dot;
+    char dot_name[4];
+    dx_fake_dirent dotdot;
+    char dotdot_name[4];
+    dx_root_info info;
+    dx_entry entries[];
+};
+
+struct dx_node
+{
+    dx_fake_dirent fake;
+    dx_entry entries[];
+};
+
+/* Only the low 28 bits of an index entry's block are the block number */
+#define DX_BLOCK_MASK 0x0fffffff
+
+/* Low bit of a hash in the index, set if the previous block holds names with the same hash */
+#define DX_HASH_CONTINUED 1
+
+#define DX_HASH_EOF 0x7fffffffU
+
+static const uint32_t dx_default_seed[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+
+struct dx_frame
+{
+    char *buf;
+    ext2_block_no block;
+    dx_entry *entries;
+    dx_entry *at;
+};
+
+struct dx_path
+{
+    dx_frame frames[EXT2_HTREE_MAX_LEVELS];
+    unsigned int nr_frames;
+    uint32_t hash;
+};
+
+static inline dx_countlimit *dx_countlimit_of(dx_entry *entries)
+{
+    return (dx_countlimit *) entries;
+}
+
+static inline unsigned int dx_root_limit(ext2_superblock *sb)
+{
+    return (sb->block_size - sizeof(dx_root)) / sizeof(dx_entry);
+}
+
+static inline unsigned int dx_node_limit(ext2_superblock *sb)
+{
+    return (sb->block_size - sizeof(dx_node)) / sizeof(dx_entry);
+}
+
+static void dx_str_to_hashbuf(const char *name, size_t len, uint32_t *buf, unsigned int nwords,
+                              bool is_signed)
+{
+    /* Words get padded with the length of what's left of the name, so that names that are
+     * prefixes of each other don't hash the same.
+     */
+    uint32_t pad = (uint32_t) len | ((uint32_t) len << 8);
+    pad |= pad << 16;
+
+    uint32_t val = pad;
+    if (len > nwords * 4)
+        len = nwords * 4;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        const int c = is_signed ? (int) (signed char) name[i] : (int) (unsigned char) name[i];
+        val = (uint32_t) c + (val << 8);
+        if (i % 4 == 3)
+        {
+            *buf++ = val;
+            val = pad;
+            nwords--;
+        }
+    }
+
+    if (nwords > 0)
+    {
+        *buf++ = val;
+        nwords--;
+    }
+
+    while (nwords-- > 0)
+        *buf++ = pad;
+}
+
+static uint32_t dx_legacy_hash(const char *name, size_t len, bool is_signed)
+{
+    uint32_t hash0 = 0x12a3fe2d;
+    uint32_t hash1 = 0x37abe8f9;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        const int c = is_signed ? (int) (signed char) name[i] : (int) (unsigned char) name[i];
+        uint32_t hash = hash1 + (hash0 ^ (uint32_t) (c * 7152373));
+        if (hash & 0x80000000)
+            hash -= 0x7fffffff;
+        hash1 = hash0;
+        hash0 = hash;
+    }
+
+    return hash0 << 1;
+}
+
+static inline uint32_t dx_rol32(uint32_t word, unsigned int shift)
+{
+    return (word << shift) | (word >> (32 - shift));
+}
+
+/* MD4 with the last round chopped off, as used by ext3 */
+static void dx_half_md4(uint32_t buf[4], const uint32_t in[8])
+{
+    static const uint8_t order[3][8] = {
+        {0, 1, 2, 3, 4, 5, 6, 7}, {1, 3, 5, 7, 0, 2, 4, 6}, {3, 7, 2, 6, 1, 5, 0, 4}};
+    static const uint8_t shifts[3][4] = {{3, 7, 11, 19}, {3, 5, 9, 13}, {3, 9, 11, 15}};
+    static const uint32_t round_k[3] = {0, 013240474631, 015666365641};
+    uint32_t v[4] = {buf[0], buf[1], buf[2], buf[3]};
+
+    for (unsigned int round = 0; round < 3; round++)
+    {
+        for (unsigned int i = 0; i < 8; i++)
+        {
+            /* Every step updates a, d, c, b (in that order) using the other three */
+            const unsigned int t = (4 - i) & 3;
+            const uint32_t x = v[(t + 1) & 3];
+            const uint32_t y = v[(t + 2) & 3];
+            const uint32_t z = v[(t + 3) & 3];
+            uint32_t f;
+
+            if (round == 0)
+                f = z ^ (x & (y ^ z));
+            else if (round == 1)
+                f = (x & y) + ((x ^ y) & z);
+            else
+                f = x ^ y ^ z;
+
+            v[t] += f + in[order[round][i]] + round_k[round];
+            v[t] = dx_rol32(v[t], shifts[round][i & 3]);
+        }
+    }
+
+    for (unsigned int i = 0; i < 4; i++)
+        buf[i] += v[i];
+}
+
+static void dx_tea(uint32_t buf[4], const uint32_t in[4])
+{
+    uint32_t sum = 0;
+    uint32_t b0 = buf[0];
+    uint32_t b1 = buf[1];
+
+    for (unsigned int i = 0; i < 16; i++)
+    {
+        sum += 0x9e3779b9;
+        b0 += ((b1 << 4) + in[0]) ^ (b1 + sum) ^ ((b1 >> 5) + in[1]);
+        b1 += ((b0 << 4) + in[2]) ^ (b0 + sum) ^ ((b0 >> 5) + in[3]);
+    }
+
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+/**
+ * @brief Hash a directory entry's name
+ *
+ * @param name Name
+ * @param len Length of the name
+ * @param version Hash version (EXT2_HASH_*)
+ * @param sb Superblock, for the hash seed
+ * @return The hash, with the continuation bit clear
+ */
+static uint32_t dx_hash(const char *name, size_t len, unsigned int version, ext2_superblock *sb)
+{
+    const uint32_t *seed = dx_default_seed;
+    uint32_t buf[4];
+    uint32_t in[8];
+    uint32_t hash;
+
+    const uint32_t *sb_seed = sb->sb->s_hash_seed;
+    if (sb_seed[0] | sb_seed[1] | sb_seed[2] | sb_seed[3])
+        seed = sb_seed;
+
+    memcpy(buf, seed, sizeof(buf));
+
+    switch (version)
+    {
+        case EXT2_HASH_LEGACY:
+        case EXT2_HASH_LEGACY_UNSIGNED:
+            hash = dx_legacy_hash(name, len, version == EXT2_HASH_LEGACY);
+            break;
+        case EXT2_HASH_HALF_MD4:
+        case EXT2_HASH_HALF_MD4_UNSIGNED:
+            for (size_t i = 0; i < len; i += 32)
+            {
+                dx_str_to_hashbuf(name + i, len - i, in, 8, version == EXT2_HASH_HALF_MD4);
+                dx_half_md4(buf, in);
+            }
+
+            hash = buf[1];
+            break;
+        case EXT2_HASH_TEA:
+        case EXT2_HASH_TEA_UNSIGNED:
+        default:
+            for (size_t i = 0; i < len; i += 16)
+            {
+                dx_str_to_hashbuf(name + i, len - i, in, 4, version == EXT2_HASH_TEA);
+                dx_tea(buf, in);
+            }
+
+            hash = buf[0];
+            break;
+    }
+
+    hash &= ~DX_HASH_CONTINUED;
+
+    /* This one is reserved for telldir/seekdir cookies */
+    if (hash == (DX_HASH_EOF << 1))
+        hash = (DX_HASH_EOF - 1) << 1;
+    return hash;
+}
+
+static int dx_read_block(inode *dir, ext2_block_no block, char *buf, ext2_superblock *sb)
+{
+    const size_t off = (size_t) block << sb->block_size_shift;
+    if (off >= dir->i_size)
+        return -EIO;
+
+    auto old = thread_change_addr_limit(VM_KERNEL_ADDR_LIMIT);
+    ssize_t st = file_read_cache(buf, sb->block_size, dir, off);
+    thread_change_addr_limit(old);
+
+    return st == (ssize_t) sb->block_size ? 0 : -EIO;
+}
+
+static int dx_write_block(inode *dir, ext2_block_no block, const char *buf, ext2_superblock *sb)
+{
+    const size_t off = (size_t) block << sb->block_size_shift;
+
+    auto old = thread_change_addr_limit(VM_KERNEL_ADDR_LIMIT);
+    ssize_t st = file_write_cache_unlocked((void *) buf, sb->block_size, dir, off);
+    thread_change_addr_limit(old);
+
+    return st == (ssize_t) sb->block_size ? 0 : -EIO;
+}
+
+static void dx_release(dx_path *path)
+{
+    for (unsigned int i = 0; i < path->nr_frames; i++)
+        free(path->frames[i].buf);
+    path->nr_frames = 0;
+}
+
+/**
+ * @brief Check if a directory is indexed (and we can use the index)
+ *
+ * @param dir Directory
+ * @param sb Superblock
+ * @return True if so, else false
+ */
+bool ext2_dir_is_indexed(inode *dir, ext2_superblock *sb)
+{
+    return sb->features_compat & EXT2_FEATURE_COMPAT_DIR_INDEX &&
+           ext2_get_inode_from_node(dir)->i_flags & EXT2_INDEX_FL;
+}
+
+static unsigned int dx_hash_version(const dx_root *root, ext2_superblock *sb)
+{
+    unsigned int version = root->info.hash_version;
+
+    /* Whether chars are signed used to depend on the architecture mkfs ran on. The superblock
+     * tells us which one this filesystem got, and signed is what x86 did.
+     */
+    if (version <= EXT2_HASH_TEA && sb->sb->s_flags & EXT2_FLAGS_UNSIGNED_HASH)
+        version += EXT2_HASH_LEGACY_UNSIGNED;
+    return version;
+}
+
+static dx_entry *dx_search(dx_entry *entries, uint32_t hash)
+{
+    const unsigned int count = dx_countlimit_of(entries)->count;
+    dx_entry *p = entries + 1;
+    dx_entry *q = entries + count - 1;
+
+    /* Find the last entry whose hash is <= ours. entries[0] covers everything below entries[1]. */
+    while (p <= q)
+    {
+        dx_entry *m = p + (q - p) / 2;
+        if (m->hash > hash)
+            q = m - 1;
+        else
+            p = m + 1;
+    }
+
+    return p - 1;
+}
+
+static int dx_check_entries(dx_entry *entries, unsigned int limit, ext2_superblock *sb)
+{
+    const dx_countlimit *cl = dx_countlimit_of(entries);
+    if (cl->limit != limit || cl->count == 0 || cl->count > cl->limit)
+    {
+        sb->error("Corrupted directory index (bad count/limit)");
+        return -EIO;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Walk the index down to the leaf that may hold \p name
+ *
+ * @param dir Directory
+ * @param name Name
+ * @param len Length of the name
+ * @param sb Superblock
+ * @param path Path to fill; on success, the caller needs to dx_release it
+ * @return 0 on success, -ENOTSUP if the index can't be used, negative error codes
+ */
+static int dx_probe(inode *dir, const char *name, size_t len, ext2_superblock *sb, dx_path *path)
+{
+    path->nr_frames = 0;
+
+    char *buf = (char *) malloc(sb->block_size);
+    if (!buf)
+        return -ENOMEM;
+
+    if (int st = dx_read_block(dir, 0, buf, sb); st < 0)
+    {
+        free(buf);
+        return st;
+    }
+
+    auto root = (dx_root *) buf;
+    if (root->info.reserved_zero || root->info.info_length != sizeof(dx_root_info) ||
+        root->info.hash_version > EXT2_HASH_TEA_UNSIGNED ||
+        root->info.indirect_levels >= EXT2_HTREE_MAX_LEVELS ||
+        root->dotdot.rec_len != sb->block_size - 12)
+    {
+        printk("ext2: Directory %lu has an unsupported index, falling back to linear search\n",
+               dir->i_inode);
+        /* Treat it as a linear directory from now on (in memory only, until it gets modified),
+         * so we don't keep tripping on the index (and warning about it) on every lookup.
+         */
+        ext2_get_inode_from_node(dir)->i_flags &= ~EXT2_INDEX_FL;
+        free(buf);
+        return -ENOTSUP;
+    }
+
+    const unsigned int levels = root->info.indirect_levels + 1;
+    path->hash = dx_hash(name, len, dx_hash_version(root, sb), sb);
+
+    dx_frame *frame = &path->frames[0];
+    frame->buf = buf;
+    frame->block = 0;
+    frame->entries = root->entries;
+    path->nr_frames = 1;
+
+    if (int st = dx_check_entries(frame->entries, dx_root_limit(sb), sb); st < 0)
+    {
+        dx_release(path);
+        return st;
+    }
+
+    frame->at = dx_search(frame->entries, path->hash);
+
+    while (path->nr_frames < levels)
+    {
+        const ext2_block_no block = frame->at->block & DX_BLOCK_MASK;
+
+        buf = (char *) malloc(sb->block_size);
+        if (!buf)
+        {
+            dx_release(path);
+            return -ENOMEM;
+        }
+
+        frame = &path->frames[path->nr_frames++];
+        frame->buf = buf;
+        frame->block = block;
+
+        auto node = (dx_node *) buf;
+        frame->entries = node->entries;
+
+        if (int st = dx_read_block(dir, block, buf, sb); st < 0)
+        {
+            dx_release(path);
+            return st;
+        }
+
+        if (node->fake.inode || node->fake.rec_len != sb->block_size)
+        {
+            sb->error("Corrupted directory index (bad node)");
+            dx_release(path);
+            return -EIO;
+        }
+
+        if (int st = dx_check_entries(frame->entries, dx_node_limit(sb), sb); st < 0)
+        {
+            dx_release(path);
+            return st;
+        }
+
+        frame->at = dx_search(frame->entries, path->hash);
+    }
+
+    return 0;
+}
+
+static inline ext2_block_no dx_leaf_block(dx_path *path)
+{
+    return path->frames[path->nr_frames - 1].at->block & DX_BLOCK_MASK;
+}
+
+/**
+ * @brief Move the path to the next leaf, if it may hold names with the same hash
+ *
+ * @param dir Directory
+ * @param path Path
+ * @param sb Superblock
+ * @return 1 if we moved, 0 if there are no more candidates, negative error codes
+ */
+static int dx_next_leaf(inode *dir, dx_path *path, ext2_superblock *sb)
+{
+    int level = path->nr_frames - 1;
+    dx_frame *frame = nullptr;
+
+    while (level >= 0)
+    {
+        frame = &path->frames[level];
+        if (frame->at + 1 < frame->entries + dx_countlimit_of(frame->entries)->count)
+            break;
+        level--;
+    }
+
+    if (level < 0)
+        return 0;
+
+    frame->at++;
+
+    const uint32_t next_hash = frame->at->hash;
+    if (!(next_hash & DX_HASH_CONTINUED) || (next_hash & ~DX_HASH_CONTINUED) != path->hash)
+        return 0;
+
+    /* Go down the leftmost side of the subtree */
+    for (unsigned int i = level + 1; i < path->nr_frames; i++)
+    {
+        frame = &path->frames[i];
+        frame->block = path->frames[i - 1].at->block & DX_BLOCK_MASK;
+
+        if (int st = dx_read_block(dir, frame->block, frame->buf, sb); st < 0)
+            return st;
+
+        if (int st = dx_check_entries(frame->entries, dx_node_limit(sb), sb); st < 0)
+            return st;
+
+        frame->at = frame->entries;
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Look for a name in a directory block
+ *
+ * @param buf Block
+ * @param name Name
+ * @param len Length of the name
+ * @param sb Superblock
+ * @return Offset of the entry in the block, -ENOENT if not found, negative error codes
+ */
+static int dx_search_block(char *buf, const char *name, size_t len, ext2_superblock *sb)
+{
+    for (size_t off = 0; off < sb->block_size;)
+    {
+        auto entry = (ext2_dir_entry_t *) (buf + off);
+        if (!sb->valid_dirent(entry, off))
+        {
+            sb->error("Invalid directory entry");
+            return -EIO;
+        }
+
+        if (entry->inode && entry->name_len == len && !memcmp(entry->name, name, len))
+            return (int) off;
+
+        off += entry->rec_len;
+    }
+
+    return -ENOENT;
+}
+
+/**
+ * @brief Look up a name in an indexed directory
+ *
+ * @param dir Directory
+ * @param name Name
+ * @param len Length of the name
+ * @param sb Superblock
+ * @param res Result, filled like ext2_retrieve_dirent does
+ * @return 1 if found, -ENOENT if not, -ENOTSUP if the index can't be used, negative error codes
+ */
+int ext2_dx_find_entry(inode *dir, const char *name, size_t len, ext2_superblock *sb,
+                       ext2_dirent_result *res)
+{
+    dx_path path;
+    int st = dx_probe(dir, name, len, sb, &path);
+    if (st < 0)
+        return st;
+
+    char *buf = (char *) malloc(sb->block_size);
+    if (!buf)
+    {
+        dx_release(&path);
+        return -ENOMEM;
+    }
+
+    do
+    {
+        const ext2_block_no block = dx_leaf_block(&path);
+        if (st = dx_read_block(dir, block, buf, sb); st < 0)
+            break;
+
+        st = dx_search_block(buf, name, len, sb);
+        if (st >= 0)
+        {
+            res->block_off = st;
+            res->file_off = ((off_t) block << sb->block_size_shift) + st;
+            res->buf = buf;
+            dx_release(&path);
+            return 1;
+        }
+
+        if (st != -ENOENT)
+            break;
+
+        /* Colliding hashes may have spilled over to the next leaf */
+        st = dx_next_leaf(dir, &path, sb);
+    } while (st > 0);
+
+    free(buf);
+    dx_release(&path);
+    return st < 0 ? st : -ENOENT;
+}
+
+/**
+ * @brief Try to fit a directory entry in a block
+ *
+ * @param buf Block
+ * @param entry Entry to add (rec_len is ignored)
+ * @param sb Superblock
+ * @return 0 on success, -ENOSPC if it doesn't fit, negative error codes
+ */
+static int dx_insert_in_block(char *buf, const ext2_dir_entry_t *entry, ext2_superblock *sb)
+{
+    const size_t size = ext2_calculate_dirent_size(entry->name_len);
+
+    for (size_t off = 0; off < sb->block_size;)
+    {
+        auto e = (ext2_dir_entry_t *) (buf + off);
+        if (!sb->valid_dirent(e, off))
+        {
+            sb->error("Invalid directory entry");
+            return -EIO;
+        }
+
+        const size_t used = e->inode ? ext2_calculate_dirent_size(e->name_len) : 0;
+
+        if (e->rec_len - used >= size)
+        {
+            auto d = (ext2_dir_entry_t *) ((char *) e + used);
+            const uint16_t rec_len = e->rec_len - used;
+
+            if (used)
+                e->rec_len = used;
+
+            d->inode = entry->inode;
+            d->rec_len = rec_len;
+            d->name_len = entry->name_len;
+            d->file_type = entry->file_type;
+            memcpy(d->name, entry->name, entry->name_len);
+            return 0;
+        }
+
+        off += e->rec_len;
+    }
+
+    return -ENOSPC;
+}
+
+struct dx_map_entry
+{
+    uint32_t hash;
+    uint16_t off;
+    uint16_t size;
+};
+
+static int dx_map_cmp(const void *lhs, const void *rhs)
+{
+    auto a = (const dx_map_entry *) lhs;
+    auto b = (const dx_map_entry *) rhs;
+
+    if (a->hash != b->hash)
+        return a->hash < b->hash ? -1 : 1;
+    return a->off < b->off ? -1 : 1;
+}
+
+/* Lay out [first, last) of the map compactly in dst, with the last entry padding out the block */
+static void dx_pack_entries(char *dst, const char *src, const dx_map_entry *map, unsigned int first,
+                            unsigned int last, ext2_superblock *sb)
+{
+    ext2_dir_entry_t *prev = nullptr;
+    size_t off = 0;
+
+    for (unsigned int i = first; i < last; i++)
+    {
+        auto d = (ext2_dir_entry_t *) (dst + off);
+        memcpy(d, src + map[i].off, map[i].size);
+        d->rec_len = map[i].size;
+        off += map[i].size;
+        prev = d;
+    }
+
+    if (prev)
+        prev->rec_len += sb->block_size - off;
+    else
+    {
+        auto d = (ext2_dir_entry_t *) dst;
+        d->inode = 0;
+        d->rec_len = sb->block_size;
+        d->name_len = 0;
+        d->file_type = 0;
+    }
+}
+
+/**
+ * @brief Insert a (hash, block) pair in an index block, right after frame->at
+ *
+ * @param frame Frame of the index block, with room for another entry
+ * @param hash Hash
+ * @param block Block
+ */
+static void dx_insert_entry(dx_frame *frame, uint32_t hash, ext2_block_no block)
+{
+    dx_countlimit *cl = dx_countlimit_of(frame->entries);
+    dx_entry *new_entry = frame->at + 1;
+    dx_entry *end = frame->entries + cl->count;
+
+    memmove(new_entry + 1, new_entry, (end - new_entry) * sizeof(dx_entry));
+    new_entry->hash = hash;
+    new_entry->block = block;
+    cl->count++;
+}
+
+static inline ext2_block_no dx_next_block(inode *dir, ext2_superblock *sb)
+{
+    return dir->i_size >> sb->block_size_shift;
+}
+
+/**
+ * @brief Make room in the bottom index block for one more entry
+ *
+ * @param dir Directory
+ * @param path Path to the leaf; gets adjusted if entries move around
+ * @param sb Superblock
+ * @return 0 on success, -ENOSPC if the index is full, negative error codes
+ */
+static int dx_grow_index(inode *dir, dx_path *path, ext2_superblock *sb)
+{
+    dx_frame *bottom = &path->frames[path->nr_frames - 1];
+    dx_countlimit *cl = dx_countlimit_of(bottom->entries);
+    if (cl->count < cl->limit)
+        return 0;
+
+    char *buf = (char *) zalloc(sb->block_size);
+    if (!buf)
+        return -ENOMEM;
+
+    auto node = (dx_node *) buf;
+    node->fake.rec_len = sb->block_size;
+    const ext2_block_no new_block = dx_next_block(dir, sb);
+    const unsigned int count = cl->count;
+    int st;
+
+    if (path->nr_frames == 1)
+    {
+        /* The root is full and there's no node below it. Move its entries to a new node and make
+         * the root point to it.
+         */
+        auto root = (dx_root *) bottom->buf;
+        if (root->info.indirect_levels + 1 >= EXT2_HTREE_MAX_LEVELS)
+        {
+            free(buf);
+            return -ENOSPC;
+        }
+
+        memcpy(node->entries, bottom->entries, count * sizeof(dx_entry));
+        dx_countlimit_of(node->entries)->limit = dx_node_limit(sb);
+
+        if (st = dx_write_block(dir, new_block, buf, sb); st < 0)
+        {
+            free(buf);
+            return st;
+        }
+
+        dx_frame *frame = &path->frames[1];
+        frame->buf = buf;
+        frame->block = new_block;
+        frame->entries = node->entries;
+        frame->at = node->entries + (bottom->at - bottom->entries);
+        path->nr_frames = 2;
+
+        cl->count = 1;
+        bottom->entries[0].block = new_block;
+        bottom->at = bottom->entries;
+        root->info.indirect_levels++;
+
+        return dx_write_block(dir, 0, bottom->buf, sb);
+    }
+
+    /* A full node. Split it in half, and point the root at the new one */
+    dx_frame *parent = &path->frames[path->nr_frames - 2];
+    dx_countlimit *parent_cl = dx_countlimit_of(parent->entries);
+    if (parent_cl->count == parent_cl->limit)
+    {
+        free(buf);
+        return -ENOSPC;
+    }
+
+    const unsigned int keep = count / 2;
+    const uint32_t split_hash = bottom->entries[keep].hash;
+
+    memcpy(node->entries, bottom->entries + keep, (count - keep) * sizeof(dx_entry));
+    dx_countlimit_of(node->entries)->limit = dx_node_limit(sb);
+    dx_countlimit_of(node->entries)->count = count - keep;
+    cl->count = keep;
+
+    if (st = dx_write_block(dir, new_block, buf, sb); st < 0)
+    {
+        free(buf);
+        return st;
+    }
+
+    if (st = dx_write_block(dir, bottom->block, bottom->buf, sb); st < 0)
+    {
+        free(buf);
+        return st;
+    }
+
+    dx_insert_entry(parent, split_hash, new_block);
+    if (st = dx_write_block(dir, parent->block, parent->buf, sb); st < 0)
+    {
+        free(buf);
+        return st;
+    }
+
+    /* Switch to the new node if that's where our leaf ended up */
+    const unsigned int at = bottom->at - bottom->entries;
+    if (at >= keep)
+    {
+        free(bottom->buf);
+        bottom->buf = buf;
+        bottom->block = new_block;
+        bottom->entries = node->entries;
+        bottom->at = node->entries + (at - keep);
+        parent->at++;
+    }
+    else
+        free(buf);
+
+    return 0;
+}
+
+/**
+ * @brief Split a full leaf in two, by hash, and add an entry to the right half
+ *
+ * @param dir Directory
+ * @param path Path to the leaf
+ * @param leaf Contents of the leaf
+ * @param entry Entry to add
+ * @param sb Superblock
+ * @return 0 on success, negative error codes
+ */
+static int dx_split_leaf(inode *dir, dx_path *path, char *leaf, const ext2_dir_entry_t *entry,
+                         ext2_superblock *sb)
+{
+    /* Every live entry takes at least 12 bytes */
+    const unsigned int max_entries = sb->block_size / 12;
+    auto map = (dx_map_entry *) malloc(max_entries * sizeof(dx_map_entry));
+    auto new_leaf = (char *) malloc(sb->block_size);
+    auto old_leaf = (char *) malloc(sb->block_size);
+    unsigned int nr = 0;
+    int st = -ENOMEM;
+
+    if (!map || !new_leaf || !old_leaf)
+        goto out;
+
+    {
+        auto root = (dx_root *) path->frames[0].buf;
+        const unsigned int version = dx_hash_version(root, sb);
+
+        for (size_t off = 0; off < sb->block_size;)
+        {
+            auto e = (ext2_dir_entry_t *) (leaf + off);
+            if (e->inode && nr < max_entries)
+            {
+                map[nr].hash = dx_hash(e->name, e->name_len, version, sb);
+                map[nr].off = off;
+                map[nr].size = ext2_calculate_dirent_size(e->name_len);
+                nr++;
+            }
+
+            off += e->rec_len;
+        }
+    }
+
+    if (nr < 2)
+    {
+        /* Can't happen with a valid leaf, since the new entry didn't fit */
+        sb->error("Corrupted directory leaf");
+        st = -EIO;
+        goto out;
+    }
+
+    qsort(map, nr, sizeof(dx_map_entry), dx_map_cmp);
+
+    {
+        /* Move everything from split onwards to the new leaf. Pick the split point that leaves
+         * the two halves closest in size once the new entry is in, out of the ones that leave room
+         * for it in its half. With big names in small blocks, just halving the leaf by size can
+         * leave the new entry's half short of room.
+         */
+        const size_t size = ext2_calculate_dirent_size(entry->name_len);
+        size_t total = 0;
+        for (unsigned int i = 0; i < nr; i++)
+            total += map[i].size;
+
+        unsigned int split = 0;
+        uint32_t split_hash = 0;
+        size_t best = SIZE_MAX;
+        size_t left = map[0].size;
+
+        for (unsigned int i = 1; i < nr; left += map[i++].size)
+        {
+            uint32_t hash = map[i].hash;
+            if (map[i - 1].hash == hash)
+                hash |= DX_HASH_CONTINUED;
+
+            /* Names that hash the same as the split point stay in the old leaf */
+            const bool to_new = path->hash >= hash;
+            const size_t old_used = left + (to_new ? 0 : size);
+            const size_t new_used = total - left + (to_new ? size : 0);
+            if (old_used > sb->block_size || new_used > sb->block_size)
+                continue;
+
+            const size_t diff = old_used > new_used ? old_used - new_used : new_used - old_used;
+            if (diff < best)
+            {
+                best = diff;
+                split = i;
+                split_hash = hash;
+            }
+        }
+
+        if (!split)
+        {
+            /* Can't happen, each half is at most half the block plus an entry */
+            sb->error("Corrupted directory leaf");
+            st = -EIO;
+            goto out;
+        }
+
+        dx_pack_entries(new_leaf, leaf, map, split, nr, sb);
+        dx_pack_entries(old_leaf, leaf, map, 0, split, sb);
+
+        char *target = path->hash >= split_hash ? new_leaf : old_leaf;
+        if (st = dx_insert_in_block(target, entry, sb); st < 0)
+            goto out;
+
+        const ext2_block_no new_block = dx_next_block(dir, sb);
+        const ext2_block_no old_block = dx_leaf_block(path);
+
+        if (st = dx_write_block(dir, new_block, new_leaf, sb); st < 0)
+            goto out;
+        if (st = dx_write_block(dir, old_block, old_leaf, sb); st < 0)
+            goto out;
+
+        dx_frame *bottom = &path->frames[path->nr_frames - 1];
+        dx_insert_entry(bottom, split_hash, new_block);
+        st = dx_write_block(dir, bottom->block, bottom->buf, sb);
+    }
+
+out:
+    free(map);
+    free(new_leaf);
+    free(old_leaf);
+    return st;
+}
+
+/**
+ * @brief Add an entry to an indexed directory
+ *
+ * @param dir Directory
+ * @param entry Entry to add (rec_len is ignored)
+ * @param sb Superblock
+ * @return 0 on success, -ENOTSUP if the index can't be used, negative error codes
+ */
+int ext2_dx_add_entry(inode *dir, const ext2_dir_entry_t *entry, ext2_superblock *sb)
+{
+    dx_path path;
+    int st = dx_probe(dir, entry->name, entry->name_len, sb, &path);
+    if (st < 0)
+        return st;
+
+    char *leaf = (char *) malloc(sb->block_size);
+    if (!leaf)
+    {
+        dx_release(&path);
+        return -ENOMEM;
+    }
+
+    if (st = dx_read_block(dir, dx_leaf_block(&path), leaf, sb); st < 0)
+        goto out;
+
+    st = dx_insert_in_block(leaf, entry, sb);
+    if (st == 0)
+    {
+        st = dx_write_block(dir, dx_leaf_block(&path), leaf, sb);
+        goto out;
+    }
+
+    if (st != -ENOSPC)
+        goto out;
+
+    if (st = dx_grow_index(dir, &path, sb); st < 0)
+    {
+        if (st == -ENOSPC)
+            printk("ext2: Directory %lu's index is full\n", dir->i_inode);
+        goto out;
+    }
+
+    st = dx_split_leaf(dir, &path, leaf, entry, sb);
+out:
+    free(leaf);
+    dx_release(&path);
+    return st;
+}
+
+/**
+ * @brief Turn a single-block directory into an indexed one, and add an entry to it
+ *
+ * @param dir Directory, whose only block is full
+ * @param entry Entry to add (rec_len is ignored)
+ * @param sb Superblock
+ * @return 0 on success, -ENOTSUP if the directory can't be indexed, negative error codes
+ */
+int ext2_dx_make_indexed(inode *dir, const ext2_dir_entry_t *entry, ext2_superblock *sb)
+{
+    if (dir->i_size != sb->block_size)
+        return -ENOTSUP;
+
+    char *buf = (char *) malloc(sb->block_size);
+    char *leaf = (char *) zalloc(sb->block_size);
+    int st = -ENOMEM;
+
+    if (!buf || !leaf)
+        goto out;
+
+    if (st = dx_read_block(dir, 0, buf, sb); st < 0)
+        goto out;
+
+    {
+        auto dot = (ext2_dir_entry_t *) buf;
+        if (!sb->valid_dirent(dot, 0) || dot->name_len != 1 || dot->name[0] != '.')
+        {
+            st = -ENOTSUP;
+            goto out;
+        }
+
+        auto dotdot = (ext2_dir_entry_t *) (buf + dot->rec_len);
+        if (!sb->valid_dirent(dotdot, dot->rec_len) || dotdot->name_len != 2 ||
+            memcmp(dotdot->name, "..", 2))
+        {
+            st = -ENOTSUP;
+            goto out;
+        }
+
+        /* Everything after ".." moves to the first leaf, as is */
+        const size_t rest = dot->rec_len + dotdot->rec_len;
+        if (rest == sb->block_size)
+        {
+            st = -ENOTSUP;
+            goto out;
+        }
+
+        memcpy(leaf, buf + rest, sb->block_size - rest);
+        for (size_t off = 0;;)
+        {
+            auto e = (ext2_dir_entry_t *) (leaf + off);
+            if (!sb->valid_dirent(e, off))
+            {
+                sb->error("Invalid directory entry");
+                st = -EIO;
+                goto out;
+            }
+
+            if (off + e->rec_len == sb->block_size - rest)
+            {
+                e->rec_len += rest;
+                break;
+            }
+
+            off += e->rec_len;
+        }
+
+        if (st = dx_write_block(dir, 1, leaf, sb); st < 0)
+            goto out;
+
+        auto root = (dx_root *) buf;
+        const uint32_t dotdot_ino = dotdot->inode;
+        const uint8_t dotdot_type = dotdot->file_type;
+        memset(buf + 12, 0, sb->block_size - 12);
+
+        root->dot.rec_len = 12;
+        root->dotdot.inode = dotdot_ino;
+        root->dotdot.rec_len = sb->block_size - 12;
+        root->dotdot.name_len = 2;
+        root->dotdot.file_type = dotdot_type;
+        memcpy(root->dotdot_name, "..", 2);
+
+        unsigned int version = sb->sb->s_def_hash_version;
+        if (version > EXT2_HASH_TEA)
+            version = EXT2_HASH_HALF_MD4;
+        root->info.hash_version = version;
+        root->info.info_length = sizeof(dx_root_info);
+
+        dx_countlimit_of(root->entries)->limit = dx_root_limit(sb);
+        dx_countlimit_of(root->entries)->count = 1;
+        root->entries[0].block = 1;
+
+        if (st = dx_write_block(dir, 0, buf, sb); st < 0)
+            goto out;
+
+        ext2_get_inode_from_node(dir)->i_flags |= EXT2_INDEX_FL;
+        inode_mark_dirty(dir);
+    }
+
+    st = ext2_dx_add_entry(dir, entry, sb);
+out:
+    free(buf);
+    free(leaf);
+    return st;
+}
+
+/**
+ * @brief Stop using a directory's index
+ * Used when we find an index we can't deal with. From then on, it's a regular directory, and the
+ * root's slack space gets reused like any other.
+ *
+ * @param dir Directory
+ */
+void ext2_dx_clear_index(inode *dir)
+{
+    ext2_get_inode_from_node(dir)->i_flags &= ~EXT2_INDEX_FL;
+    inode_mark_dirty(dir);
+}
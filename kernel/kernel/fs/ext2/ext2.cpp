@@ -41,8 +41,8 @@ int ext2_link_fops(struct file *target, const char *name, struct dentry *dir);
 int ext2_fallocate(int mode, off_t off, off_t len, struct file *f);
 int ext2_ftruncate(size_t len, struct file *f);
 ssize_t ext2_readpage(struct page *page, size_t off, struct inode *ino);
-ssize_t ext2_writepage(struct page *page, size_t off, struct inode *ino);
 int ext2_prepare_write(inode *ino, struct page *page, size_t page_off, size_t offset, size_t len);
+int ext2_prepare_write_range(inode *ino, size_t offset, size_t len);
 int ext2_link(struct inode *target, const char *name, struct inode *dir);
 inode *ext2_symlink(const char *name, const char *dest, dentry *dir);
 
@@ -59,8 +59,9 @@ struct file_ops ext2_ops = {.open = ext2_open,
                             .unlink = ext2_unlink,
                             .fallocate = ext2_fallocate,
                             .readpage = ext2_readpage,
-                            .writepage = ext2_writepage,
+                            .writepage = block_buf_writepage,
                             .prepare_write = ext2_prepare_write,
+                            .prepare_write_range = ext2_prepare_write_range,
                             .read_iter = filemap_read_iter,
                             .write_iter = filemap_write_iter};
 
@@ -86,6 +87,8 @@ void ext2_close(struct inode *vfs_ino)
 {
     struct ext2_inode *inode = ext2_get_inode_from_node(vfs_ino);
 
+    ext2_discard_reservation(vfs_ino, ext2_superblock_from_inode(vfs_ino));
+
     /* TODO: It would be better, cache-wise and memory allocator-wise if we
      * had ext2_inode incorporate a struct inode inside it, and have everything in the same
      * location.
@@ -95,43 +98,12 @@ void ext2_close(struct inode *vfs_ino)
     free(inode);
 }
 
-ssize_t ext2_writepage(page *page, size_t off, inode *ino)
-{
-    auto buf = block_buf_from_page(page);
-    auto sb = ext2_superblock_from_inode(ino);
-
-    assert(buf != nullptr);
-
-    while (buf)
-    {
-        page_iov v[1];
-        v->length = buf->block_size;
-        v->page = buf->this_page;
-        v->page_off = buf->page_off;
-
-#if 0
-		printk("Writing to block %lu\n", buf->block_nr);
-#endif
-
-        if (sb_write_bio(sb, v, 1, buf->block_nr) < 0)
-        {
-            sb->error("Error writing back page");
-            return -EIO;
-        }
-
-        buf = buf->next;
-    }
-
-    return PAGE_SIZE;
-}
-
 ssize_t ext2_readpage(struct page *page, size_t off, struct inode *ino)
 {
     bool is_buffer = page->flags & PAGE_FLAG_BUFFER;
 
     assert(is_buffer == true);
 
-    auto raw_inode = ext2_get_inode_from_node(ino);
     auto sb = ext2_superblock_from_inode(ino);
     auto nr_blocks = PAGE_SIZE / sb->block_size;
     auto base_block_index = off / sb->block_size;
@@ -147,7 +119,7 @@ ssize_t ext2_readpage(struct page *page, size_t off, struct inode *ino)
             return -ENOMEM;
         }
 
-        auto res = ext2_get_block_from_inode(raw_inode, base_block_index + i, sb);
+        auto res = ext2_get_block_from_inode(ino, base_block_index + i, sb);
         if (res.has_error())
         {
             page_destroy_block_bufs(page);
@@ -195,6 +167,9 @@ struct ext2_inode_info *ext2_cache_inode_info(struct inode *ino, struct ext2_ino
         return nullptr;
 
     inf->inode = fs_ino;
+    mutex_init(&inf->alloc_lock);
+    rwlock_init(&inf->ext_lock);
+    spinlock_init(&inf->ext_cache_lock);
 
     return inf;
 }
@@ -404,6 +379,10 @@ struct inode *ext2_create_file(const char *name, mode_t mode, dev_t dev, struct
 
     inode->i_mode = ext2_file_type | (mode & ~S_IFMT);
 
+    /* New files and directories get extent trees, if the filesystem supports them */
+    if (fs->features_incompat & EXT4_FEATURE_INCOMPAT_EXTENTS && (S_ISREG(mode) || S_ISDIR(mode)))
+        ext4_ext_init_inode(inode);
+
     if (S_ISBLK(mode) || S_ISCHR(mode))
     {
         /* We're a device file, store the device in dbp[0] */
@@ -648,21 +627,35 @@ off_t ext2_getdirent(struct dirent *buf, off_t off, struct file *f)
 
     unsigned long old = thread_change_addr_limit(VM_KERNEL_ADDR_LIMIT);
 
-    /* Read a dir entry from the offset */
-    read = file_read_cache(&entry, sizeof(ext2_dir_entry_t), f->f_ino, off);
-    if (read < 0)
-        return read;
+    while (true)
+    {
+        /* Read a dir entry from the offset */
+        read = file_read_cache(&entry, sizeof(ext2_dir_entry_t), f->f_ino, off);
+        if (read <= 0)
+            break;
+
+        if (entry.inode)
+            break;
+
+        /* Skip unused entries. htree index nodes look like one big unused entry, too. */
+        if (entry.rec_len < EXT2_MIN_DIR_ENTRY_LEN)
+        {
+            read = -EIO;
+            break;
+        }
+
+        off += entry.rec_len;
+    }
 
     thread_change_addr_limit(old);
 
+    if (read < 0)
+        return read;
+
     /* If we reached the end of the directory buffer, return 0 */
     if (read == 0)
         return 0;
 
-    /* If we reached the end of the directory list, return 0 */
-    if (!entry.inode)
-        return 0;
-
     memcpy(buf->d_name, entry.name, entry.name_len);
     buf->d_name[entry.name_len] = '\0';
     buf->d_ino = entry.inode;
@@ -9,6 +9,7 @@
 #define _EXT2_H
 
 #include <errno.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <uapi/stat.h>
 
@@ -16,6 +17,7 @@
 #include <onyx/buffer.h>
 #include <onyx/dentry.h>
 #include <onyx/mutex.h>
+#include <onyx/rwlock.h>
 #include <onyx/scoped_lock.h>
 #include <onyx/spinlock.h>
 #include <onyx/vector.h>
@@ -56,6 +58,7 @@
 #define EXT2_FEATURE_INCOMPAT_RECOVER     0x4
 #define EXT2_FEATURE_INCOMPAT_JOURNAL_DEV 0x8
 #define EXT2_FEATURE_INCOMPAT_META_BG     0x10
+#define EXT4_FEATURE_INCOMPAT_EXTENTS     0x40
 
 #define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 1
 #define EXT2_FEATURE_RO_COMPAT_LARGE_FILE   2
@@ -83,8 +86,9 @@
 #define EXT2_NOCOMPR_FL      0x400
 #define EXT2_ECOMPR_FL       0x800
 #define EXT2_BTREE_FL        0x1000
-#define EXT2_INDEX_FL        0x2000
+#define EXT2_INDEX_FL        0x1000
 #define EXT3_JOURNAL_DATA_FL 0x4000
+#define EXT4_EXTENTS_FL      0x80000
 #define EXT2_RESERVED_FL     0x80000000
 
 /* File type flags that are stored in the directory entries */
@@ -146,10 +150,37 @@ typedef struct
     uint32_t s_last_orphan;
     uint32_t s_hash_seed[4];
     uint8_t s_def_hash_version;
+    uint8_t s_jnl_backup_type;
+    uint16_t s_desc_size;
     uint32_t s_default_mount_options;
     uint32_t s_first_meta_bg;
+    uint32_t s_mkfs_time;
+    uint32_t s_jnl_blocks[17];
+    uint32_t s_blocks_count_hi;
+    uint32_t s_r_blocks_count_hi;
+    uint32_t s_free_blocks_count_hi;
+    uint16_t s_min_extra_isize;
+    uint16_t s_want_extra_isize;
+    uint32_t s_flags;
 } __attribute__((aligned(1024), packed)) superblock_t;
 
+static_assert(offsetof(superblock_t, s_flags) == 0x160);
+
+/* s_flags */
+#define EXT2_FLAGS_SIGNED_HASH   (1 << 0)
+#define EXT2_FLAGS_UNSIGNED_HASH (1 << 1)
+
+/* Directory index hash versions */
+#define EXT2_HASH_LEGACY            0
+#define EXT2_HASH_HALF_MD4          1
+#define EXT2_HASH_TEA               2
+#define EXT2_HASH_LEGACY_UNSIGNED   3
+#define EXT2_HASH_HALF_MD4_UNSIGNED 4
+#define EXT2_HASH_TEA_UNSIGNED      5
+
+/* Max depth of a directory index, counting the root */
+#define EXT2_HTREE_MAX_LEVELS 2
+
 typedef struct
 {
     uint32_t block_usage_addr;
@@ -235,6 +266,29 @@ using ext2_block_group_no = uint32_t;
 using ext2_inode_no = uint32_t;
 using ext2_block_no = uint32_t;
 
+#define EXT2_RSV_NO_BG ((ext2_block_group_no) -1)
+
+/* Default and max size of a reservation window, in blocks */
+#define EXT2_RSV_DEFAULT_BLOCKS 32
+#define EXT2_RSV_MAX_BLOCKS     1024
+
+/* A per-inode block reservation window, like ext3's. Blocks in an inode's window don't get handed
+ * out to anyone else (unless the filesystem is close to full), so concurrent appenders don't
+ * interleave their blocks. Windows only exist in memory.
+ */
+struct ext2_rsv_window
+{
+    /* Node in the block group's window list, protected by its block_bitmap_lock */
+    struct list_head list_node;
+    /* Block group the window is in, or EXT2_RSV_NO_BG */
+    ext2_block_group_no bg{EXT2_RSV_NO_BG};
+    /* [start, end), in bits of the block group's bitmap */
+    uint32_t start{0};
+    uint32_t end{0};
+    /* Size of the next window we grab */
+    uint32_t goal_size{EXT2_RSV_DEFAULT_BLOCKS};
+};
+
 class ext2_block_group
 {
 private:
@@ -247,12 +301,24 @@ private:
     /* Protects used_dirs, unallocated inodes and blocks */
     spinlock lock_{};
 
+    /* Reservation windows in this block group, sorted by start. Protected by block_bitmap_lock */
+    struct list_head rsv_windows;
+
+    ext2_rsv_window *find_rsv(uint32_t bit, const ext2_rsv_window *self);
+    uint32_t find_free_bit(const unsigned long *bitmap, uint32_t start, uint32_t end,
+                           const ext2_rsv_window *self, bool use_windows);
+    uint32_t find_free_bit_wrap(const unsigned long *bitmap, uint32_t goal, uint32_t end,
+                                const ext2_rsv_window *self, bool use_windows);
+    uint32_t next_rsv_start(uint32_t bit, uint32_t end, const ext2_rsv_window *self);
+    void insert_rsv(ext2_rsv_window *rsv);
+
 public:
     ext2_block_group() : buf{}, nr{(ext2_block_group_no) -1}
     {
         mutex_init(&inode_bitmap_lock);
         mutex_init(&block_bitmap_lock);
         spinlock_init(&lock_);
+        INIT_LIST_HEAD(&rsv_windows);
     }
 
     ext2_block_group(ext2_block_group_no nr_) : nr{nr_}
@@ -260,6 +326,7 @@ public:
         spinlock_init(&lock_);
         mutex_init(&inode_bitmap_lock);
         mutex_init(&block_bitmap_lock);
+        INIT_LIST_HEAD(&rsv_windows);
     }
 
     ext2_block_group &operator=(ext2_block_group &&rhs)
@@ -272,6 +339,7 @@ public:
         nr = cul::move(rhs.nr);
         mutex_init(&inode_bitmap_lock);
         mutex_init(&block_bitmap_lock);
+        INIT_LIST_HEAD(&rsv_windows);
 
         rhs.bgd = nullptr;
         rhs.buf = nullptr;
@@ -289,6 +357,7 @@ public:
         nr = cul::move(rhs.nr);
         mutex_init(&inode_bitmap_lock);
         mutex_init(&block_bitmap_lock);
+        INIT_LIST_HEAD(&rsv_windows);
 
         rhs.bgd = nullptr;
         rhs.buf = nullptr;
@@ -352,11 +421,11 @@ public:
         dirty();
     }
 
-    void dec_unallocated_blocks()
+    void dec_unallocated_blocks(uint16_t nr_blocks = 1)
     {
         lock();
 
-        bgd->unallocated_blocks_in_group--;
+        bgd->unallocated_blocks_in_group -= nr_blocks;
 
         unlock();
 
@@ -381,9 +450,29 @@ public:
 
     expected<ext2_inode_no, int> allocate_inode(ext2_superblock *sb);
     void free_inode(ext2_inode_no inode, ext2_superblock *sb);
-    expected<ext2_block_no, int> allocate_block(ext2_superblock *sb);
+    /**
+     * @brief Allocate a run of contiguous blocks, in a single pass over the bitmap
+     *
+     * @param sb Superblock
+     * @param goal Bitmap bit to start looking at
+     * @param count Max number of blocks to allocate
+     * @param rsv Reservation window of the inode we're allocating for, or nullptr
+     * @param use_windows If false, ignore reservation windows altogether
+     * @param nr_out Number of blocks allocated (at least 1, on success)
+     * @return First block of the run, or a negative error code
+     */
+    expected<ext2_block_no, int> allocate_blocks(ext2_superblock *sb, uint32_t goal,
+                                                 uint32_t count, ext2_rsv_window *rsv,
+                                                 bool use_windows, uint32_t *nr_out);
     void free_block(ext2_block_no block, ext2_superblock *sb);
 
+    /**
+     * @brief Drop a reservation window that lives in this block group
+     *
+     * @param rsv The window
+     */
+    void release_rsv(ext2_rsv_window *rsv);
+
     auto_block_buf get_inode_table(const ext2_superblock *sb, uint32_t off) const;
 };
 
@@ -409,7 +498,8 @@ struct ext2_superblock : public superblock
     unsigned int entry_shift;
     cul::vector<ext2_block_group> block_groups;
 
-    ext2_block_no try_allocate_block_from_bg(ext2_block_group_no nr);
+    ext2_block_no try_allocate_from_bg(ext2_block_group_no nr, uint32_t goal, uint32_t count,
+                                       ext2_rsv_window *rsv, bool use_windows, uint32_t *nr_out);
 
 public:
     ext2_superblock()
@@ -447,6 +537,25 @@ public:
      */
     ext2_block_no allocate_block(ext2_block_group_no preferred = -1);
 
+    /**
+     * @brief Allocates a run of contiguous blocks, as close to the goal as possible
+     *
+     * @param goal Block we'd like to get
+     * @param count Max number of blocks to allocate
+     * @param rsv Reservation window of the inode we're allocating for, or nullptr
+     * @param nr_out Number of blocks allocated (at least 1, on success)
+     * @return First block of the run, or EXT2_ERR_INV_BLOCK if we couldn't allocate any.
+     */
+    ext2_block_no allocate_blocks(ext2_block_no goal, uint32_t count, ext2_rsv_window *rsv,
+                                  uint32_t *nr_out);
+
+    /**
+     * @brief Drops a reservation window, if there's one
+     *
+     * @param rsv The window
+     */
+    void release_rsv(ext2_rsv_window *rsv);
+
     /**
      * @brief Frees a block
      *
@@ -490,6 +599,18 @@ public:
         return sb->s_first_data_block;
     }
 
+    /**
+     * @brief Get the number of blocks in a block group (the last one may be smaller)
+     *
+     * @param nr Block group number
+     * @return Number of blocks
+     */
+    uint32_t blocks_in_group(ext2_block_group_no nr) const
+    {
+        uint32_t left = total_blocks - first_data_block() - nr * blocks_per_block_group;
+        return left < blocks_per_block_group ? left : blocks_per_block_group;
+    }
+
     /**
      * @brief Does statfs
      *
@@ -508,10 +629,33 @@ public:
     bool valid_dirent(const ext2_dir_entry_t *dentry, size_t offset);
 };
 
+/* Number of extents we keep cached per inode */
+#define EXT4_EXT_CACHE_SIZE 4
+
+struct ext4_ext_cache_entry
+{
+    ext2_block_no lblk;
+    ext2_block_no pblk;
+    /* 0 if the entry is unused */
+    uint32_t len;
+};
+
 struct ext2_inode_info
 {
     /* Cached copy of the on-disk inode */
     struct ext2_inode *inode;
+    /* Protects the block allocation state below */
+    struct mutex alloc_lock;
+    struct ext2_rsv_window rsv;
+    /* Last data block we allocated (physical block 0 if none), used to pick the next goal */
+    ext2_block_no last_alloc_logical{0};
+    ext2_block_no last_alloc_phys{0};
+    /* Protects the extent tree, for inodes that have one */
+    struct rwlock ext_lock;
+    /* Recently looked up extents, so sequential I/O doesn't walk the tree for every block */
+    struct spinlock ext_cache_lock;
+    unsigned int ext_cache_next{0};
+    struct ext4_ext_cache_entry ext_cache[EXT4_EXT_CACHE_SIZE]{};
 };
 
 static inline struct ext2_inode *ext2_get_inode_from_node(struct inode *ino)
@@ -543,15 +687,32 @@ void ext2_set_inode_size(struct ext2_inode *inode, size_t size);
 int ext2_add_direntry(const char *name, uint32_t inum, ext2_inode *raw_ino, inode *dir,
                       ext2_superblock *fs);
 int ext2_remove_direntry(uint32_t inum, inode *dir, ext2_superblock *fs);
+size_t ext2_calculate_dirent_size(size_t len_name);
 
 int ext2_ino_type_to_vfs_type(uint16_t mode);
 uint16_t ext2_mode_to_ino_type(mode_t mode);
 struct inode *ext2_fs_ino_to_vfs_ino(struct ext2_inode *inode, uint32_t inumber,
                                      ext2_superblock *fs);
 void ext2_free_inode_space(struct inode *inode, struct ext2_superblock *fs);
-expected<ext2_block_no, int> ext2_get_block_from_inode(ext2_inode *ino, ext2_block_no block,
+void ext2_discard_reservation(struct inode *ino, ext2_superblock *sb);
+expected<ext2_block_no, int> ext2_get_block_from_inode(inode *ino, ext2_block_no block,
                                                        ext2_superblock *sb);
 
+static inline bool ext4_has_extents(struct ext2_inode *raw_ino)
+{
+    return raw_ino->i_flags & EXT4_EXTENTS_FL;
+}
+
+void ext4_ext_init_inode(struct ext2_inode *raw_ino);
+expected<ext2_block_no, int> ext4_ext_map_block(inode *ino, ext2_block_no lblk,
+                                                ext2_superblock *sb);
+int ext4_ext_insert_blocks(inode *ino, ext2_block_no lblk, ext2_block_no pblk, uint32_t len,
+                           ext2_superblock *sb);
+expected<ext2_block_no, int> ext4_ext_convert_unwritten(inode *ino, ext2_block_no lblk,
+                                                        uint32_t count, uint32_t *nr_out,
+                                                        ext2_superblock *sb);
+int ext4_ext_truncate(inode *ino, ext2_block_no first, ext2_superblock *sb);
+
 struct ext2_dirent_result
 {
     off_t file_off;
@@ -562,6 +723,13 @@ struct ext2_dirent_result
 int ext2_retrieve_dirent(inode *inode, const char *name, ext2_superblock *sb,
                          ext2_dirent_result *res);
 
+bool ext2_dir_is_indexed(inode *dir, ext2_superblock *sb);
+int ext2_dx_find_entry(inode *dir, const char *name, size_t len, ext2_superblock *sb,
+                       ext2_dirent_result *res);
+int ext2_dx_add_entry(inode *dir, const ext2_dir_entry_t *entry, ext2_superblock *sb);
+int ext2_dx_make_indexed(inode *dir, const ext2_dir_entry_t *entry, ext2_superblock *sb);
+void ext2_dx_clear_index(inode *dir);
+
 struct inode *ext2_load_inode_from_disk(uint32_t inum, ext2_superblock *fs);
 
 static inline ext2_superblock *ext2_superblock_from_inode(inode *ino)
@@ -653,7 +821,7 @@ inline uint32_t ext2_block_number_to_bg(ext2_block_no block_no, const ext2_super
 
 #define EXT2_ATOMIC_SUB(var, num) __atomic_sub_fetch(&var, num, __ATOMIC_RELAXED)
 
-#define EXT2_SUPPORTED_INCOMPAT EXT2_FEATURE_INCOMPAT_FILETYPE
+#define EXT2_SUPPORTED_INCOMPAT (EXT2_FEATURE_INCOMPAT_FILETYPE | EXT4_FEATURE_INCOMPAT_EXTENTS)
 
 inode *ext2_get_inode(ext2_superblock *sb, uint32_t inode_num);
 inode *ext2_create_file(const char *name, mode_t mode, dev_t dev, dentry *dir);
@@ -223,6 +223,19 @@ int ext2_add_direntry(const char *name, uint32_t inum, struct ext2_inode *ino, i
 
     strlcpy(entry.name, name, sizeof(entry.name));
 
+    if (ext2_dir_is_indexed(dir, fs))
+    {
+        int st = ext2_dx_add_entry(dir, &entry, fs);
+        if (st != -ENOTSUP)
+        {
+            free(buffer);
+            return st < 0 ? (errno = -st, -1) : 0;
+        }
+
+        /* Don't add entries linearly to an indexed dir, it'd clobber the index root */
+        ext2_dx_clear_index(dir);
+    }
+
     while (true)
     {
         if (off < dir->i_size)
@@ -298,6 +311,17 @@ int ext2_add_direntry(const char *name, uint32_t inum, struct ext2_inode *ino, i
         }
         else
         {
+            /* Index the directory once its first block fills up, instead of growing it linearly */
+            if (off == fs->block_size && fs->features_compat & EXT2_FEATURE_COMPAT_DIR_INDEX)
+            {
+                int st = ext2_dx_make_indexed(dir, &entry, fs);
+                if (st != -ENOTSUP)
+                {
+                    free(buffer);
+                    return st < 0 ? (errno = -st, -1) : 0;
+                }
+            }
+
             entry.rec_len = fs->block_size;
             memcpy(buf, &entry, dirent_size);
 
@@ -411,6 +435,17 @@ int ext2_file_present(inode *inode, const char *name, ext2_superblock *fs)
 int ext2_retrieve_dirent(inode *inode, const char *name, ext2_superblock *fs,
                          ext2_dirent_result *res)
 {
+    const size_t name_len = strlen(name);
+    const bool is_dot = name[0] == '.' && (name_len == 1 || (name_len == 2 && name[1] == '.'));
+
+    /* "." and ".." live in the first block, outside of the index */
+    if (!is_dot && ext2_dir_is_indexed(inode, fs))
+    {
+        int st = ext2_dx_find_entry(inode, name, name_len, fs, res);
+        if (st != -ENOTSUP)
+            return st;
+    }
+
     int st = -ENOENT;
     char *buf = static_cast<char *>(zalloc(fs->block_size));
     if (!buf)
@@ -448,7 +483,7 @@ int ext2_retrieve_dirent(inode *inode, const char *name, ext2_superblock *fs,
                 continue;
             }
 
-            if (entry->name_len == strlen(name) && !memcmp(entry->name, name, entry->name_len))
+            if (entry->name_len == name_len && !memcmp(entry->name, name, name_len))
             {
                 res->block_off = b - buf;
                 res->file_off = off + res->block_off;
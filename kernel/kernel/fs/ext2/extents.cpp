@@ -0,0 +1,758 @@
+/*
+ * Copyright (c) 2023 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <onyx/buffer.h>
+#include <onyx/log.h>
+#include <onyx/rwlock.h>
+#include <onyx/spinlock.h>
+
+#include "ext2.h"
+
+#include <onyx/utility.hpp>
+
+/* ext4 extent trees. Instead of a block pointer per file block, inodes with EXT4_EXTENTS_FL map
+ * runs of up to 32768 contiguous blocks with a single extent. The tree's root lives in i_data
+ * (with room for 4 entries), and every node starts with a header. Index nodes hold (first block,
+ * child) pairs, leaves hold the extents themselves. Both are sorted by logical block.
+ *
+ * Extents with a length over 32768 are unwritten (preallocated): they have blocks, but read back
+ * as zeroes. We don't create them, but we know how to convert them on write.
+ */
+
+struct ext4_extent_header
+{
+    uint16_t eh_magic;
+    uint16_t eh_entries;
+    uint16_t eh_max;
+    uint16_t eh_depth;
+    uint32_t eh_generation;
+};
+
+struct ext4_extent_idx
+{
+    uint32_t ei_block;
+    uint32_t ei_leaf_lo;
+    uint16_t ei_leaf_hi;
+    uint16_t ei_unused;
+};
+
+struct ext4_extent
+{
+    uint32_t ee_block;
+    uint16_t ee_len;
+    uint16_t ee_start_hi;
+    uint32_t ee_start_lo;
+};
+
+/* We binary search both kinds of entries the same way, by their first field */
+static_assert(sizeof(ext4_extent) == sizeof(ext4_extent_idx));
+
+#define EXT4_EXT_MAGIC        0xf30a
+#define EXT4_EXT_MAX_DEPTH    5
+#define EXT4_EXT_INIT_MAX_LEN (1U << 15)
+#define EXT4_EXT_MAX_BLOCK    0xffffffffU
+
+#define EXT4_EXT_ROOT_MAX ((EXT2_NR_BLOCKS * sizeof(uint32_t) - sizeof(ext4_extent_header)) / 12)
+
+struct ext4_ext_frame
+{
+    /* Empty for the root, which lives in the inode */
+    auto_block_buf buf;
+    ext4_extent_header *hdr;
+    /* Entry we went through. For leaves, the extent before the block (or -1 if none). */
+    int pos;
+};
+
+struct ext4_ext_path
+{
+    ext4_ext_frame frames[EXT4_EXT_MAX_DEPTH + 1];
+    unsigned int depth;
+};
+
+static inline ext4_extent_header *ext4_ext_root(inode *ino)
+{
+    return (ext4_extent_header *) ext2_get_inode_from_node(ino)->i_data;
+}
+
+static inline ext4_extent *ext4_ext_first(ext4_extent_header *hdr)
+{
+    return (ext4_extent *) (hdr + 1);
+}
+
+static inline ext4_extent_idx *ext4_idx_first(ext4_extent_header *hdr)
+{
+    return (ext4_extent_idx *) (hdr + 1);
+}
+
+static inline uint32_t ext4_ext_len(const ext4_extent *ex)
+{
+    return ex->ee_len > EXT4_EXT_INIT_MAX_LEN ? ex->ee_len - EXT4_EXT_INIT_MAX_LEN : ex->ee_len;
+}
+
+static inline bool ext4_ext_unwritten(const ext4_extent *ex)
+{
+    return ex->ee_len > EXT4_EXT_INIT_MAX_LEN;
+}
+
+static inline void ext4_ext_set_len(ext4_extent *ex, uint32_t len, bool unwritten)
+{
+    ex->ee_len = unwritten ? len + EXT4_EXT_INIT_MAX_LEN : len;
+}
+
+static inline uint32_t ext4_ext_max_len(bool unwritten)
+{
+    return unwritten ? EXT4_EXT_INIT_MAX_LEN - 1 : EXT4_EXT_INIT_MAX_LEN;
+}
+
+static inline uint16_t ext4_ext_block_max(ext2_superblock *sb)
+{
+    return (sb->block_size - sizeof(ext4_extent_header)) / sizeof(ext4_extent);
+}
+
+/**
+ * @brief Set up an empty extent tree in a new inode
+ *
+ * @param raw_ino The inode
+ */
+void ext4_ext_init_inode(struct ext2_inode *raw_ino)
+{
+    auto hdr = (ext4_extent_header *) raw_ino->i_data;
+
+    memset(raw_ino->i_data, 0, sizeof(raw_ino->i_data));
+    hdr->eh_magic = EXT4_EXT_MAGIC;
+    hdr->eh_max = EXT4_EXT_ROOT_MAX;
+    raw_ino->i_flags |= EXT4_EXTENTS_FL;
+}
+
+static int ext4_ext_check(ext4_extent_header *hdr, unsigned int depth, unsigned int max,
+                          ext2_superblock *sb)
+{
+    if (hdr->eh_magic != EXT4_EXT_MAGIC || hdr->eh_depth != depth || hdr->eh_max > max ||
+        !hdr->eh_max || hdr->eh_entries > hdr->eh_max)
+    {
+        sb->error("Corrupted extent tree header");
+        return -EIO;
+    }
+
+    return 0;
+}
+
+/* Index of the last entry that starts at or before lblk, or -1 if there's none */
+static int ext4_ext_bsearch(ext4_extent_header *hdr, ext2_block_no lblk)
+{
+    const ext4_extent *entries = ext4_ext_first(hdr);
+    int lo = 0;
+    int hi = (int) hdr->eh_entries - 1;
+
+    while (lo <= hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (entries[mid].ee_block > lblk)
+            hi = mid - 1;
+        else
+            lo = mid + 1;
+    }
+
+    return hi;
+}
+
+/**
+ * @brief Walk the extent tree down to the leaf that covers a block
+ *
+ * @param ino The inode
+ * @param lblk The logical block
+ * @param path Path to fill
+ * @param sb The superblock
+ * @return 0 on success, negative error codes
+ */
+static int ext4_ext_find(inode *ino, ext2_block_no lblk, ext4_ext_path *path, ext2_superblock *sb)
+{
+    auto hdr = ext4_ext_root(ino);
+
+    if (hdr->eh_depth > EXT4_EXT_MAX_DEPTH)
+    {
+        sb->error("Extent tree too deep");
+        return -EIO;
+    }
+
+    if (int st = ext4_ext_check(hdr, hdr->eh_depth, EXT4_EXT_ROOT_MAX, sb); st < 0)
+        return st;
+
+    path->depth = hdr->eh_depth;
+
+    for (unsigned int level = 0;; level++)
+    {
+        auto &frame = path->frames[level];
+        frame.hdr = hdr;
+        frame.pos = ext4_ext_bsearch(hdr, lblk);
+
+        if (level == path->depth)
+            break;
+
+        if (!hdr->eh_entries)
+        {
+            sb->error("Empty extent index node");
+            return -EIO;
+        }
+
+        /* The first index covers everything to its left, too */
+        if (frame.pos < 0)
+            frame.pos = 0;
+
+        const auto idx = ext4_idx_first(hdr) + frame.pos;
+        if (idx->ei_leaf_hi)
+        {
+            sb->error("Extent tree node past 32-bit block numbers");
+            return -EIO;
+        }
+
+        auto &child = path->frames[level + 1];
+        child.buf = sb_read_block(sb, idx->ei_leaf_lo);
+        if (!child.buf)
+            return -EIO;
+
+        hdr = (ext4_extent_header *) block_buf_data(child.buf);
+        if (int st = ext4_ext_check(hdr, path->depth - level - 1, ext4_ext_block_max(sb), sb);
+            st < 0)
+            return st;
+    }
+
+    return 0;
+}
+
+static inline void ext4_ext_dirty(inode *ino, ext4_ext_frame *frame)
+{
+    if (frame->buf)
+        block_buf_dirty(frame->buf);
+    else
+        inode_mark_dirty(ino);
+}
+
+static bool ext4_ext_cache_lookup(ext2_inode_info *info, ext2_block_no lblk, ext2_block_no *pblk)
+{
+    scoped_lock g{info->ext_cache_lock};
+
+    for (const auto &entry : info->ext_cache)
+    {
+        if (lblk - entry.lblk < entry.len)
+        {
+            *pblk = entry.pblk + (lblk - entry.lblk);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void ext4_ext_cache_insert(ext2_inode_info *info, ext2_block_no lblk, ext2_block_no pblk,
+                                  uint32_t len)
+{
+    scoped_lock g{info->ext_cache_lock};
+    auto &entry = info->ext_cache[info->ext_cache_next++ % EXT4_EXT_CACHE_SIZE];
+    entry.lblk = lblk;
+    entry.pblk = pblk;
+    entry.len = len;
+}
+
+/* Called with ext_lock held for writing, whenever the tree changes */
+static void ext4_ext_cache_clear(ext2_inode_info *info)
+{
+    scoped_lock g{info->ext_cache_lock};
+    for (auto &entry : info->ext_cache)
+        entry.len = 0;
+}
+
+/**
+ * @brief Map a file block through the extent tree
+ *
+ * @param ino The inode
+ * @param lblk The logical block
+ * @param sb The superblock
+ * @return The physical block, EXT2_FILE_HOLE_BLOCK if it's not mapped (or unwritten), or a
+ * negative error code
+ */
+expected<ext2_block_no, int> ext4_ext_map_block(inode *ino, ext2_block_no lblk,
+                                                ext2_superblock *sb)
+{
+    auto info = (ext2_inode_info *) ino->i_helper;
+    ext2_block_no pblk;
+
+    if (ext4_ext_cache_lookup(info, lblk, &pblk))
+        return pblk;
+
+    scoped_rwlock<rw_lock::read> g{info->ext_lock};
+    ext4_ext_path path;
+
+    if (int st = ext4_ext_find(ino, lblk, &path, sb); st < 0)
+        return unexpected<int>{st};
+
+    const auto &leaf = path.frames[path.depth];
+    if (leaf.pos < 0)
+        return EXT2_FILE_HOLE_BLOCK;
+
+    const auto ex = ext4_ext_first(leaf.hdr) + leaf.pos;
+    const uint32_t len = ext4_ext_len(ex);
+    if (lblk - ex->ee_block >= len || ext4_ext_unwritten(ex))
+        return EXT2_FILE_HOLE_BLOCK;
+
+    if (ex->ee_start_hi)
+    {
+        sb->error("Extent past 32-bit block numbers");
+        return unexpected<int>{-EIO};
+    }
+
+    ext4_ext_cache_insert(info, ex->ee_block, ex->ee_start_lo, len);
+    return ex->ee_start_lo + (lblk - ex->ee_block);
+}
+
+/* First logical block mapped after the path's leaf position, or EXT4_EXT_MAX_BLOCK */
+static ext2_block_no ext4_ext_next_mapped(ext4_ext_path *path)
+{
+    for (int level = path->depth; level >= 0; level--)
+    {
+        const auto &frame = path->frames[level];
+        if (frame.pos + 1 < frame.hdr->eh_entries)
+            return ext4_ext_first(frame.hdr)[frame.pos + 1].ee_block;
+    }
+
+    return EXT4_EXT_MAX_BLOCK;
+}
+
+static expected<ext2_block_no, int> ext4_ext_alloc_node(inode *ino, ext2_block_no goal,
+                                                        auto_block_buf &buf, ext2_superblock *sb)
+{
+    uint32_t nr;
+    const ext2_block_no block = sb->allocate_blocks(goal, 1, nullptr, &nr);
+    if (block == EXT2_ERR_INV_BLOCK)
+        return unexpected<int>{-ENOSPC};
+
+    buf = sb_read_block(sb, block);
+    if (!buf)
+    {
+        sb->free_block(block);
+        return unexpected<int>{-EIO};
+    }
+
+    memset(block_buf_data(buf), 0, sb->block_size);
+    block_buf_dirty(buf);
+    ino->i_blocks += sb->block_size >> 9;
+    return block;
+}
+
+/**
+ * @brief Grow the tree by a level, moving the root's entries to a new node
+ * Used when every node in the path is full.
+ */
+static int ext4_ext_grow(inode *ino, ext2_block_no goal, ext2_superblock *sb)
+{
+    auto root = ext4_ext_root(ino);
+    auto_block_buf buf;
+
+    if (root->eh_depth == EXT4_EXT_MAX_DEPTH)
+        return -ENOSPC;
+
+    auto res = ext4_ext_alloc_node(ino, goal, buf, sb);
+    if (res.has_error())
+        return res.error();
+
+    auto hdr = (ext4_extent_header *) block_buf_data(buf);
+    memcpy(hdr, root, sizeof(ext4_extent_header) + root->eh_entries * sizeof(ext4_extent));
+    hdr->eh_max = ext4_ext_block_max(sb);
+
+    auto idx = ext4_idx_first(root);
+    idx->ei_block = ext4_ext_first(hdr)->ee_block;
+    idx->ei_leaf_lo = res.value();
+    idx->ei_leaf_hi = 0;
+    idx->ei_unused = 0;
+    root->eh_entries = 1;
+    root->eh_depth++;
+
+    inode_mark_dirty(ino);
+    return 0;
+}
+
+/**
+ * @brief Split a full node, moving its upper entries to a new sibling
+ * The parent needs to have room for another index.
+ */
+static int ext4_ext_split(inode *ino, ext4_ext_path *path, unsigned int level, ext2_block_no goal,
+                          ext2_superblock *sb)
+{
+    auto &frame = path->frames[level];
+    auto &parent = path->frames[level - 1];
+    const unsigned int nr = frame.hdr->eh_entries;
+    auto_block_buf buf;
+
+    auto res = ext4_ext_alloc_node(ino, goal, buf, sb);
+    if (res.has_error())
+        return res.error();
+
+    /* Appending is by far the most common case, so keep the old node full if we're adding to the
+     * end of it. Else, split it in half.
+     */
+    const unsigned int split = frame.pos + 1 >= (int) nr ? nr - 1 : nr / 2;
+    auto hdr = (ext4_extent_header *) block_buf_data(buf);
+    hdr->eh_magic = EXT4_EXT_MAGIC;
+    hdr->eh_entries = nr - split;
+    hdr->eh_max = ext4_ext_block_max(sb);
+    hdr->eh_depth = frame.hdr->eh_depth;
+    memcpy(ext4_ext_first(hdr), ext4_ext_first(frame.hdr) + split,
+           (nr - split) * sizeof(ext4_extent));
+
+    frame.hdr->eh_entries = split;
+    ext4_ext_dirty(ino, &frame);
+
+    auto idx = ext4_idx_first(parent.hdr) + parent.pos + 1;
+    memmove(idx + 1, idx, (parent.hdr->eh_entries - parent.pos - 1) * sizeof(ext4_extent_idx));
+    idx->ei_block = ext4_ext_first(hdr)->ee_block;
+    idx->ei_leaf_lo = res.value();
+    idx->ei_leaf_hi = 0;
+    idx->ei_unused = 0;
+    parent.hdr->eh_entries++;
+    ext4_ext_dirty(ino, &parent);
+
+    return 0;
+}
+
+/* The first entry of the path's leaf changed, so fix the indexes that point to it */
+static void ext4_ext_fix_keys(inode *ino, ext4_ext_path *path, ext2_block_no key)
+{
+    for (int level = path->depth - 1; level >= 0; level--)
+    {
+        auto &frame = path->frames[level];
+        ext4_idx_first(frame.hdr)[frame.pos].ei_block = key;
+        ext4_ext_dirty(ino, &frame);
+
+        if (frame.pos != 0)
+            break;
+    }
+}
+
+static bool ext4_ext_can_merge(const ext4_extent *left, ext2_block_no lblk, ext2_block_no pblk,
+                               uint32_t len, bool unwritten)
+{
+    const uint32_t left_len = ext4_ext_len(left);
+
+    return ext4_ext_unwritten(left) == unwritten && left->ee_block + left_len == lblk &&
+           left->ee_start_lo + left_len == pblk && left_len + len <= ext4_ext_max_len(unwritten);
+}
+
+/**
+ * @brief Add an extent to the tree
+ * Called with ext_lock held for writing. The range must not be mapped yet.
+ *
+ * @param ino The inode
+ * @param lblk First logical block
+ * @param pblk First physical block
+ * @param len Number of blocks, up to the max extent length
+ * @param unwritten True if the extent is unwritten
+ * @param sb The superblock
+ * @return 0 on success, negative error codes
+ */
+static int ext4_ext_insert(inode *ino, ext2_block_no lblk, ext2_block_no pblk, uint32_t len,
+                           bool unwritten, ext2_superblock *sb)
+{
+    ext4_ext_cache_clear((ext2_inode_info *) ino->i_helper);
+
+    for (;;)
+    {
+        ext4_ext_path path;
+        if (int st = ext4_ext_find(ino, lblk, &path, sb); st < 0)
+            return st;
+
+        auto &leaf = path.frames[path.depth];
+        auto hdr = leaf.hdr;
+        const auto first = ext4_ext_first(hdr);
+        auto prev = leaf.pos >= 0 ? first + leaf.pos : nullptr;
+        auto next = leaf.pos + 1 < hdr->eh_entries ? first + leaf.pos + 1 : nullptr;
+
+        if ((prev && lblk - prev->ee_block < ext4_ext_len(prev)) ||
+            (next && lblk + len > next->ee_block))
+        {
+            sb->error("Overlapping extents");
+            return -EIO;
+        }
+
+        if (prev && ext4_ext_can_merge(prev, lblk, pblk, len, unwritten))
+        {
+            ext4_ext_set_len(prev, ext4_ext_len(prev) + len, unwritten);
+            ext4_ext_dirty(ino, &leaf);
+            return 0;
+        }
+
+        if (next && ext4_ext_unwritten(next) == unwritten && lblk + len == next->ee_block &&
+            pblk + len == next->ee_start_lo &&
+            ext4_ext_len(next) + len <= ext4_ext_max_len(unwritten))
+        {
+            ext4_ext_set_len(next, ext4_ext_len(next) + len, unwritten);
+            next->ee_block = lblk;
+            next->ee_start_lo = pblk;
+            ext4_ext_dirty(ino, &leaf);
+
+            if (next == first)
+                ext4_ext_fix_keys(ino, &path, lblk);
+            return 0;
+        }
+
+        if (hdr->eh_entries < hdr->eh_max)
+        {
+            const int at = leaf.pos + 1;
+            auto ex = first + at;
+            memmove(ex + 1, ex, (hdr->eh_entries - at) * sizeof(ext4_extent));
+            ex->ee_block = lblk;
+            ext4_ext_set_len(ex, len, unwritten);
+            ex->ee_start_hi = 0;
+            ex->ee_start_lo = pblk;
+            hdr->eh_entries++;
+            ext4_ext_dirty(ino, &leaf);
+
+            if (at == 0)
+                ext4_ext_fix_keys(ino, &path, lblk);
+            return 0;
+        }
+
+        /* The leaf is full. Split the lowest full node whose parent has room, or grow the tree
+         * if there's no such node, and try again.
+         */
+        int level = path.depth - 1;
+        while (level >= 0 && path.frames[level].hdr->eh_entries == path.frames[level].hdr->eh_max)
+            level--;
+
+        int st = level < 0 ? ext4_ext_grow(ino, pblk, sb) : ext4_ext_split(ino, &path, level + 1,
+                                                                           pblk, sb);
+        if (st < 0)
+            return st;
+    }
+}
+
+/**
+ * @brief Map a run of newly allocated blocks
+ *
+ * @param ino The inode
+ * @param lblk First logical block
+ * @param pblk First physical block
+ * @param len Number of blocks
+ * @param sb The superblock
+ * @return 0 on success, negative error codes
+ */
+int ext4_ext_insert_blocks(inode *ino, ext2_block_no lblk, ext2_block_no pblk, uint32_t len,
+                           ext2_superblock *sb)
+{
+    auto info = (ext2_inode_info *) ino->i_helper;
+    scoped_rwlock<rw_lock::write> g{info->ext_lock};
+
+    while (len)
+    {
+        const uint32_t nr = cul::min(len, ext4_ext_max_len(false));
+        if (int st = ext4_ext_insert(ino, lblk, pblk, nr, false, sb); st < 0)
+            return st;
+
+        lblk += nr;
+        pblk += nr;
+        len -= nr;
+    }
+
+    inode_update_ctime(ino);
+    inode_mark_dirty(ino);
+    return 0;
+}
+
+/**
+ * @brief Prepare a range of unmapped blocks for writing.
+ * If the first block is part of an unwritten extent, mark as many blocks as we can as written.
+ * Else, find out how many blocks we need to allocate.
+ *
+ * @param ino The inode
+ * @param lblk First logical block
+ * @param count Number of blocks
+ * @param nr_out Number of blocks converted, or number of blocks to allocate
+ * @param sb The superblock
+ * @return First physical block of the converted run, EXT2_ERR_INV_BLOCK if the blocks need to be
+ * allocated, or a negative error code
+ */
+expected<ext2_block_no, int> ext4_ext_convert_unwritten(inode *ino, ext2_block_no lblk,
+                                                        uint32_t count, uint32_t *nr_out,
+                                                        ext2_superblock *sb)
+{
+    auto info = (ext2_inode_info *) ino->i_helper;
+    scoped_rwlock<rw_lock::write> g{info->ext_lock};
+    ext4_ext_path path;
+
+    if (int st = ext4_ext_find(ino, lblk, &path, sb); st < 0)
+        return unexpected<int>{st};
+
+    auto &leaf = path.frames[path.depth];
+    auto ex = leaf.pos >= 0 ? ext4_ext_first(leaf.hdr) + leaf.pos : nullptr;
+
+    if (!ex || lblk - ex->ee_block >= ext4_ext_len(ex) || !ext4_ext_unwritten(ex))
+    {
+        /* A hole. Allocate up to the next extent. */
+        const ext2_block_no next = ext4_ext_next_mapped(&path);
+        *nr_out = next - lblk < count ? next - lblk : count;
+        return EXT2_ERR_INV_BLOCK;
+    }
+
+    const uint32_t len = ext4_ext_len(ex);
+    const uint32_t left = lblk - ex->ee_block;
+    const uint32_t nr = cul::min(count, len - left);
+    const uint32_t right = len - left - nr;
+    const ext2_block_no pblk = ex->ee_start_lo + left;
+
+    ext4_ext_cache_clear(info);
+
+    /* Split the extent in up to three: [unwritten][written][unwritten]. If inserting the
+     * pieces fails, the tail of the extent is dropped, which leaks its blocks but doesn't
+     * expose stale data.
+     */
+    if (left)
+    {
+        ext4_ext_set_len(ex, left, true);
+        ext4_ext_dirty(ino, &leaf);
+
+        if (int st = ext4_ext_insert(ino, lblk, pblk, nr, false, sb); st < 0)
+            return unexpected<int>{st};
+    }
+    else
+    {
+        ext4_ext_set_len(ex, nr, false);
+        ext4_ext_dirty(ino, &leaf);
+    }
+
+    if (right)
+    {
+        if (int st = ext4_ext_insert(ino, lblk + nr, pblk + nr, right, true, sb); st < 0)
+            return unexpected<int>{st};
+    }
+
+    *nr_out = nr;
+    return pblk;
+}
+
+static void ext4_ext_free_blocks(inode *ino, ext2_block_no pblk, uint32_t len,
+                                 ext2_superblock *sb)
+{
+    for (uint32_t i = 0; i < len; i++)
+        sb->free_block(pblk + i);
+    ino->i_blocks -= (unsigned long) len * (sb->block_size >> 9);
+}
+
+/**
+ * @brief Remove every block at or past \p first from a subtree
+ *
+ * @return True if the node is now empty, false if not, or a negative error code
+ */
+static expected<bool, int> ext4_ext_remove(inode *ino, ext4_extent_header *hdr,
+                                           ext2_block_no first, ext2_superblock *sb)
+{
+    if (hdr->eh_depth == 0)
+    {
+        auto extents = ext4_ext_first(hdr);
+
+        while (hdr->eh_entries)
+        {
+            auto ex = &extents[hdr->eh_entries - 1];
+            const uint32_t len = ext4_ext_len(ex);
+
+            if (ex->ee_block + len <= first)
+                break;
+
+            if (ex->ee_block >= first)
+            {
+                ext4_ext_free_blocks(ino, ex->ee_start_lo, len, sb);
+                hdr->eh_entries--;
+                continue;
+            }
+
+            const uint32_t keep = first - ex->ee_block;
+            ext4_ext_free_blocks(ino, ex->ee_start_lo + keep, len - keep, sb);
+            ext4_ext_set_len(ex, keep, ext4_ext_unwritten(ex));
+            break;
+        }
+
+        return hdr->eh_entries == 0;
+    }
+
+    auto indexes = ext4_idx_first(hdr);
+
+    while (hdr->eh_entries)
+    {
+        auto idx = &indexes[hdr->eh_entries - 1];
+        if (idx->ei_leaf_hi)
+        {
+            sb->error("Extent tree node past 32-bit block numbers");
+            return unexpected<int>{-EIO};
+        }
+
+        auto_block_buf buf = sb_read_block(sb, idx->ei_leaf_lo);
+        if (!buf)
+            return unexpected<int>{-EIO};
+
+        auto child = (ext4_extent_header *) block_buf_data(buf);
+        if (int st = ext4_ext_check(child, hdr->eh_depth - 1, ext4_ext_block_max(sb), sb); st < 0)
+            return unexpected<int>{st};
+
+        auto res = ext4_ext_remove(ino, child, first, sb);
+        if (res.has_error())
+            return res;
+
+        if (!res.value())
+        {
+            /* Everything to the left of this one is before first */
+            block_buf_dirty(buf);
+            break;
+        }
+
+        ext4_ext_free_blocks(ino, idx->ei_leaf_lo, 1, sb);
+        hdr->eh_entries--;
+    }
+
+    return hdr->eh_entries == 0;
+}
+
+/**
+ * @brief Unmap and free every block at or past \p first
+ *
+ * @param ino The inode
+ * @param first First logical block to remove
+ * @param sb The superblock
+ * @return 0 on success, negative error codes
+ */
+int ext4_ext_truncate(inode *ino, ext2_block_no first, ext2_superblock *sb)
+{
+    auto info = (ext2_inode_info *) ino->i_helper;
+    scoped_rwlock<rw_lock::write> g{info->ext_lock};
+    auto root = ext4_ext_root(ino);
+
+    if (root->eh_depth > EXT4_EXT_MAX_DEPTH)
+    {
+        sb->error("Extent tree too deep");
+        return -EIO;
+    }
+
+    if (int st = ext4_ext_check(root, root->eh_depth, EXT4_EXT_ROOT_MAX, sb); st < 0)
+        return st;
+
+    ext4_ext_cache_clear(info);
+
+    auto res = ext4_ext_remove(ino, root, first, sb);
+    if (res.has_error())
+        return res.error();
+
+    /* An empty tree goes back to being a single (empty) leaf */
+    if (res.value())
+    {
+        root->eh_depth = 0;
+        root->eh_max = EXT4_EXT_ROOT_MAX;
+    }
+
+    inode_mark_dirty(ino);
+    return 0;
+}
@@ -86,9 +86,13 @@ unsigned int ext2_get_block_path(ext2_superblock *sb, ext2_block_no offsets[4],
     return idx;
 }
 
-expected<ext2_block_no, int> ext2_get_block_from_inode(ext2_inode *ino, ext2_block_no block,
+expected<ext2_block_no, int> ext2_get_block_from_inode(inode *vfs_ino, ext2_block_no block,
                                                        ext2_superblock *sb)
 {
+    auto ino = ext2_get_inode_from_node(vfs_ino);
+    if (ext4_has_extents(ino))
+        return ext4_ext_map_block(vfs_ino, block, sb);
+
     ext2_block_no offsets[4];
 
     unsigned int len = ext2_get_block_path(sb, offsets, block);
@@ -123,10 +127,94 @@ expected<ext2_block_no, int> ext2_get_block_from_inode(ext2_inode *ino, ext2_blo
     return dest_block_nr;
 }
 
+/**
+ * @brief Pick the block we'd like a file block to go in
+ *
+ * @param ino The inode
+ * @param block The file block
+ * @param sb The superblock
+ * @return The goal block
+ */
+static ext2_block_no ext2_find_goal(struct inode *ino, ext2_block_no block, ext2_superblock *sb)
+{
+    auto info = (ext2_inode_info *) ino->i_helper;
+
+    /* Appending right after our last allocation, the common case */
+    if (info->last_alloc_phys != EXT2_ERR_INV_BLOCK && block == info->last_alloc_logical + 1)
+        return info->last_alloc_phys + 1;
+
+    /* Right after the previous block in the file, if there's one */
+    if (block > 0)
+    {
+        auto res = ext2_get_block_from_inode(ino, block - 1, sb);
+        if (res.has_value() && res.value() != EXT2_FILE_HOLE_BLOCK)
+            return res.value() + 1;
+    }
+
+    /* Else, somewhere in the inode's block group */
+    return ext2_inode_number_to_bg(ino->i_inode, sb) * sb->blocks_per_block_group +
+           sb->first_data_block();
+}
+
+/**
+ * @brief Allocate a run of contiguous blocks for an inode, near its other blocks and inside its
+ * reservation window.
+ *
+ * @param ino The inode
+ * @param block The file block the run is for
+ * @param count Max number of blocks to allocate
+ * @param nr_out Number of blocks allocated
+ * @param sb The superblock
+ * @param data True if these are data blocks (and not indirect blocks)
+ * @return First block of the run, or EXT2_ERR_INV_BLOCK if we're out of space
+ */
+static ext2_block_no ext2_alloc_inode_blocks(struct inode *ino, ext2_block_no block,
+                                             uint32_t count, uint32_t *nr_out, ext2_superblock *sb,
+                                             bool data)
+{
+    auto info = (ext2_inode_info *) ino->i_helper;
+    scoped_mutex g{info->alloc_lock};
+
+    const ext2_block_no goal = ext2_find_goal(ino, block, sb);
+    ext2_block_no res = sb->allocate_blocks(goal, count, &info->rsv, nr_out);
+
+    if (res != EXT2_ERR_INV_BLOCK && data)
+    {
+        info->last_alloc_logical = block + *nr_out - 1;
+        info->last_alloc_phys = res + *nr_out - 1;
+    }
+
+    return res;
+}
+
+/**
+ * @brief Drop the inode's reservation window and allocation goal
+ *
+ * @param ino The inode
+ * @param sb The superblock
+ */
+void ext2_discard_reservation(struct inode *ino, ext2_superblock *sb)
+{
+    auto info = (ext2_inode_info *) ino->i_helper;
+    scoped_mutex g{info->alloc_lock};
+
+    sb->release_rsv(&info->rsv);
+    info->last_alloc_phys = EXT2_ERR_INV_BLOCK;
+}
+
+/**
+ * @brief Create the path to a file block, allocating indirect blocks as needed
+ *
+ * @param ino The inode
+ * @param block The file block
+ * @param sb The superblock
+ * @param data_block Block to map in if the file block is a hole, or EXT2_ERR_INV_BLOCK to
+ * allocate one. If the file block turns out to be mapped already, data_block is freed.
+ * @return The file block's block number, or a negative error code
+ */
 expected<ext2_block_no, int> ext2_create_path(struct inode *ino, ext2_block_no block,
-                                              ext2_superblock *sb)
+                                              ext2_superblock *sb, ext2_block_no data_block)
 {
-    auto preferred_bg = ext2_inode_number_to_bg(ino->i_inode, sb);
     auto raw_inode = ext2_get_inode_from_node(ino);
 
     ext2_block_no offsets[4];
@@ -149,15 +237,19 @@ expected<ext2_block_no, int> ext2_create_path(struct inode *ino, ext2_block_no b
 
             if (b == EXT2_ERR_INV_BLOCK)
             {
-                auto block = sb->allocate_block(preferred_bg);
-                if (block == EXT2_ERR_INV_BLOCK)
+                /* Indirect blocks go right next to the data they point to */
+                uint32_t nr;
+                auto block_ = ext2_alloc_inode_blocks(ino, block, 1, &nr, sb, false);
+                if (block_ == EXT2_ERR_INV_BLOCK)
                 {
+                    if (data_block != EXT2_ERR_INV_BLOCK)
+                        sb->free_block(data_block);
                     return unexpected<int>{-ENOSPC};
                 }
 
                 should_zero_block = true;
 
-                b = curr_block[off] = block;
+                b = curr_block[off] = block_;
 
                 ino->i_blocks += sb->block_size >> 9;
 
@@ -172,7 +264,11 @@ expected<ext2_block_no, int> ext2_create_path(struct inode *ino, ext2_block_no b
 
             buf = sb_read_block(sb, b);
             if (!buf)
+            {
+                if (data_block != EXT2_ERR_INV_BLOCK)
+                    sb->free_block(data_block);
                 return unexpected<int>{-errno};
+            }
 
             curr_block = static_cast<uint32_t *>(block_buf_data(buf));
 
@@ -188,24 +284,123 @@ expected<ext2_block_no, int> ext2_create_path(struct inode *ino, ext2_block_no b
 
             if (dest_block_nr == EXT2_FILE_HOLE_BLOCK)
             {
-                auto block = sb->allocate_block();
-                if (block == EXT2_ERR_INV_BLOCK)
-                    return unexpected<int>{-ENOSPC};
+                auto block_ = data_block;
+                if (block_ == EXT2_ERR_INV_BLOCK)
+                {
+                    uint32_t nr;
+                    block_ = ext2_alloc_inode_blocks(ino, block, 1, &nr, sb, true);
+                    if (block_ == EXT2_ERR_INV_BLOCK)
+                        return unexpected<int>{-ENOSPC};
+                }
 
-                dest_block_nr = curr_block[off] = block;
+                dest_block_nr = curr_block[off] = block_;
 
                 ino->i_blocks += sb->block_size >> 9;
                 // printk("Block: %u\n", block);
                 // printk("Iblocks %lu\n", ino->i_blocks);
+                if (buf)
+                    block_buf_dirty(buf);
                 inode_update_ctime(ino);
                 inode_mark_dirty(ino);
             }
+            else if (data_block != EXT2_ERR_INV_BLOCK)
+            {
+                /* Someone beat us to it */
+                sb->free_block(data_block);
+            }
         }
     }
 
     return dest_block_nr;
 }
 
+/**
+ * @brief Map a run of holes in a file, allocating their blocks in as few contiguous runs as
+ * possible.
+ *
+ * @param ino The inode
+ * @param block First file block
+ * @param count Number of file blocks
+ * @param bufs The block_bufs of the file blocks, in order, to be filled with the block numbers.
+ * May be nullptr, if the blocks aren't in the page cache.
+ * @param sb The superblock
+ * @return 0 on success, negative error code
+ */
+static int ext2_map_holes(struct inode *ino, ext2_block_no block, uint32_t count,
+                          struct block_buf **bufs, ext2_superblock *sb)
+{
+    const bool extents = ext4_has_extents(ext2_get_inode_from_node(ino));
+
+    while (count)
+    {
+        uint32_t nr = count;
+        ext2_block_no run;
+
+        if (extents)
+        {
+            /* Preallocated blocks just need to be marked as written */
+            auto res = ext4_ext_convert_unwritten(ino, block, count, &nr, sb);
+            if (res.has_error())
+                return res.error();
+
+            run = res.value();
+            if (run == EXT2_ERR_INV_BLOCK)
+            {
+                run = ext2_alloc_inode_blocks(ino, block, nr, &nr, sb, true);
+                if (run == EXT2_ERR_INV_BLOCK)
+                    return -ENOSPC;
+
+                if (int st = ext4_ext_insert_blocks(ino, block, run, nr, sb); st < 0)
+                {
+                    for (uint32_t i = 0; i < nr; i++)
+                        sb->free_block(run + i);
+                    return st;
+                }
+
+                ino->i_blocks += (unsigned long) nr * (sb->block_size >> 9);
+                inode_mark_dirty(ino);
+            }
+
+            if (bufs)
+            {
+                for (uint32_t i = 0; i < nr; i++)
+                    bufs[i]->block_nr = run + i;
+                bufs += nr;
+            }
+
+            block += nr;
+            count -= nr;
+            continue;
+        }
+
+        run = ext2_alloc_inode_blocks(ino, block, count, &nr, sb, true);
+        if (run == EXT2_ERR_INV_BLOCK)
+            return -ENOSPC;
+
+        for (uint32_t i = 0; i < nr; i++)
+        {
+            auto res = ext2_create_path(ino, block + i, sb, run + i);
+            if (res.has_error())
+            {
+                /* Give back the part of the run we didn't get to use */
+                for (uint32_t j = i + 1; j < nr; j++)
+                    sb->free_block(run + j);
+                return res.error();
+            }
+
+            if (bufs)
+                bufs[i]->block_nr = res.value();
+        }
+
+        block += nr;
+        if (bufs)
+            bufs += nr;
+        count -= nr;
+    }
+
+    return 0;
+}
+
 int ext2_prepare_write(inode *ino, struct page *page, size_t page_off, size_t offset, size_t len)
 {
     auto end = offset + len;
@@ -242,29 +437,102 @@ int ext2_prepare_write(inode *ino, struct page *page, size_t page_off, size_t of
         bufs = block_buf_from_page(page);
     }
 
-    while (bufs)
-    {
-        if (bufs->page_off >= offset && bufs->page_off < end)
-        {
-            auto relative_block = bufs->page_off / sb->block_size;
+    /* Gather runs of holes in the range we're writing to, and allocate each in one go */
+    struct block_buf *holes[PAGE_SIZE / 512];
+    uint32_t nr_holes = 0;
+    ext2_block_no first_hole = 0;
 
-            auto block_number = bufs->block_nr;
+    for (; bufs; bufs = bufs->next)
+    {
+        bool in_range = bufs->page_off >= offset && bufs->page_off < end;
+        auto relative_block = bufs->page_off / sb->block_size;
 
-            if (block_number == EXT2_FILE_HOLE_BLOCK)
-            {
-                auto res = ext2_create_path(ino, base_block + relative_block, sb);
-                // printk("creating path for poff %u file off %lu\n", bufs->page_off, offset);
+        bool hole = in_range && bufs->block_nr == EXT2_FILE_HOLE_BLOCK;
 
-                if (res.has_error())
-                    return res.error();
+        if (hole)
+        {
+            /* ext2_prepare_write_range may have mapped it already */
+            auto res = ext2_get_block_from_inode(ino, base_block + relative_block, sb);
+            if (res.has_error())
+                return res.error();
 
+            if (res.value() != EXT2_FILE_HOLE_BLOCK)
+            {
                 bufs->block_nr = res.value();
+                hole = false;
             }
         }
 
-        bufs = bufs->next;
+        if (hole)
+        {
+            if (!nr_holes)
+                first_hole = base_block + relative_block;
+            holes[nr_holes++] = bufs;
+            continue;
+        }
+
+        if (nr_holes)
+        {
+            if (int st = ext2_map_holes(ino, first_hole, nr_holes, holes, sb); st < 0)
+                return st;
+            nr_holes = 0;
+        }
     }
 
+    if (nr_holes)
+        return ext2_map_holes(ino, first_hole, nr_holes, holes, sb);
+
+    return 0;
+}
+
+/**
+ * @brief Allocate blocks for the holes in a range we're about to write to
+ * Runs of holes that span several pages get allocated in one go, instead of one page at a time
+ * in ext2_prepare_write.
+ *
+ * @param ino The inode
+ * @param offset Start of the write
+ * @param len Length of the write
+ * @return 0 on success, negative error code
+ */
+int ext2_prepare_write_range(inode *ino, size_t offset, size_t len)
+{
+    auto sb = ext2_superblock_from_inode(ino);
+
+    /* Only map blocks the write covers entirely. Partially written blocks are read in before
+     * being written to, and a freshly allocated block would read back as stale disk contents.
+     * ext2_prepare_write handles those.
+     */
+    ext2_block_no block = (offset + sb->block_size - 1) / sb->block_size;
+    ext2_block_no end = (offset + len) / sb->block_size;
+    ext2_block_no first_hole = 0;
+    uint32_t nr_holes = 0;
+
+    for (; block < end; block++)
+    {
+        auto res = ext2_get_block_from_inode(ino, block, sb);
+        if (res.has_error())
+            return res.error();
+
+        if (res.value() == EXT2_FILE_HOLE_BLOCK)
+        {
+            if (!nr_holes)
+                first_hole = block;
+            nr_holes++;
+            continue;
+        }
+
+        if (nr_holes)
+        {
+            if (int st = ext2_map_holes(ino, first_hole, nr_holes, nullptr, sb); st < 0)
+                return st;
+            nr_holes = 0;
+        }
+    }
+
+    if (nr_holes)
+        return ext2_map_holes(ino, first_hole, nr_holes, nullptr, sb);
+
     return 0;
 }
 
@@ -449,6 +717,27 @@ int ext2_free_space(size_t new_len, inode *ino)
         return 0;
     }
 
+    /* Whatever we had reserved past the new end is most likely useless now */
+    ext2_discard_reservation(ino, sb);
+
+    if (ext4_has_extents(raw_inode))
+    {
+        const ext2_block_no first = cul::align_up2(new_len, sb->block_size) >> sb->block_size_shift;
+        inode_truncate_range(ino, (size_t) first << sb->block_size_shift,
+                             cul::align_up2(ino->i_size, sb->block_size));
+
+        if (int st = ext4_ext_truncate(ino, first, sb); st < 0)
+        {
+            ERROR("ext2", "Error truncating file: %d\n", st);
+            sb->error("Error truncating file");
+            return st;
+        }
+
+        if (new_len & (sb->block_size - 1))
+            inode_truncate_range(ino, new_len, ino->i_size);
+        return 0;
+    }
+
     ext2_block_coords curr_coords{};
 
     ext2_block_coords boundary_coords;
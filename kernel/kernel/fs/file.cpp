@@ -23,6 +23,7 @@
 #include <onyx/mm/slab.h>
 #include <onyx/namei.h>
 #include <onyx/panic.h>
+#include <onyx/pipe.h>
 #include <onyx/process.h>
 #include <onyx/rcupdate.h>
 #include <onyx/user.h>
@@ -1104,6 +1105,41 @@ ssize_t sys_pwritev(int fd, const struct iovec *vec, int veccnt, off_t offset)
     return write_iter_vfs(f.get_file(), offset, &iter, 0);
 }
 
+ssize_t sys_vmsplice(int fd, const struct iovec *vec, size_t nr_segs, unsigned int flags)
+{
+    iovec_guard guard;
+    ssize_t st;
+    auto_file f = get_file_description(fd);
+    if (!f)
+        return -EBADF;
+
+    struct file *filp = f.get_file();
+
+    if (!file_is_pipe(filp))
+        return -EBADF;
+
+    if (flags & ~(SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE | SPLICE_F_GIFT))
+        return -EINVAL;
+
+    if (nr_segs > IOV_MAX)
+        return -EINVAL;
+
+    if (st = fetch_iovec(vec, nr_segs, guard); st < 0)
+        return st;
+
+    iovec_iter iter = guard.to_iter(nr_segs);
+
+    /* We don't map user pages into the pipe (SPLICE_F_GIFT is a hint anyway), so this ends up being
+     * a copy, much like readv/writev on the pipe.
+     */
+    if (fd_may_access(filp, FILE_ACCESS_WRITE))
+        return write_iter_vfs(filp, 0, &iter, 0);
+    else if (fd_may_access(filp, FILE_ACCESS_READ))
+        return read_iter_vfs(filp, 0, &iter, 0);
+
+    return -EBADF;
+}
+
 unsigned int putdir(struct dirent *buf, struct dirent *ubuf, unsigned int count);
 
 int sys_getdents(int fd, struct dirent *dirp, unsigned int count)
@@ -1131,6 +1167,132 @@ int sys_getdents(int fd, struct dirent *dirp, unsigned int count)
     return ret;
 }
 
+/**
+ * @brief Find the dentry for an entry we just got out of getdirent
+ * This never walks a path: dcache-backed directories hand us the dentry through their readdir
+ * cursor, everything else is a single dcache lookup in the directory.
+ *
+ * @param dir Directory
+ * @param ent Directory entry
+ * @return Referenced dentry (crossing into mounts), or nullptr
+ */
+static dentry *getdents_plus_lookup(struct file *dir, const struct dirent *ent)
+{
+    dentry *d;
+    const std::string_view name{ent->d_name};
+
+    if (dir->f_ino->i_fops->getdirent == dcache_getdirent && name != "." && name != "..")
+    {
+        d = (dentry *) dir->private_data;
+        dentry_get(d);
+    }
+    else
+        d = dentry_lookup_internal(name, dir->f_dentry);
+
+    if (d && dentry_is_mountpoint(d))
+    {
+        auto dest = d->d_mount_dentry;
+        dentry_get(dest);
+        dentry_put(d);
+        d = dest;
+    }
+
+    return d;
+}
+
+static int getdents_plus_stat(struct stat *buf, dentry *d)
+{
+    // ->stat only looks at the file's inode and dentry, so a transient file will do
+    struct file f;
+    f.f_refcount = 1;
+    f.f_seek = 0;
+    f.f_ino = d->d_inode;
+    f.f_dentry = d;
+    f.private_data = nullptr;
+    f.f_flags = O_RDONLY;
+
+    return stat_vfs(buf, &f);
+}
+
+int sys_getdents_plus(int fd, struct dirent_plus *udirp, unsigned int count, unsigned int flags)
+{
+    if (!count || flags != 0)
+        return -EINVAL;
+
+    auto_fd f = fdget_seek(fd);
+    if (!f)
+        return -errno;
+
+    auto fil = f.get_file();
+
+    if (!S_ISDIR(fil->f_ino->i_mode))
+        return -ENOTDIR;
+
+    if (!file_can_access(fil, FILE_ACCESS_READ))
+        return -EACCES;
+
+    struct dirent ent;
+    struct dirent_plus *dp = (struct dirent_plus *) malloc(sizeof(*dp));
+    if (!dp)
+        return -ENOMEM;
+
+    unsigned int pos = 0;
+    off_t off = fil->f_seek;
+    int st = 0;
+
+    while (pos < count)
+    {
+        off_t next = do_getdirent(&ent, off, fil);
+        if (next <= 0)
+        {
+            st = next;
+            break;
+        }
+
+        const size_t namelen = strlen(ent.d_name);
+        unsigned int reclen = offsetof(struct dirent_plus, d_name) + namelen + 1;
+        reclen = ALIGN_TO(reclen, alignof(struct dirent_plus));
+
+        if (reclen > count - pos)
+        {
+            if (!pos)
+                st = -EINVAL;
+            break;
+        }
+
+        memset(&dp->dp_stat, 0, sizeof(dp->dp_stat));
+        dp->d_ino = ent.d_ino;
+        dp->d_off = next;
+        dp->d_reclen = reclen;
+        dp->d_type = ent.d_type;
+        dp->dp_flags = 0;
+        memcpy(dp->d_name, ent.d_name, namelen + 1);
+
+        if (dentry *d = getdents_plus_lookup(fil, &ent); d)
+        {
+            if (getdents_plus_stat(&dp->dp_stat, d) == 0)
+                dp->dp_flags |= DIRENT_PLUS_STAT_VALID;
+            dentry_put(d);
+        }
+
+        if (copy_to_user((u8 *) udirp + pos, dp, reclen) < 0)
+        {
+            st = -EFAULT;
+            break;
+        }
+
+        pos += reclen;
+        off = next;
+    }
+
+    free(dp);
+    fil->f_seek = off;
+
+    if (pos)
+        return pos;
+    return st;
+}
+
 int sys_ioctl(int fd, int request, char *argp)
 {
     struct file *f = get_file_description(fd);
@@ -7,6 +7,7 @@
  */
 
 #include <onyx/filemap.h>
+#include <onyx/mm/flush.h>
 #include <onyx/pagecache.h>
 #include <onyx/vfs.h>
 
@@ -189,24 +190,27 @@ ssize_t file_write_cache(void *buffer, size_t len, struct inode *ino, size_t off
     return file_write_cache_unlocked(buffer, len, ino, offset);
 }
 
-/**
- * @brief Write to a generic file (using the page cache) using iovec_iter
- *
- * @param filp File pointer
- * @param off Offset
- * @param iter Iterator
- * @param flags Flags
- * @return Written bytes, or negative error code
- */
-ssize_t filemap_write_iter(struct file *filp, size_t off, iovec_iter *iter, unsigned int flags)
+/* How much of a write we let the filesystem prepare (allocate blocks for) at once */
+#define FILEMAP_WRITE_CLUSTER (64 * PAGE_SIZE)
+
+static ssize_t filemap_do_write(struct file *filp, size_t off, iovec_iter *iter)
 {
     struct inode *ino = filp->f_ino;
     scoped_rwlock<rw_lock::write> g{ino->i_rwlock};
 
     ssize_t st = 0;
+    size_t prepared_end = off;
 
     while (!iter->empty())
     {
+        if (ino->i_fops->prepare_write_range && off >= prepared_end)
+        {
+            size_t len = min(iter->bytes, (size_t) FILEMAP_WRITE_CLUSTER);
+            if (int st2 = ino->i_fops->prepare_write_range(ino, off, len); st2 < 0)
+                return st ?: st2;
+            prepared_end = off + len;
+        }
+
         struct page_cache_block *cache = inode_get_page(ino, off, FILE_CACHING_WRITE);
 
         if (!cache)
@@ -251,3 +255,22 @@ ssize_t filemap_write_iter(struct file *filp, size_t off, iovec_iter *iter, unsi
 
     return st;
 }
+
+/**
+ * @brief Write to a generic file (using the page cache) using iovec_iter
+ *
+ * @param filp File pointer
+ * @param off Offset
+ * @param iter Iterator
+ * @param flags Flags
+ * @return Written bytes, or negative error code
+ */
+ssize_t filemap_write_iter(struct file *filp, size_t off, iovec_iter *iter, unsigned int flags)
+{
+    ssize_t st = filemap_do_write(filp, off, iter);
+
+    /* Heavy writers wait for writeback here, with the inode unlocked */
+    if (st > 0)
+        flush_throttle_dirty();
+    return st;
+}
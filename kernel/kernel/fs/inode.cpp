@@ -15,14 +15,17 @@
 #include <onyx/fnv.h>
 #include <onyx/page.h>
 #include <onyx/pagecache.h>
+#include <onyx/mutex.h>
 #include <onyx/panic.h>
+#include <onyx/rcupdate.h>
 #include <onyx/rwlock.h>
 #include <onyx/scoped_lock.h>
 #include <onyx/vfs.h>
 #include <onyx/vm.h>
 #include <onyx/wait.h>
 
-#include <onyx/hashtable.hpp>
+#include <uapi/memstat.h>
+
 #include <onyx/list.hpp>
 
 fnv_hash_t inode_hash(inode &ino)
@@ -38,10 +41,119 @@ fnv_hash_t inode_hash(dev_t dev, ino_t ino)
     return fnv_hash_cont(&ino, sizeof(ino_t), h);
 }
 
-constexpr size_t inode_hashtable_size = 512;
+/* Like the dcache, the inode hashtable is sized at boot and grows with its load. A given hash
+ * always maps to the same lock stripe, whatever the size of the table.
+ */
+#define INODE_HT_NR_LOCKS  512
+#define INODE_HT_MIN_SHIFT 9
+#define INODE_HT_MAX_SHIFT 20
+/* One bucket per this many pages of memory, at boot */
+#define INODE_HT_PAGES_PER_BUCKET 8
+/* Grow when we average more than this many inodes per bucket */
+#define INODE_HT_MAX_LOAD 2UL
+
+struct inode_hashtable
+{
+    unsigned int shift;
+    struct list_head buckets[];
+};
+
+static inode_hashtable *inode_ht;
+static struct spinlock inode_hashtable_locks[INODE_HT_NR_LOCKS];
+static unsigned long inode_ht_nr_entries;
+static mutex inode_ht_resize_lock;
+
+static size_t inode_ht_pages(unsigned int shift)
+{
+    return vm_size_to_pages(sizeof(inode_hashtable) + (sizeof(list_head) << shift));
+}
+
+static inode_hashtable *inode_ht_alloc(unsigned int shift)
+{
+    auto ht = (inode_hashtable *) vmalloc(inode_ht_pages(shift), VM_TYPE_REGULAR,
+                                          VM_READ | VM_WRITE, GFP_KERNEL);
+    if (!ht)
+        return nullptr;
+
+    ht->shift = shift;
+    for (size_t i = 0; i < (1UL << shift); i++)
+        INIT_LIST_HEAD(&ht->buckets[i]);
+    return ht;
+}
+
+static inline struct spinlock &inode_ht_lock(fnv_hash_t hash)
+{
+    return inode_hashtable_locks[hash & (INODE_HT_NR_LOCKS - 1)];
+}
+
+/* Must hold the bucket's lock stripe */
+static inline list_head *inode_ht_bucket(fnv_hash_t hash)
+{
+    return &inode_ht->buckets[hash & ((1UL << inode_ht->shift) - 1)];
+}
+
+/**
+ * @brief Double the size of the inode hashtable, if it's too loaded.
+ * Must be called without any spinlocks held.
+ *
+ */
+static void inode_ht_maybe_grow()
+{
+    auto ht = __atomic_load_n(&inode_ht, __ATOMIC_RELAXED);
+    if (ht->shift == INODE_HT_MAX_SHIFT ||
+        __atomic_load_n(&inode_ht_nr_entries, __ATOMIC_RELAXED) <= (INODE_HT_MAX_LOAD << ht->shift))
+        return;
+
+    if (!mutex_trylock(&inode_ht_resize_lock))
+        return;
+
+    ht = inode_ht;
+    auto new_ht = inode_ht_alloc(ht->shift + 1);
+    if (!new_ht)
+    {
+        mutex_unlock(&inode_ht_resize_lock);
+        return;
+    }
+
+    for (auto &lock : inode_hashtable_locks)
+        spin_lock(&lock);
+
+    for (size_t i = 0; i < (1UL << ht->shift); i++)
+    {
+        list_for_every_safe (&ht->buckets[i])
+        {
+            auto ino = container_of(l, inode, i_hash_list_node);
+            auto hash = inode_hash(*ino);
+            list_remove(&ino->i_hash_list_node);
+            list_add_tail(&ino->i_hash_list_node,
+                          &new_ht->buckets[hash & ((1UL << new_ht->shift) - 1)]);
+        }
+    }
+
+    inode_ht = new_ht;
+
+    for (auto &lock : inode_hashtable_locks)
+        spin_unlock(&lock);
+
+    /* No one looks at the table without a lock, so we can free it right away */
+    vfree(ht, inode_ht_pages(ht->shift));
+    mutex_unlock(&inode_ht_resize_lock);
+}
+
+void inode_cache_init()
+{
+    struct memstat stat;
+    page_get_stats(&stat);
+
+    unsigned int shift = ilog2(stat.total_pages / INODE_HT_PAGES_PER_BUCKET | 1);
+    if (shift < INODE_HT_MIN_SHIFT)
+        shift = INODE_HT_MIN_SHIFT;
+    if (shift > INODE_HT_MAX_SHIFT)
+        shift = INODE_HT_MAX_SHIFT;
 
-static cul::hashtable2<inode, inode_hashtable_size, fnv_hash_t, inode_hash> inode_hashtable;
-static struct spinlock inode_hashtable_locks[inode_hashtable_size];
+    inode_ht = inode_ht_alloc(shift);
+    CHECK(inode_ht != nullptr);
+}
 
 struct page_cache_block *inode_get_cache_block(struct inode *ino, size_t off, long flags)
 {
@@ -60,7 +172,7 @@ struct page_cache_block *inode_get_cache_block(struct inode *ino, size_t off, lo
         vmo_truncate(ino->i_pages, cul::align_up2(off + 1, PAGE_SIZE), 0);
         assert(ino->i_pages->size > off);
 
-        struct page *p = alloc_page(0);
+        struct page *p = alloc_page(PAGE_ALLOC_RECLAIMABLE);
         if (!p)
             return nullptr;
 
@@ -158,6 +270,8 @@ void inode_destroy_page_caches(struct inode *inode)
 
 ssize_t inode_sync(struct inode *inode)
 {
+    ssize_t st = 0;
+
     if (!inode->i_pages)
         return 0;
     scoped_mutex g{inode->i_pages->page_lock};
@@ -168,13 +282,21 @@ ssize_t inode_sync(struct inode *inode)
 
         if (page->flags & PAGE_FLAG_DIRTY)
         {
-            flush_sync_one(&b->fobj);
+            // Keep going on errors, but report the first one
+            ssize_t st2 = flush_sync_one(&b->fobj);
+            if (st2 < 0 && !st)
+                st = st2;
         }
 
         return true;
     });
 
-    return 0;
+    // Background writeback may have failed on pages that are clean (or written back) by now
+    int err = __atomic_exchange_n(&inode->i_wb_error, 0, __ATOMIC_RELAXED);
+    if (err && !st)
+        st = err;
+
+    return st;
 }
 
 bool inode_is_cacheable(struct inode *file);
@@ -215,7 +337,9 @@ void inode_release(struct inode *inode)
     if (inode->i_fops->close != nullptr)
         inode->i_fops->close(inode);
 
-    free(inode);
+    /* RCU path walkers might still be checking permissions on it */
+    call_rcu(&inode->i_rcu,
+             [](struct rcu_head *head) { free(container_of(head, struct inode, i_rcu)); });
 }
 
 void inode_unref(struct inode *ino)
@@ -233,13 +357,11 @@ struct inode *superblock_find_inode(struct superblock *sb, ino_t ino_nr)
 {
     auto hash = inode_hash(sb->s_devnr, ino_nr);
 
-    auto index = inode_hashtable.get_hashtable_index(hash);
-
 restart:
 
-    scoped_lock g{inode_hashtable_locks[index]};
+    scoped_lock g{inode_ht_lock(hash)};
 
-    auto _l = inode_hashtable.get_hashtable(index);
+    auto _l = inode_ht_bucket(hash);
 
     list_for_every (_l)
     {
@@ -269,27 +391,29 @@ restart:
 void superblock_add_inode_unlocked(struct superblock *sb, struct inode *inode)
 {
     auto hash = inode_hash(sb->s_devnr, inode->i_inode);
-    auto index = inode_hashtable.get_hashtable_index(hash);
+    auto &lock = inode_ht_lock(hash);
 
-    MUST_HOLD_LOCK(&inode_hashtable_locks[index]);
+    MUST_HOLD_LOCK(&lock);
 
-    auto head = inode_hashtable.get_hashtable(index);
+    list_add_tail(&inode->i_hash_list_node, inode_ht_bucket(hash));
+    __atomic_add_fetch(&inode_ht_nr_entries, 1, __ATOMIC_RELAXED);
 
-    list_add_tail(&inode->i_hash_list_node, head);
+    {
+        scoped_lock g{sb->s_ilock};
+        list_add_tail(&inode->i_sb_list_node, &sb->s_inodes);
+        __atomic_add_fetch(&sb->s_ref, 1, __ATOMIC_ACQUIRE);
+    }
 
-    scoped_lock g{sb->s_ilock};
-    list_add_tail(&inode->i_sb_list_node, &sb->s_inodes);
-    __atomic_add_fetch(&sb->s_ref, 1, __ATOMIC_ACQUIRE);
+    spin_unlock(&lock);
 
-    spin_unlock(&inode_hashtable_locks[index]);
+    inode_ht_maybe_grow();
 }
 
 /* Should only be used when creating new inodes(so we're sure that they don't exist). */
 void superblock_add_inode(struct superblock *sb, struct inode *inode)
 {
     auto hash = inode_hash(sb->s_devnr, inode->i_inode);
-    auto index = inode_hashtable.get_hashtable_index(hash);
-    scoped_lock g{inode_hashtable_locks[index]};
+    scoped_lock g{inode_ht_lock(hash)};
     superblock_add_inode_unlocked(sb, inode);
 
     // Was already unlocked
@@ -300,14 +424,13 @@ void superblock_remove_inode(struct superblock *sb, struct inode *inode)
 {
     auto hash = inode_hash(sb->s_devnr, inode->i_inode);
 
-    auto index = inode_hashtable.get_hashtable_index(hash);
-
-    scoped_lock g1{inode_hashtable_locks[index]};
+    scoped_lock g1{inode_ht_lock(hash)};
 
     scoped_lock g2{sb->s_ilock};
 
     list_remove(&inode->i_sb_list_node);
     list_remove(&inode->i_hash_list_node);
+    __atomic_sub_fetch(&inode_ht_nr_entries, 1, __ATOMIC_RELAXED);
 
     __atomic_sub_fetch(&sb->s_ref, 1, __ATOMIC_RELAXED);
 }
@@ -326,9 +449,7 @@ void inode_unlock_hashtable(struct superblock *sb, ino_t ino_nr)
 {
     auto hash = inode_hash(sb->s_devnr, ino_nr);
 
-    auto index = inode_hashtable.get_hashtable_index(hash);
-
-    spin_unlock(&inode_hashtable_locks[index]);
+    spin_unlock(&inode_ht_lock(hash));
 }
 
 int sys_fsync(int fd)
@@ -339,10 +460,8 @@ int sys_fsync(int fd)
         return -EBADF;
     }
 
-    /* TODO: Same problem as inode_sync, return errors. */
-    inode_sync(f.get_file()->f_ino);
-
-    return 0;
+    ssize_t st = inode_sync(f.get_file()->f_ino);
+    return st < 0 ? st : 0;
 }
 
 void inode_add_hole_in_page(struct page *page, size_t page_offset, size_t end_offset)
@@ -419,10 +538,13 @@ cul::atomic_size_t evicted_inodes = 0;
 void inode_trim_cache()
 {
     struct list_head to_evict = LIST_HEAD_INIT(to_evict);
-    for (size_t i = 0; i < inode_hashtable_size; i++)
+    for (size_t i = 0;; i++)
     {
-        scoped_lock g{inode_hashtable_locks[i]};
-        auto ht = inode_hashtable.get_hashtable(i);
+        /* Bucket i is always covered by stripe i, and the table can't be resized under us */
+        scoped_lock g{inode_hashtable_locks[i & (INODE_HT_NR_LOCKS - 1)]};
+        if (i >= (1UL << inode_ht->shift))
+            break;
+        auto ht = &inode_ht->buckets[i];
 
         list_for_every_safe (ht)
         {
@@ -0,0 +1,1176 @@
+/*
+ * Copyright (c) 2023 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <onyx/clock.h>
+#include <onyx/dentry.h>
+#include <onyx/file.h>
+#include <onyx/mm/vm_object.h>
+#include <onyx/net/socket.h>
+#include <onyx/poll.h>
+#include <onyx/process.h>
+#include <onyx/user.h>
+#include <onyx/vfs.h>
+#include <onyx/vm.h>
+
+#include <uapi/io_ring.h>
+
+/* io_ring is a shared memory submission/completion ring. Userspace fills SQEs and calls
+ * io_ring_enter() to submit them, and reaps CQEs without any syscall.
+ *
+ * Requests are first tried from the submitter's context. Regular file I/O that hits the page
+ * cache completes inline, sockets are tried without blocking, and other files are checked for
+ * readiness through ->poll. Everything else goes to the ring's worker thread: page cache misses
+ * (which would block the submitter on the bio) are run there, and requests waiting on a file get
+ * hooked onto its wait queues and run as they become ready. So deferred requests make progress
+ * whether or not anyone is in io_ring_enter.
+ *
+ * SQEs carry user pointers, so a ring is bound to the address space that created it: the worker
+ * runs in it, and io_ring_enter() from any other address space is refused.
+ */
+
+struct io_ring_buf
+{
+    unsigned long addr;
+    size_t len;
+    struct page **pages;
+    size_t nr_pages;
+};
+
+struct io_ring_req
+{
+    struct list_head list_node;
+    struct io_ring_sqe sqe;
+    struct file *file{nullptr};
+    /* Poll events we're waiting on, if deferred */
+    short events{0};
+    /* Absolute deadline, for timeouts */
+    hrtime_t deadline{0};
+};
+
+struct io_ring
+{
+    struct mutex lock;
+    struct io_ring_header *hdr{nullptr};
+    struct io_ring_sqe *sqes{nullptr};
+    struct io_ring_cqe *cqes{nullptr};
+    /* Kernel copies of the ring geometry and our indices; userspace may scribble on the header */
+    u32 sq_entries{0};
+    u32 cq_entries{0};
+    u32 sq_head{0};
+    u32 cq_tail{0};
+    void *mem{nullptr};
+    size_t nr_pages{0};
+    struct vm_object *vmo{nullptr};
+    struct list_head pending;
+    unsigned int nr_pending{0};
+    struct wait_queue cq_wait;
+    struct file **files{nullptr};
+    unsigned int nr_files{0};
+    struct io_ring_buf *bufs{nullptr};
+    unsigned int nr_bufs{0};
+    /* IORING_SETUP_* flags */
+    unsigned int flags{0};
+    /* Requests that would block the submitter, to be run by the worker. Counted in nr_pending. */
+    struct list_head punted;
+    /* Address space of the ring's creator */
+    struct mm_address_space *mm{nullptr};
+    struct thread *worker{nullptr};
+    struct wait_queue worker_wq;
+    bool worker_exit{false};
+    /* The file and the worker each hold a reference */
+    unsigned long refs{1};
+
+    io_ring()
+    {
+        INIT_LIST_HEAD(&pending);
+        INIT_LIST_HEAD(&punted);
+        init_wait_queue_head(&cq_wait);
+        init_wait_queue_head(&worker_wq);
+    }
+};
+
+/* io_ring_issue return values */
+#define IO_RING_DONE     0
+#define IO_RING_DEFERRED 1
+#define IO_RING_PUNT     2
+
+extern const struct file_ops io_ring_fops;
+
+static u32 io_ring_cq_used(struct io_ring *ring)
+{
+    return ring->cq_tail - __atomic_load_n(&ring->hdr->cq_head, __ATOMIC_ACQUIRE);
+}
+
+static void io_ring_post_cqe(struct io_ring *ring, u64 user_data, s32 res)
+{
+    if (io_ring_cq_used(ring) >= ring->cq_entries)
+    {
+        // We reserve CQ space on submission, so this only happens if userspace moved cq_head
+        // backwards.
+        ring->hdr->cq_overflow++;
+        return;
+    }
+
+    struct io_ring_cqe *cqe = &ring->cqes[ring->cq_tail & (ring->cq_entries - 1)];
+    cqe->user_data = user_data;
+    cqe->res = res;
+    cqe->flags = 0;
+
+    ring->cq_tail++;
+    __atomic_store_n(&ring->hdr->cq_tail, ring->cq_tail, __ATOMIC_RELEASE);
+    wait_queue_wake_all(&ring->cq_wait);
+}
+
+static void io_ring_free_req(struct io_ring_req *req)
+{
+    if (req->file)
+        fd_put(req->file);
+    delete req;
+}
+
+static bool io_ring_file_may_block(struct file *f)
+{
+    mode_t mode = f->f_ino->i_mode;
+    return !S_ISREG(mode) && !S_ISBLK(mode) && !S_ISDIR(mode);
+}
+
+static bool io_ring_op_is_write(u8 opcode)
+{
+    return opcode == IORING_OP_WRITE || opcode == IORING_OP_WRITEV ||
+           opcode == IORING_OP_WRITE_FIXED;
+}
+
+/**
+ * @brief Check if a read or write request's file range is in the page cache
+ * If it's not, doing the request would mean sleeping on a bio.
+ *
+ * @param req Request
+ * @return True if every page is cached
+ */
+static bool io_ring_rw_cached(struct io_ring_req *req)
+{
+    const struct io_ring_sqe *sqe = &req->sqe;
+    struct inode *ino = req->file->f_ino;
+    size_t off = sqe->off == (u64) -1 ? req->file->f_seek : sqe->off;
+    size_t len = sqe->len;
+
+    if (!ino->i_pages)
+        return true;
+
+    // We don't know the length of vectored requests without copying the iovecs in, just look
+    // at the first page.
+    if (sqe->opcode == IORING_OP_READV || sqe->opcode == IORING_OP_WRITEV)
+        len = 1;
+
+    size_t end = min(off + len, (size_t) ino->i_size);
+    for (size_t pos = off & -PAGE_SIZE; pos < end; pos += PAGE_SIZE)
+    {
+        struct page *page;
+        if (vmo_get(ino->i_pages, pos, 0, &page) == VMO_STATUS_NON_EXISTENT)
+            return false;
+        page_unpin(page);
+    }
+
+    return true;
+}
+
+/**
+ * @brief Poll a request's file for the events it's waiting on
+ *
+ * @param req Request
+ * @param pt Poll table. If it's still queueing, we get hooked onto the file's wait queues.
+ * @return revents
+ */
+static short io_ring_poll_req(struct io_ring_req *req, poll_table *pt)
+{
+    // poll_file drops a file ref when it goes away
+    fd_get(req->file);
+    auto pf = make_unique<poll_file>(-1, pt, req->file, req->events, nullptr);
+    if (!pf)
+    {
+        fd_put(req->file);
+        return 0;
+    }
+
+    short revents = poll_vfs(pf.get(), pf->get_efective_event_mask(), req->file);
+
+    // Keep the wait queue entries alive while the caller sleeps
+    if (!revents && pt->may_queue())
+        pt->get_poll_table().push_back(cul::move(pf));
+
+    return revents;
+}
+
+static bool io_ring_poll_ready(struct io_ring_req *req, short events)
+{
+    poll_table pt;
+    pt.dont_queue();
+    req->events = events;
+    return io_ring_poll_req(req, &pt) != 0;
+}
+
+static ssize_t io_ring_fixed_iovecs(struct io_ring *ring, struct io_ring_req *req, iovec **pvec)
+{
+    const struct io_ring_sqe *sqe = &req->sqe;
+
+    if (sqe->buf_index >= ring->nr_bufs)
+        return -EFAULT;
+
+    struct io_ring_buf *buf = &ring->bufs[sqe->buf_index];
+    unsigned long addr = sqe->addr;
+    size_t len = sqe->len;
+
+    if (addr < buf->addr || addr + len < addr || addr + len > buf->addr + buf->len)
+        return -EFAULT;
+
+    // The pages are already pinned, point the iovecs at their direct map
+    size_t start = addr - (buf->addr & -PAGE_SIZE);
+    size_t first = start >> PAGE_SHIFT;
+    size_t pgoff = start & (PAGE_SIZE - 1);
+    size_t nr = vm_size_to_pages(pgoff + len);
+
+    iovec *vec = (iovec *) malloc(nr * sizeof(iovec));
+    if (!vec)
+        return -ENOMEM;
+
+    for (size_t i = 0; i < nr; i++)
+    {
+        size_t chunk = min(PAGE_SIZE - pgoff, len);
+        vec[i].iov_base = (u8 *) PAGE_TO_VIRT(buf->pages[first + i]) + pgoff;
+        vec[i].iov_len = chunk;
+        len -= chunk;
+        pgoff = 0;
+    }
+
+    *pvec = vec;
+    return nr;
+}
+
+static ssize_t io_ring_rw(struct io_ring *ring, struct io_ring_req *req, bool write)
+{
+    const struct io_ring_sqe *sqe = &req->sqe;
+    struct file *f = req->file;
+    const bool use_pos = sqe->off == (u64) -1;
+    size_t off = use_pos ? f->f_seek : sqe->off;
+    iovec inline_vec, *vec = &inline_vec;
+    size_t nr_vecs = 1;
+    ssize_t len;
+    ssize_t st;
+    iovec_type type = IOVEC_USER;
+
+    switch (sqe->opcode)
+    {
+        case IORING_OP_READ:
+        case IORING_OP_WRITE:
+            inline_vec.iov_base = (void *) sqe->addr;
+            inline_vec.iov_len = sqe->len;
+            len = sqe->len;
+            break;
+        case IORING_OP_READV:
+        case IORING_OP_WRITEV:
+            if (sqe->len > IOV_MAX)
+                return -EINVAL;
+            nr_vecs = sqe->len;
+            vec = (iovec *) malloc(nr_vecs * sizeof(iovec));
+            if (!vec)
+                return -ENOMEM;
+            if (copy_from_user(vec, (const void *) sqe->addr, nr_vecs * sizeof(iovec)) < 0)
+            {
+                len = -EFAULT;
+                goto out;
+            }
+
+            len = iovec_count_length(vec, nr_vecs);
+            break;
+        default:
+            st = io_ring_fixed_iovecs(ring, req, &vec);
+            if (st < 0)
+                return st;
+            nr_vecs = st;
+            len = sqe->len;
+            type = IOVEC_KERNEL;
+            break;
+    }
+
+    if (len <= 0)
+        goto out;
+
+    {
+        iovec_iter iter{{vec, nr_vecs}, (size_t) len, type};
+        auto_addr_limit l_{type == IOVEC_KERNEL ? VM_KERNEL_ADDR_LIMIT : thread_get_addr_limit()};
+        struct thread *curr = get_current_thread();
+        const bool iopoll = ring->flags & IORING_SETUP_IOPOLL;
+
+        /* Any bio we end up submitting synchronously (e.g page cache misses) gets polled */
+        if (iopoll)
+            __atomic_or_fetch(&curr->flags, THREAD_IO_POLL, __ATOMIC_RELAXED);
+
+        if (write)
+        {
+            if (f->f_flags & O_APPEND && use_pos)
+                off = f->f_ino->i_size;
+            len = write_iter_vfs(f, off, &iter, 0);
+        }
+        else
+            len = read_iter_vfs(f, off, &iter, 0);
+
+        if (iopoll)
+            __atomic_and_fetch(&curr->flags, ~THREAD_IO_POLL, __ATOMIC_RELAXED);
+    }
+
+    if (len > 0 && use_pos)
+        f->f_seek = off + len;
+out:
+    if (vec != &inline_vec)
+        free(vec);
+    return len;
+}
+
+static ssize_t io_ring_sockop(struct io_ring_req *req, bool send)
+{
+    const struct io_ring_sqe *sqe = &req->sqe;
+    socket *sock = file_to_socket(req->file);
+
+    iovec vec;
+    vec.iov_base = (void *) sqe->addr;
+    vec.iov_len = sqe->len;
+
+    msghdr msg;
+    msg.msg_name = nullptr;
+    msg.msg_namelen = 0;
+    msg.msg_control = nullptr;
+    msg.msg_controllen = 0;
+    msg.msg_flags = 0;
+    msg.msg_iov = &vec;
+    msg.msg_iovlen = 1;
+
+    int flags = sqe->msg_flags | MSG_DONTWAIT;
+    return send ? sock->sendmsg(&msg, flags) : sock->recvmsg(&msg, flags);
+}
+
+/**
+ * @brief Try to issue a request
+ *
+ * @param ring Ring
+ * @param req Request
+ * @param res Result, if the request completed
+ * @return IO_RING_DONE if it completed, IO_RING_DEFERRED if it needs to wait, IO_RING_PUNT if it
+ * would block and needs to be run by the worker
+ */
+static int io_ring_issue(struct io_ring *ring, struct io_ring_req *req, ssize_t *res)
+{
+    const struct io_ring_sqe *sqe = &req->sqe;
+    struct file *f = req->file;
+    const bool nonblock = f && f->f_flags & O_NONBLOCK;
+
+    switch (sqe->opcode)
+    {
+        case IORING_OP_NOP:
+            *res = 0;
+            break;
+        case IORING_OP_READ:
+        case IORING_OP_READV:
+        case IORING_OP_READ_FIXED:
+        case IORING_OP_WRITE:
+        case IORING_OP_WRITEV:
+        case IORING_OP_WRITE_FIXED: {
+            const bool write = io_ring_op_is_write(sqe->opcode);
+            if (!nonblock && io_ring_file_may_block(f) &&
+                !io_ring_poll_ready(req, write ? POLLOUT : POLLIN))
+                return IO_RING_DEFERRED;
+            if (S_ISREG(f->f_ino->i_mode) && !io_ring_rw_cached(req))
+                return IO_RING_PUNT;
+            *res = io_ring_rw(ring, req, write);
+            break;
+        }
+        case IORING_OP_FSYNC:
+            *res = inode_sync(f->f_ino);
+            break;
+        case IORING_OP_POLL_ADD: {
+            poll_table pt;
+            pt.dont_queue();
+            req->events = sqe->poll_events;
+            short revents = io_ring_poll_req(req, &pt);
+            if (!revents)
+                return IO_RING_DEFERRED;
+            *res = revents;
+            break;
+        }
+        case IORING_OP_TIMEOUT:
+            if (clocksource_get_time() < req->deadline)
+                return IO_RING_DEFERRED;
+            *res = -ETIME;
+            break;
+        case IORING_OP_ACCEPT:
+        case IORING_OP_RECV:
+        case IORING_OP_SEND: {
+            if (!file_is_socket(f))
+            {
+                *res = -ENOTSOCK;
+                break;
+            }
+
+            if (sqe->opcode == IORING_OP_ACCEPT)
+            {
+                *res = socket_accept_file(f, (struct sockaddr *) sqe->addr,
+                                          (socklen_t *) sqe->addr2, sqe->accept_flags,
+                                          f->f_flags | O_NONBLOCK);
+                req->events = POLLIN;
+            }
+            else
+            {
+                *res = io_ring_sockop(req, sqe->opcode == IORING_OP_SEND);
+                req->events = sqe->opcode == IORING_OP_SEND ? POLLOUT : POLLIN;
+            }
+
+            if (*res == -EAGAIN && !nonblock && !(sqe->msg_flags & MSG_DONTWAIT))
+                return IO_RING_DEFERRED;
+            break;
+        }
+    }
+
+    return IO_RING_DONE;
+}
+
+/**
+ * @brief Resolve a request's file and check it's valid
+ *
+ * @param ring Ring
+ * @param req Request
+ * @return 0 on success, negative error code
+ */
+static int io_ring_prep(struct io_ring *ring, struct io_ring_req *req)
+{
+    const struct io_ring_sqe *sqe = &req->sqe;
+    unsigned int access = 0;
+
+    switch (sqe->opcode)
+    {
+        case IORING_OP_NOP:
+            return 0;
+        case IORING_OP_TIMEOUT: {
+            struct timespec ts;
+            if (copy_from_user(&ts, (const void *) sqe->addr, sizeof(ts)) < 0)
+                return -EFAULT;
+            if (!timespec_valid(&ts, false))
+                return -EINVAL;
+            req->deadline = clocksource_get_time() + timespec_to_hrtime(&ts);
+            return 0;
+        }
+        case IORING_OP_READ:
+        case IORING_OP_READV:
+        case IORING_OP_READ_FIXED:
+        case IORING_OP_RECV:
+        case IORING_OP_ACCEPT:
+            access = FILE_ACCESS_READ;
+            break;
+        case IORING_OP_WRITE:
+        case IORING_OP_WRITEV:
+        case IORING_OP_WRITE_FIXED:
+        case IORING_OP_SEND:
+            access = FILE_ACCESS_WRITE;
+            break;
+        case IORING_OP_FSYNC:
+        case IORING_OP_POLL_ADD:
+            break;
+        default:
+            return -EINVAL;
+    }
+
+    if (sqe->flags & ~IOSQE_FIXED_FILE)
+        return -EINVAL;
+
+    if (sqe->flags & IOSQE_FIXED_FILE)
+    {
+        // Registered files skip the fd table, we just need a ref for the request's lifetime
+        if ((unsigned int) sqe->fd >= ring->nr_files || !ring->files[sqe->fd])
+            return -EBADF;
+        req->file = ring->files[sqe->fd];
+        fd_get(req->file);
+    }
+    else
+    {
+        req->file = get_file_description(sqe->fd);
+        if (!req->file)
+            return -EBADF;
+    }
+
+    if (access && !fd_may_access(req->file, access))
+        return -EBADF;
+
+    // A request holding a ref to its own ring would keep the ring alive forever
+    if (req->file->f_ino->i_fops == &io_ring_fops)
+        return -EINVAL;
+
+    return 0;
+}
+
+static void io_ring_queue(struct io_ring *ring, struct io_ring_req *req)
+{
+    ssize_t res;
+
+    if (int st = io_ring_prep(ring, req); st < 0)
+    {
+        io_ring_post_cqe(ring, req->sqe.user_data, st);
+        io_ring_free_req(req);
+        return;
+    }
+
+    switch (io_ring_issue(ring, req, &res))
+    {
+        case IO_RING_DEFERRED:
+            list_add_tail(&req->list_node, &ring->pending);
+            break;
+        case IO_RING_PUNT:
+            list_add_tail(&req->list_node, &ring->punted);
+            break;
+        default:
+            io_ring_post_cqe(ring, req->sqe.user_data, res);
+            io_ring_free_req(req);
+            return;
+    }
+
+    ring->nr_pending++;
+    wait_queue_wake_all(&ring->worker_wq);
+}
+
+static int io_ring_submit(struct io_ring *ring, unsigned int to_submit)
+{
+    u32 tail = __atomic_load_n(&ring->hdr->sq_tail, __ATOMIC_ACQUIRE);
+    unsigned int submitted = 0;
+
+    while (submitted < to_submit && ring->sq_head != tail)
+    {
+        // Every request in flight has a CQ slot reserved for it, so completions never overflow
+        if (io_ring_cq_used(ring) + ring->nr_pending >= ring->cq_entries)
+            break;
+
+        auto req = new io_ring_req;
+        if (!req)
+            break;
+
+        memcpy(&req->sqe, &ring->sqes[ring->sq_head & (ring->sq_entries - 1)], sizeof(req->sqe));
+        ring->sq_head++;
+        __atomic_store_n(&ring->hdr->sq_head, ring->sq_head, __ATOMIC_RELEASE);
+        submitted++;
+
+        io_ring_queue(ring, req);
+    }
+
+    if (!submitted && to_submit && ring->sq_head != tail)
+        return -EBUSY;
+
+    return submitted;
+}
+
+/**
+ * @brief Run deferred requests that are ready
+ *
+ * @param ring Ring
+ * @param pt Poll table. If it's queueing, requests that are not ready hook onto their wait queues.
+ * @param next_deadline Earliest timeout deadline still pending (or 0 if none)
+ * @return True if any request completed
+ */
+static bool io_ring_run_deferred(struct io_ring *ring, poll_table *pt, hrtime_t *next_deadline)
+{
+    bool progress = false;
+    *next_deadline = 0;
+
+    list_for_every_safe (&ring->pending)
+    {
+        auto req = container_of(l, io_ring_req, list_node);
+        ssize_t res;
+
+        if (req->sqe.opcode != IORING_OP_TIMEOUT && !io_ring_poll_req(req, pt))
+            continue;
+
+        if (io_ring_issue(ring, req, &res) == IO_RING_DEFERRED)
+        {
+            if (req->sqe.opcode == IORING_OP_TIMEOUT &&
+                (!*next_deadline || req->deadline < *next_deadline))
+                *next_deadline = req->deadline;
+            continue;
+        }
+
+        list_remove(&req->list_node);
+        ring->nr_pending--;
+        io_ring_post_cqe(ring, req->sqe.user_data, res);
+        io_ring_free_req(req);
+        progress = true;
+    }
+
+    return progress;
+}
+
+/**
+ * @brief Run the requests that were punted to the worker
+ * The ring lock is dropped while each one runs, so submitters and reapers don't wait behind it.
+ *
+ * @param ring Ring
+ * @return True if any request completed
+ */
+static bool io_ring_run_punted(struct io_ring *ring)
+{
+    bool progress = false;
+
+    while (!list_is_empty(&ring->punted))
+    {
+        auto req = container_of(list_first_element(&ring->punted), io_ring_req, list_node);
+        list_remove(&req->list_node);
+
+        // Registered buffers can't go away under us, unregistering is refused while requests are
+        // in flight.
+        mutex_unlock(&ring->lock);
+        ssize_t res = io_ring_rw(ring, req, io_ring_op_is_write(req->sqe.opcode));
+        mutex_lock(&ring->lock);
+
+        ring->nr_pending--;
+        io_ring_post_cqe(ring, req->sqe.user_data, res);
+        io_ring_free_req(req);
+        progress = true;
+    }
+
+    return progress;
+}
+
+static void io_ring_free(struct io_ring *ring);
+
+static void io_ring_put(struct io_ring *ring)
+{
+    if (__atomic_sub_fetch(&ring->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        io_ring_free(ring);
+}
+
+static void io_ring_worker(void *arg)
+{
+    struct io_ring *ring = (struct io_ring *) arg;
+
+    // Resolve the SQEs' user pointers in the ring creator's address space, as the creator would
+    vm_set_aspace(ring->mm);
+    thread_change_addr_limit(VM_USER_ADDR_LIMIT);
+
+    mutex_lock(&ring->lock);
+
+    while (!ring->worker_exit)
+    {
+        poll_table pt;
+        hrtime_t deadline;
+
+        // Get on worker_wq before looking at the requests, so we don't miss a kick in between
+        auto kick = make_unique<poll_file>(-1, &pt, nullptr, 0, nullptr);
+        const bool kickable = kick != nullptr;
+        if (kick)
+        {
+            kick->wait(&ring->worker_wq);
+            pt.get_poll_table().push_back(cul::move(kick));
+        }
+
+        bool progress = io_ring_run_punted(ring);
+        if (io_ring_run_deferred(ring, &pt, &deadline))
+            progress = true;
+
+        if (progress)
+            continue;
+
+        hrtime_t timeout = 0;
+        if (deadline)
+        {
+            hrtime_t now = clocksource_get_time();
+            // Always sleep for a tiny bit, a timeout of 0 means "don't sleep"
+            timeout = deadline > now ? deadline - now : 1;
+        }
+        else if (!kickable)
+            timeout = 10 * NS_PER_MS;
+
+        mutex_unlock(&ring->lock);
+        pt.dont_queue();
+        pt.sleep_poll(timeout, timeout != 0);
+        mutex_lock(&ring->lock);
+    }
+
+    mutex_unlock(&ring->lock);
+
+    vm_set_aspace(&kernel_address_space);
+    io_ring_put(ring);
+    thread_exit();
+}
+
+static int io_ring_start_worker(struct io_ring *ring)
+{
+    ring->worker = sched_create_thread(io_ring_worker, THREAD_KERNEL, ring);
+    if (!ring->worker)
+        return -ENOMEM;
+
+    ring->refs++;
+    sched_start_thread(ring->worker);
+    return 0;
+}
+
+/**
+ * @brief Drop the file's reference to the ring, and tell the worker to go away
+ *
+ * @param ring Ring
+ */
+static void io_ring_shutdown(struct io_ring *ring)
+{
+    if (ring->worker)
+    {
+        scoped_mutex g{ring->lock};
+        ring->worker_exit = true;
+        wait_queue_wake_all(&ring->worker_wq);
+    }
+
+    io_ring_put(ring);
+}
+
+static int io_ring_wait(struct io_ring *ring, unsigned int min_complete)
+{
+    // The worker completes deferred requests, we just wait for their CQEs
+    return wait_for_event_mutex_interruptible(
+        &ring->cq_wait, io_ring_cq_used(ring) >= min_complete || ring->nr_pending == 0,
+        &ring->lock);
+}
+
+static void io_ring_unregister_buffers(struct io_ring *ring)
+{
+    for (unsigned int i = 0; i < ring->nr_bufs; i++)
+    {
+        struct io_ring_buf *buf = &ring->bufs[i];
+        for (size_t j = 0; j < buf->nr_pages; j++)
+            page_unpin(buf->pages[j]);
+        free(buf->pages);
+    }
+
+    free(ring->bufs);
+    ring->bufs = nullptr;
+    ring->nr_bufs = 0;
+}
+
+static int io_ring_register_buffers(struct io_ring *ring, const struct iovec *uvec,
+                                    unsigned int nr)
+{
+    if (ring->bufs)
+        return -EBUSY;
+
+    if (nr == 0 || nr > IORING_MAX_REG_BUFS)
+        return -EINVAL;
+
+    ring->bufs = (io_ring_buf *) calloc(nr, sizeof(io_ring_buf));
+    if (!ring->bufs)
+        return -ENOMEM;
+
+    for (unsigned int i = 0; i < nr; i++)
+    {
+        struct io_ring_buf *buf = &ring->bufs[i];
+        struct iovec vec;
+        int st = -EFAULT;
+
+        if (copy_from_user(&vec, uvec + i, sizeof(vec)) < 0)
+            goto err;
+
+        st = -EINVAL;
+        buf->addr = (unsigned long) vec.iov_base;
+        buf->len = vec.iov_len;
+        if (buf->len == 0 || buf->len > IORING_MAX_REG_BUFLEN || buf->addr + buf->len < buf->addr)
+            goto err;
+
+        {
+            unsigned long start = buf->addr & -PAGE_SIZE;
+            size_t nr_pages = vm_size_to_pages(buf->addr + buf->len - start);
+
+            st = -ENOMEM;
+            buf->pages = (struct page **) calloc(nr_pages, sizeof(struct page *));
+            if (!buf->pages)
+                goto err;
+
+            // Pin the pages once here, so fixed reads and writes don't need to
+            int gpp = get_phys_pages((void *) start, GPP_READ | GPP_WRITE | GPP_USER, buf->pages,
+                                     nr_pages);
+            st = -EFAULT;
+            if (!(gpp & GPP_ACCESS_OK))
+                goto err;
+
+            st = -EOPNOTSUPP;
+            if (gpp & GPP_ACCESS_PFNMAP)
+            {
+                // These were only referenced, not pinned
+                for (size_t j = 0; j < nr_pages; j++)
+                    page_unref(buf->pages[j]);
+                goto err;
+            }
+
+            buf->nr_pages = nr_pages;
+            ring->nr_bufs = i + 1;
+        }
+
+        continue;
+    err:
+        if (!buf->nr_pages)
+            free(buf->pages);
+        io_ring_unregister_buffers(ring);
+        return st;
+    }
+
+    return 0;
+}
+
+static void io_ring_unregister_files(struct io_ring *ring)
+{
+    for (unsigned int i = 0; i < ring->nr_files; i++)
+    {
+        if (ring->files[i])
+            fd_put(ring->files[i]);
+    }
+
+    free(ring->files);
+    ring->files = nullptr;
+    ring->nr_files = 0;
+}
+
+static int io_ring_register_files(struct io_ring *ring, const int *ufds, unsigned int nr)
+{
+    if (ring->files)
+        return -EBUSY;
+
+    if (nr == 0 || nr > IORING_MAX_REG_FILES)
+        return -EINVAL;
+
+    ring->files = (struct file **) calloc(nr, sizeof(struct file *));
+    if (!ring->files)
+        return -ENOMEM;
+
+    ring->nr_files = nr;
+
+    for (unsigned int i = 0; i < nr; i++)
+    {
+        int fd;
+        if (copy_from_user(&fd, ufds + i, sizeof(int)) < 0)
+        {
+            io_ring_unregister_files(ring);
+            return -EFAULT;
+        }
+
+        // Sparse slots are allowed
+        if (fd == -1)
+            continue;
+
+        struct file *f = get_file_description(fd);
+        if (!f || f->f_ino->i_fops == &io_ring_fops)
+        {
+            // Registering a ring in itself would keep it alive forever
+            if (f)
+                fd_put(f);
+            io_ring_unregister_files(ring);
+            return -EBADF;
+        }
+
+        ring->files[i] = f;
+    }
+
+    return 0;
+}
+
+static void io_ring_free(struct io_ring *ring)
+{
+    list_for_every_safe (&ring->pending)
+    {
+        auto req = container_of(l, io_ring_req, list_node);
+        list_remove(&req->list_node);
+        io_ring_free_req(req);
+    }
+
+    list_for_every_safe (&ring->punted)
+    {
+        auto req = container_of(l, io_ring_req, list_node);
+        list_remove(&req->list_node);
+        io_ring_free_req(req);
+    }
+
+    io_ring_unregister_files(ring);
+    io_ring_unregister_buffers(ring);
+
+    if (ring->mem)
+        vfree(ring->mem, ring->nr_pages);
+    if (ring->vmo)
+        vmo_unref(ring->vmo);
+    if (ring->mm)
+        ring->mm->unref();
+
+    delete ring;
+}
+
+// Our VMO ops are a noop, since we have filled the VMO out with the correct size and pages
+static const struct vm_object_ops io_ring_vmo_ops = {};
+
+static int io_ring_setup_mem(struct io_ring *ring, size_t size)
+{
+    ring->nr_pages = vm_size_to_pages(size);
+    ring->mem = vmalloc(ring->nr_pages, VM_TYPE_REGULAR, VM_READ | VM_WRITE, GFP_KERNEL);
+    if (!ring->mem)
+        return -ENOMEM;
+
+    memset(ring->mem, 0, ring->nr_pages << PAGE_SHIFT);
+
+    ring->vmo = vmo_create(ring->nr_pages << PAGE_SHIFT, nullptr);
+    if (!ring->vmo)
+        return -ENOMEM;
+
+    // vmalloc_to_pages gives us refs, we give them away to the vm_object (through vmo_add_page)
+    auto pages = vmalloc_to_pages(ring->mem);
+    size_t off = 0;
+
+    for (struct page *p = pages; p; p = p->next_un.next_allocation, off += PAGE_SIZE)
+    {
+        if (vmo_add_page(off, p, ring->vmo) < 0)
+        {
+            // Drop the refs we didn't get to give away
+            for (; p; p = p->next_un.next_allocation)
+                page_unref(p);
+            return -ENOMEM;
+        }
+    }
+
+    ring->vmo->ops = &io_ring_vmo_ops;
+    return 0;
+}
+
+static void *io_ring_mmap(struct vm_region *area, struct file *f)
+{
+    struct io_ring *ring = (struct io_ring *) f->f_ino->i_helper;
+
+    if (area->offset != 0 || area->mapping_type != MAP_SHARED || area->pages > ring->nr_pages)
+        return errno = EINVAL, nullptr;
+
+    area->vmo = ring->vmo;
+    vmo_ref(area->vmo);
+    vmo_assign_mapping(area->vmo, area);
+
+    return (void *) area->base;
+}
+
+static short io_ring_poll(void *poll_file, short events, struct file *f)
+{
+    struct io_ring *ring = (struct io_ring *) f->f_ino->i_helper;
+
+    if (io_ring_cq_used(ring))
+        return events & (POLLIN | POLLRDNORM);
+
+    poll_wait_helper(poll_file, &ring->cq_wait);
+    return 0;
+}
+
+static void io_ring_release(struct file *f)
+{
+    io_ring_shutdown((struct io_ring *) f->f_ino->i_helper);
+    f->f_ino->i_helper = nullptr;
+}
+
+const struct file_ops io_ring_fops = {
+    .mmap = io_ring_mmap,
+    .poll = io_ring_poll,
+    .release = io_ring_release,
+};
+
+static atomic<ino_t> current_inode_number;
+
+static int io_ring_file_create(struct io_ring *ring, struct file **pfile)
+{
+    struct inode *anon_ino;
+    struct dentry *anon_dent;
+    struct file *f;
+
+    anon_ino = inode_create(false);
+    if (!anon_ino)
+        return -ENOMEM;
+
+    anon_ino->i_dev = 0;
+    anon_ino->i_type = VFS_TYPE_CHAR_DEVICE;
+    anon_ino->i_flags = INODE_FLAG_NO_SEEK;
+    anon_ino->i_inode = current_inode_number++;
+    anon_ino->i_fops = (struct file_ops *) &io_ring_fops;
+
+    anon_dent = dentry_create("<io_ring>", anon_ino, nullptr);
+    if (!anon_dent)
+    {
+        close_vfs(anon_ino);
+        return -ENOMEM;
+    }
+
+    f = inode_to_file(anon_ino);
+    if (!f)
+    {
+        dentry_put(anon_dent);
+        close_vfs(anon_ino);
+        return -ENOMEM;
+    }
+
+    f->f_dentry = anon_dent;
+    anon_ino->i_helper = ring;
+    *pfile = f;
+    return 0;
+}
+
+int sys_io_ring_setup(unsigned int entries, struct io_ring_params *uparams)
+{
+    struct io_ring_params params;
+    struct file *f;
+    int st;
+
+    if (copy_from_user(&params, uparams, sizeof(params)) < 0)
+        return -EFAULT;
+
+    if (params.flags & ~IORING_SETUP_IOPOLL || entries == 0 || entries > IORING_MAX_ENTRIES)
+        return -EINVAL;
+
+    u32 sq_entries = 1;
+    while (sq_entries < entries)
+        sq_entries <<= 1;
+    u32 cq_entries = sq_entries * 2;
+
+    auto ring = new io_ring;
+    if (!ring)
+        return -ENOMEM;
+
+    ring->sq_entries = sq_entries;
+    ring->cq_entries = cq_entries;
+    ring->flags = params.flags;
+    ring->mm = get_current_address_space();
+    ring->mm->ref();
+
+    const size_t sqes_off = sizeof(io_ring_header);
+    const size_t cqes_off = sqes_off + sq_entries * sizeof(io_ring_sqe);
+    const size_t size = cqes_off + cq_entries * sizeof(io_ring_cqe);
+
+    if (st = io_ring_setup_mem(ring, size); st < 0)
+    {
+        io_ring_free(ring);
+        return st;
+    }
+
+    ring->hdr = (io_ring_header *) ring->mem;
+    ring->sqes = (io_ring_sqe *) ((u8 *) ring->mem + sqes_off);
+    ring->cqes = (io_ring_cqe *) ((u8 *) ring->mem + cqes_off);
+    ring->hdr->sq_entries = sq_entries;
+    ring->hdr->sq_mask = sq_entries - 1;
+    ring->hdr->cq_entries = cq_entries;
+    ring->hdr->cq_mask = cq_entries - 1;
+
+    params.sq_entries = sq_entries;
+    params.cq_entries = cq_entries;
+    params.ring_size = size;
+    params.sqes_off = sqes_off;
+    params.cqes_off = cqes_off;
+
+    if (copy_to_user(uparams, &params, sizeof(params)) < 0)
+    {
+        io_ring_free(ring);
+        return -EFAULT;
+    }
+
+    if (st = io_ring_start_worker(ring); st < 0)
+    {
+        io_ring_free(ring);
+        return st;
+    }
+
+    if (st = io_ring_file_create(ring, &f); st < 0)
+    {
+        io_ring_shutdown(ring);
+        return st;
+    }
+
+    int fd = open_with_vnode(f, O_RDWR | O_CLOEXEC);
+    fd_put(f);
+    return fd;
+}
+
+static struct io_ring *io_ring_from_file(struct file *f)
+{
+    if (f->f_ino->i_fops != &io_ring_fops)
+        return nullptr;
+    return (struct io_ring *) f->f_ino->i_helper;
+}
+
+int sys_io_ring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+                      unsigned int flags)
+{
+    auto_file f;
+
+    if (flags & ~IORING_ENTER_GETEVENTS)
+        return -EINVAL;
+
+    if (f.from_fd(fd) < 0)
+        return -EBADF;
+
+    struct io_ring *ring = io_ring_from_file(f.get_file());
+    if (!ring)
+        return -EOPNOTSUPP;
+
+    // SQEs point into the creator's address space, they mean nothing (or worse) in ours
+    if (get_current_address_space() != ring->mm)
+        return -EPERM;
+
+    scoped_mutex g{ring->lock};
+
+    int submitted = io_ring_submit(ring, to_submit);
+    if (submitted < 0)
+        return submitted;
+
+    if (flags & IORING_ENTER_GETEVENTS)
+    {
+        if (int st = io_ring_wait(ring, min_complete); st < 0 && submitted == 0)
+            return st;
+    }
+
+    return submitted;
+}
+
+int sys_io_ring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+    auto_file f;
+
+    if (f.from_fd(fd) < 0)
+        return -EBADF;
+
+    struct io_ring *ring = io_ring_from_file(f.get_file());
+    if (!ring)
+        return -EOPNOTSUPP;
+
+    // Registered buffers get pinned through the current address space
+    if (get_current_address_space() != ring->mm)
+        return -EPERM;
+
+    scoped_mutex g{ring->lock};
+
+    switch (opcode)
+    {
+        case IORING_REGISTER_BUFFERS:
+            return io_ring_register_buffers(ring, (const struct iovec *) arg, nr_args);
+        case IORING_UNREGISTER_BUFFERS:
+            if (!ring->bufs)
+                return -ENXIO;
+            // Punted requests use them without the ring lock
+            if (ring->nr_pending)
+                return -EBUSY;
+            io_ring_unregister_buffers(ring);
+            return 0;
+        case IORING_REGISTER_FILES:
+            return io_ring_register_files(ring, (const int *) arg, nr_args);
+        case IORING_UNREGISTER_FILES:
+            if (!ring->files)
+                return -ENXIO;
+            io_ring_unregister_files(ring);
+            return 0;
+    }
+
+    return -EINVAL;
+}
@@ -193,6 +193,96 @@ static int namei_walk_component(std::string_view v, nameidata &data, unsigned in
     return 0;
 }
 
+/**
+ * @brief Walk as much of the path as we can in RCU mode
+ * RCU-walk doesn't take locks or references on the way down: dentries are looked up straight from
+ * the dcache and validated with d_seq and dentry_rename_lock. It stops at the first component it
+ * can't handle (cache misses, "..", symlinks, mountpoints, the last name if the caller wants it),
+ * grabs a reference to where it got to, and leaves the rest to ref-walk. If validation fails,
+ * nothing is consumed and ref-walk redoes the whole path.
+ *
+ * @param data Relevant data for the namei operation (see nameidata docs)
+ */
+static void namei_rcu_walk(nameidata &data)
+{
+    auto &path = data.paths[data.pdepth];
+    const size_t start_pos = path.pos;
+    const fs_token_type start_token = path.token_type;
+    const bool stop_at_last = data.handler || (data.lookup_flags & LOOKUP_DONT_DO_LAST_NAME);
+
+    dentry *cur = data.cur;
+    unsigned int seq = 0;
+    size_t pos = start_pos;
+    fs_token_type token_type = start_token;
+
+    rcu_read_lock();
+    const unsigned int rseq = read_seqbegin(&dentry_rename_lock);
+
+    while (path.token_type != fs_token_type::LAST_NAME_IN_PATH)
+    {
+        auto v = get_token_from_path(path, false);
+        if (v.length() == 0 || v.length() > NAME_MAX || !v.compare(".."))
+            break;
+
+        if (stop_at_last && path.token_type == fs_token_type::LAST_NAME_IN_PATH)
+            break;
+
+        struct inode *ino = cur->d_inode;
+        if (!S_ISDIR(ino->i_mode) || !inode_can_access(ino, FILE_ACCESS_EXECUTE))
+            break;
+
+        if (v.compare("."))
+        {
+            unsigned int next_seq;
+            dentry *next = dentry_lookup_rcu(cur, v, &next_seq);
+            if (!next)
+                break;
+
+            const uint16_t flags = next->d_flags;
+            struct inode *next_ino = next->d_inode;
+            if (flags & (DENTRY_FLAG_PENDING | DENTRY_FLAG_FAILED | DENTRY_FLAG_MOUNTPOINT) ||
+                !next_ino || S_ISLNK(next_ino->i_mode))
+                break;
+
+            if (read_seqcount_retry(&next->d_seq, next_seq))
+                break;
+
+            cur = next;
+            seq = next_seq;
+        }
+
+        pos = path.pos;
+        token_type = path.token_type;
+    }
+
+    path.pos = pos;
+    path.token_type = token_type;
+
+    if (cur == data.cur)
+    {
+        rcu_read_unlock();
+        return;
+    }
+
+    const bool got_ref = dentry_tryget(cur);
+    const bool valid = got_ref && !read_seqcount_retry(&cur->d_seq, seq) &&
+                       !read_seqretry(&dentry_rename_lock, rseq);
+
+    rcu_read_unlock();
+
+    if (!valid)
+    {
+        if (got_ref)
+            dentry_put(cur);
+        path.pos = start_pos;
+        path.token_type = start_token;
+        return;
+    }
+
+    dentry_put(data.cur);
+    data.cur = cur;
+}
+
 /**
  * @brief Do path resolution
  *
@@ -211,6 +301,10 @@ static int namei_resolve_path(nameidata &data)
     if (data.paths[data.pdepth].view.length() == 0)
         return 0;
 
+    /* Symlink targets are walked the slow way */
+    if (data.pdepth == 0)
+        namei_rcu_walk(data);
+
     for (;;)
     {
 #define NAMEI_DEBUG 0
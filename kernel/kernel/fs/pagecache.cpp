@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <onyx/buffer.h>
 #include <onyx/compiler.h>
 #include <onyx/condvar.h>
 #include <onyx/cpu.h>
@@ -44,6 +45,13 @@ void wait_for_flush(struct page *page)
         cpu_relax();
 }
 
+void pagecache_write_protect(struct flush_object *fo, struct mmu_gather *tlb)
+{
+    struct page_cache_block *b = cache_block_from_fo(fo);
+
+    vm_wp_page_for_every_region(b->page, b->offset, b->node->i_pages, tlb);
+}
+
 void pagecache_set_dirty(bool dirty, struct flush_object *fo)
 {
     struct page_cache_block *b = cache_block_from_fo(fo);
@@ -75,10 +83,51 @@ ssize_t pagecache_flush(struct flush_object *fo)
     return b->node->i_fops->writepage(b->page, b->offset, b->node);
 }
 
+static bool pagecache_queue(struct flush_object *fo, struct wb_cluster *wbc)
+{
+    struct page_cache_block *b = cache_block_from_fo(fo);
+    struct page *page = b->page;
+
+    /* We can only cluster pages whose blocks we know, which means pages written back through
+     * their block_bufs.
+     */
+    if (b->node->i_fops->writepage != block_buf_writepage || !(page->flags & PAGE_FLAG_BUFFER) ||
+        !block_buf_from_page(page))
+        return false;
+
+    for (struct block_buf *buf = block_buf_from_page(page); buf; buf = buf->next)
+    {
+        wb_cluster_add(wbc, fo, buf->dev, block_buf_sector(buf), page, buf->page_off,
+                       buf->block_size);
+    }
+
+    return true;
+}
+
+static void pagecache_start_wb(struct flush_object *fo)
+{
+    struct page_cache_block *b = cache_block_from_fo(fo);
+
+    __sync_or_and_fetch(&b->page->flags, PAGE_FLAG_FLUSHING);
+}
+
+static void pagecache_wb_error(struct flush_object *fo, int err)
+{
+    struct page_cache_block *b = cache_block_from_fo(fo);
+
+    /* Leave it dirty, and make sure the next fsync hears about it */
+    __sync_bool_compare_and_swap(&b->node->i_wb_error, 0, err);
+    __sync_fetch_and_and(&b->page->flags, ~PAGE_FLAG_FLUSHING);
+}
+
 const struct flush_ops pagecache_flush_ops = {
     .flush = pagecache_flush,
     .is_dirty = pagecache_is_dirty,
     .set_dirty = pagecache_set_dirty,
+    .write_protect = pagecache_write_protect,
+    .queue = pagecache_queue,
+    .start_wb = pagecache_start_wb,
+    .wb_error = pagecache_wb_error,
 };
 
 struct page_cache_block *pagecache_create_cache_block(struct page *page, size_t size, size_t offset,
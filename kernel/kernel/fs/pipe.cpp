@@ -15,11 +15,14 @@
 #include <onyx/compiler.h>
 #include <onyx/dentry.h>
 #include <onyx/dev.h>
+#include <onyx/filemap.h>
 #include <onyx/init.h>
 #include <onyx/kunit.h>
 #include <onyx/limits.h>
 #include <onyx/mm/slab.h>
+#include <onyx/pagecache.h>
 #include <onyx/panic.h>
+#include <onyx/pipe.h>
 #include <onyx/poll.h>
 #include <onyx/process.h>
 #include <onyx/scoped_lock.h>
@@ -41,16 +44,40 @@ constexpr unsigned long default_pipe_size = (16 * PAGE_SIZE);
 // TODO: Make this configurable
 constexpr unsigned long max_pipe_size = 0x100000;
 
+// Number of free pages a pipe keeps around for new buffers
+#define PIPE_PAGE_POOL 4
+
 static slab_cache *pipe_buffer_cache, *pipe_cache;
 
+struct pipe_buffer;
+
+/* Pipe buffers hold a reference to a page (plus an offset and length into it). Depending on where
+ * the page came from, the pipe may or may not own it outright, which these ops abstract.
+ */
+struct pipe_buf_operations
+{
+    /* Try to take exclusive ownership of the page. Returns true if the caller may reuse it. */
+    bool (*try_steal)(struct pipe_buffer *buf);
+    /* Grab an extra reference to the page, for a buffer that's going to share it */
+    void (*get)(struct pipe_buffer *buf);
+    /* Drop the buffer's reference to the page */
+    void (*release)(struct pipe_buffer *buf);
+};
+
+/* Writes may append to the buffer's page, past offset + len */
+#define PIPE_BUF_CAN_MERGE (1 << 0)
+
 struct pipe_buffer
 {
     struct page *page_;
     struct list_head list_node;
     unsigned int len_;
     unsigned int offset_{0};
+    unsigned int flags_{0};
+    const struct pipe_buf_operations *ops_;
 
-    pipe_buffer(struct page *page, unsigned int len) : page_{page}, len_{len}
+    pipe_buffer(struct page *page, unsigned int len, const pipe_buf_operations *ops)
+        : page_{page}, len_{len}, ops_{ops}
     {
     }
 
@@ -69,7 +96,7 @@ struct pipe_buffer
     ~pipe_buffer()
     {
         if (page_)
-            page_unref(page_);
+            ops_->release(this);
     }
 
     void *operator new(size_t len)
@@ -83,10 +110,47 @@ struct pipe_buffer
     }
 };
 
+static void generic_pipe_buf_get(struct pipe_buffer *buf)
+{
+    page_ref(buf->page_);
+}
+
+static void generic_pipe_buf_release(struct pipe_buffer *buf)
+{
+    page_unref(buf->page_);
+}
+
+static bool anon_pipe_buf_try_steal(struct pipe_buffer *buf)
+{
+    // Ours if no one else (tee) holds a reference
+    return __atomic_load_n(&buf->page_->ref, __ATOMIC_ACQUIRE) == 1;
+}
+
+static bool page_cache_pipe_buf_try_steal(struct pipe_buffer *buf)
+{
+    // The page still belongs to the page cache
+    return false;
+}
+
+/* Pages allocated by the pipe and filled by write() (or by splicing from a non page cache file) */
+static const struct pipe_buf_operations anon_pipe_buf_ops = {
+    .try_steal = anon_pipe_buf_try_steal,
+    .get = generic_pipe_buf_get,
+    .release = generic_pipe_buf_release,
+};
+
+/* Page cache pages, spliced in from a file */
+static const struct pipe_buf_operations page_cache_pipe_buf_ops = {
+    .try_steal = page_cache_pipe_buf_try_steal,
+    .get = generic_pipe_buf_get,
+    .release = generic_pipe_buf_release,
+};
+
 class pipe : public refcountable
 {
 private:
-    struct page *cached_page{nullptr};
+    struct page *page_pool[PIPE_PAGE_POOL];
+    unsigned int nr_pool{0};
     struct list_head pipe_buffers;
     size_t curr_len{0};
     mutex pipe_lock;
@@ -122,6 +186,12 @@ private:
     }
 
     ssize_t append(const void *ubuf, size_t len, bool atomic);
+    struct page *alloc_buf_page();
+    void free_buf_page(struct page *page);
+    void consume(pipe_buffer *pbf, size_t len);
+    int wait_readable(bool nonblock);
+    int wait_writable(bool nonblock);
+    ssize_t transfer(pipe *out, size_t len, bool take);
 
 public:
     size_t reader_count{1};
@@ -165,6 +235,30 @@ public:
     int set_capacity(size_t len);
 
     int open_named(struct file *filp);
+
+    ssize_t splice_in(struct file *in, size_t *off, size_t len, bool nonblock);
+    ssize_t splice_out(struct file *out, size_t *off, size_t len, bool nonblock);
+    static ssize_t splice_pipe(pipe *in, pipe *out, size_t len, bool nonblock, bool take);
+
+#ifdef CONFIG_KUNIT
+    struct page *first_page()
+    {
+        return list_is_empty(&pipe_buffers) ? nullptr : first_buf()->page_;
+    }
+
+    unsigned int nr_buffers()
+    {
+        unsigned int nr = 0;
+        list_for_every (&pipe_buffers)
+            nr++;
+        return nr;
+    }
+
+    unsigned int pool_size() const
+    {
+        return nr_pool;
+    }
+#endif
 };
 
 pipe::pipe() : refcountable(2)
@@ -183,6 +277,34 @@ pipe::~pipe()
         list_remove(&pbf->list_node);
         delete pbf;
     }
+
+    while (nr_pool)
+        free_page(page_pool[--nr_pool]);
+}
+
+/**
+ * @brief Get a page for a new pipe buffer, from the pool if possible
+ *
+ * @return Page, or nullptr
+ */
+struct page *pipe::alloc_buf_page()
+{
+    if (nr_pool)
+        return page_pool[--nr_pool];
+    return alloc_page(PAGE_ALLOC_NO_ZERO);
+}
+
+/**
+ * @brief Give a page we exclusively own back to the pool (or free it, if the pool is full)
+ *
+ * @param page Page
+ */
+void pipe::free_buf_page(struct page *page)
+{
+    if (nr_pool < PIPE_PAGE_POOL)
+        page_pool[nr_pool++] = page;
+    else
+        free_page(page);
 }
 
 bool pipe::is_full() const
@@ -259,25 +381,7 @@ ssize_t pipe::read(int flags, size_t len, void *buf)
             break;
         }
 
-        pbf->offset_ += to_read;
-        pbf->len_ -= to_read;
-
-        if (pbf->len_ == 0)
-        {
-            // If its now empty, free the pipe buffer
-            list_remove(&pbf->list_node);
-
-            // Check if we have a cached page. If not, cache this one, else let it go.
-            if (!cached_page)
-            {
-                cached_page = pbf->steal_page();
-            }
-
-            delete pbf;
-        }
-
-        // Decrement the length of the pipe (curr_len)
-        curr_len -= to_read;
+        consume(pbf, to_read);
         ret += to_read;
         len -= to_read;
 
@@ -300,6 +404,31 @@ ssize_t pipe::read(int flags, size_t len, void *buf)
     return ret;
 }
 
+/**
+ * @brief Consume len bytes from the start of a pipe buffer, freeing it if it's now empty
+ *
+ * @param pbf Pipe buffer
+ * @param len Length to consume
+ */
+void pipe::consume(pipe_buffer *pbf, size_t len)
+{
+    pbf->offset_ += len;
+    pbf->len_ -= len;
+    curr_len -= len;
+
+    if (pbf->len_ == 0)
+    {
+        // If its now empty, free the pipe buffer
+        list_remove(&pbf->list_node);
+
+        // Steal the page back into our pool if it's exclusively ours, else let it go.
+        if (pbf->ops_->try_steal(pbf))
+            free_buf_page(pbf->steal_page());
+
+        delete pbf;
+    }
+}
+
 ssize_t pipe::append(const void *ubuf, size_t len, bool atomic)
 {
     // Logic here is a bit tricky. Try to append to the last pipe buf
@@ -318,7 +447,8 @@ ssize_t pipe::append(const void *ubuf, size_t len, bool atomic)
         // See if we have space in this pipe buffer
         // TODO: Idea to test: memmove data back if we have offset != 0
         // May compact things a bit.
-        if (PAGE_SIZE - last_buf->len_ <= len)
+        const size_t tail = last_buf->offset_ + last_buf->len_;
+        if (last_buf->flags_ & PIPE_BUF_CAN_MERGE && tail < PAGE_SIZE)
         {
             // We have space, copy up
             if (atomic)
@@ -326,13 +456,13 @@ ssize_t pipe::append(const void *ubuf, size_t len, bool atomic)
 
             old_restore_len = last_buf->len_;
             u8 *page_buf = (u8 *) PAGE_TO_VIRT(last_buf->page_);
-            size_t to_copy = min(PAGE_SIZE - last_buf->len_, len);
-            if (copy_from_user(page_buf + last_buf->offset_, ubuf, to_copy) < 0)
+            size_t to_copy = min(PAGE_SIZE - tail, len);
+            if (copy_from_user(page_buf + tail, ubuf, to_copy) < 0)
                 return -EFAULT;
 
             // Adjust the length
             last_buf->len_ += to_copy;
-            assert(last_buf->len_ <= PAGE_SIZE);
+            assert(last_buf->offset_ + last_buf->len_ <= PAGE_SIZE);
             len -= to_copy;
             ret += to_copy;
             curr_len += to_copy;
@@ -344,25 +474,20 @@ ssize_t pipe::append(const void *ubuf, size_t len, bool atomic)
     // If we still have more to append and enough space, lets do so
     if (avail && len)
     {
-        page *p = cached_page;
-        if (!cached_page)
+        page *p = alloc_buf_page();
+        if (!p)
         {
-            p = alloc_page(PAGE_ALLOC_NO_ZERO);
-            if (!p)
-            {
-                ret = -ENOMEM;
-                goto out;
-            }
-
-            cached_page = p;
+            ret = -ENOMEM;
+            goto out;
         }
 
         auto blen = min(min(avail, len), PAGE_SIZE);
         // Note: the page and its lifetime are now tied to the pipe buffer, but we steal
         // the page on error.
-        auto buf = make_unique<pipe_buffer>(p, blen);
+        auto buf = make_unique<pipe_buffer>(p, blen, &anon_pipe_buf_ops);
         if (!buf)
         {
+            free_buf_page(p);
             ret = -ENOMEM;
             goto out;
         }
@@ -372,19 +497,18 @@ ssize_t pipe::append(const void *ubuf, size_t len, bool atomic)
         {
             if (atomic || !ret)
                 ret = -EFAULT;
-            buf->steal_page();
+            free_buf_page(buf->steal_page());
             goto out;
         }
 
+        buf->flags_ = PIPE_BUF_CAN_MERGE;
+
         // Append the page_buf to the end of list
         list_add_tail(&buf->list_node, &pipe_buffers);
         ret += buf->len_;
         curr_len += buf->len_;
         to_restore = nullptr;
 
-        // Release the cached page, definitely no longer ours.
-        cached_page = nullptr;
-
         buf.release();
     }
 
@@ -490,6 +614,351 @@ ssize_t pipe::write(int flags, size_t len, const void *ubuf)
     return ret;
 }
 
+/**
+ * @brief Wait for the pipe to have data (or for EOF)
+ *
+ * @param nonblock If true, don't block
+ * @return 1 if there's data, 0 on EOF, or negative error code
+ */
+int pipe::wait_readable(bool nonblock)
+{
+    while (!can_read())
+    {
+        if (writer_count == 0)
+            return 0;
+
+        if (nonblock)
+            return -EAGAIN;
+
+        if (wait_for_event_mutex_interruptible(&read_queue, can_read_or_eof(), &pipe_lock) ==
+            -EINTR)
+            return -EINTR;
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Wait for the pipe to have space
+ *
+ * @param nonblock If true, don't block
+ * @return 0 if there's space, or negative error code
+ */
+int pipe::wait_writable(bool nonblock)
+{
+    while (true)
+    {
+        if (reader_count == 0)
+        {
+            CALL_KUNIT_MOCKABLE(kernel_raise_signal, SIGPIPE, get_current_process(), 0, nullptr);
+            return -EPIPE;
+        }
+
+        if (can_write())
+            return 0;
+
+        if (nonblock)
+            return -EAGAIN;
+
+        if (wait_for_event_mutex_interruptible(&write_queue, can_write_or_broken(), &pipe_lock) ==
+            -EINTR)
+            return -EINTR;
+    }
+}
+
+/**
+ * @brief Splice data from a file into the pipe
+ * Page cache pages are referenced by the pipe buffers directly, other files are read into fresh
+ * pages.
+ *
+ * @param in File to read from
+ * @param off Offset into the file, advanced by the amount spliced
+ * @param len Maximum length
+ * @param nonblock If true, don't block
+ * @return Spliced bytes, or negative error code
+ */
+ssize_t pipe::splice_in(struct file *in, size_t *off, size_t len, bool nonblock)
+{
+    struct inode *ino = in->f_ino;
+    const bool cached = ino->i_fops->read_iter == filemap_read_iter;
+    ssize_t ret = 0;
+
+    if (len == 0)
+        return 0;
+
+    scoped_mutex g{pipe_lock};
+
+    if (int st = wait_writable(nonblock); st < 0)
+        return st;
+
+    bool wasempty = !can_read();
+
+    while (len && can_write())
+    {
+        size_t pgoff = 0;
+        size_t amount = min(min(len, PAGE_SIZE), available_space());
+        const pipe_buf_operations *ops = &page_cache_pipe_buf_ops;
+        unsigned int bufflags = 0;
+        bool short_read = false;
+        struct page *page;
+
+        if (cached)
+        {
+            if (*off >= ino->i_size)
+                break;
+
+            pgoff = *off % PAGE_SIZE;
+            amount = min(min(amount, PAGE_SIZE - pgoff), ino->i_size - *off);
+
+            struct page_cache_block *cache = inode_get_page(ino, *off);
+            if (!cache)
+            {
+                ret = ret ?: -EIO;
+                break;
+            }
+
+            // The pin inode_get_page gave us now belongs to the pipe buffer
+            page = cache->page;
+        }
+        else
+        {
+            ops = &anon_pipe_buf_ops;
+            bufflags = PIPE_BUF_CAN_MERGE;
+            page = alloc_buf_page();
+            if (!page)
+            {
+                ret = ret ?: -ENOMEM;
+                break;
+            }
+
+            auto_addr_limit l_{VM_KERNEL_ADDR_LIMIT};
+            ssize_t st = read_vfs(*off, amount, PAGE_TO_VIRT(page), in);
+            if (st <= 0)
+            {
+                free_buf_page(page);
+                ret = ret ?: st;
+                break;
+            }
+
+            short_read = (size_t) st < amount;
+            amount = st;
+        }
+
+        auto pbf = new pipe_buffer{page, (unsigned int) amount, ops};
+        if (!pbf)
+        {
+            page_unref(page);
+            ret = ret ?: -ENOMEM;
+            break;
+        }
+
+        pbf->offset_ = pgoff;
+        pbf->flags_ = bufflags;
+        list_add_tail(&pbf->list_node, &pipe_buffers);
+
+        curr_len += amount;
+        *off += amount;
+        ret += amount;
+        len -= amount;
+
+        // Short read from a non page cache file, don't go back for more
+        if (short_read)
+            break;
+    }
+
+    g.unlock();
+
+    if (wasempty && ret > 0)
+        wake_all(&read_queue);
+
+    return ret;
+}
+
+/**
+ * @brief Splice data from the pipe into a file
+ *
+ * @param out File to write to
+ * @param off Offset into the file, advanced by the amount spliced
+ * @param len Maximum length
+ * @param nonblock If true, don't block
+ * @return Spliced bytes, or negative error code
+ */
+ssize_t pipe::splice_out(struct file *out, size_t *off, size_t len, bool nonblock)
+{
+    ssize_t ret = 0;
+
+    if (len == 0)
+        return 0;
+
+    scoped_mutex g{pipe_lock};
+
+    if (int st = wait_readable(nonblock); st <= 0)
+        return st;
+
+    bool wasfull = available_space() < PIPE_BUF;
+
+    auto_addr_limit l_{VM_KERNEL_ADDR_LIMIT};
+
+    while (len && can_read())
+    {
+        auto pbf = first_buf();
+        size_t to_write = min((size_t) pbf->len_, len);
+        u8 *page_buf = (u8 *) PAGE_TO_VIRT(pbf->page_) + pbf->offset_;
+
+        ssize_t st = write_vfs(*off, to_write, page_buf, out);
+        if (st <= 0)
+        {
+            ret = ret ?: st;
+            break;
+        }
+
+        consume(pbf, st);
+        *off += st;
+        ret += st;
+        len -= st;
+
+        if ((size_t) st < to_write)
+            break;
+    }
+
+    g.unlock();
+
+    if (wasfull && ret > 0)
+        wake_all(&write_queue);
+
+    return ret;
+}
+
+/**
+ * @brief Transfer pipe buffers to another pipe, without copying. Both pipes must be locked.
+ *
+ * @param out Pipe to transfer to
+ * @param len Maximum length
+ * @param take If true, remove the data from this pipe
+ * @return Transferred bytes
+ */
+ssize_t pipe::transfer(pipe *out, size_t len, bool take)
+{
+    ssize_t ret = 0;
+
+    list_for_every_safe (&pipe_buffers)
+    {
+        if (!len || !out->can_write())
+            break;
+
+        auto pbf = container_of(l, pipe_buffer, list_node);
+        size_t amount = min(min((size_t) pbf->len_, len), out->available_space());
+
+        if (take && amount == pbf->len_)
+        {
+            // Moving the whole buffer, just relink it
+            list_remove(&pbf->list_node);
+            list_add_tail(&pbf->list_node, &out->pipe_buffers);
+            curr_len -= amount;
+        }
+        else
+        {
+            auto nb = new pipe_buffer{pbf->page_, (unsigned int) amount, pbf->ops_};
+            if (!nb)
+                break;
+
+            // Both buffers now point to the same page, so neither may be appended to
+            pbf->ops_->get(pbf);
+            nb->offset_ = pbf->offset_;
+            pbf->flags_ &= ~PIPE_BUF_CAN_MERGE;
+            list_add_tail(&nb->list_node, &out->pipe_buffers);
+
+            if (take)
+                consume(pbf, amount);
+        }
+
+        out->curr_len += amount;
+        ret += amount;
+        len -= amount;
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Move or duplicate data from one pipe into another
+ *
+ * @param in Pipe to read from
+ * @param out Pipe to write to
+ * @param len Maximum length
+ * @param nonblock If true, don't block
+ * @param take If true, remove the data from in (splice), else leave it (tee)
+ * @return Transferred bytes, or negative error code
+ */
+ssize_t pipe::splice_pipe(pipe *in, pipe *out, size_t len, bool nonblock, bool take)
+{
+    if (in == out)
+        return -EINVAL;
+
+    if (len == 0)
+        return 0;
+
+    // Lock ordering: lowest address first
+    pipe *first = in < out ? in : out;
+    pipe *second = in < out ? out : in;
+    ssize_t ret;
+
+    while (true)
+    {
+        mutex_lock(&first->pipe_lock);
+        mutex_lock(&second->pipe_lock);
+
+        if (out->reader_count == 0)
+        {
+            CALL_KUNIT_MOCKABLE(kernel_raise_signal, SIGPIPE, get_current_process(), 0, nullptr);
+            ret = -EPIPE;
+            break;
+        }
+
+        if (in->can_read() && out->can_write())
+        {
+            ret = in->transfer(out, len, take);
+            break;
+        }
+
+        if (!in->can_read() && in->writer_count == 0)
+        {
+            ret = 0;
+            break;
+        }
+
+        if (nonblock)
+        {
+            ret = -EAGAIN;
+            break;
+        }
+
+        const bool wait_in = !in->can_read();
+
+        mutex_unlock(&second->pipe_lock);
+        mutex_unlock(&first->pipe_lock);
+
+        // Wait on one of the pipes at a time, and re-check both afterwards
+        pipe *p = wait_in ? in : out;
+        scoped_mutex g{p->pipe_lock};
+        int st = wait_in ? p->wait_readable(false) : p->wait_writable(false);
+        if (st < 0)
+            return st;
+    }
+
+    mutex_unlock(&second->pipe_lock);
+    mutex_unlock(&first->pipe_lock);
+
+    if (ret > 0)
+    {
+        out->wake_all(&out->read_queue);
+        if (take)
+            in->wake_all(&in->write_queue);
+    }
+
+    return ret;
+}
+
 pipe *get_pipe(void *helper)
 {
     return (pipe *) helper;
@@ -957,6 +1426,40 @@ int pipe_do_fifo(inode *ino)
     return 0;
 }
 
+bool file_is_pipe(struct file *filp)
+{
+    auto fops = filp->f_ino->i_fops;
+    return fops == &pipe_ops || fops == &named_pipe_ops;
+}
+
+static bool splice_nonblock(struct file *pipe_filp, unsigned int flags)
+{
+    return flags & SPLICE_F_NONBLOCK || pipe_filp->f_flags & O_NONBLOCK;
+}
+
+ssize_t pipe_splice_from_file(struct file *pipe_filp, struct file *in, size_t *off, size_t len,
+                              unsigned int flags)
+{
+    pipe *p = get_pipe(pipe_filp->f_ino->i_pipe);
+    return p->splice_in(in, off, len, splice_nonblock(pipe_filp, flags));
+}
+
+ssize_t pipe_splice_to_file(struct file *pipe_filp, struct file *out, size_t *off, size_t len,
+                            unsigned int flags)
+{
+    pipe *p = get_pipe(pipe_filp->f_ino->i_pipe);
+    return p->splice_out(out, off, len, splice_nonblock(pipe_filp, flags));
+}
+
+ssize_t pipe_splice_pipe(struct file *in, struct file *out, size_t len, unsigned int flags,
+                         bool consume)
+{
+    pipe *pin = get_pipe(in->f_ino->i_pipe);
+    pipe *pout = get_pipe(out->f_ino->i_pipe);
+    bool nonblock = splice_nonblock(in, flags) || splice_nonblock(out, flags);
+    return pipe::splice_pipe(pin, pout, len, nonblock, consume);
+}
+
 #ifdef CONFIG_KUNIT
 
 TEST(pipe, rw_works)
@@ -979,6 +1482,239 @@ TEST(pipe, rw_works)
     ASSERT_EQ(p->get_unread_len(), 0U);
 }
 
+TEST(pipe, small_writes_append)
+{
+    auto_addr_limit l_{VM_KERNEL_ADDR_LIMIT};
+
+    auto p = make_refc<pipe>();
+
+    ASSERT_EQ(p->write(0, 5, "Hello"), 5);
+    ASSERT_EQ(p->write(0, 5, "World"), 5);
+    ASSERT_EQ(p->get_unread_len(), 10U);
+
+    char buf[11] = {};
+    ASSERT_EQ(p->read(0, 3, buf), 3);
+    ASSERT_EQ(p->write(0, 1, "!"), 1);
+    ASSERT_EQ(p->read(0, 8, buf + 3), 8);
+    EXPECT_EQ(memcmp(buf, "HelloWorld!", 11), 0);
+}
+
+TEST(pipe, tee_shares_pages)
+{
+    auto_addr_limit l_{VM_KERNEL_ADDR_LIMIT};
+
+    auto p = make_refc<pipe>();
+    auto p2 = make_refc<pipe>();
+
+    ASSERT_EQ(p->write(0, 5, "Hello"), 5);
+    ASSERT_EQ(pipe::splice_pipe(p.get(), p2.get(), 5, true, false), 5);
+    ASSERT_EQ(p->get_unread_len(), 5U);
+    ASSERT_EQ(p2->get_unread_len(), 5U);
+
+    // Both pipes reference the same page, no copy was made
+    struct page *page = p->first_page();
+    ASSERT_NONNULL(page);
+    EXPECT_EQ(p2->first_page(), page);
+    EXPECT_EQ(page->ref, 2U);
+
+    ASSERT_EQ(p->write(0, 5, "World"), 5);
+
+    char buf[10];
+    ASSERT_EQ(p2->read(0, 10, buf), 5);
+    EXPECT_EQ(memcmp(buf, "Hello", 5), 0);
+    ASSERT_EQ(p->read(0, 10, buf), 10);
+    EXPECT_EQ(memcmp(buf, "HelloWorld", 10), 0);
+}
+
+/* A small in-memory file, accessed through file_ops::read and write */
+struct pipe_test_file
+{
+    struct inode ino;
+    struct file filp;
+    char data[64];
+    size_t size;
+};
+
+static size_t pipe_test_file_read(size_t off, size_t len, void *buf, struct file *filp)
+{
+    auto tf = (pipe_test_file *) filp->private_data;
+    if (off >= tf->size)
+        return 0;
+
+    len = min(len, tf->size - off);
+    memcpy(buf, tf->data + off, len);
+    return len;
+}
+
+static size_t pipe_test_file_write(size_t off, size_t len, void *buf, struct file *filp)
+{
+    auto tf = (pipe_test_file *) filp->private_data;
+    if (off >= sizeof(tf->data))
+        return 0;
+
+    len = min(len, sizeof(tf->data) - off);
+    memcpy(tf->data + off, buf, len);
+    tf->size = cul::max(tf->size, off + len);
+    return len;
+}
+
+static struct file_ops pipe_test_file_ops = {
+    .read = pipe_test_file_read,
+    .write = pipe_test_file_write,
+};
+
+// tf must be value-initialized (pipe_test_file tf{})
+static void pipe_test_file_init(pipe_test_file *tf, const char *contents)
+{
+    tf->ino.i_mode = S_IFREG | 0644;
+    tf->ino.i_fops = &pipe_test_file_ops;
+    // Already "dirty", so timestamp updates don't put us on the flush lists
+    tf->ino.i_flags = INODE_FLAG_DIRTY;
+    tf->filp.f_ino = &tf->ino;
+    tf->filp.f_flags = O_RDWR | O_NOATIME;
+    tf->filp.private_data = tf;
+    tf->size = strlen(contents);
+    memcpy(tf->data, contents, tf->size);
+}
+
+TEST(pipe, splice_from_file)
+{
+    auto_addr_limit l_{VM_KERNEL_ADDR_LIMIT};
+
+    auto p = make_refc<pipe>();
+    pipe_test_file tf{};
+    pipe_test_file_init(&tf, "HelloWorld");
+
+    size_t off = 5;
+    ASSERT_EQ(p->splice_in(&tf.filp, &off, 5, false), 5);
+    EXPECT_EQ(off, 10U);
+    ASSERT_EQ(p->get_unread_len(), 5U);
+
+    // Short read at EOF
+    off = 8;
+    ASSERT_EQ(p->splice_in(&tf.filp, &off, 10, false), 2);
+    EXPECT_EQ(off, 10U);
+    EXPECT_EQ(p->splice_in(&tf.filp, &off, 10, false), 0);
+
+    char buf[7];
+    ASSERT_EQ(p->read(0, 7, buf), 7);
+    EXPECT_EQ(memcmp(buf, "Worldld", 7), 0);
+}
+
+TEST(pipe, splice_to_file)
+{
+    auto_addr_limit l_{VM_KERNEL_ADDR_LIMIT};
+
+    auto p = make_refc<pipe>();
+    pipe_test_file tf{};
+    pipe_test_file_init(&tf, "..........");
+
+    ASSERT_EQ(p->write(0, 5, "Hello"), 5);
+
+    size_t off = 2;
+    ASSERT_EQ(p->splice_out(&tf.filp, &off, 3, false), 3);
+    EXPECT_EQ(off, 5U);
+    ASSERT_EQ(p->get_unread_len(), 2U);
+
+    ASSERT_EQ(p->splice_out(&tf.filp, &off, 10, false), 2);
+    EXPECT_EQ(off, 7U);
+    EXPECT_EQ(p->get_unread_len(), 0U);
+    EXPECT_EQ(memcmp(tf.data, "..Hello...", 10), 0);
+
+    // Empty pipe
+    EXPECT_EQ(p->splice_out(&tf.filp, &off, 10, true), -EAGAIN);
+}
+
+TEST(pipe, writes_merge)
+{
+    auto_addr_limit l_{VM_KERNEL_ADDR_LIMIT};
+
+    auto p = make_refc<pipe>();
+
+    ASSERT_EQ(p->write(0, 5, "Hello"), 5);
+    ASSERT_EQ(p->write(0, 5, "World"), 5);
+    EXPECT_EQ(p->nr_buffers(), 1U);
+
+    // Fill up the rest of the page, the next write needs a new buffer
+    static char buf[PAGE_SIZE];
+    ASSERT_EQ(p->write(0, PAGE_SIZE - 10, buf), (ssize_t) (PAGE_SIZE - 10));
+    EXPECT_EQ(p->nr_buffers(), 1U);
+    ASSERT_EQ(p->write(0, 1, buf), 1);
+    EXPECT_EQ(p->nr_buffers(), 2U);
+}
+
+TEST(pipe, shared_bufs_dont_merge)
+{
+    auto_addr_limit l_{VM_KERNEL_ADDR_LIMIT};
+
+    auto p = make_refc<pipe>();
+    auto p2 = make_refc<pipe>();
+
+    ASSERT_EQ(p->write(0, 5, "Hello"), 5);
+    ASSERT_EQ(pipe::splice_pipe(p.get(), p2.get(), 5, true, false), 5);
+
+    // The page is shared with p2 now, so the write must not go into it
+    ASSERT_EQ(p->write(0, 5, "World"), 5);
+    EXPECT_EQ(p->nr_buffers(), 2U);
+    EXPECT_EQ(p2->nr_buffers(), 1U);
+
+    // Splicing out of a non page cache file gives us a page we own, so writes merge again
+    pipe_test_file tf{};
+    pipe_test_file_init(&tf, "!");
+    size_t off = 0;
+    ASSERT_EQ(p2->splice_in(&tf.filp, &off, 1, false), 1);
+    ASSERT_EQ(p2->write(0, 1, "?"), 1);
+    EXPECT_EQ(p2->nr_buffers(), 2U);
+
+    char buf[7];
+    ASSERT_EQ(p2->read(0, 7, buf), 7);
+    EXPECT_EQ(memcmp(buf, "Hello!?", 7), 0);
+}
+
+TEST(pipe, page_pool_reuse)
+{
+    auto_addr_limit l_{VM_KERNEL_ADDR_LIMIT};
+
+    auto p = make_refc<pipe>();
+    char buf[5];
+
+    ASSERT_EQ(p->write(0, 5, "Hello"), 5);
+    struct page *page = p->first_page();
+    ASSERT_NONNULL(page);
+    EXPECT_EQ(p->pool_size(), 0U);
+
+    // Fully consumed buffers give their page back to the pool...
+    ASSERT_EQ(p->read(0, 5, buf), 5);
+    EXPECT_EQ(p->pool_size(), 1U);
+
+    // ... and the next buffer gets it from there
+    ASSERT_EQ(p->write(0, 5, "World"), 5);
+    EXPECT_EQ(p->first_page(), page);
+    EXPECT_EQ(p->pool_size(), 0U);
+}
+
+TEST(pipe, shared_pages_arent_stolen)
+{
+    auto_addr_limit l_{VM_KERNEL_ADDR_LIMIT};
+
+    auto p = make_refc<pipe>();
+    auto p2 = make_refc<pipe>();
+    char buf[5];
+
+    ASSERT_EQ(p->write(0, 5, "Hello"), 5);
+    ASSERT_EQ(pipe::splice_pipe(p.get(), p2.get(), 5, true, false), 5);
+    struct page *page = p->first_page();
+
+    // p2 still references the page, so it can't go into p's pool
+    ASSERT_EQ(p->read(0, 5, buf), 5);
+    EXPECT_EQ(p->pool_size(), 0U);
+    EXPECT_EQ(page->ref, 1U);
+
+    ASSERT_EQ(p2->read(0, 5, buf), 5);
+    EXPECT_EQ(memcmp(buf, "Hello", 5), 0);
+    EXPECT_EQ(p2->pool_size(), 1U);
+}
+
 TEST(pipe, pipe_buf_works)
 {
     auto_addr_limit l_{VM_KERNEL_ADDR_LIMIT};
@@ -0,0 +1,402 @@
+/*
+ * Copyright (c) 2023 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <errno.h>
+#include <limits.h>
+
+#include <onyx/file.h>
+#include <onyx/filemap.h>
+#include <onyx/pagecache.h>
+#include <onyx/pipe.h>
+#include <onyx/signal.h>
+#include <onyx/user.h>
+#include <onyx/vfs.h>
+#include <onyx/vm.h>
+
+#include <uapi/fcntl.h>
+
+#define SPLICE_VALID_FLAGS (SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE | SPLICE_F_GIFT)
+
+/**
+ * @brief Hold the seek locks of the files whose f_seek a splice-like operation uses.
+ * Pass nullptr for files whose position comes from userspace. As with read() and write(), only
+ * regular files and directories get locked. Locks are taken in address order, so two splices going
+ * in opposite directions can't deadlock.
+ */
+class splice_seek_lock
+{
+    struct file *files[2];
+
+public:
+    splice_seek_lock(struct file *a, struct file *b) : files{a, b}
+    {
+        for (struct file *&f : files)
+        {
+            if (f && !S_ISREG(f->f_ino->i_mode) && !S_ISDIR(f->f_ino->i_mode))
+                f = nullptr;
+        }
+
+        if (files[0] == files[1])
+            files[1] = nullptr;
+
+        if (files[0] && files[1] && files[1] < files[0])
+        {
+            struct file *tmp = files[0];
+            files[0] = files[1];
+            files[1] = tmp;
+        }
+
+        for (struct file *f : files)
+        {
+            if (f)
+                mutex_lock(&f->f_seeklock);
+        }
+    }
+
+    ~splice_seek_lock()
+    {
+        if (files[1])
+            mutex_unlock(&files[1]->f_seeklock);
+        if (files[0])
+            mutex_unlock(&files[0]->f_seeklock);
+    }
+
+    CLASS_DISALLOW_COPY(splice_seek_lock);
+    CLASS_DISALLOW_MOVE(splice_seek_lock);
+};
+
+/**
+ * @brief Fetch the position for a splice-like operation
+ *
+ * @param f File
+ * @param uoff User offset pointer. If null, use (and later update) the file's position.
+ * @param pos Pointer to the resulting position
+ * @return 0 on success, negative error code
+ */
+static int splice_get_pos(struct file *f, off_t *uoff, size_t *pos)
+{
+    off_t off;
+
+    if (!uoff)
+    {
+        *pos = f->f_seek;
+        return 0;
+    }
+
+    if (f->f_ino->i_flags & INODE_FLAG_NO_SEEK)
+        return -ESPIPE;
+
+    if (copy_from_user(&off, uoff, sizeof(off_t)) < 0)
+        return -EFAULT;
+
+    if (off < 0)
+        return -EINVAL;
+
+    *pos = off;
+    return 0;
+}
+
+static int splice_put_pos(struct file *f, off_t *uoff, size_t pos)
+{
+    off_t off = pos;
+
+    if (!uoff)
+    {
+        f->f_seek = pos;
+        return 0;
+    }
+
+    return copy_to_user(uoff, &off, sizeof(off_t)) < 0 ? -EFAULT : 0;
+}
+
+/**
+ * @brief Copy data between two files without going through userspace
+ * If in is backed by the page cache, its pages are handed to out's write directly (for page cache
+ * backed outs, this is a single cache-to-cache copy). Other files go through a bounce page.
+ *
+ * @param in File to read from
+ * @param in_off Offset into in, advanced by the amount copied
+ * @param out File to write to
+ * @param out_off Offset into out, advanced by the amount copied
+ * @param len Maximum length
+ * @return Copied bytes, or negative error code
+ */
+static ssize_t do_splice_direct(struct file *in, size_t *in_off, struct file *out, size_t *out_off,
+                                size_t len)
+{
+    struct inode *ino = in->f_ino;
+    const bool cached = ino->i_fops->read_iter == filemap_read_iter;
+    struct page *bounce = nullptr;
+    ssize_t ret = 0;
+    ssize_t st = 0;
+
+    if (!cached)
+    {
+        bounce = alloc_page(PAGE_ALLOC_NO_ZERO);
+        if (!bounce)
+            return -ENOMEM;
+    }
+
+    auto_addr_limit l_{VM_KERNEL_ADDR_LIMIT};
+
+    while (len)
+    {
+        struct page_cache_block *cache = nullptr;
+        size_t amount = min(len, PAGE_SIZE);
+        u8 *buf;
+
+        if (cached)
+        {
+            if (*in_off >= ino->i_size)
+                break;
+
+            size_t pgoff = *in_off % PAGE_SIZE;
+            amount = min(min(amount, PAGE_SIZE - pgoff), ino->i_size - *in_off);
+
+            cache = inode_get_page(ino, *in_off);
+            if (!cache)
+            {
+                st = -EIO;
+                break;
+            }
+
+            buf = (u8 *) cache->buffer + pgoff;
+        }
+        else
+        {
+            buf = (u8 *) PAGE_TO_VIRT(bounce);
+            st = read_vfs(*in_off, amount, buf, in);
+            if (st <= 0)
+                break;
+            amount = st;
+        }
+
+        st = write_vfs(*out_off, amount, buf, out);
+
+        if (cache)
+            page_unpin(cache->page);
+
+        if (st <= 0)
+            break;
+
+        // Note: a short write from a non page cache file loses the rest of the bounce buffer.
+        // This matches what a read + write loop in userspace would do.
+        *in_off += st;
+        *out_off += st;
+        ret += st;
+        len -= st;
+
+        if ((size_t) st < amount || signal_is_pending())
+            break;
+    }
+
+    if (bounce)
+        page_unref(bounce);
+
+    return ret ?: st;
+}
+
+ssize_t sys_sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+    auto_file in, out;
+    size_t in_pos, out_pos;
+    ssize_t st;
+
+    if (st = in.from_fd(in_fd); st < 0)
+        return st;
+    if (st = out.from_fd(out_fd); st < 0)
+        return st;
+
+    struct file *inf = in.get_file();
+    struct file *outf = out.get_file();
+
+    if (!fd_may_access(inf, FILE_ACCESS_READ) || !fd_may_access(outf, FILE_ACCESS_WRITE))
+        return -EBADF;
+
+    if (S_ISDIR(inf->f_ino->i_mode))
+        return -EISDIR;
+
+    if (outf->f_flags & O_APPEND)
+        return -EINVAL;
+
+    splice_seek_lock l_{offset ? nullptr : inf, outf};
+
+    if (st = splice_get_pos(inf, offset, &in_pos); st < 0)
+        return st;
+
+    out_pos = outf->f_seek;
+
+    if (file_is_pipe(outf))
+        st = pipe_splice_from_file(outf, inf, &in_pos, count, 0);
+    else
+        st = do_splice_direct(inf, &in_pos, outf, &out_pos, count);
+
+    if (st <= 0)
+        return st;
+
+    if (S_ISREG(outf->f_ino->i_mode))
+        outf->f_seek = out_pos;
+
+    if (int st2 = splice_put_pos(inf, offset, in_pos); st2 < 0)
+        return st2;
+
+    return st;
+}
+
+ssize_t sys_splice(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len,
+                   unsigned int flags)
+{
+    auto_file in, out;
+    size_t pos;
+    ssize_t st;
+
+    if (flags & ~SPLICE_VALID_FLAGS)
+        return -EINVAL;
+
+    if (st = in.from_fd(fd_in); st < 0)
+        return st;
+    if (st = out.from_fd(fd_out); st < 0)
+        return st;
+
+    struct file *inf = in.get_file();
+    struct file *outf = out.get_file();
+
+    if (!fd_may_access(inf, FILE_ACCESS_READ) || !fd_may_access(outf, FILE_ACCESS_WRITE))
+        return -EBADF;
+
+    const bool in_pipe = file_is_pipe(inf);
+    const bool out_pipe = file_is_pipe(outf);
+
+    if ((in_pipe && off_in) || (out_pipe && off_out))
+        return -ESPIPE;
+
+    if (in_pipe && out_pipe)
+        return pipe_splice_pipe(inf, outf, len, flags, true);
+
+    if (in_pipe)
+    {
+        if (outf->f_flags & O_APPEND)
+            return -EINVAL;
+
+        splice_seek_lock l_{off_out ? nullptr : outf, nullptr};
+
+        if (st = splice_get_pos(outf, off_out, &pos); st < 0)
+            return st;
+
+        st = pipe_splice_to_file(inf, outf, &pos, len, flags);
+        if (st > 0)
+        {
+            if (int st2 = splice_put_pos(outf, off_out, pos); st2 < 0)
+                return st2;
+        }
+
+        return st;
+    }
+
+    if (out_pipe)
+    {
+        if (S_ISDIR(inf->f_ino->i_mode))
+            return -EISDIR;
+
+        splice_seek_lock l_{off_in ? nullptr : inf, nullptr};
+
+        if (st = splice_get_pos(inf, off_in, &pos); st < 0)
+            return st;
+
+        st = pipe_splice_from_file(outf, inf, &pos, len, flags);
+        if (st > 0)
+        {
+            if (int st2 = splice_put_pos(inf, off_in, pos); st2 < 0)
+                return st2;
+        }
+
+        return st;
+    }
+
+    // One of the ends needs to be a pipe
+    return -EINVAL;
+}
+
+ssize_t sys_tee(int fd_in, int fd_out, size_t len, unsigned int flags)
+{
+    auto_file in, out;
+    ssize_t st;
+
+    if (flags & ~SPLICE_VALID_FLAGS)
+        return -EINVAL;
+
+    if (st = in.from_fd(fd_in); st < 0)
+        return st;
+    if (st = out.from_fd(fd_out); st < 0)
+        return st;
+
+    struct file *inf = in.get_file();
+    struct file *outf = out.get_file();
+
+    if (!fd_may_access(inf, FILE_ACCESS_READ) || !fd_may_access(outf, FILE_ACCESS_WRITE))
+        return -EBADF;
+
+    if (!file_is_pipe(inf) || !file_is_pipe(outf))
+        return -EINVAL;
+
+    return pipe_splice_pipe(inf, outf, len, flags, false);
+}
+
+ssize_t sys_copy_file_range(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len,
+                            unsigned int flags)
+{
+    auto_file in, out;
+    size_t in_pos, out_pos;
+    ssize_t st;
+
+    if (flags != 0)
+        return -EINVAL;
+
+    if (st = in.from_fd(fd_in); st < 0)
+        return st;
+    if (st = out.from_fd(fd_out); st < 0)
+        return st;
+
+    struct file *inf = in.get_file();
+    struct file *outf = out.get_file();
+
+    if (!fd_may_access(inf, FILE_ACCESS_READ) || !fd_may_access(outf, FILE_ACCESS_WRITE) ||
+        outf->f_flags & O_APPEND)
+        return -EBADF;
+
+    if (S_ISDIR(inf->f_ino->i_mode) || S_ISDIR(outf->f_ino->i_mode))
+        return -EISDIR;
+
+    if (!S_ISREG(inf->f_ino->i_mode) || !S_ISREG(outf->f_ino->i_mode))
+        return -EINVAL;
+
+    splice_seek_lock l_{off_in ? nullptr : inf, off_out ? nullptr : outf};
+
+    if (st = splice_get_pos(inf, off_in, &in_pos); st < 0)
+        return st;
+    if (st = splice_get_pos(outf, off_out, &out_pos); st < 0)
+        return st;
+
+    // Nothing can be copied past the maximum file offset, so don't let the ranges wrap around
+    len = min(len, (size_t) LONG_MAX - cul::max(in_pos, out_pos));
+
+    // Overlapping ranges in the same file are not allowed
+    if (inf->f_ino == outf->f_ino && in_pos < out_pos + len && out_pos < in_pos + len)
+        return -EINVAL;
+
+    st = do_splice_direct(inf, &in_pos, outf, &out_pos, len);
+    if (st <= 0)
+        return st;
+
+    if (int st2 = splice_put_pos(inf, off_in, in_pos); st2 < 0)
+        return st2;
+    if (int st2 = splice_put_pos(outf, off_out, out_pos); st2 < 0)
+        return st2;
+
+    return st;
+}
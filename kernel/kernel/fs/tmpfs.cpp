@@ -122,47 +122,6 @@ struct inode *tmpfs_open(struct dentry *dir, const char *name)
     return errno = ENOENT, nullptr;
 }
 
-off_t tmpfs_getdirent(struct dirent *buf, off_t off, struct file *file)
-{
-    auto dent = file->f_dentry;
-
-    buf->d_off = off;
-
-    if (off == 0)
-    {
-        /* . */
-        put_dentry_to_dirent(buf, dent, ".");
-    }
-    else if (off == 1)
-    {
-        /* .. */
-        auto parent = dentry_parent(dent);
-        if (!parent) // We're root, so use ourselves
-            parent = dent;
-        put_dentry_to_dirent(buf, parent, "..");
-        dentry_put(parent);
-    }
-    else
-    {
-        scoped_rwslock<rw_lock::read> g(dent->d_lock);
-
-        off_t c = 0;
-        list_for_every (&dent->d_children_head)
-        {
-            if (off > c++ + 2)
-                continue;
-
-            auto d = container_of(l, dentry, d_parent_dir_node);
-            put_dentry_to_dirent(buf, d);
-            return off + 1;
-        }
-
-        return 0;
-    }
-
-    return off + 1;
-}
-
 int tmpfs_prepare_write(inode *ino, struct page *page, size_t page_off, size_t offset, size_t len)
 {
     // If PAGE_FLAG_FILESYSTEM1 is not set, we have not seen this page. Add to blocks and make sure
@@ -202,7 +161,7 @@ struct file_ops tmpfs_fops = {.read = nullptr,
                               .write = nullptr,
                               .open = tmpfs_open,
                               .close = tmpfs_close,
-                              .getdirent = tmpfs_getdirent,
+                              .getdirent = dcache_getdirent,
                               .ioctl = nullptr,
                               .creat = tmpfs_creat,
                               .stat = nullptr,
@@ -220,6 +179,7 @@ struct file_ops tmpfs_fops = {.read = nullptr,
                               .readpage = tmpfs_readpage,
                               .writepage = tmpfs_writepage,
                               .prepare_write = tmpfs_prepare_write,
+                              .release = dcache_readdir_release,
                               .read_iter = filemap_read_iter,
                               .write_iter = filemap_write_iter};
 
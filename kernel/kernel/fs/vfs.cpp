@@ -43,6 +43,7 @@ int vfs_init()
 {
     object_init(&boot_root.object, nullptr);
     dentry_init();
+    inode_cache_init();
     file_cache_init();
 
     return 0;
@@ -805,6 +806,7 @@ struct file *inode_to_file(struct inode *ino)
     f->f_refcount = 1;
     f->f_seek = 0;
     f->f_dentry = nullptr;
+    f->private_data = nullptr;
 
     return f;
 }
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2017 Pedro Falcato
+ * Copyright (c) 2017 - 2023 Pedro Falcato
  * This file is part of Onyx, and is released under the terms of the MIT License
  * check LICENSE at the root directory for more information
  */
@@ -11,17 +11,24 @@
 #include <stdlib.h>
 #include <time.h>
 
+#include <onyx/clock.h>
+#include <onyx/cpu.h>
 #include <onyx/fnv.h>
 #include <onyx/futex.h>
+#include <onyx/init.h>
 #include <onyx/list.h>
+#include <onyx/page.h>
 #include <onyx/pagecache.h>
+#include <onyx/panic.h>
 #include <onyx/process.h>
+#include <onyx/scheduler.h>
 #include <onyx/user.h>
+#include <onyx/vm.h>
 #include <onyx/wait_queue.h>
 
-#include <onyx/hashtable.hpp>
+#include <uapi/futex.h>
+
 #include <onyx/memory.hpp>
-#include <onyx/pair.hpp>
 
 /* This union describes the key used to match futexes with each other.
  * For private mappings, we use the mm_address_space address of the process and
@@ -92,43 +99,58 @@ struct futex_key
     }
 };
 
+struct futex_queue;
+
+/* Each bucket has a separate lock to encourage concurrency. Futexes are hashed by the fnv of the
+ * futex key, whose values depend on the type of mapping.
+ */
+struct futex_bucket
+{
+    struct spinlock lock;
+    /* Threads queued (or about to queue) on this bucket, so wakes can skip the lock if it's 0 */
+    unsigned long waiters;
+    struct list_head queues;
+} __align_cache;
+
 class futex_queue
 {
 public:
     futex_key key;
     bool awaken;
-    wait_queue wq;
+    /* Waiting on a PI futex (FUTEX_LOCK_PI) */
+    bool pi;
+    struct thread *waiter;
+    /* Bucket we're queued on. Only changes on requeue, with both buckets locked. */
+    futex_bucket *bucket;
+    /* Where we get woken up. Our own, unless we're part of a futex_waitv. */
+    wait_queue *wq;
+    wait_queue own_wq;
     list_head_cpp<futex_queue> list_node;
 
-    futex_queue(futex_key key) : key(key), awaken(false), wq{}, list_node{this}
-    {
-        init_wait_queue_head(&wq);
-    }
-
-    ~futex_queue()
+    futex_queue()
+        : key{}, awaken(false), pi(false), waiter(get_current_thread()), bucket(nullptr),
+          wq(&own_wq), own_wq{}, list_node{this}
     {
+        init_wait_queue_head(&own_wq);
     }
 
-    int wait(hrtime_t _timeout, struct spinlock *s)
+    futex_queue(futex_key key) : futex_queue()
     {
-        MUST_HOLD_LOCK(s);
-        return wait_for_event_locked_timeout_interruptible(&wq, awaken, _timeout, s);
+        this->key = key;
     }
 
-    int wait(struct spinlock *s)
+    ~futex_queue()
     {
-        MUST_HOLD_LOCK(s);
-        return wait_for_event_locked_interruptible(&wq, awaken, s);
     }
 
     void wake()
     {
+        MUST_HOLD_LOCK(&bucket->lock);
         list_remove(&list_node);
-        awaken = true;
-
-        COMPILER_BARRIER();
+        __atomic_sub_fetch(&bucket->waiters, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&awaken, true, __ATOMIC_RELEASE);
 
-        wait_queue_wake_all(&wq);
+        wait_queue_wake_all(wq);
     }
 
     futex_key &get_key()
@@ -138,10 +160,10 @@ public:
 
     bool was_awaken() const
     {
-        return awaken;
+        return __atomic_load_n(&awaken, __ATOMIC_ACQUIRE);
     }
 
-    void requeue(const futex_key &new_key, struct list_head *new_head);
+    void requeue(const futex_key &new_key, futex_bucket *new_bucket);
 };
 
 inline uint32_t __futex_hash(futex_key &key)
@@ -149,76 +171,122 @@ inline uint32_t __futex_hash(futex_key &key)
     return fnv_hash(&key.both, sizeof(key.both));
 }
 
-uint32_t futex_hash(futex_queue &queue)
+/* We're holding a system-wide hashtable for futexes, sized at boot from the number of CPUs */
+static futex_bucket *futex_buckets;
+static unsigned int futex_hash_order;
+
+static futex_bucket *futex_get_bucket(futex_key &key)
 {
-    return __futex_hash(queue.get_key());
+    return &futex_buckets[__futex_hash(key) & ((1U << futex_hash_order) - 1)];
 }
 
-/* We're holding a system-wide hashtable for futexes. Each bucket has a separate
- * lock to encourage concurrency. Futexes are hashed by the fnv of the futex key, whose values
- * depend on the type of mapping.
+/**
+ * @brief Lock a futex's bucket, in order to queue on it
+ * We count ourselves as a waiter before locking, so a concurrent wake either sees us or we see
+ * the futex value it changed.
+ *
+ * @param key Futex key
+ * @return The locked bucket
  */
+static futex_bucket *futex_lock_bucket(futex_key &key)
+{
+    futex_bucket *b = futex_get_bucket(key);
+    __atomic_add_fetch(&b->waiters, 1, __ATOMIC_SEQ_CST);
+    spin_lock(&b->lock);
+    return b;
+}
 
-static constexpr size_t futex_hashtable_buckets = 1024;
-static cul::hashtable2<futex_queue, futex_hashtable_buckets, uint32_t, futex_hash> futex_hashtable;
-static struct spinlock futex_hashtable_locks[futex_hashtable_buckets];
-
-uint32_t get_hashtable(futex_key &key)
+/**
+ * @brief Unlock a bucket locked with futex_lock_bucket, without having queued on it
+ *
+ * @param b Bucket
+ */
+static void futex_unlock_bucket_unqueued(futex_bucket *b)
 {
-    auto hash = __futex_hash(key);
-    auto index = futex_hashtable.get_hashtable_index(hash);
+    __atomic_sub_fetch(&b->waiters, 1, __ATOMIC_RELAXED);
+    spin_unlock(&b->lock);
+}
 
-    spin_lock(&futex_hashtable_locks[index]);
+/**
+ * @brief Check if a bucket may have waiters, without locking it
+ *
+ * @param b Bucket
+ * @return True if it may have waiters
+ */
+static bool futex_bucket_has_waiters(futex_bucket *b)
+{
+    /* Pairs with the increment in futex_lock_bucket: order the futex value's store (done by the
+     * caller) against our load of waiters.
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(&b->waiters, __ATOMIC_RELAXED) != 0;
+}
 
-    return index;
+static void futex_enqueue(futex_bucket *b, futex_queue &q)
+{
+    MUST_HOLD_LOCK(&b->lock);
+    q.bucket = b;
+    list_add_tail(&q.list_node, &b->queues);
 }
 
-cul::pair<uint32_t, uint32_t> lock_two_hashes(futex_key &key1, futex_key &key2)
+/**
+ * @brief Take a queue off its bucket, after waiting on it
+ *
+ * @param q Queue
+ * @return True if we were still queued, false if we got woken up
+ */
+static bool futex_unqueue(futex_queue &q)
 {
-    const auto hash1 = __futex_hash(key1);
-    const auto hash2 = __futex_hash(key2);
+    while (true)
+    {
+        futex_bucket *b = __atomic_load_n(&q.bucket, __ATOMIC_ACQUIRE);
+        spin_lock(&b->lock);
 
-    auto index1 = futex_hashtable.get_hashtable_index(hash1);
-    auto index2 = futex_hashtable.get_hashtable_index(hash2);
+        /* We got requeued while we were locking, try again */
+        if (b != q.bucket)
+        {
+            spin_unlock(&b->lock);
+            continue;
+        }
 
-    if (index1 < index2)
-    {
-        spin_lock(&futex_hashtable_locks[index1]);
-        spin_lock(&futex_hashtable_locks[index2]);
-    }
-    else if (index1 > index2)
-    {
-        spin_lock(&futex_hashtable_locks[index2]);
-        spin_lock(&futex_hashtable_locks[index1]);
-    }
-    else
-    {
-        /* Only lock once if it's the same bucket */
-        spin_lock(&futex_hashtable_locks[index1]);
-    }
+        bool queued = !q.was_awaken();
+        if (queued)
+        {
+            list_remove(&q.list_node);
+            __atomic_sub_fetch(&b->waiters, 1, __ATOMIC_RELAXED);
+        }
 
-    return {index1, index2};
+        spin_unlock(&b->lock);
+        return queued;
+    }
 }
 
-void unlock_two_hashes(uint32_t index1, uint32_t index2)
+static void lock_two_buckets(futex_bucket *b1, futex_bucket *b2)
 {
-    if (index1 > index2)
+    if (b1 < b2)
     {
-        spin_unlock(&futex_hashtable_locks[index1]);
-        spin_unlock(&futex_hashtable_locks[index2]);
+        spin_lock(&b1->lock);
+        spin_lock(&b2->lock);
     }
-    else if (index1 < index2)
+    else if (b1 > b2)
     {
-        spin_unlock(&futex_hashtable_locks[index2]);
-        spin_unlock(&futex_hashtable_locks[index1]);
+        spin_lock(&b2->lock);
+        spin_lock(&b1->lock);
     }
     else
     {
         /* Only lock once if it's the same bucket */
-        spin_unlock(&futex_hashtable_locks[index1]);
+        spin_lock(&b1->lock);
     }
 }
 
+static void unlock_two_buckets(futex_bucket *b1, futex_bucket *b2)
+{
+    spin_unlock(&b1->lock);
+    if (b1 != b2)
+        spin_unlock(&b2->lock);
+}
+
 int calculate_key(int *uaddr, int flags, futex_key &out_key)
 {
     bool private_ftx = flags & FUTEX_PRIVATE_FLAG;
@@ -273,6 +341,36 @@ int calculate_key(int *uaddr, int flags, futex_key &out_key)
     return 0;
 }
 
+static bool futex_any_awaken(futex_queue *queues, unsigned int nr)
+{
+    for (unsigned int i = 0; i < nr; i++)
+    {
+        if (queues[i].was_awaken())
+            return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Sleep until one of the queues gets woken up
+ *
+ * @param wq Wait queue the queues wake up
+ * @param queues Queues
+ * @param nr Number of queues
+ * @param timeout Timeout, in ns
+ * @return 0 on wake up, -ETIMEDOUT or -EINTR
+ */
+static int futex_sleep(wait_queue *wq, futex_queue *queues, unsigned int nr, hrtime_t timeout)
+{
+    return wait_for_event_timeout_interruptible(wq, futex_any_awaken(queues, nr), timeout);
+}
+
+static int futex_sleep(wait_queue *wq, futex_queue *queues, unsigned int nr)
+{
+    return wait_for_event_interruptible(wq, futex_any_awaken(queues, nr));
+}
+
 int wait(int *uaddr, int val, int flags, const struct timespec *utimespec)
 {
     bool has_timeout = false;
@@ -301,49 +399,38 @@ int wait(int *uaddr, int val, int flags, const struct timespec *utimespec)
 
     futex_queue queue{key};
 
-#if 0
-	auto hash = __futex_hash(key);
-	auto index = futex_hashtable.get_hashtable_index(hash);
-	printk("wuaddr %p index %lu\n", uaddr, index);
-#endif
     /* After making a queue entry for this thread and this key,
      * we're going to atomically calculate a hash index and lock that hash index,
      * then check for the value(and if doesn't match, return -EAGAIN), and finally, sleep.
      */
-    auto hash_index = get_hashtable(key);
-    auto list_head = futex_hashtable.get_hashtable(hash_index);
-    auto lock = &futex_hashtable_locks[hash_index];
+    futex_bucket *b = futex_lock_bucket(key);
 
     unsigned int curr_val = 0;
 
     if (get_user32((unsigned int *) uaddr, &curr_val) < 0)
     {
-        st = -EFAULT;
-        goto out;
+        futex_unlock_bucket_unqueued(b);
+        return -EFAULT;
     }
 
     if (curr_val != (unsigned int) val)
     {
-        st = -EAGAIN;
-        goto out;
+        futex_unlock_bucket_unqueued(b);
+        return -EAGAIN;
     }
 
-    list_add_tail(&queue.list_node, list_head);
+    futex_enqueue(b, queue);
+    spin_unlock(&b->lock);
 
     if (has_timeout)
-        st = queue.wait(timeout, lock);
+        st = futex_sleep(queue.wq, &queue, 1, timeout);
     else
-        st = queue.wait(lock);
+        st = futex_sleep(queue.wq, &queue, 1);
 
-    MUST_HOLD_LOCK(lock);
+    /* If we got woken up, that's what we report, even if we timed out or got signalled */
+    if (!futex_unqueue(queue))
+        st = 0;
 
-    if (!queue.was_awaken())
-    {
-        futex_hashtable.remove_element(queue);
-    }
-
-out:
-    spin_unlock(&futex_hashtable_locks[hash_index]);
     return st;
 }
 
@@ -358,19 +445,16 @@ int wake(int *uaddr, int flags, int to_wake)
     if ((st = calculate_key(uaddr, flags, key)) < 0)
         return st;
 
-        // printk("Shared: %s\n", key.both.offset & FUTEX_OFFSET_SHARED ? "yes" : "no");
+    futex_bucket *b = futex_get_bucket(key);
 
-#if 0
-	auto hash = __futex_hash(key);
-	auto index = futex_hashtable.get_hashtable_index(hash);
-
-	printk("uaddr %p index %lu\n", uaddr, index);
-#endif
+    /* Nobody's waiting, don't bother locking */
+    if (!futex_bucket_has_waiters(b))
+        return 0;
 
-    auto hash_index = get_hashtable(key);
-    auto list_head = futex_hashtable.get_hashtable(hash_index);
+    spin_lock(&b->lock);
 
     int awaken = 0;
+    auto list_head = &b->queues;
 
     list_for_every_safe (list_head)
     {
@@ -379,33 +463,43 @@ int wake(int *uaddr, int flags, int to_wake)
 
         futex_queue *f = list_head_cpp<futex_queue>::self_from_list_head(l);
 
-        MUST_HOLD_LOCK(&futex_hashtable_locks[hash_index]);
-
         if (f->get_key() == key)
         {
+            /* PI futexes are only woken through FUTEX_UNLOCK_PI */
+            if (f->pi)
+            {
+                awaken = -EINVAL;
+                break;
+            }
+
             f->wake();
             to_wake--;
             awaken++;
         }
     }
 
-    spin_unlock(&futex_hashtable_locks[hash_index]);
+    spin_unlock(&b->lock);
 
     return awaken;
 }
 
-void futex_queue::requeue(const futex_key &new_key, struct list_head *new_head)
+void futex_queue::requeue(const futex_key &new_key, futex_bucket *new_bucket)
 {
-    key = new_key;
+    MUST_HOLD_LOCK(&bucket->lock);
+    MUST_HOLD_LOCK(&new_bucket->lock);
+
     list_remove(&list_node);
-    list_add(&list_node, new_head);
+    __atomic_sub_fetch(&bucket->waiters, 1, __ATOMIC_RELAXED);
+
+    key = new_key;
+    __atomic_add_fetch(&new_bucket->waiters, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&bucket, new_bucket, __ATOMIC_RELEASE);
+    list_add(&list_node, &new_bucket->queues);
 }
 
 int cmp_requeue(int *uaddr, int flags, int to_wake, int to_requeue, int *uaddr2, int val3,
                 bool val3_valid = true)
 {
-    // printk("requeue %p, %d, %d, %p\n", uaddr, to_wake, to_requeue, uaddr2);
-
     if (to_wake < 0 || to_requeue < 0)
         return -EINVAL;
 
@@ -419,12 +513,16 @@ int cmp_requeue(int *uaddr, int flags, int to_wake, int to_requeue, int *uaddr2,
     if ((st = calculate_key(uaddr2, flags, key2)) < 0)
         return st;
 
-    // printk("Shared: %s\n", key.offset & FUTEX_OFFSET_SHARED ? "yes" : "no");
+    futex_bucket *b1 = futex_get_bucket(key1);
+    futex_bucket *b2 = futex_get_bucket(key2);
+
+    /* FUTEX_CMP_REQUEUE still needs to check val3, even if there's no one to requeue */
+    if (!val3_valid && !futex_bucket_has_waiters(b1))
+        return 0;
 
-    auto [hash_index1, hash_index2] = lock_two_hashes(key1, key2);
+    lock_two_buckets(b1, b2);
 
-    auto wake_list = futex_hashtable.get_hashtable(hash_index1);
-    auto requeue_list = futex_hashtable.get_hashtable(hash_index2);
+    auto wake_list = &b1->queues;
 
     int awaken = 0, requeued = 0;
 
@@ -445,6 +543,9 @@ int cmp_requeue(int *uaddr, int flags, int to_wake, int to_requeue, int *uaddr2,
         }
     }
 
+    /* Waking up to_wake waiters and moving the rest to uaddr2 (instead of waking everyone up)
+     * is what keeps condvar broadcasts from causing a thundering herd on the mutex.
+     */
     list_for_every_safe (wake_list)
     {
         if (to_wake == 0 && to_requeue == 0)
@@ -454,6 +555,12 @@ int cmp_requeue(int *uaddr, int flags, int to_wake, int to_requeue, int *uaddr2,
 
         if (f->get_key() == key1)
         {
+            if (f->pi)
+            {
+                st = -EINVAL;
+                goto out;
+            }
+
             if (to_wake > 0)
             {
                 f->wake();
@@ -462,7 +569,7 @@ int cmp_requeue(int *uaddr, int flags, int to_wake, int to_requeue, int *uaddr2,
             }
             else
             {
-                f->requeue(key2, requeue_list);
+                f->requeue(key2, b2);
                 to_requeue--;
                 requeued++;
             }
@@ -481,7 +588,7 @@ int cmp_requeue(int *uaddr, int flags, int to_wake, int to_requeue, int *uaddr2,
         st = awaken;
 
 out:
-    unlock_two_hashes(hash_index1, hash_index2);
+    unlock_two_buckets(b1, b2);
     return st;
 }
 
@@ -490,6 +597,429 @@ int requeue(int *uaddr, int flags, int to_wake, int to_requeue, int *uaddr2)
     return cmp_requeue(uaddr, flags, to_wake, to_requeue, uaddr2, 0, false);
 }
 
+/**
+ * @brief Compare and exchange a futex word
+ *
+ * @param uaddr Futex
+ * @param old Expected value
+ * @param newval New value
+ * @return 0 on success, -EAGAIN if the value changed under us, -EFAULT
+ */
+static int futex_cmpxchg(int *uaddr, unsigned int old, unsigned int newval)
+{
+    unsigned int curr = old;
+    if (cmpxchg_user32((unsigned int *) uaddr, &curr, newval) < 0)
+        return -EFAULT;
+    return curr == old ? 0 : -EAGAIN;
+}
+
+/**
+ * @brief Fault in a futex word for writing
+ * Accesses to the futex word under a bucket lock can't take page faults (they just fail with
+ * -EFAULT). When that happens, we drop the lock, fault it in here and retry.
+ *
+ * @param uaddr Futex
+ * @return 0 on success, -EFAULT
+ */
+static int futex_fault_in_writable(int *uaddr)
+{
+    unsigned int val;
+    if (get_user32((unsigned int *) uaddr, &val) < 0)
+        return -EFAULT;
+
+    /* A cmpxchg to the same value takes a write fault without changing anything */
+    if (cmpxchg_user32((unsigned int *) uaddr, &val, val) < 0)
+        return -EFAULT;
+    return 0;
+}
+
+/**
+ * @brief Find the waiter a PI futex gets handed to - the highest priority one, FIFO among equals
+ *
+ * @param b Locked bucket
+ * @param key Futex key
+ * @param more If not null, set to whether there are other waiters
+ * @return The top waiter, or nullptr if there are none
+ */
+static futex_queue *futex_pi_top_waiter(futex_bucket *b, futex_key &key, bool *more)
+{
+    MUST_HOLD_LOCK(&b->lock);
+    futex_queue *top = nullptr;
+    unsigned int nr = 0;
+
+    list_for_every (&b->queues)
+    {
+        futex_queue *f = list_head_cpp<futex_queue>::self_from_list_head(l);
+        if (!f->pi || !(f->get_key() == key))
+            continue;
+
+        nr++;
+        if (!top || f->waiter->priority > top->waiter->priority)
+            top = f;
+    }
+
+    if (more)
+        *more = nr > 1;
+    return top;
+}
+
+/**
+ * @brief Lock a PI futex
+ * The futex word holds the owner's TID, with FUTEX_WAITERS set if anyone's blocked on it.
+ * Unlocks hand the futex straight to the highest priority waiter.
+ *
+ * @param uaddr Futex
+ * @param flags Futex flags
+ * @param utimespec Absolute CLOCK_REALTIME timeout, or nullptr
+ * @param trylock Don't block (FUTEX_TRYLOCK_PI)
+ * @return 0 on success, negative error code
+ */
+int lock_pi(int *uaddr, int flags, const struct timespec *utimespec, bool trylock)
+{
+    bool has_timeout = false;
+    hrtime_t timeout = 0;
+    struct timespec ts;
+    int st = 0;
+
+    if (utimespec != nullptr && !trylock)
+    {
+        has_timeout = true;
+        if (copy_from_user(&ts, utimespec, sizeof(ts)) < 0)
+            return -EFAULT;
+
+        if (!timespec_valid(&ts, false))
+            return -EINVAL;
+
+        struct timespec now;
+        clock_gettime_kernel(CLOCK_REALTIME, &now);
+        const hrtime_t deadline = timespec_to_hrtime(&ts);
+        const hrtime_t curr = timespec_to_hrtime(&now);
+        if (deadline <= curr)
+            return -ETIMEDOUT;
+        timeout = deadline - curr;
+    }
+
+    const unsigned int tid = get_current_thread()->id;
+    futex_key key{};
+
+    if ((st = calculate_key(uaddr, flags, key)) < 0)
+        return st;
+
+    futex_queue queue{key};
+    queue.pi = true;
+
+    futex_bucket *b;
+
+retry:
+    b = futex_lock_bucket(key);
+
+    while (true)
+    {
+        unsigned int val;
+        if (get_user32((unsigned int *) uaddr, &val) < 0)
+            goto fault;
+
+        if (!(val & FUTEX_TID_MASK))
+        {
+            /* Unowned (the owner may have died), take it */
+            unsigned int newval = tid | (val & FUTEX_OWNER_DIED);
+            if (futex_pi_top_waiter(b, key, nullptr))
+                newval |= FUTEX_WAITERS;
+
+            st = futex_cmpxchg(uaddr, val, newval);
+            if (st == -EAGAIN)
+                continue;
+            if (st == -EFAULT)
+                goto fault;
+            goto out_unqueued;
+        }
+
+        if ((val & FUTEX_TID_MASK) == tid)
+        {
+            st = -EDEADLK;
+            goto out_unqueued;
+        }
+
+        if (trylock)
+        {
+            st = -EAGAIN;
+            goto out_unqueued;
+        }
+
+        struct thread *owner = thread_get_from_tid(val & FUTEX_TID_MASK);
+        if (!owner)
+        {
+            st = -ESRCH;
+            goto out_unqueued;
+        }
+
+        thread_put(owner);
+
+        /* Make the owner come to us on unlock */
+        if (!(val & FUTEX_WAITERS))
+        {
+            st = futex_cmpxchg(uaddr, val, val | FUTEX_WAITERS);
+            if (st == -EAGAIN)
+                continue;
+            if (st < 0)
+                goto fault;
+        }
+
+        break;
+    }
+
+    futex_enqueue(b, queue);
+    spin_unlock(&b->lock);
+
+    if (has_timeout)
+        st = futex_sleep(queue.wq, &queue, 1, timeout);
+    else
+        st = futex_sleep(queue.wq, &queue, 1);
+
+    /* We were handed the futex */
+    if (!futex_unqueue(queue))
+        st = 0;
+
+    return st;
+out_unqueued:
+    futex_unlock_bucket_unqueued(b);
+    return st;
+fault:
+    futex_unlock_bucket_unqueued(b);
+    if ((st = futex_fault_in_writable(uaddr)) < 0)
+        return st;
+    goto retry;
+}
+
+/**
+ * @brief Unlock a PI futex, handing it off to the top waiter
+ *
+ * @param uaddr Futex
+ * @param flags Futex flags
+ * @return 0 on success, negative error code
+ */
+int unlock_pi(int *uaddr, int flags)
+{
+    const unsigned int tid = get_current_thread()->id;
+    futex_key key{};
+    int st;
+
+    if ((st = calculate_key(uaddr, flags, key)) < 0)
+        return st;
+
+    futex_bucket *b = futex_get_bucket(key);
+
+retry:
+    spin_lock(&b->lock);
+
+    while (true)
+    {
+        unsigned int val;
+        if (get_user32((unsigned int *) uaddr, &val) < 0)
+        {
+            st = -EFAULT;
+            break;
+        }
+
+        if ((val & FUTEX_TID_MASK) != tid)
+        {
+            st = -EPERM;
+            break;
+        }
+
+        bool more;
+        futex_queue *top = futex_pi_top_waiter(b, key, &more);
+        unsigned int newval = 0;
+        if (top)
+            newval = top->waiter->id | (more ? FUTEX_WAITERS : 0);
+
+        st = futex_cmpxchg(uaddr, val, newval);
+        if (st == -EAGAIN)
+            continue;
+
+        if (st == 0 && top)
+            top->wake();
+        break;
+    }
+
+    spin_unlock(&b->lock);
+
+    if (st == -EFAULT)
+    {
+        if ((st = futex_fault_in_writable(uaddr)) < 0)
+            return st;
+        goto retry;
+    }
+
+    return st;
+}
+
+/**
+ * @brief Take every queue of a futex_waitv off its bucket
+ *
+ * @param queues Queues
+ * @param nr Number of queues
+ * @return Index of a queue that got woken up, or -1
+ */
+static int futex_unqueue_multiple(futex_queue *queues, unsigned int nr)
+{
+    int woken = -1;
+
+    for (unsigned int i = 0; i < nr; i++)
+    {
+        if (!futex_unqueue(queues[i]) && woken < 0)
+            woken = i;
+    }
+
+    return woken;
+}
+
+static int __waitv(struct futex_waitv *uwaiters, futex_waitv *waiters, futex_queue *queues,
+                   unsigned int nr, bool has_timeout, hrtime_t timeout)
+{
+    int st;
+
+    if (copy_from_user(waiters, uwaiters, sizeof(futex_waitv) * nr) < 0)
+        return -EFAULT;
+
+    for (unsigned int i = 0; i < nr; i++)
+    {
+        const futex_waitv &w = waiters[i];
+
+        if (w.flags & ~(FUTEX_32 | FUTEX_PRIVATE_FLAG) || !(w.flags & FUTEX_32) || w.__reserved)
+            return -EINVAL;
+
+        if (w.uaddr & (4 - 1) || w.val > UINT32_MAX)
+            return -EINVAL;
+
+        int kflags = w.flags & FUTEX_PRIVATE_FLAG;
+        if ((st = calculate_key((int *) w.uaddr, kflags, queues[i].get_key())) < 0)
+            return st;
+    }
+
+    /* Every queue wakes us up through the same wait queue */
+    struct wait_queue wq;
+    init_wait_queue_head(&wq);
+
+    for (unsigned int i = 0; i < nr; i++)
+    {
+        futex_queue &q = queues[i];
+        q.wq = &wq;
+
+        futex_bucket *b = futex_lock_bucket(q.get_key());
+
+        unsigned int curr_val;
+        st = 0;
+
+        if (get_user32((unsigned int *) waiters[i].uaddr, &curr_val) < 0)
+            st = -EFAULT;
+        else if (curr_val != (unsigned int) waiters[i].val)
+            st = -EAGAIN;
+
+        if (st < 0)
+        {
+            futex_unlock_bucket_unqueued(b);
+
+            /* If one of the futexes we already queued on got woken up, that's not a failure */
+            int woken = futex_unqueue_multiple(queues, i);
+            return woken >= 0 ? woken : st;
+        }
+
+        futex_enqueue(b, q);
+        spin_unlock(&b->lock);
+    }
+
+    if (has_timeout)
+        st = futex_sleep(&wq, queues, nr, timeout);
+    else
+        st = futex_sleep(&wq, queues, nr);
+
+    int woken = futex_unqueue_multiple(queues, nr);
+    return woken >= 0 ? woken : st;
+}
+
+/**
+ * @brief Wait on multiple futexes at once
+ *
+ * @param uwaiters Futexes to wait on
+ * @param nr Number of futexes
+ * @param flags Flags (must be 0)
+ * @param utimespec Absolute timeout on clockid, or nullptr
+ * @param clockid CLOCK_MONOTONIC or CLOCK_REALTIME
+ * @return Index of a futex that was woken up, or negative error code
+ */
+int waitv(struct futex_waitv *uwaiters, unsigned int nr, unsigned int flags,
+          const struct timespec *utimespec, clockid_t clockid)
+{
+    bool has_timeout = false;
+    hrtime_t timeout = 0;
+    int st = 0;
+
+    if (flags != 0 || nr == 0 || nr > FUTEX_WAITV_MAX)
+        return -EINVAL;
+
+    if (utimespec != nullptr)
+    {
+        struct timespec ts, now;
+        has_timeout = true;
+
+        if (clockid != CLOCK_MONOTONIC && clockid != CLOCK_REALTIME)
+            return -EINVAL;
+
+        if (copy_from_user(&ts, utimespec, sizeof(ts)) < 0)
+            return -EFAULT;
+
+        if (!timespec_valid(&ts, false))
+            return -EINVAL;
+
+        clock_gettime_kernel(clockid, &now);
+        const hrtime_t deadline = timespec_to_hrtime(&ts);
+        const hrtime_t curr = timespec_to_hrtime(&now);
+        if (deadline <= curr)
+            return -ETIMEDOUT;
+        timeout = deadline - curr;
+    }
+
+    futex_waitv *waiters = new futex_waitv[nr];
+    futex_queue *queues = new futex_queue[nr];
+
+    if (waiters && queues)
+        st = __waitv(uwaiters, waiters, queues, nr, has_timeout, timeout);
+    else
+        st = -ENOMEM;
+
+    delete[] queues;
+    delete[] waiters;
+    return st;
+}
+
+static void futex_init()
+{
+    /* Size the table like Linux does, 256 buckets per CPU */
+    const unsigned long nr_buckets = 256UL * get_nr_cpus();
+    futex_hash_order = ilog2(nr_buckets);
+    if ((1UL << futex_hash_order) < nr_buckets)
+        futex_hash_order++;
+
+    const size_t size = sizeof(futex_bucket) << futex_hash_order;
+    futex_buckets = (futex_bucket *) vmalloc(vm_size_to_pages(size), VM_TYPE_REGULAR,
+                                             VM_READ | VM_WRITE, GFP_KERNEL);
+    if (!futex_buckets)
+        panic("futex: Could not allocate the futex hashtable");
+
+    for (unsigned long i = 0; i < (1UL << futex_hash_order); i++)
+    {
+        futex_bucket *b = &futex_buckets[i];
+        spinlock_init(&b->lock);
+        b->waiters = 0;
+        INIT_LIST_HEAD(&b->queues);
+    }
+
+    printf("futex: Using %lu hash buckets\n", 1UL << futex_hash_order);
+}
+
+INIT_LEVEL_CORE_AFTER_SCHED_ENTRY(futex_init);
+
 }; // namespace futex
 
 int futex_wake(int *uaddr, int nr_waiters)
@@ -532,7 +1062,19 @@ int sys_futex(int *uaddr, int futex_op, int val, const struct timespec *timeout,
         case FUTEX_REQUEUE:
             // printk("futex(%p, %d, %d)(op %d)\n", uaddr, futex_op, val, futex_op & FUTEX_OP_MASK);
             return futex::requeue(uaddr, flags, val, get_val2(timeout), uaddr2);
+        case FUTEX_LOCK_PI:
+            return futex::lock_pi(uaddr, flags, timeout, false);
+        case FUTEX_TRYLOCK_PI:
+            return futex::lock_pi(uaddr, flags, nullptr, true);
+        case FUTEX_UNLOCK_PI:
+            return futex::unlock_pi(uaddr, flags);
         default:
             return -ENOSYS;
     }
 }
+
+int sys_futex_waitv(struct futex_waitv *waiters, unsigned int nr_futexes, unsigned int flags,
+                    const struct timespec *timeout, clockid_t clockid)
+{
+    return futex::waitv(waiters, nr_futexes, flags, timeout, clockid);
+}
@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <onyx/cpu.h>
 #include <onyx/dev.h>
 #include <onyx/dpc.h>
 #include <onyx/gen/trace_irq.h>
@@ -19,18 +20,57 @@
 #include <onyx/percpu.h>
 #include <onyx/perf_probe.h>
 #include <onyx/platform.h>
+#include <onyx/scheduler.h>
+#include <onyx/sysfs.h>
+#include <onyx/thread.h>
+#include <onyx/user.h>
+#include <onyx/wait_queue.h>
+
+#include <onyx/utility.hpp>
 
 struct irq_line irq_lines[NR_IRQ] = {};
 unsigned long rogue_irqs = 0;
 
-static struct interrupt_handler *add_to_list(struct irq_line *line)
+/* The thread has work to do */
+#define IRQ_THREAD_RUN (1 << 0)
+/* The thread needs to exit (the handler is being freed) */
+#define IRQ_THREAD_STOP (1 << 1)
+/* The thread's priority changed */
+#define IRQ_THREAD_SETPRIO (1 << 2)
+
+#define IRQ_THREAD_DEFAULT_PRIO SCHED_PRIO_HIGH
+
+struct irq_thread
 {
-    auto handler = new interrupt_handler;
-    if (!handler)
+    struct thread *thread;
+    struct interrupt_handler *handler;
+    unsigned int irq;
+    unsigned int cpu;
+    /* IRQ_THREAD_* */
+    unsigned int flags;
+    int prio;
+    unsigned long runs;
+    bool exited;
+    struct wait_queue exit_wq;
+};
+
+static struct interrupt_handler *alloc_handler(irq_t handler, struct device *device,
+                                               unsigned int flags, void *cookie)
+{
+    auto h = new interrupt_handler;
+    if (!h)
         return NULL;
 
-    memset(handler, 0, sizeof(*handler));
+    memset(h, 0, sizeof(*h));
+    h->handler = handler;
+    h->device = device;
+    h->flags = flags;
+    h->cookie = cookie;
+    return h;
+}
 
+static void add_to_list(struct irq_line *line, struct interrupt_handler *handler)
+{
     spin_lock(&line->list_lock);
 
     if (!line->irq_handlers)
@@ -46,8 +86,6 @@ static struct interrupt_handler *add_to_list(struct irq_line *line)
     }
 
     spin_unlock(&line->list_lock);
-
-    return handler;
 }
 
 int install_irq(unsigned int irq, irq_t handler, struct device *device, unsigned int flags,
@@ -60,14 +98,11 @@ int install_irq(unsigned int irq, irq_t handler, struct device *device, unsigned
 
     struct irq_line *line = &irq_lines[irq];
 
-    struct interrupt_handler *h = add_to_list(line);
+    struct interrupt_handler *h = alloc_handler(handler, device, flags, cookie);
     if (!h)
         return -1;
 
-    h->handler = handler;
-    h->device = device;
-    h->flags = flags;
-    h->cookie = cookie;
+    add_to_list(line, h);
 
     platform_install_irq(irq, h);
 
@@ -76,6 +111,174 @@ int install_irq(unsigned int irq, irq_t handler, struct device *device, unsigned
     return 0;
 }
 
+static void irq_thread_main(void *arg)
+{
+    struct irq_thread *it = (struct irq_thread *) arg;
+    struct interrupt_handler *h = it->handler;
+    struct thread *current = get_current_thread();
+
+    while (true)
+    {
+        set_current_state(THREAD_UNINTERRUPTIBLE);
+
+        unsigned int flags = __atomic_exchange_n(&it->flags, 0, __ATOMIC_ACQUIRE);
+        if (!flags)
+        {
+            sched_yield();
+            continue;
+        }
+
+        set_current_state(THREAD_RUNNABLE);
+
+        if (flags & IRQ_THREAD_STOP)
+            break;
+
+        /* We're not on a runqueue while running, so we can change our own priority. It gets
+         * picked up the next time we're queued.
+         */
+        if (int prio = __atomic_load_n(&it->prio, __ATOMIC_RELAXED); prio != current->priority)
+        {
+            unsigned long cpu_flags = irq_save_and_disable();
+            current->priority = prio;
+            irq_restore(cpu_flags);
+        }
+
+        if (!(flags & IRQ_THREAD_RUN))
+            continue;
+
+        h->thread_fn(h->cookie);
+        it->runs++;
+
+        if (h->flags & IRQ_FLAG_ONESHOT)
+            platform_unmask_irq(it->irq);
+    }
+
+    /* Publish exited under the wait queue's lock, so irq_thread_stop can't free us while we're
+     * still waking it up.
+     */
+    unsigned long cpu_flags = spin_lock_irqsave(&it->exit_wq.lock);
+    __atomic_store_n(&it->exited, true, __ATOMIC_RELEASE);
+    __wait_queue_wake(&it->exit_wq, 0, nullptr, ULONG_MAX);
+    spin_unlock_irqrestore(&it->exit_wq.lock, cpu_flags);
+}
+
+static void irq_thread_kick(struct irq_thread *it, unsigned int flags)
+{
+    __atomic_or_fetch(&it->flags, flags, __ATOMIC_RELEASE);
+    thread_wake_up(it->thread);
+}
+
+static void irq_wake_thread(unsigned int irq, struct interrupt_handler *h)
+{
+    assert(h->thread != nullptr);
+
+    /* The thread unmasks it once it's done */
+    if (h->flags & IRQ_FLAG_ONESHOT)
+        platform_mask_irq(irq);
+
+    irq_thread_kick(h->thread, IRQ_THREAD_RUN);
+}
+
+static irqstatus_t irq_default_handler(struct irq_context *context, void *cookie)
+{
+    return IRQ_WAKE_THREAD;
+}
+
+int install_threaded_irq(unsigned int irq, irq_t handler, irq_thread_t thread_fn,
+                         struct device *device, unsigned int flags, void *cookie)
+{
+    assert(irq < NR_IRQ);
+    assert(device != NULL);
+    assert(thread_fn != NULL);
+
+    /* Without a hard handler, nothing would stop the device from interrupting us again */
+    if (!handler && !(flags & IRQ_FLAG_ONESHOT))
+        return -EINVAL;
+
+    /* e.g MSIs on x86, which can only be masked through the device */
+    if (flags & IRQ_FLAG_ONESHOT && !platform_irq_can_mask(irq))
+        return -EOPNOTSUPP;
+
+    struct interrupt_handler *h =
+        alloc_handler(handler ? handler : irq_default_handler, device, flags, cookie);
+    if (!h)
+        return -ENOMEM;
+
+    struct irq_thread *it = new irq_thread{};
+    if (!it)
+    {
+        free(h);
+        return -ENOMEM;
+    }
+
+    it->handler = h;
+    it->irq = irq;
+    it->prio = IRQ_THREAD_DEFAULT_PRIO;
+    init_wait_queue_head(&it->exit_wq);
+
+    /* The scheduler doesn't migrate threads, so run where the irq is taken */
+    it->cpu = irq_get_affinity(irq);
+    if (it->cpu == IRQ_AFFINITY_NONE)
+        it->cpu = get_cpu_nr();
+
+    it->thread = sched_create_thread(irq_thread_main, THREAD_KERNEL, it);
+    if (!it->thread)
+    {
+        delete it;
+        free(h);
+        return -ENOMEM;
+    }
+
+    it->thread->priority = it->prio;
+    h->thread_fn = thread_fn;
+    h->thread = it;
+
+    sched_start_thread_for_cpu(it->thread, it->cpu);
+
+    add_to_list(&irq_lines[irq], h);
+
+    platform_install_irq(irq, h);
+
+    printf("Installed threaded handler (driver %s) for IRQ%u, thread on cpu%u\n",
+           device->driver_->name, irq, it->cpu);
+
+    return 0;
+}
+
+int irq_set_thread_priority(unsigned int irq, int prio)
+{
+    if (irq >= NR_IRQ || prio < SCHED_PRIO_VERY_LOW || prio > SCHED_PRIO_VERY_HIGH)
+        return -EINVAL;
+
+    struct irq_line *line = &irq_lines[irq];
+    scoped_lock g{line->list_lock};
+    int st = -ENOENT;
+
+    for (struct interrupt_handler *h = line->irq_handlers; h; h = h->next)
+    {
+        if (!h->thread)
+            continue;
+
+        /* The thread applies it itself */
+        __atomic_store_n(&h->thread->prio, prio, __ATOMIC_RELAXED);
+        irq_thread_kick(h->thread, IRQ_THREAD_SETPRIO);
+        st = 0;
+    }
+
+    return st;
+}
+
+static void irq_thread_stop(struct irq_thread *it)
+{
+    irq_thread_kick(it, IRQ_THREAD_STOP);
+    wait_for_event(&it->exit_wq, __atomic_load_n(&it->exited, __ATOMIC_ACQUIRE));
+
+    /* The thread sets exited with the lock held, and doesn't touch it after dropping it */
+    unsigned long cpu_flags = spin_lock_irqsave(&it->exit_wq.lock);
+    spin_unlock_irqrestore(&it->exit_wq.lock, cpu_flags);
+    delete it;
+}
+
 void free_irq(unsigned int irq, struct device *device)
 {
     struct irq_line *line = &irq_lines[irq];
@@ -106,13 +309,59 @@ void free_irq(unsigned int irq, struct device *device)
     /* Assert if the device had no registered irq */
     assert(handler != NULL);
 
-    free(handler);
-
     /* Mask the irq if the irq has no handler */
     if (line->irq_handlers == NULL)
         platform_mask_irq(irq);
 
     spin_unlock(&line->list_lock);
+
+    if (handler->thread)
+        irq_thread_stop(handler->thread);
+
+    free(handler);
+}
+
+void irq_init_affinity(unsigned int irq, unsigned int cpu, irq_affinity_t set_affinity,
+                       void *ctx)
+{
+    assert(irq < NR_IRQ);
+    struct irq_line *line = &irq_lines[irq];
+
+    scoped_lock g{line->list_lock};
+    line->affinity = cpu;
+    line->affinity_known = true;
+    line->set_affinity = set_affinity;
+    line->affinity_ctx = ctx;
+}
+
+int irq_set_affinity(unsigned int irq, unsigned int cpu)
+{
+    if (irq >= NR_IRQ || cpu >= get_nr_cpus())
+        return -EINVAL;
+
+    struct irq_line *line = &irq_lines[irq];
+    scoped_lock g{line->list_lock};
+
+    if (!line->set_affinity)
+        return -EOPNOTSUPP;
+
+    if (line->affinity == cpu)
+        return 0;
+
+    if (int st = line->set_affinity(irq, cpu, line->affinity_ctx); st < 0)
+        return st;
+
+    line->affinity = cpu;
+    return 0;
+}
+
+unsigned int irq_get_affinity(unsigned int irq)
+{
+    if (irq >= NR_IRQ)
+        return IRQ_AFFINITY_NONE;
+
+    struct irq_line *line = &irq_lines[irq];
+    return line->affinity_known ? line->affinity : IRQ_AFFINITY_NONE;
 }
 
 PER_CPU_VAR(bool in_irq) = false;
@@ -132,6 +381,12 @@ void dispatch_irq(unsigned int irq, struct irq_context *context)
     {
         irqstatus_t st = h->handler(context, h->cookie);
 
+        if (st == IRQ_WAKE_THREAD)
+        {
+            irq_wake_thread(irq, h);
+            st = IRQ_HANDLED;
+        }
+
         if (st == IRQ_HANDLED)
         {
             line->stats.handled_irqs++;
@@ -146,9 +401,156 @@ void dispatch_irq(unsigned int irq, struct irq_context *context)
     write_per_cpu(in_irq, false);
 }
 
+static struct sysfs_object irq_obj;
+static struct sysfs_object irq_affinity_obj;
+static struct sysfs_object irq_threads_obj;
+
+/* Reads from /sys/irq/affinity - "<irq> <cpu>" for every irq whose routing we know */
+static ssize_t irq_affinity_read(void *buffer, size_t size, off_t off)
+{
+    constexpr size_t line_len = 24;
+    char *buf = (char *) malloc(NR_IRQ * line_len);
+    if (!buf)
+        return -ENOMEM;
+
+    size_t len = 0;
+
+    for (unsigned int i = 0; i < NR_IRQ; i++)
+    {
+        unsigned int cpu = irq_get_affinity(i);
+        if (cpu == IRQ_AFFINITY_NONE)
+            continue;
+        len += snprintf(buf + len, NR_IRQ * line_len - len, "%u %u\n", i, cpu);
+    }
+
+    ssize_t st = 0;
+
+    if ((size_t) off < len)
+    {
+        st = cul::min(size, len - off);
+        if (copy_to_user(buffer, buf + off, st) < 0)
+            st = -EFAULT;
+    }
+
+    free(buf);
+    return st;
+}
+
+/* Writes to /sys/irq/affinity - "<irq> <cpu>" moves an irq to a CPU */
+static ssize_t irq_affinity_write(void *buffer, size_t size, off_t off)
+{
+    char buf[32];
+    char *end, *end2;
+
+    if (size >= sizeof(buf))
+        return -EINVAL;
+
+    if (copy_from_user(buf, buffer, size) < 0)
+        return -EFAULT;
+    buf[size] = '\0';
+
+    unsigned long irq = strtoul(buf, &end, 10);
+    unsigned long cpu = strtoul(end, &end2, 10);
+    if (end == buf || end2 == end)
+        return -EINVAL;
+
+    if (int st = irq_set_affinity(irq, cpu); st < 0)
+        return st;
+
+    return size;
+}
+
+/* Reads from /sys/irq/threads - "<irq> <driver> <cpu> <prio> <runs>" for every irq thread */
+static ssize_t irq_threads_read(void *buffer, size_t size, off_t off)
+{
+    constexpr size_t line_len = 96;
+    size_t buflen = line_len;
+
+    /* Size it up first, we can't allocate under the list locks */
+    for (unsigned int i = 0; i < NR_IRQ; i++)
+    {
+        struct irq_line *line = &irq_lines[i];
+        scoped_lock g{line->list_lock};
+        for (struct interrupt_handler *h = line->irq_handlers; h; h = h->next)
+        {
+            if (h->thread)
+                buflen += line_len;
+        }
+    }
+
+    char *buf = (char *) malloc(buflen);
+    if (!buf)
+        return -ENOMEM;
+
+    size_t len = 0;
+
+    for (unsigned int i = 0; i < NR_IRQ && len + line_len <= buflen; i++)
+    {
+        struct irq_line *line = &irq_lines[i];
+        scoped_lock g{line->list_lock};
+        for (struct interrupt_handler *h = line->irq_handlers; h; h = h->next)
+        {
+            if (!h->thread || len + line_len > buflen)
+                continue;
+            struct irq_thread *it = h->thread;
+            len += snprintf(buf + len, buflen - len, "%u %s %u %d %lu\n", i,
+                            h->device->driver_->name, it->cpu, it->prio, it->runs);
+        }
+    }
+
+    ssize_t st = 0;
+
+    if ((size_t) off < len)
+    {
+        st = cul::min(size, len - off);
+        if (copy_to_user(buffer, buf + off, st) < 0)
+            st = -EFAULT;
+    }
+
+    free(buf);
+    return st;
+}
+
+/* Writes to /sys/irq/threads - "<irq> <prio>" sets the priority of an irq's threads */
+static ssize_t irq_threads_write(void *buffer, size_t size, off_t off)
+{
+    char buf[32];
+    char *end, *end2;
+
+    if (size >= sizeof(buf))
+        return -EINVAL;
+
+    if (copy_from_user(buf, buffer, size) < 0)
+        return -EFAULT;
+    buf[size] = '\0';
+
+    unsigned long irq = strtoul(buf, &end, 10);
+    long prio = strtol(end, &end2, 10);
+    if (end == buf || end2 == end)
+        return -EINVAL;
+
+    if (int st = irq_set_thread_priority(irq, prio); st < 0)
+        return st;
+
+    return size;
+}
+
 void irq_init()
 {
     dpc_init();
+
+    assert(sysfs_init_and_add("irq", &irq_obj, nullptr) == 0);
+    irq_obj.perms = 0755 | S_IFDIR;
+
+    assert(sysfs_init_and_add("affinity", &irq_affinity_obj, &irq_obj) == 0);
+    irq_affinity_obj.read = irq_affinity_read;
+    irq_affinity_obj.write = irq_affinity_write;
+    irq_affinity_obj.perms = 0644 | S_IFREG;
+
+    assert(sysfs_init_and_add("threads", &irq_threads_obj, &irq_obj) == 0);
+    irq_threads_obj.read = irq_threads_read;
+    irq_threads_obj.write = irq_threads_write;
+    irq_threads_obj.perms = 0644 | S_IFREG;
 }
 
 INIT_LEVEL_CORE_AFTER_SCHED_ENTRY(irq_init);
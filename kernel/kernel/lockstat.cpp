@@ -0,0 +1,377 @@
+/*
+ * Copyright (c) 2023 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <onyx/clock.h>
+#include <onyx/cpu.h>
+#include <onyx/init.h>
+#include <onyx/lockstat.h>
+#include <onyx/mutex.h>
+#include <onyx/page.h>
+#include <onyx/percpu.h>
+#include <onyx/sysfs.h>
+#include <onyx/vm.h>
+
+#include <onyx/utility.hpp>
+
+/* Note: The recording paths must not take any locks, as every lock reports back to us */
+
+#define LOCKSTAT_TABLE_ORDER 9
+#define LOCKSTAT_TABLE_SIZE  (1UL << LOCKSTAT_TABLE_ORDER)
+#define LOCKSTAT_MAX_PROBE   16
+
+struct lockstat_entry
+{
+    unsigned long ip;
+    unsigned int type;
+    unsigned long acquired;
+    unsigned long contended;
+    unsigned long spun;
+    u64 wait_total;
+    u64 wait_max;
+    u64 hold_total;
+    u64 hold_max;
+};
+
+struct lockstat_table
+{
+    /* Events we had no room for */
+    unsigned long dropped;
+    struct lockstat_entry entries[LOCKSTAT_TABLE_SIZE];
+};
+
+bool lockstat_enabled = false;
+static PER_CPU_VAR(struct lockstat_table *lockstat_tab);
+static DECLARE_MUTEX(lockstat_ctl_lock);
+
+static const char *lockstat_type_names[LOCKSTAT_NR_TYPES] = {
+    "spinlock", "mutex", "rwlock_read", "rwlock_write", "rwslock_read", "rwslock_write",
+};
+
+static inline unsigned long lockstat_hash(unsigned long ip, unsigned int type, unsigned int order)
+{
+    return ((ip ^ type) * 0x9e3779b97f4a7c15UL) >> (64 - order);
+}
+
+/**
+ * @brief Find (or create) the entry for a call site
+ *
+ * @param entries Hash table
+ * @param order log2 of the table's size
+ * @param ip Call site
+ * @param type Lock type
+ * @return The entry, or nullptr if there's no room
+ */
+static struct lockstat_entry *lockstat_lookup(struct lockstat_entry *entries, unsigned int order,
+                                              unsigned long ip, unsigned int type)
+{
+    const unsigned long mask = (1UL << order) - 1;
+    unsigned long idx = lockstat_hash(ip, type, order);
+
+    for (unsigned int i = 0; i < LOCKSTAT_MAX_PROBE; i++, idx = (idx + 1) & mask)
+    {
+        struct lockstat_entry *e = &entries[idx];
+
+        if (e->ip == ip && e->type == type)
+            return e;
+
+        if (e->ip == 0)
+        {
+            memset(e, 0, sizeof(*e));
+            e->ip = ip;
+            e->type = type;
+            return e;
+        }
+    }
+
+    return nullptr;
+}
+
+u64 __lockstat_wait_start(void)
+{
+    return clocksource_get_time();
+}
+
+/**
+ * @brief Get this CPU's entry for a call site
+ * Must be called with irqs disabled.
+ *
+ * @param ip Call site
+ * @param type Lock type
+ * @return The entry, or nullptr if there's no room (or no table)
+ */
+static struct lockstat_entry *lockstat_get_entry(unsigned long ip, enum lockstat_type type)
+{
+    struct lockstat_table *tab = get_per_cpu(lockstat_tab);
+    if (!tab)
+        return nullptr;
+
+    struct lockstat_entry *e = lockstat_lookup(tab->entries, LOCKSTAT_TABLE_ORDER, ip, type);
+    if (!e)
+        tab->dropped++;
+    return e;
+}
+
+void __lockstat_acquired(struct lockstat_hold *hold, unsigned long ip, enum lockstat_type type,
+                         unsigned int flags, u64 wait_start)
+{
+    const u64 now = clocksource_get_time();
+    const unsigned long irqflags = irq_save_and_disable();
+
+    if (struct lockstat_entry *e = lockstat_get_entry(ip, type); e)
+    {
+        e->acquired++;
+
+        if (flags & LOCKSTAT_CONTENDED)
+        {
+            e->contended++;
+            if (flags & LOCKSTAT_SPUN)
+                e->spun++;
+
+            if (wait_start)
+            {
+                const u64 wait = now - wait_start;
+                e->wait_total += wait;
+                e->wait_max = cul::max(e->wait_max, wait);
+            }
+        }
+    }
+
+    irq_restore(irqflags);
+
+    if (hold)
+    {
+        hold->acquired_at = now;
+        hold->ip = ip;
+    }
+}
+
+void __lockstat_release(struct lockstat_hold *hold, enum lockstat_type type)
+{
+    const u64 acquired_at = hold->acquired_at;
+    hold->acquired_at = 0;
+
+    if (!__atomic_load_n(&lockstat_enabled, __ATOMIC_RELAXED))
+        return;
+
+    const u64 held = clocksource_get_time() - acquired_at;
+    const unsigned long irqflags = irq_save_and_disable();
+
+    if (struct lockstat_entry *e = lockstat_get_entry(hold->ip, type); e)
+    {
+        e->hold_total += held;
+        e->hold_max = cul::max(e->hold_max, held);
+    }
+
+    irq_restore(irqflags);
+}
+
+#define LOCKSTAT_TABLE_PAGES vm_size_to_pages(sizeof(struct lockstat_table))
+
+static int lockstat_enable(bool enable)
+{
+    scoped_mutex g{lockstat_ctl_lock};
+
+    if (!enable)
+    {
+        __atomic_store_n(&lockstat_enabled, false, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    for (unsigned int i = 0; i < get_nr_cpus(); i++)
+    {
+        struct lockstat_table **tab = other_cpu_get_ptr(lockstat_tab, i);
+        if (*tab)
+            continue;
+
+        void *ptr = vmalloc(LOCKSTAT_TABLE_PAGES, VM_TYPE_REGULAR, VM_READ | VM_WRITE, GFP_KERNEL);
+        if (!ptr)
+            return -ENOMEM;
+
+        memset(ptr, 0, sizeof(struct lockstat_table));
+        __atomic_store_n(tab, (struct lockstat_table *) ptr, __ATOMIC_RELEASE);
+    }
+
+    __atomic_store_n(&lockstat_enabled, true, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static void lockstat_reset()
+{
+    scoped_mutex g{lockstat_ctl_lock};
+
+    /* Racy against CPUs recording at the same time, but lookups re-initialize entries they claim,
+     * so the worst we get is an off-by-a-few stat.
+     */
+    for (unsigned int i = 0; i < get_nr_cpus(); i++)
+    {
+        struct lockstat_table *tab = other_cpu_get(lockstat_tab, i);
+        if (tab)
+            memset(tab, 0, sizeof(*tab));
+    }
+}
+
+#define LOCKSTAT_MERGE_ORDER (LOCKSTAT_TABLE_ORDER + 2)
+#define LOCKSTAT_MERGE_PAGES vm_size_to_pages(sizeof(struct lockstat_entry) << LOCKSTAT_MERGE_ORDER)
+#define LOCKSTAT_LINE_LEN    256
+
+static struct sysfs_object lockstat_obj;
+static struct sysfs_object lockstat_enable_obj;
+static struct sysfs_object lockstat_stats_obj;
+
+/* Reads from /sys/lockstat/stats - one line per (type, call site), merged across CPUs */
+static ssize_t lockstat_stats_read(void *buffer, size_t size, off_t off)
+{
+    struct lockstat_entry *merged = (struct lockstat_entry *) vmalloc(
+        LOCKSTAT_MERGE_PAGES, VM_TYPE_REGULAR, VM_READ | VM_WRITE, GFP_KERNEL);
+    if (!merged)
+        return -ENOMEM;
+
+    memset(merged, 0, sizeof(struct lockstat_entry) << LOCKSTAT_MERGE_ORDER);
+
+    unsigned long dropped = 0;
+    size_t nr_entries = 0;
+
+    for (unsigned int i = 0; i < get_nr_cpus(); i++)
+    {
+        struct lockstat_table *tab = other_cpu_get(lockstat_tab, i);
+        if (!tab)
+            continue;
+
+        dropped += tab->dropped;
+
+        for (unsigned long j = 0; j < LOCKSTAT_TABLE_SIZE; j++)
+        {
+            struct lockstat_entry ent = tab->entries[j];
+            if (ent.ip == 0)
+                continue;
+
+            struct lockstat_entry *e =
+                lockstat_lookup(merged, LOCKSTAT_MERGE_ORDER, ent.ip, ent.type);
+            if (!e)
+            {
+                dropped += ent.acquired;
+                continue;
+            }
+
+            if (e->acquired == 0 && ent.acquired != 0)
+                nr_entries++;
+
+            e->acquired += ent.acquired;
+            e->contended += ent.contended;
+            e->spun += ent.spun;
+            e->wait_total += ent.wait_total;
+            e->wait_max = cul::max(e->wait_max, ent.wait_max);
+            e->hold_total += ent.hold_total;
+            e->hold_max = cul::max(e->hold_max, ent.hold_max);
+        }
+    }
+
+    const size_t buflen = (nr_entries + 2) * LOCKSTAT_LINE_LEN;
+    const size_t bufpages = vm_size_to_pages(buflen);
+    char *buf = (char *) vmalloc(bufpages, VM_TYPE_REGULAR, VM_READ | VM_WRITE, GFP_KERNEL);
+    ssize_t st = -ENOMEM;
+    if (!buf)
+        goto out;
+
+    {
+        size_t len = snprintf(buf, buflen,
+                              "type site acquired contended spun wait_total_ns wait_max_ns "
+                              "hold_total_ns hold_max_ns\n");
+
+        for (unsigned long i = 0; i < (1UL << LOCKSTAT_MERGE_ORDER); i++)
+        {
+            struct lockstat_entry *e = &merged[i];
+            if (e->ip == 0 || e->acquired == 0)
+                continue;
+
+            len += snprintf(buf + len, buflen - len, "%s %#lx %lu %lu %lu %lu %lu %lu %lu\n",
+                            lockstat_type_names[e->type], e->ip, e->acquired, e->contended,
+                            e->spun, e->wait_total, e->wait_max, e->hold_total, e->hold_max);
+        }
+
+        if (dropped)
+            len += snprintf(buf + len, buflen - len, "# dropped %lu\n", dropped);
+
+        st = 0;
+
+        if ((size_t) off < len)
+        {
+            st = cul::min(size, len - off);
+            if (copy_to_user(buffer, buf + off, st) < 0)
+                st = -EFAULT;
+        }
+    }
+
+    vfree(buf, bufpages);
+out:
+    vfree(merged, LOCKSTAT_MERGE_PAGES);
+    return st;
+}
+
+/* Writes to /sys/lockstat/stats - anything resets the stats */
+static ssize_t lockstat_stats_write(void *buffer, size_t size, off_t off)
+{
+    lockstat_reset();
+    return size;
+}
+
+static ssize_t lockstat_enable_read(void *buffer, size_t size, off_t off)
+{
+    const char *str = __atomic_load_n(&lockstat_enabled, __ATOMIC_RELAXED) ? "1\n" : "0\n";
+
+    if (off >= 2)
+        return 0;
+
+    size_t to_copy = cul::min(size, (size_t) (2 - off));
+    if (copy_to_user(buffer, str + off, to_copy) < 0)
+        return -EFAULT;
+    return to_copy;
+}
+
+/* Writes to /sys/lockstat/enable - "1" starts recording, "0" stops it */
+static ssize_t lockstat_enable_write(void *buffer, size_t size, off_t off)
+{
+    char c;
+
+    if (size == 0)
+        return -EINVAL;
+
+    if (copy_from_user(&c, buffer, 1) < 0)
+        return -EFAULT;
+
+    if (c != '0' && c != '1')
+        return -EINVAL;
+
+    if (int st = lockstat_enable(c == '1'); st < 0)
+        return st;
+
+    return size;
+}
+
+static void lockstat_init()
+{
+    assert(sysfs_init_and_add("lockstat", &lockstat_obj, nullptr) == 0);
+    lockstat_obj.perms = 0755 | S_IFDIR;
+
+    assert(sysfs_init_and_add("enable", &lockstat_enable_obj, &lockstat_obj) == 0);
+    lockstat_enable_obj.read = lockstat_enable_read;
+    lockstat_enable_obj.write = lockstat_enable_write;
+    lockstat_enable_obj.perms = 0644 | S_IFREG;
+
+    assert(sysfs_init_and_add("stats", &lockstat_stats_obj, &lockstat_obj) == 0);
+    lockstat_stats_obj.read = lockstat_stats_read;
+    lockstat_stats_obj.write = lockstat_stats_write;
+    lockstat_stats_obj.perms = 0644 | S_IFREG;
+}
+
+INIT_LEVEL_CORE_AFTER_SCHED_ENTRY(lockstat_init);
@@ -0,0 +1,275 @@
+/*
+ * Copyright (c) 2023 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <onyx/mm/compaction.h>
+#include <onyx/mm/vm_object.h>
+#include <onyx/mutex.h>
+#include <onyx/page.h>
+#include <onyx/preempt.h>
+#include <onyx/process.h>
+#include <onyx/utils.h>
+#include <onyx/vm.h>
+
+#include <platform/irq.h>
+
+/* Compaction works by isolating the movable blocks that are closest to being free, and migrating
+ * every page we can find in them somewhere else. The only reverse mapping we have is the
+ * vm_object's list of mappings, so we find the pages by walking user address spaces.
+ *
+ * Only private anonymous memory gets migrated. Page cache pages are referenced by buffers and
+ * block pointers all over the filesystem code, so they're tagged as reclaimable but left alone.
+ */
+
+/* Address spaces we look at, per batch */
+#define COMPACT_MM_BATCH 32
+
+/* Max number of compaction passes compact_all() does */
+#define COMPACT_MAX_PASSES 16
+
+/* Max number of direct compaction attempts we skip after a failed one is 1 << this */
+#define COMPACT_MAX_DEFER_SHIFT 6
+
+static unsigned int compact_considered;
+static unsigned int compact_defer_shift;
+
+static bool compact_pfn_isolated(const struct compact_control *cc, unsigned long pfn)
+{
+    for (unsigned int i = 0; i < cc->nr_blocks; i++)
+    {
+        if (pfn - cc->blocks[i] < (1UL << cc->block_order))
+            return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Migrate a page out of an isolated block
+ * Called with the mm's vm_lock and the vmo's page_lock held. The first keeps GUP and page faults
+ * out, the second keeps anyone from looking the page up in the vmo.
+ *
+ * @param cc Compaction control
+ * @param vmo The VMO the page belongs to
+ * @param page The page
+ * @param off Offset of the page in the VMO
+ */
+static void compact_migrate_page(struct compact_control *cc, vm_object *vmo, struct page *page,
+                                 unsigned long off)
+{
+    /* The vmo's reference must be the only one, or someone else is using the page */
+    if (page->flags & (PAGE_FLAG_LOCKED | PAGE_FLAG_PINNED | PAGE_FLAG_BUFFER) || page->cache ||
+        page->ref != 1)
+    {
+        cc->nr_failed++;
+        return;
+    }
+
+    struct page *new_page = alloc_page(PAGE_ALLOC_MOVABLE | PAGE_ALLOC_NO_ZERO);
+    if (!new_page)
+    {
+        cc->nr_failed++;
+        return;
+    }
+
+    /* Once it's unmapped, no one can write to it anymore. Faulting it back in requires the
+     * page_lock, by which point the new page is in place.
+     */
+    vmo->unmap_page(off);
+
+    if (__atomic_load_n(&page->ref, __ATOMIC_ACQUIRE) != 1)
+    {
+        free_page(new_page);
+        cc->nr_failed++;
+        return;
+    }
+
+    copy_page_to_page(page_to_phys(new_page), page_to_phys(page));
+
+    int st = vmo->vm_pages.store(off >> PAGE_SHIFT, (unsigned long) new_page);
+    DCHECK(st == 0);
+
+    /* The old page goes back to its (isolated) block */
+    free_page(page);
+    cc->nr_migrated++;
+}
+
+static void compact_region(struct compact_control *cc, vm_region *region)
+{
+    vm_object *vmo = region->vmo;
+
+    /* Only private (or COW'd) anonymous memory. Shared mappings are skipped, since we only hold
+     * the vm_lock of the address space we're walking.
+     */
+    if (!vmo || (vmo->type != VMO_ANON && !vmo->cow_clone) ||
+        vmo->flags & VMO_FLAG_DEVICE_MAPPING)
+        return;
+
+    if (!mutex_trylock(&vmo->page_lock))
+        return;
+
+    unsigned int nr_mappings = 0;
+    vmo->for_every_mapping([&](vm_region *) -> bool {
+        nr_mappings++;
+        return true;
+    });
+
+    if (nr_mappings == 1)
+    {
+        const unsigned long start = region->offset;
+        const unsigned long end = start + (region->pages << PAGE_SHIFT);
+
+        vmo->for_every_page([&](struct page *page, unsigned long off) -> bool {
+            if (off >= start && off < end && compact_pfn_isolated(cc, page_to_pfn(page)))
+                compact_migrate_page(cc, vmo, page, off);
+            return true;
+        });
+    }
+
+    mutex_unlock(&vmo->page_lock);
+}
+
+static void compact_mm(struct compact_control *cc, mm_address_space *mm)
+{
+    /* We may be called from the allocator, with some other mm's lock held. Don't risk a
+     * deadlock, just skip it.
+     */
+    if (!mutex_trylock(&mm->vm_lock))
+        return;
+
+    vm_for_every_region(*mm, [cc](vm_region *region) -> bool {
+        compact_region(cc, region);
+        return true;
+    });
+
+    mutex_unlock(&mm->vm_lock);
+}
+
+struct compact_mm_batch
+{
+    unsigned long skip;
+    unsigned long seen;
+    unsigned int nr;
+    mm_address_space *mms[COMPACT_MM_BATCH];
+};
+
+static bool compact_collect_mm(process *p, void *ctx)
+{
+    auto batch = (compact_mm_batch *) ctx;
+
+    if (batch->seen++ < batch->skip)
+        return true;
+
+    mm_address_space *mm = p->get_aspace();
+    if (mm && mm != &kernel_address_space)
+    {
+        mm->ref();
+        batch->mms[batch->nr++] = mm;
+    }
+
+    return batch->nr < COMPACT_MM_BATCH;
+}
+
+static void compact_walk_mms(struct compact_control *cc)
+{
+    compact_mm_batch batch;
+    batch.skip = 0;
+
+    /* We can't sleep under the process list lock, so grab references to a batch of address
+     * spaces and walk them after dropping it.
+     */
+    do
+    {
+        batch.seen = 0;
+        batch.nr = 0;
+        for_every_process(compact_collect_mm, &batch);
+        batch.skip = batch.seen;
+
+        for (unsigned int i = 0; i < batch.nr; i++)
+        {
+            compact_mm(cc, batch.mms[i]);
+            batch.mms[i]->unref();
+        }
+    } while (batch.nr == COMPACT_MM_BATCH);
+}
+
+/**
+ * @brief Do a compaction pass, migrating movable pages out of the blocks that are closest to
+ * being free.
+ *
+ * @param order Order we're trying to make available
+ * @return Number of pages migrated
+ */
+unsigned long compact_memory(unsigned int order)
+{
+    struct compact_control cc = {};
+    cc.order = order;
+
+    page_isolate_for_compaction(&cc);
+    if (!cc.nr_blocks)
+        return 0;
+
+    /* Pages in pcpu queues aren't in the buddy lists; flush them so they get isolated too */
+    page_drain_pcpu();
+
+    compact_walk_mms(&cc);
+    page_unisolate(&cc);
+    return cc.nr_migrated;
+}
+
+/**
+ * @brief Compact as much of memory as we can
+ *
+ */
+void compact_all()
+{
+    for (unsigned int i = 0; i < COMPACT_MAX_PASSES; i++)
+    {
+        if (!compact_memory(0))
+            break;
+    }
+}
+
+static bool compact_deferred()
+{
+    const unsigned int shift = __atomic_load_n(&compact_defer_shift, __ATOMIC_RELAXED);
+    if (!shift)
+        return false;
+    return __atomic_add_fetch(&compact_considered, 1, __ATOMIC_RELAXED) < (1U << shift);
+}
+
+static void compact_defer(bool success)
+{
+    unsigned int shift = __atomic_load_n(&compact_defer_shift, __ATOMIC_RELAXED);
+
+    if (success)
+        shift = 0;
+    else if (shift < COMPACT_MAX_DEFER_SHIFT)
+        shift++;
+
+    __atomic_store_n(&compact_considered, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&compact_defer_shift, shift, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Try to compact memory after a failed higher-order allocation.
+ * Does nothing if we can't sleep, or if recent attempts were not fruitful.
+ *
+ * @param order Order of the failed allocation
+ * @return True if it's worth retrying the allocation, else false
+ */
+bool compact_direct(unsigned int order)
+{
+    if (sched_is_preemption_disabled() || irq_is_disabled() || !get_current_thread())
+        return false;
+
+    if (compact_deferred())
+        return false;
+
+    const bool success = compact_memory(order) != 0;
+    compact_defer(success);
+    return success;
+}
@@ -5,14 +5,326 @@
  */
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <onyx/array.h>
+#include <onyx/block.h>
+#include <onyx/clock.h>
 #include <onyx/mm/flush.h>
+#include <onyx/mm/mmu_gather.h>
+#include <onyx/page_iov.h>
 #include <onyx/scheduler.h>
 #include <onyx/vfs.h>
 
+#include <uapi/memstat.h>
+
 static void flush_thr_init(void *arg);
 
+/* Writeback clustering: instead of writing objects back one at a time, in the order they got
+ * dirtied, objects that know where they live on disk queue their blocks in a wb_cluster. The
+ * cluster sorts them by sector, merges runs of adjacent blocks into multi-vec bios and keeps up to
+ * WB_MAX_INFLIGHT of those in flight.
+ */
+
+/* Max number of blocks we sort and merge at once */
+#define WB_CLUSTER_MAX_BLOCKS 512
+
+/* Max number of vecs in a single bio */
+#define WB_MAX_VECS 32
+
+/* Max number of bios in flight, per cluster */
+#define WB_MAX_INFLIGHT 8
+
+struct wb_block
+{
+    struct blockdev *dev;
+    sector_t sector;
+    struct page *page;
+    unsigned int page_off;
+    unsigned int length;
+    /* Index in wb_cluster::owners */
+    unsigned int owner;
+};
+
+struct wb_owner
+{
+    struct flush_object *fo;
+    /* Number of blocks not written back yet */
+    unsigned int pending;
+    /* start_wb was called */
+    bool started;
+    /* One of the blocks failed to write back */
+    bool failed;
+};
+
+struct wb_cluster
+{
+    struct wb_block *blocks{nullptr};
+    struct wb_owner *owners{nullptr};
+    unsigned int nr_blocks{0};
+    unsigned int nr_owners{0};
+    unsigned int inflight{0};
+    struct spinlock lock{};
+    struct wait_queue wq{};
+    /* Objects that failed to write back, to be put back on the dirty list */
+    struct list_head failed;
+};
+
+struct wb_bio
+{
+    struct bio_req req;
+    struct wb_cluster *wbc;
+    /* Range of (sorted) blocks in wbc->blocks this bio covers */
+    unsigned int first;
+    unsigned int nr;
+    bool allocated;
+    struct page_iov vecs[WB_MAX_VECS];
+};
+
+void wb_cluster_add(struct wb_cluster *wbc, struct flush_object *owner, struct blockdev *dev,
+                    uint64_t sector, struct page *page, unsigned int page_off, unsigned int length)
+{
+    DCHECK(wbc->nr_blocks < WB_CLUSTER_MAX_BLOCKS);
+
+    /* An object's blocks are all queued at once, so we only need to look at the last owner */
+    if (!wbc->nr_owners || wbc->owners[wbc->nr_owners - 1].fo != owner)
+        wbc->owners[wbc->nr_owners++] = wb_owner{owner, 0, false, false};
+
+    const unsigned int idx = wbc->nr_owners - 1;
+    wbc->owners[idx].pending++;
+    wbc->blocks[wbc->nr_blocks++] = wb_block{dev, sector, page, page_off, length, idx};
+}
+
+static int wb_block_cmp(const void *lhs, const void *rhs)
+{
+    auto a = (const wb_block *) lhs;
+    auto b = (const wb_block *) rhs;
+
+    if (a->dev != b->dev)
+        return (unsigned long) a->dev < (unsigned long) b->dev ? -1 : 1;
+    if (a->sector != b->sector)
+        return a->sector < b->sector ? -1 : 1;
+    return 0;
+}
+
+/**
+ * @brief Finish an object's writeback
+ * Objects that failed to write back stay dirty, if they know how to.
+ *
+ * @param fo Object
+ * @param failed True if writing it back failed
+ * @return True if the object is still dirty, and needs to stay on a dirty list
+ */
+static bool wb_complete(struct flush_object *fo, bool failed)
+{
+    if (failed && fo->ops->wb_error)
+    {
+        fo->ops->wb_error(fo, -EIO);
+        return true;
+    }
+
+    fo->ops->set_dirty(false, fo);
+    return false;
+}
+
+static void wb_end_io(struct bio_req *req)
+{
+    auto bio = (wb_bio *) req->b_private;
+    auto wbc = bio->wbc;
+
+    const bool error = req->flags & BIO_REQ_EIO;
+    if (error)
+    {
+        printf("writeback: Error writing back %u block(s) at sector %lu\n", bio->nr,
+               wbc->blocks[bio->first].sector);
+    }
+
+    for (unsigned int i = bio->first; i < bio->first + bio->nr; i++)
+    {
+        struct wb_owner *owner = &wbc->owners[wbc->blocks[i].owner];
+        if (error)
+            __atomic_store_n(&owner->failed, true, __ATOMIC_RELAXED);
+        if (__atomic_sub_fetch(&owner->pending, 1, __ATOMIC_ACQ_REL) == 0)
+            wb_complete(owner->fo, __atomic_load_n(&owner->failed, __ATOMIC_RELAXED));
+    }
+
+    if (bio->allocated)
+        free(bio);
+
+    /* The submitter may be waiting to tear the cluster down, so wake it up under the lock */
+    spin_lock(&wbc->lock);
+    __atomic_sub_fetch(&wbc->inflight, 1, __ATOMIC_RELEASE);
+    wait_queue_wake_all(&wbc->wq);
+    spin_unlock(&wbc->lock);
+}
+
+static void wb_cluster_wait(struct wb_cluster *wbc, unsigned int max_inflight)
+{
+    wait_for_event(&wbc->wq, __atomic_load_n(&wbc->inflight, __ATOMIC_ACQUIRE) <= max_inflight);
+
+    /* Synchronize with wb_end_io, which may still be touching the wait queue */
+    spin_lock(&wbc->lock);
+    spin_unlock(&wbc->lock);
+}
+
+/**
+ * @brief Build a bio out of the run of adjacent blocks starting at \p first
+ *
+ * @param wbc Writeback cluster
+ * @param bio Bio to fill
+ * @param first Index of the first (sorted) block
+ * @return Index of the first block not in the bio
+ */
+static unsigned int wb_cluster_build_bio(struct wb_cluster *wbc, struct wb_bio *bio,
+                                         unsigned int first)
+{
+    struct blockdev *dev = wbc->blocks[first].dev;
+    sector_t next_sector = wbc->blocks[first].sector;
+    unsigned int nr_vecs = 0;
+    unsigned int i;
+
+    for (i = first; i < wbc->nr_blocks; i++)
+    {
+        const wb_block &b = wbc->blocks[i];
+        page_iov *last = nr_vecs ? &bio->vecs[nr_vecs - 1] : nullptr;
+
+        if (b.dev != dev || b.sector != next_sector)
+            break;
+
+        if (last && last->page == b.page && last->page_off + last->length == b.page_off)
+        {
+            /* Same page, right after the last block: grow the vec */
+            last->length += b.length;
+        }
+        else
+        {
+            /* Every vec but the first has to start at a page boundary, and every vec but the last
+             * has to end at one. Drivers (NVMe PRPs, in particular) can't express anything else.
+             */
+            if (last && (nr_vecs == WB_MAX_VECS || last->page_off + last->length != PAGE_SIZE ||
+                         b.page_off != 0))
+                break;
+
+            bio->vecs[nr_vecs++] = page_iov{b.page, b.length, b.page_off};
+        }
+
+        struct wb_owner *owner = &wbc->owners[b.owner];
+        if (!owner->started)
+        {
+            owner->started = true;
+            if (owner->fo->ops->start_wb)
+                owner->fo->ops->start_wb(owner->fo);
+        }
+
+        next_sector += b.length / dev->sector_size;
+    }
+
+    bio->req = {};
+    bio->req.flags = BIO_REQ_WRITE_OP;
+    bio->req.sector_number = wbc->blocks[first].sector;
+    bio->req.vec = bio->vecs;
+    bio->req.nr_vecs = nr_vecs;
+    bio->req.b_end_io = wb_end_io;
+    bio->req.b_private = bio;
+    bio->wbc = wbc;
+    bio->first = first;
+    bio->nr = i - first;
+
+    return i;
+}
+
+/**
+ * @brief Write back every block queued in the cluster, and wait for it to finish
+ *
+ * @param wbc Writeback cluster
+ */
+static void wb_cluster_submit(struct wb_cluster *wbc)
+{
+    qsort(wbc->blocks, wbc->nr_blocks, sizeof(wb_block), wb_block_cmp);
+
+    unsigned int i = 0;
+    while (i < wbc->nr_blocks)
+    {
+        struct wb_bio on_stack;
+        struct wb_bio *bio = (wb_bio *) malloc(sizeof(wb_bio));
+        const bool allocated = bio != nullptr;
+
+        if (!allocated)
+        {
+            /* Out of memory, write this run back synchronously */
+            wb_cluster_wait(wbc, 0);
+            bio = &on_stack;
+        }
+
+        struct blockdev *dev = wbc->blocks[i].dev;
+        i = wb_cluster_build_bio(wbc, bio, i);
+        bio->allocated = allocated;
+
+        wb_cluster_wait(wbc, WB_MAX_INFLIGHT - 1);
+        __atomic_add_fetch(&wbc->inflight, 1, __ATOMIC_RELAXED);
+
+        if (!allocated)
+        {
+            if (bio_submit_request(dev, &bio->req) < 0)
+                bio->req.flags |= BIO_REQ_EIO;
+            wb_end_io(&bio->req);
+        }
+        else if (bio_submit_async(dev, &bio->req) < 0)
+        {
+            bio->req.flags |= BIO_REQ_EIO;
+            wb_end_io(&bio->req);
+        }
+    }
+
+    wb_cluster_wait(wbc, 0);
+
+    /* Failed objects are still dirty; take them off the dirty list for now so sync() can put
+     * them back once it's done with it.
+     */
+    for (unsigned int j = 0; j < wbc->nr_owners; j++)
+    {
+        struct flush_object *fo = wbc->owners[j].fo;
+        if (wbc->owners[j].failed && fo->ops->wb_error)
+        {
+            list_remove(&fo->dirty_list);
+            list_add_tail(&fo->dirty_list, &wbc->failed);
+        }
+    }
+
+    wbc->nr_blocks = 0;
+    wbc->nr_owners = 0;
+}
+
+/**
+ * @brief Queue an object for clustered writeback
+ *
+ * @param wbc Writeback cluster
+ * @param fo Object
+ * @return True if queued (or clean already), false if it needs to be flushed by hand
+ */
+static bool wb_cluster_queue(struct wb_cluster *wbc, struct flush_object *fo)
+{
+    if (!fo->ops->queue)
+        return false;
+
+    if (WB_CLUSTER_MAX_BLOCKS - wbc->nr_blocks < WB_OBJ_MAX_BLOCKS)
+        wb_cluster_submit(wbc);
+
+    const unsigned int nr_blocks = wbc->nr_blocks;
+    if (!fo->ops->queue(fo, wbc))
+        return false;
+
+    /* Nothing to write back */
+    if (wbc->nr_blocks == nr_blocks)
+        fo->ops->set_dirty(false, fo);
+    return true;
+}
+
+/* Dirty objects past which writeback gets kicked early, and past which dirtiers get throttled */
+static unsigned long dirty_bg_thresh;
+static unsigned long dirty_thresh;
+static struct wait_queue dirty_throttle_wq;
+
 namespace flush
 {
 
@@ -28,8 +340,31 @@ void flush_dev::init()
 
 void flush_dev::sync()
 {
+    struct wb_cluster wbc;
+    wbc.blocks = (wb_block *) malloc(sizeof(wb_block) * WB_CLUSTER_MAX_BLOCKS);
+    wbc.owners = (wb_owner *) malloc(sizeof(wb_owner) * WB_CLUSTER_MAX_BLOCKS);
+    /* If we can't allocate the cluster, everything gets written back one object at a time */
+    const bool cluster = wbc.blocks && wbc.owners;
+    INIT_LIST_HEAD(&wbc.failed);
+
     lock();
 
+    {
+        /* Write-protect every dirty object's mappings up front, so the TLB shootdowns get
+         * batched over the whole run instead of being issued once per page. set_dirty(false)
+         * re-checks the mappings below and only needs to shoot down the ones that got
+         * re-dirtied in the meantime.
+         */
+        mmu_gather tlb;
+
+        list_for_every (&dirty_bufs)
+        {
+            flush_object *buf = container_of(l, flush_object, dirty_list);
+            if (buf->ops->write_protect)
+                buf->ops->write_protect(buf, &tlb);
+        }
+    }
+
     // printk("Syncing\n");
     /* We have to use list_for_every_safe because between clearing the dirty
      * flag and going to the next buf some other cpu can see the flag is clear,
@@ -40,13 +375,22 @@ void flush_dev::sync()
         /*printk("writeback file %p, size %lu, off %lu\n", blk->node,
             blk->size, blk->offset);*/
 
-        buf->ops->flush(buf);
-
-        buf->ops->set_dirty(false, buf);
+        if (!cluster || !wb_cluster_queue(&wbc, buf))
+        {
+            if (wb_complete(buf, buf->ops->flush(buf) < 0))
+            {
+                list_remove(&buf->dirty_list);
+                list_add_tail(&buf->dirty_list, &wbc.failed);
+            }
+        }
 
         block_load--;
     }
 
+    /* Data goes out before the inodes that point to it */
+    if (cluster)
+        wb_cluster_submit(&wbc);
+
     list_for_every_safe (&dirty_inodes)
     {
         struct inode *ino = container_of(l, struct inode, i_dirty_inode_node);
@@ -63,19 +407,33 @@ void flush_dev::sync()
     list_reset(&dirty_inodes);
     assert(block_load == 0);
 
+    /* Whatever failed to write back is still dirty, so retry it next time around */
+    list_for_every_safe (&wbc.failed)
+    {
+        list_remove(l);
+        list_add_tail(l, &dirty_bufs);
+        block_load++;
+    }
+
     unlock();
+
+    free(wbc.blocks);
+    free(wbc.owners);
+    wait_queue_wake_all(&dirty_throttle_wq);
 }
 
 ssize_t flush_dev::sync_one(struct flush_object *obj)
 {
     lock();
 
-    size_t res = obj->ops->flush(obj);
-
-    obj->ops->set_dirty(false, obj);
+    ssize_t res = obj->ops->flush(obj);
 
-    list_remove(&obj->dirty_list);
-    block_load--;
+    /* On failure, the object stays dirty and on the list (if it can) */
+    if (!wb_complete(obj, res < 0))
+    {
+        list_remove(&obj->dirty_list);
+        block_load--;
+    }
 
     unlock();
 
@@ -88,7 +446,9 @@ void flush_dev::run()
     {
         while (this->get_load())
         {
-            sched_sleep_ms(flush_dev::wb_run_delta_ms);
+            wait_for_event_timeout(&kick_wq, __atomic_load_n(&kicked, __ATOMIC_RELAXED),
+                                   flush_dev::wb_run_delta_ms * NS_PER_MS);
+            __atomic_store_n(&kicked, false, __ATOMIC_RELAXED);
 
             // printk("Flushing data to disk\n");
             sync();
@@ -98,6 +458,12 @@ void flush_dev::run()
     }
 }
 
+void flush_dev::kick()
+{
+    __atomic_store_n(&kicked, true, __ATOMIC_RELAXED);
+    wait_queue_wake_all(&kick_wq);
+}
+
 bool flush_dev::called_from_sync()
 {
     /* We detect this by testing if the current thread holds this lock */
@@ -223,12 +589,56 @@ void flush_remove_buf(struct flush_object *blk)
 
 void flush_init(void)
 {
+    struct memstat stat;
+    page_get_stats(&stat);
+
+    /* Start writing back early at 5% of memory, and throttle dirtiers at 10% */
+    dirty_thresh = stat.total_pages / 10;
+    dirty_bg_thresh = dirty_thresh / 2;
+
     for (auto &b : flush::thread_list)
     {
         b.init();
     }
 }
 
+static unsigned long flush_nr_dirty()
+{
+    unsigned long nr = 0;
+
+    for (auto &b : flush::thread_list)
+        nr += b.get_load();
+
+    return nr;
+}
+
+void flush_throttle_dirty(void)
+{
+    if (flush_nr_dirty() <= dirty_bg_thresh) [[likely]]
+        return;
+
+    for (auto &b : flush::thread_list)
+    {
+        if (b.get_load())
+            b.kick();
+    }
+
+    /* Block until writeback brings us back under the limit. Kick it again every so often, since
+     * other tasks may be dirtying the devs we didn't kick.
+     */
+    while (flush_nr_dirty() > dirty_thresh)
+    {
+        wait_for_event_timeout(&dirty_throttle_wq, flush_nr_dirty() <= dirty_thresh,
+                               200 * NS_PER_MS);
+
+        for (auto &b : flush::thread_list)
+        {
+            if (b.get_load())
+                b.kick();
+        }
+    }
+}
+
 void flush_add_inode(struct inode *ino)
 {
     auto dev = flush_allocate_dev();
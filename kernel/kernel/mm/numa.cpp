@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2023 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <errno.h>
+#include <stdio.h>
+
+#include <onyx/cpumask.h>
+#include <onyx/numa.h>
+
+#define NUMA_MAX_MEMBLKS 64
+
+struct numa_memblk
+{
+    int nid;
+    unsigned long start;
+    unsigned long end;
+};
+
+static numa_memblk memblks[NUMA_MAX_MEMBLKS];
+static unsigned int nr_memblks;
+
+static unsigned int numa_distances[MAX_NUMA_NODES][MAX_NUMA_NODES];
+static bool distances_valid;
+static unsigned long online_nodes = 1;
+
+struct numa_hwid
+{
+    u32 hwid;
+    int nid;
+};
+
+static numa_hwid cpu_hwids[CONFIG_SMP_NR_CPUS];
+static unsigned int nr_cpu_hwids;
+
+static int cpu_nodes[CONFIG_SMP_NR_CPUS];
+
+static inline bool numa_nid_valid(int nid)
+{
+    return nid >= 0 && nid < MAX_NUMA_NODES;
+}
+
+int numa_add_memblk(int nid, unsigned long start, unsigned long end)
+{
+    if (!numa_nid_valid(nid) || start >= end)
+        return -EINVAL;
+
+    if (nr_memblks == NUMA_MAX_MEMBLKS)
+    {
+        printf("numa: Too many memory ranges, ignoring [%016lx, %016lx] (node %d)\n", start,
+               end - 1, nid);
+        return -ENOSPC;
+    }
+
+    memblks[nr_memblks++] = numa_memblk{nid, start, end};
+    online_nodes |= (1UL << nid);
+    printf("numa: Node %d: [%016lx, %016lx]\n", nid, start, end - 1);
+    return 0;
+}
+
+void numa_set_distance(int from, int to, unsigned int distance)
+{
+    if (!numa_nid_valid(from) || !numa_nid_valid(to))
+        return;
+    numa_distances[from][to] = distance;
+    distances_valid = true;
+}
+
+unsigned int numa_distance(int from, int to)
+{
+    if (from == to)
+        return NUMA_LOCAL_DISTANCE;
+
+    /* Firmware didn't give us a SLIT (or equivalent), so assume every other node is remote */
+    if (!distances_valid || !numa_distances[from][to])
+        return NUMA_REMOTE_DISTANCE;
+    return numa_distances[from][to];
+}
+
+void numa_add_cpu_hwid(u32 hwid, int nid)
+{
+    if (!numa_nid_valid(nid) || nr_cpu_hwids == CONFIG_SMP_NR_CPUS)
+        return;
+    cpu_hwids[nr_cpu_hwids++] = numa_hwid{hwid, nid};
+}
+
+int numa_hwid_to_node(u32 hwid)
+{
+    for (unsigned int i = 0; i < nr_cpu_hwids; i++)
+    {
+        if (cpu_hwids[i].hwid == hwid)
+            return cpu_hwids[i].nid;
+    }
+
+    return NUMA_NO_NODE;
+}
+
+void numa_set_cpu_node(unsigned int cpu, int nid)
+{
+    if (cpu >= CONFIG_SMP_NR_CPUS || !numa_nid_valid(nid))
+        return;
+    cpu_nodes[cpu] = nid;
+}
+
+int cpu_to_node(unsigned int cpu)
+{
+    return cpu_nodes[cpu];
+}
+
+int phys_to_nid(unsigned long phys)
+{
+    if (online_nodes == 1) [[likely]]
+        return 0;
+
+    for (unsigned int i = 0; i < nr_memblks; i++)
+    {
+        if (phys >= memblks[i].start && phys < memblks[i].end)
+            return memblks[i].nid;
+    }
+
+    return 0;
+}
+
+unsigned int numa_nr_nodes()
+{
+    return __builtin_popcountl(online_nodes);
+}
+
+bool numa_node_online(int nid)
+{
+    return numa_nid_valid(nid) && online_nodes & (1UL << nid);
+}
+
+unsigned int numa_node_fallback_order(int nid, int *order)
+{
+    unsigned int nr = 0;
+
+    for (int i = 0; i < MAX_NUMA_NODES; i++)
+    {
+        if (!numa_node_online(i))
+            continue;
+
+        /* Insertion sort by distance from nid. Ties get broken by node id, so the order is
+         * stable and nid itself always comes first.
+         */
+        unsigned int j = nr++;
+        const unsigned int dist = numa_distance(nid, i);
+        while (j > 0 && numa_distance(nid, order[j - 1]) > dist)
+        {
+            order[j] = order[j - 1];
+            j--;
+        }
+
+        order[j] = i;
+    }
+
+    return nr;
+}
+
+void numa_for_each_range(unsigned long start, size_t size,
+                         void (*cb)(int nid, unsigned long start, size_t size, void *context),
+                         void *context)
+{
+    const unsigned long end = start + size;
+
+    while (start < end)
+    {
+        int nid = 0;
+        unsigned long piece_end = end;
+
+        for (unsigned int i = 0; i < nr_memblks; i++)
+        {
+            const auto &blk = memblks[i];
+            if (start >= blk.start && start < blk.end)
+            {
+                /* Found the memblk we're in, clip to it */
+                nid = blk.nid;
+                piece_end = blk.end < end ? blk.end : end;
+                break;
+            }
+
+            /* Not in any memblk (yet), clip to the next one so it gets its own piece */
+            if (blk.start > start && blk.start < piece_end)
+                piece_end = blk.start;
+        }
+
+        cb(nid, start, piece_end - start, context);
+        start = piece_end;
+    }
+}
@@ -42,6 +42,10 @@ void page_allocate_pagemap(unsigned long __maxpfn)
 {
     maxpfn = __maxpfn;
     page_map = (page *) __ksbrk((maxpfn - base_pfn) * sizeof(struct page));
+    /* Holes in the physical address space never get page_add_page'd, but the page allocator still
+     * looks at their struct pages (when looking for buddies, or compaction candidates).
+     */
+    memset(page_map, 0, (maxpfn - base_pfn) * sizeof(struct page));
 }
 
 struct page *phys_to_page(uintptr_t phys)
@@ -17,12 +17,19 @@
 #include <unistd.h>
 
 #include <onyx/copy.h>
+#include <onyx/cpumask.h>
+#include <onyx/init.h>
+#include <onyx/mm/compaction.h>
+#include <onyx/numa.h>
 #include <onyx/page.h>
 #include <onyx/pagecache.h>
 #include <onyx/panic.h>
+#include <onyx/scheduler.h>
+#include <onyx/smp.h>
 #include <onyx/spinlock.h>
 #include <onyx/utils.h>
 #include <onyx/vm.h>
+#include <onyx/wait_queue.h>
 
 #include <uapi/memstat.h>
 
@@ -38,33 +45,117 @@ __always_inline unsigned long pow2(unsigned int exp)
 
 #define PAGEALLOC_NR_ORDERS 14
 
+/* Pageblocks are the unit of anti-fragmentation grouping. Every pageblock has a migratetype, and
+ * free pages go into the free lists of their pageblock's type. Allocations stick to their own type
+ * as long as they can, so movable and unmovable memory don't end up interleaved.
+ */
+#define PAGEBLOCK_ORDER    9
+#define PAGEBLOCK_NR_PAGES (1UL << PAGEBLOCK_ORDER)
+
+enum migratetype
+{
+    MIGRATE_UNMOVABLE = 0,
+    MIGRATE_MOVABLE,
+    MIGRATE_RECLAIMABLE,
+    MIGRATE_PCPUTYPES,
+    /* Pageblocks being compacted. Pages here never get allocated. */
+    MIGRATE_ISOLATE = MIGRATE_PCPUTYPES,
+    MIGRATE_TYPES
+};
+
+/* Fallback order when a migratetype runs out of free pages */
+static const int migrate_fallbacks[MIGRATE_PCPUTYPES][MIGRATE_PCPUTYPES - 1] = {
+    {MIGRATE_RECLAIMABLE, MIGRATE_MOVABLE},   /* MIGRATE_UNMOVABLE */
+    {MIGRATE_RECLAIMABLE, MIGRATE_UNMOVABLE}, /* MIGRATE_MOVABLE */
+    {MIGRATE_UNMOVABLE, MIGRATE_MOVABLE},     /* MIGRATE_RECLAIMABLE */
+};
+
+/* One byte per pageblock, indexed by pfn >> PAGEBLOCK_ORDER */
+static u8 *pageblock_types;
+static unsigned long page_max_pfn;
+
+__always_inline int get_pageblock_type(unsigned long pfn)
+{
+    return pageblock_types[pfn >> PAGEBLOCK_ORDER];
+}
+
+__always_inline int get_pageblock_type(struct page *page)
+{
+    return get_pageblock_type(page_to_pfn(page));
+}
+
+__always_inline void set_pageblock_type(unsigned long pfn, int type)
+{
+    pageblock_types[pfn >> PAGEBLOCK_ORDER] = type;
+}
+
+/* One byte per page, with the node it belongs to. Filled in as memory gets added, so the free
+ * path doesn't need to look through the firmware's memory ranges. nullptr on single-node systems.
+ */
+static u8 *page_nids;
+
+__always_inline int pfn_to_nid(unsigned long pfn)
+{
+    return page_nids ? page_nids[pfn] : 0;
+}
+
+__always_inline int gfp_to_migratetype(unsigned long flags)
+{
+    if (flags & PAGE_ALLOC_MOVABLE)
+        return MIGRATE_MOVABLE;
+    if (flags & PAGE_ALLOC_RECLAIMABLE)
+        return MIGRATE_RECLAIMABLE;
+    return MIGRATE_UNMOVABLE;
+}
+
+__always_inline unsigned long migratetype_to_gfp(int mt)
+{
+    if (mt == MIGRATE_MOVABLE)
+        return PAGE_ALLOC_MOVABLE;
+    if (mt == MIGRATE_RECLAIMABLE)
+        return PAGE_ALLOC_RECLAIMABLE;
+    return 0;
+}
+
 #define MAX_PCPU_PAGES    1024
 #define PCPU_REFILL_PAGES 512
 #define PCPU_REFILL_ORDER 9
 
+/* Pre-zeroed page pools, per zone and migratetype (so movable allocations don't end up in
+ * unmovable pageblocks). kzerod refills them once they drop below the low watermark.
+ */
+#define ZERO_POOL_TARGET 512
+#define ZERO_POOL_LOW    (ZERO_POOL_TARGET / 2)
+#define ZERO_POOL_BATCH  32
+/* Don't bother refilling the pool if the zone has less than this many free pages */
+#define ZERO_POOL_MIN_FREE (ZERO_POOL_TARGET * 4)
+
 struct page_pcpu_queue
 {
-    struct list_head page_list;
+    /* One list per migratetype, so pcpu caching doesn't defeat the grouping */
+    struct list_head page_list[MIGRATE_PCPUTYPES];
     unsigned long nr_pages{0};
     unsigned long nr_fast_path{0};
     unsigned long nr_slow_path{0};
     unsigned long nr_queue_reclaims{0};
     constexpr page_pcpu_queue()
     {
-        INIT_LIST_HEAD(&page_list);
+        for (auto &list : page_list)
+            INIT_LIST_HEAD(&list);
     }
 
     /**
      * @brief Allocate from pcpu state.
      * IRQs must be disabled
+     * @param mt Migratetype
      * @return Allocated struct page, or nullptr
      */
-    __attribute__((always_inline)) struct page *alloc()
+    __attribute__((always_inline)) struct page *alloc(int mt)
     {
-        if (nr_pages == 0) [[unlikely]]
+        if (list_is_empty(&page_list[mt])) [[unlikely]]
             return nullptr;
 
-        struct page *page = container_of(list_first_element(&page_list), struct page,
+        struct page *page = container_of(list_first_element(&page_list[mt]), struct page,
                                          page_allocator_node.list_node);
         list_remove(&page->page_allocator_node.list_node);
 
@@ -77,10 +168,11 @@ struct page_pcpu_queue
      * @brief Free to pcpu state
      * IRQs must be disabled
      * @param page Page to free
+     * @param mt Migratetype
      */
-    __attribute__((always_inline)) void free(struct page *page)
+    __attribute__((always_inline)) void free(struct page *page, int mt)
     {
-        list_add_tail(&page->page_allocator_node.list_node, &page_list);
+        list_add_tail(&page->page_allocator_node.list_node, &page_list[mt]);
         nr_pages++;
     }
 
@@ -89,14 +181,28 @@ struct page_pcpu_queue
 struct page_zone
 {
     const char *name;
+    /* Physical address range covered by the zone (inclusive) */
     unsigned long start;
     unsigned long end;
-    struct list_head pages[PAGEALLOC_NR_ORDERS];
+    int nid;
+    struct list_head pages[MIGRATE_TYPES][PAGEALLOC_NR_ORDERS];
     unsigned long total_pages;
     long used_pages;
     unsigned long splits;
     unsigned long merges;
+    /* Number of times we had to steal from another migratetype */
+    unsigned long fallbacks;
     spinlock lock;
+    /* Pages zeroed by kzerod, marked PAGE_FLAG_ZEROED. Protected by lock. Pool pages are free
+     * memory, so they don't count as used_pages; they go back to the buddy lists when we run short
+     * (see page_zone_drain_zero_pool).
+     */
+    struct list_head zero_pages[MIGRATE_PCPUTYPES];
+    unsigned long nr_zero[MIGRATE_PCPUTYPES];
+    /* Total of nr_zero */
+    unsigned long nr_zero_pages;
+    unsigned long zero_hits;
+    unsigned long zero_misses;
     page_pcpu_queue pcpu[CONFIG_SMP_NR_CPUS] __align_cache;
 };
 
@@ -117,65 +223,166 @@ __always_inline void page_make_buddy(page *page, unsigned int order)
     page->flags |= PAGE_BUDDY;
 }
 
-static struct page *page_zone_alloc_core(page_zone *zone, unsigned int gfp_flags,
-                                         unsigned int order)
+__always_inline void page_reset_for_free(struct page *p)
 {
-    /* *zone->lock held*, irqs disabled */
-    unsigned long nr_pgs = pow2(order);
-    unsigned int i;
-    struct page *pages = nullptr;
-    bool no_remove = false;
+    p->flags = 0;
+    p->cache = nullptr;
+    p->next_un.next_allocation = nullptr;
+    p->ref = 0;
+}
 
-    if (zone->total_pages - zone->used_pages < nr_pgs)
-        return nullptr;
+/**
+ * @brief Split a block of order \p high down to order \p low, feeding the unused halves back into
+ * the free lists of \p mt
+ */
+static void page_zone_expand(page_zone *zone, struct page *page, unsigned int low,
+                             unsigned int high, int mt)
+{
+    while (high-- != low)
+    {
+        // Feed the second half back to the lower order, keep the first half
+        // This first half will then be either further fed back, or kept
+        struct page *p2 = page + pow2(high);
+        DCHECK(!page_is_buddy(p2));
+        page_make_buddy(p2, high);
+        list_add_tail(&p2->page_allocator_node.list_node, &zone->pages[mt][high]);
+    }
+}
+
+/**
+ * @brief Take a free block of order \p high off the free lists, and split it down to \p order
+ */
+static struct page *page_zone_take(page_zone *zone, struct page *page, unsigned int order,
+                                   unsigned int high, int mt)
+{
+    CHECK(page_is_buddy(page));
+    page_debuddy(page);
+    list_remove(&page->page_allocator_node.list_node);
 
-    if (!list_is_empty(&zone->pages[order])) [[likely]]
+    if (high != order)
     {
-        pages = container_of(list_first_element(&zone->pages[order]), struct page,
-                             page_allocator_node.list_node);
-        CHECK(page_is_buddy(pages));
-        page_debuddy(pages);
-        goto out;
+        zone->splits++;
+        page_zone_expand(zone, page, order, high, mt);
     }
 
-    /* Ok, this order has no pages, lets try to split upper orders */
-    for (i = order + 1; i < PAGEALLOC_NR_ORDERS; i++)
+    return page;
+}
+
+static struct page *page_zone_rmqueue_smallest(page_zone *zone, unsigned int order, int mt)
+{
+    for (unsigned int i = order; i < PAGEALLOC_NR_ORDERS; i++)
     {
-        if (!list_is_empty(&zone->pages[i]))
-        {
-            pages = container_of(list_first_element(&zone->pages[i]), struct page,
-                                 page_allocator_node.list_node);
-            CHECK(pages->flags == PAGE_BUDDY);
-            page_debuddy(pages);
-            list_remove(&pages->page_allocator_node.list_node);
-            // No need to remove it later on, we've already done it
-            no_remove = true;
-            zone->splits++;
+        if (list_is_empty(&zone->pages[mt][i]))
+            continue;
+
+        struct page *page = container_of(list_first_element(&zone->pages[mt][i]), struct page,
+                                         page_allocator_node.list_node);
+        return page_zone_take(zone, page, order, i, mt);
+    }
+
+    return nullptr;
+}
+
+/**
+ * @brief Move every free block in [start_pfn, start_pfn + nr_pages) to the free lists of \p mt,
+ * and set the covered pageblocks' type. The range must be pageblock-aligned.
+ *
+ * @return Number of free pages moved
+ */
+static unsigned long move_freepages_block(page_zone *zone, unsigned long start_pfn,
+                                          unsigned long nr_pages, int mt)
+{
+    /* *zone->lock held*, irqs disabled */
+    const unsigned long end_pfn = start_pfn + nr_pages;
+    unsigned long moved = 0;
+
+    for (unsigned long pfn = start_pfn; pfn < end_pfn; pfn += PAGEBLOCK_NR_PAGES)
+        set_pageblock_type(pfn, mt);
+
+    for (unsigned long pfn = start_pfn; pfn < end_pfn;)
+    {
+        const unsigned long phys = pfn << PAGE_SHIFT;
+        struct page *page = phys_to_page_mayfail(phys);
+        if (!page)
             break;
+
+        /* Pageblocks may straddle zone and node boundaries, so only touch what's ours */
+        if (phys < zone->start || phys > zone->end || !page_is_buddy(page) ||
+            pfn_to_nid(pfn) != zone->nid)
+        {
+            pfn++;
+            continue;
         }
+
+        list_remove(&page->page_allocator_node.list_node);
+        list_add_tail(&page->page_allocator_node.list_node, &zone->pages[mt][page->priv]);
+        moved += pow2(page->priv);
+        pfn += pow2(page->priv);
     }
 
-    if (!pages)
-        return nullptr;
+    return moved;
+}
 
-    // Now that we have a higher-order block, lets feed it back down
-    while (i-- != order)
+/**
+ * @brief Steal a block from another migratetype's free lists
+ * We go for the largest block we can find, so the following allocations (of the same type) end up
+ * coming from the same place. If the block is large enough (or we're not movable, and thus would
+ * pollute the pageblock anyway), the whole pageblock gets claimed for \p mt.
+ */
+static struct page *page_zone_alloc_fallback(page_zone *zone, unsigned int order, int mt)
+{
+    for (int i = PAGEALLOC_NR_ORDERS - 1; i >= (int) order; i--)
     {
-        // Feed the second half back to the lower order, keep the first half
-        // This first half will then be either further fed back, or kept
-        size_t nr_pages = pow2(i);
+        for (int fallback : migrate_fallbacks[mt])
+        {
+            struct list_head *list = &zone->pages[fallback][i];
+            if (list_is_empty(list))
+                continue;
 
-        struct page *p2 = pages + nr_pages;
-        list_add_tail(&p2->page_allocator_node.list_node, &zone->pages[i]);
-        DCHECK(!page_is_buddy(p2));
-        page_make_buddy(p2, i);
+            struct page *page =
+                container_of(list_first_element(list), struct page, page_allocator_node.list_node);
+            const unsigned long pfn = page_to_pfn(page);
+            int take_mt = fallback;
+
+            if (i >= PAGEBLOCK_ORDER)
+            {
+                /* The block covers whole pageblocks, so they're all ours */
+                move_freepages_block(zone, pfn, pow2(i), mt);
+                take_mt = mt;
+            }
+            else if (i >= PAGEBLOCK_ORDER / 2 || mt != MIGRATE_MOVABLE)
+            {
+                move_freepages_block(zone, pfn & -PAGEBLOCK_NR_PAGES, PAGEBLOCK_NR_PAGES, mt);
+                take_mt = mt;
+            }
+
+            zone->fallbacks++;
+            return page_zone_take(zone, page, order, i, take_mt);
+        }
     }
 
-out:
+    return nullptr;
+}
+
+static struct page *page_zone_alloc_core(page_zone *zone, unsigned int gfp_flags,
+                                         unsigned int order)
+{
+    /* *zone->lock held*, irqs disabled */
+    unsigned long nr_pgs = pow2(order);
+    const int mt = gfp_to_migratetype(gfp_flags);
+
+    if (zone->total_pages - zone->used_pages < nr_pgs)
+        return nullptr;
+
+    struct page *pages = page_zone_rmqueue_smallest(zone, order, mt);
+    if (!pages) [[unlikely]]
+        pages = page_zone_alloc_fallback(zone, order, mt);
+
+    if (!pages)
+        return nullptr;
+
     DCHECK(!page_is_buddy(pages));
     pages->flags = 0;
-    if (!no_remove)
-        list_remove(&pages->page_allocator_node.list_node);
     zone->used_pages += nr_pgs;
     return pages;
 }
@@ -185,6 +392,7 @@ struct page *page_zone_refill_pcpu(struct page_zone *zone, unsigned int gfp_flag
 {
     unsigned int pages_collected = 0;
     struct page *ret = nullptr;
+    const int mt = gfp_to_migratetype(gfp_flags);
     scoped_lock<spinlock, true> g{zone->lock};
 
     __atomic_add_fetch(&queue->nr_slow_path, 1, __ATOMIC_RELAXED);
@@ -215,7 +423,7 @@ struct page *page_zone_refill_pcpu(struct page_zone *zone, unsigned int gfp_flag
             for (; i < order_nr_pages; i++)
             {
                 struct page *p = pages + i;
-                list_add_tail(&p->page_allocator_node.list_node, &queue->page_list);
+                list_add_tail(&p->page_allocator_node.list_node, &queue->page_list[mt]);
                 queue->nr_pages++;
             }
         }
@@ -233,7 +441,7 @@ struct page *page_zone_alloc(struct page_zone *zone, unsigned int gfp_flags, uns
         // Let's use pcpu caching for order-0 pages
         auto flags = irq_save_and_disable();
         page_pcpu_queue *queue = &zone->pcpu[get_cpu_nr()];
-        auto pages = queue->alloc();
+        auto pages = queue->alloc(gfp_to_migratetype(gfp_flags));
         if (!pages) [[unlikely]]
         {
             pages = page_zone_refill_pcpu(zone, gfp_flags, queue);
@@ -256,6 +464,62 @@ struct page *page_zone_alloc(struct page_zone *zone, unsigned int gfp_flags, uns
     return page_zone_alloc_core(zone, gfp_flags, order);
 }
 
+/**
+ * @brief Allocate up to nr_pages order-0 pages from a zone.
+ * The pcpu queue is drained first, and anything left gets carved out of the buddy lists under a
+ * single lock hold. Note: The pages are not prepared (see prepare_pages_after_alloc)
+ *
+ * @param zone Zone to allocate from
+ * @param gfp_flags GFP flags
+ * @param nr_pages Number of pages wanted
+ * @param pages Array of at least nr_pages entries, filled with the allocated pages
+ * @return Number of pages allocated
+ */
+static unsigned long page_zone_alloc_bulk(struct page_zone *zone, unsigned int gfp_flags,
+                                          unsigned long nr_pages, struct page **pages)
+{
+    unsigned long nr = 0;
+    const int mt = gfp_to_migratetype(gfp_flags);
+    auto flags = irq_save_and_disable();
+    page_pcpu_queue *queue = &zone->pcpu[get_cpu_nr()];
+
+    while (nr < nr_pages)
+    {
+        struct page *page = queue->alloc(mt);
+        if (!page)
+            break;
+        pages[nr++] = page;
+    }
+
+    if (nr > 0)
+        __atomic_add_fetch(&queue->nr_fast_path, 1, __ATOMIC_RELAXED);
+
+    if (nr < nr_pages)
+    {
+        scoped_lock<spinlock, true> g{zone->lock};
+        __atomic_add_fetch(&queue->nr_slow_path, 1, __ATOMIC_RELAXED);
+
+        /* Take the largest blocks that fit what we still need, and split them up ourselves */
+        for (int order = PCPU_REFILL_ORDER; order >= 0 && nr < nr_pages; order--)
+        {
+            const unsigned long order_nr_pages = pow2(order);
+
+            while (nr_pages - nr >= order_nr_pages)
+            {
+                struct page *block = page_zone_alloc_core(zone, gfp_flags, order);
+                if (!block)
+                    break;
+
+                for (unsigned long i = 0; i < order_nr_pages; i++)
+                    pages[nr++] = block + i;
+            }
+        }
+    }
+
+    irq_restore(flags);
+    return nr;
+}
+
 static void page_zone_add(unsigned long start, unsigned int order, struct page_zone *zone)
 {
     scoped_lock g{zone->lock};
@@ -270,7 +534,8 @@ static void page_zone_add(unsigned long start, unsigned int order, struct page_z
     zone->total_pages += nr_pages;
     struct page *headpage = phys_to_page(start);
     page_make_buddy(headpage, order);
-    list_add_tail(&headpage->page_allocator_node.list_node, &zone->pages[order]);
+    list_add_tail(&headpage->page_allocator_node.list_node,
+                  &zone->pages[get_pageblock_type(headpage)][order]);
 }
 
 void page_zone_add_region(unsigned long start, unsigned long nrpgs, struct page_zone *zone)
@@ -319,13 +584,17 @@ __always_inline struct page *get_buddy(struct page *page, unsigned int order, pa
     // 1) the buddy is not past maxpfn (phys_to_page_mayfail)
     // 2) the buddy is free and the same order as us
     // 3) the buddy is in the same zone
+    // 4) the buddy is in the same node
 
-    struct page *p = phys_to_page_mayfail(pfn2 << PAGE_SHIFT);
+    const unsigned long phys2 = pfn2 << PAGE_SHIFT;
+    struct page *p = phys_to_page_mayfail(phys2);
     if (!p) [[unlikely]]
         return nullptr;
     if (!(p->flags & PAGE_BUDDY) || p->priv != order)
         return nullptr;
-    if (pfn2 < zone->start || pfn2 > zone->end)
+    if (phys2 < zone->start || phys2 > zone->end)
+        return nullptr;
+    if (pfn_to_nid(pfn2) != zone->nid) [[unlikely]]
         return nullptr;
     return p;
 }
@@ -333,6 +602,7 @@ __always_inline struct page *get_buddy(struct page *page, unsigned int order, pa
 static void page_zone_free_core(page_zone *zone, struct page *page, unsigned int order)
 {
     /* *zone->lock held, irqs disabled* */
+    const int mt = get_pageblock_type(page);
     zone->used_pages -= pow2(order);
 
     for (; order < PAGEALLOC_NR_ORDERS - 1; order++)
@@ -342,6 +612,13 @@ static void page_zone_free_core(page_zone *zone, struct page *page, unsigned int
         if (!buddy) [[likely]]
             break;
 
+        /* From here on, buddies live in other pageblocks. Isolated free pages must not leak in or
+         * out of isolation, so never merge across that boundary.
+         */
+        if (order >= PAGEBLOCK_ORDER &&
+            (get_pageblock_type(buddy) == MIGRATE_ISOLATE) != (mt == MIGRATE_ISOLATE))
+            break;
+
         // Great, it's free, let's merge. The head will be what we're trying to insert.
         page_debuddy(buddy);
         list_remove(&buddy->page_allocator_node.list_node);
@@ -350,19 +627,35 @@ static void page_zone_free_core(page_zone *zone, struct page *page, unsigned int
         zone->merges++;
     }
 
+    /* A block this large spans whole pageblocks, which now all share its type */
+    if (order > PAGEBLOCK_ORDER)
+    {
+        const unsigned long pfn = page_to_pfn(page);
+        for (unsigned long i = 0; i < pow2(order); i += PAGEBLOCK_NR_PAGES)
+            set_pageblock_type(pfn + i, mt);
+    }
+
     // Now, insert the head into the order. Lets add to the head as this page
     // is likely cache-hot.
     page_make_buddy(page, order);
-    list_add(&page->page_allocator_node.list_node, &zone->pages[order]);
+    list_add(&page->page_allocator_node.list_node, &zone->pages[mt][order]);
 }
 
-static void page_zone_release_pcpu(page_zone *zone, page_pcpu_queue *queue)
+static void page_zone_release_pcpu(page_zone *zone, page_pcpu_queue *queue, unsigned long target)
 {
     scoped_lock<spinlock, true> g{zone->lock};
-    while (queue->nr_pages > MAX_PCPU_PAGES / 2)
+    int mt = 0;
+
+    while (queue->nr_pages > target)
     {
-        struct page *p = container_of(list_first_element(&queue->page_list), struct page,
-                                      page_allocator_node.list_node);
+        /* Go round-robin through the lists, so no migratetype gets to hog the queue */
+        struct list_head *list = &queue->page_list[mt];
+        mt = (mt + 1) % MIGRATE_PCPUTYPES;
+        if (list_is_empty(list))
+            continue;
+
+        struct page *p =
+            container_of(list_first_element(list), struct page, page_allocator_node.list_node);
         list_remove(&p->page_allocator_node.list_node);
         queue->nr_pages--;
         page_zone_free_core(zone, p, 0);
@@ -371,18 +664,20 @@ static void page_zone_release_pcpu(page_zone *zone, page_pcpu_queue *queue)
 
 void page_zone_free(page_zone *zone, struct page *page, unsigned int order)
 {
-    if (order == 0) [[likely]]
+    const int mt = get_pageblock_type(page);
+
+    if (order == 0 && mt != MIGRATE_ISOLATE) [[likely]]
     {
         // Lets release this page into the pcpu queue
         auto flags = irq_save_and_disable();
         page_pcpu_queue *queue = &zone->pcpu[get_cpu_nr()];
 
-        queue->free(page);
+        queue->free(page, mt);
 
         if (queue->nr_pages > MAX_PCPU_PAGES) [[unlikely]]
         {
             __atomic_add_fetch(&queue->nr_queue_reclaims, 1, __ATOMIC_RELAXED);
-            page_zone_release_pcpu(zone, queue);
+            page_zone_release_pcpu(zone, queue, MAX_PCPU_PAGES / 2);
         }
 
         irq_restore(flags);
@@ -399,15 +694,167 @@ constexpr void page_zone_init(page_zone *zone, const char *name, unsigned long s
     zone->name = name;
     zone->start = start;
     zone->end = end;
+    zone->nid = 0;
     spinlock_init(&zone->lock);
-    for (auto &order : zone->pages)
+    for (auto &type : zone->pages)
     {
-        INIT_LIST_HEAD(&order);
+        for (auto &order : type)
+            INIT_LIST_HEAD(&order);
     }
 
     zone->total_pages = 0;
     zone->used_pages = 0;
-    zone->merges = zone->splits = 0;
+    zone->merges = zone->splits = zone->fallbacks = 0;
+    for (int i = 0; i < MIGRATE_PCPUTYPES; i++)
+    {
+        INIT_LIST_HEAD(&zone->zero_pages[i]);
+        zone->nr_zero[i] = 0;
+    }
+
+    zone->nr_zero_pages = 0;
+    zone->zero_hits = zone->zero_misses = 0;
+}
+
+static struct wait_queue kzerod_wq;
+static bool kzerod_wake_pending;
+static struct thread *kzerod_thread;
+
+static void kzerod_kick()
+{
+    if (!kzerod_thread) [[unlikely]]
+        return;
+
+    if (__atomic_exchange_n(&kzerod_wake_pending, true, __ATOMIC_RELAXED))
+        return;
+    wait_queue_wake(&kzerod_wq);
+}
+
+/**
+ * @brief Grab pages from the zone's zero pool
+ *
+ * @param zone Zone to allocate from
+ * @param mt Migratetype
+ * @param nr_pages Number of pages wanted
+ * @param pages Array of at least nr_pages entries, filled with zeroed (but unprepared) pages
+ * @return Number of pages we got, which may be less than nr_pages if the pool ran dry
+ */
+static unsigned long page_zone_alloc_zeroed(struct page_zone *zone, int mt,
+                                            unsigned long nr_pages, struct page **pages)
+{
+    unsigned long nr = 0;
+    unsigned long nr_left;
+
+    if (__atomic_load_n(&zone->nr_zero[mt], __ATOMIC_RELAXED) == 0)
+    {
+        if (zone->total_pages)
+        {
+            __atomic_add_fetch(&zone->zero_misses, 1, __ATOMIC_RELAXED);
+            kzerod_kick();
+        }
+
+        return 0;
+    }
+
+    {
+        scoped_lock<spinlock, true> g{zone->lock};
+        while (nr < nr_pages && !list_is_empty(&zone->zero_pages[mt]))
+        {
+            struct page *page = container_of(list_first_element(&zone->zero_pages[mt]),
+                                             struct page, page_allocator_node.list_node);
+            list_remove(&page->page_allocator_node.list_node);
+            DCHECK(page->flags & PAGE_FLAG_ZEROED);
+            pages[nr++] = page;
+        }
+
+        zone->nr_zero[mt] -= nr;
+        zone->nr_zero_pages -= nr;
+        zone->used_pages += nr;
+        zone->zero_hits += nr;
+        nr_left = zone->nr_zero[mt];
+    }
+
+    if (nr_left < ZERO_POOL_LOW)
+        kzerod_kick();
+
+    return nr;
+}
+
+/**
+ * @brief Zero some pages and add them to one of the zone's zero pools
+ *
+ * @param zone Zone to refill
+ * @param mt Migratetype of the pool
+ * @return True if the pool still needs more pages, else false
+ */
+static bool page_zone_refill_zero_pool(struct page_zone *zone, int mt)
+{
+    struct page *pages[ZERO_POOL_BATCH];
+
+    if (__atomic_load_n(&zone->nr_zero[mt], __ATOMIC_RELAXED) >= ZERO_POOL_TARGET)
+        return false;
+    if (zone->total_pages - zone->used_pages - zone->nr_zero_pages < ZERO_POOL_MIN_FREE)
+        return false;
+
+    /* Allocate them as mt, so they come out of (and get accounted to) the right pageblocks */
+    unsigned long nr = page_zone_alloc_bulk(zone, PAGE_ALLOC_NO_ZERO | migratetype_to_gfp(mt),
+                                            ZERO_POOL_BATCH, pages);
+
+    /* Zero them outside of the lock, with non-temporal stores, so we don't trash the caches with
+     * pages no one is going to touch for a while.
+     */
+    for (unsigned long i = 0; i < nr; i++)
+    {
+        set_non_temporal(PAGE_TO_VIRT(pages[i]), 0, PAGE_SIZE);
+        pages[i]->flags = PAGE_FLAG_ZEROED;
+    }
+
+    /* Non-temporal stores are weakly ordered, make sure they're visible before the pages are */
+    write_memory_barrier();
+
+    scoped_lock<spinlock, true> g{zone->lock};
+    for (unsigned long i = 0; i < nr; i++)
+        list_add_tail(&pages[i]->page_allocator_node.list_node, &zone->zero_pages[mt]);
+    zone->nr_zero[mt] += nr;
+    zone->nr_zero_pages += nr;
+    zone->used_pages -= nr;
+
+    return nr == ZERO_POOL_BATCH && zone->nr_zero[mt] < ZERO_POOL_TARGET;
+}
+
+/**
+ * @brief Give the zone's zero pool back to the buddy allocator
+ * The pool is only a cache. Its pages may be all that's keeping a higher-order block from
+ * merging (or from being compacted), or just all the memory we have left.
+ *
+ * @param zone Zone to drain
+ * @return Number of pages given back
+ */
+static unsigned long page_zone_drain_zero_pool(struct page_zone *zone)
+{
+    unsigned long nr = 0;
+
+    if (!__atomic_load_n(&zone->nr_zero_pages, __ATOMIC_RELAXED))
+        return 0;
+
+    scoped_lock<spinlock, true> g{zone->lock};
+    for (int mt = 0; mt < MIGRATE_PCPUTYPES; mt++)
+    {
+        list_for_every_safe (&zone->zero_pages[mt])
+        {
+            struct page *page = container_of(l, struct page, page_allocator_node.list_node);
+            list_remove(&page->page_allocator_node.list_node);
+            page_reset_for_free(page);
+            /* page_zone_free_core un-accounts it */
+            zone->used_pages++;
+            page_zone_free_core(zone, page, 0);
+            nr++;
+        }
+
+        zone->nr_zero[mt] = 0;
+    }
+
+    zone->nr_zero_pages = 0;
+    return nr;
 }
 
 class page_node
@@ -419,9 +866,9 @@ private:
     unsigned long total_pages{0};
     struct page_zone zones[NR_ZONES];
 
-    struct page_zone *add_pick_zone(unsigned long page);
-
 public:
+    int nid{0};
+
     constexpr page_node() : node_lock{}, cpu_list_node{}
     {
         spinlock_init(&node_lock);
@@ -429,17 +876,26 @@ public:
         page_zone_init(&zones[1], "Normal", (u64) UINT32_MAX + 1, UINT64_MAX);
     }
 
-    void init()
+    void init(int nid)
     {
         INIT_LIST_HEAD(&cpu_list_node);
+        this->nid = nid;
+        for (auto &zone : zones)
+            zone.nid = nid;
     }
 
+    struct page_zone *add_pick_zone(unsigned long page);
     void add_region(unsigned long base, size_t size);
     struct page *alloc_order(unsigned int order, unsigned long flags);
-    struct page *allocate_pages(unsigned long nr_pages, unsigned long flags);
-    struct page *alloc_page(unsigned long flags);
+    unsigned long alloc_bulk(unsigned long nr_pages, unsigned long flags, struct page **pages);
+    unsigned long alloc_zeroed(unsigned long nr_pages, unsigned long flags, struct page **pages);
     void free_page(struct page *p);
 
+    unsigned long get_total_pages() const
+    {
+        return total_pages;
+    }
+
     template <typename Callable>
     bool for_every_zone(Callable c)
     {
@@ -455,7 +911,25 @@ public:
 
 static bool page_is_initialized = false;
 
-page_node main_node;
+/* One page_node per NUMA node. Every page_node has its own zones, and thus its own pcpu queues. */
+static page_node nodes[MAX_NUMA_NODES];
+
+static inline page_node &page_to_node(struct page *page)
+{
+    return nodes[pfn_to_nid(page_to_pfn(page))];
+}
+
+/**
+ * @brief Get the node we're running on, to allocate from
+ * It's only a hint: we may get migrated to another node right after.
+ */
+static int page_local_node()
+{
+    sched_disable_preempt();
+    const int nid = cpu_to_node(get_cpu_nr());
+    sched_enable_preempt();
+    return nid;
+}
 
 struct page_zone *page_node::add_pick_zone(unsigned long page)
 {
@@ -485,8 +959,12 @@ void page_node::add_region(uintptr_t base, size_t size)
         unsigned long end = cul::clamp(start + size, zone->end) + 1;
         unsigned long nr_pages = (end - start) >> PAGE_SHIFT;
         printf("pagealloc: Adding [%016lx, %016lx] to zone %s\n", start, end - 1, zone->name);
+        /* Before adding the pages, so they can merge with their buddies */
+        if (page_nids)
+            memset(page_nids + (start >> PAGE_SHIFT), nid, nr_pages);
         page_zone_add_region(start, nr_pages, zone);
         nr_global_pages.add_fetch(nr_pages, mem_order::release);
+        total_pages += nr_pages;
         start = end;
         size -= nr_pages << PAGE_SHIFT;
     }
@@ -494,7 +972,8 @@ void page_node::add_region(uintptr_t base, size_t size)
 
 void page_init(size_t memory_size, unsigned long maxpfn)
 {
-    main_node.init();
+    for (int i = 0; i < MAX_NUMA_NODES; i++)
+        nodes[i].init(i);
 
     printf("page: Memory size: %lu\n", memory_size);
     page_memory_size = memory_size;
@@ -508,12 +987,41 @@ void page_init(size_t memory_size, unsigned long maxpfn)
 
     __kbrk(PHYS_TO_VIRT(ptr), (void *) ((unsigned long) PHYS_TO_VIRT(ptr) + needed_memory));
     page_allocate_pagemap(maxpfn);
+    page_max_pfn = maxpfn;
+
+    /* Every pageblock starts out movable, and gets claimed by other migratetypes as needed */
+    const size_t nr_pageblocks = (maxpfn >> PAGEBLOCK_ORDER) + 1;
+    void *types = alloc_boot_page(vm_size_to_pages(nr_pageblocks), 0);
+    if (!types)
+    {
+        halt();
+    }
+
+    pageblock_types = (u8 *) PHYS_TO_VIRT(types);
+    memset(pageblock_types, MIGRATE_MOVABLE, nr_pageblocks);
+
+    if (numa_nr_nodes() > 1)
+    {
+        void *nids = alloc_boot_page(vm_size_to_pages(maxpfn + 1), 0);
+        if (!nids)
+        {
+            halt();
+        }
+
+        page_nids = (u8 *) PHYS_TO_VIRT(nids);
+        memset(page_nids, 0, maxpfn + 1);
+    }
 
     for_every_phys_region([](unsigned long start, size_t size) {
         /* page_add_region can't return an error value since it halts
          * on failure
          */
-        main_node.add_region(start, size);
+        numa_for_each_range(
+            start, size,
+            [](int nid, unsigned long base, size_t len, void *) {
+                nodes[nid].add_region(base, len);
+            },
+            nullptr);
     });
 
     page_is_initialized = true;
@@ -522,17 +1030,246 @@ void page_init(size_t memory_size, unsigned long maxpfn)
 template <typename Callable>
 bool for_every_node(Callable c)
 {
-    return c(main_node);
+    for (int i = 0; i < MAX_NUMA_NODES; i++)
+    {
+        if (!numa_node_online(i))
+            continue;
+        if (!c(nodes[i]))
+            return false;
+    }
+
+    return true;
 }
 
-size_t page_get_used_pages()
+static void page_drain_pcpu_local(void *)
 {
-    unsigned long used_pages = 0;
+    auto flags = irq_save_and_disable();
+    const unsigned int cpu = get_cpu_nr();
+
+    for_every_node([cpu](page_node &node) -> bool {
+        node.for_every_zone([cpu](page_zone *zone) -> bool {
+            page_zone_release_pcpu(zone, &zone->pcpu[cpu], 0);
+            return true;
+        });
+
+        return true;
+    });
+
+    irq_restore(flags);
+}
+
+/**
+ * @brief Give back every page sitting in a pcpu queue to the buddy lists
+ *
+ */
+void page_drain_pcpu()
+{
+    smp::sync_call(page_drain_pcpu_local, nullptr, cpumask::all());
+}
+
+/**
+ * @brief Give back every zero pool page to the buddy lists
+ *
+ * @return Number of pages given back
+ */
+static unsigned long page_drain_zero_pools()
+{
+    unsigned long nr = 0;
+
+    for_every_node([&](page_node &node) -> bool {
+        node.for_every_zone([&](page_zone *zone) -> bool {
+            nr += page_zone_drain_zero_pool(zone);
+            return true;
+        });
+
+        return true;
+    });
+
+    return nr;
+}
+
+/**
+ * @brief Look at [pfn, pfn + 2^block_order) as a compaction target
+ *
+ * @return Number of free pages in the block, or -1 if it can't (or doesn't need to) be compacted
+ */
+static long page_zone_compaction_score(page_zone *zone, unsigned long pfn, unsigned int block_order)
+{
+    /* *zone->lock held*, irqs disabled */
+    const unsigned long nr_pages = pow2(block_order);
+    long nr_free = 0;
+
+    for (unsigned long i = 0; i < nr_pages; i += PAGEBLOCK_NR_PAGES)
+    {
+        if (get_pageblock_type(pfn + i) != MIGRATE_MOVABLE)
+            return -1;
+    }
+
+    /* Buddies are naturally aligned, so a larger free block that covers our first page covers
+     * all of it, and there's nothing to do.
+     */
+    for (unsigned int order = block_order + 1; order < PAGEALLOC_NR_ORDERS; order++)
+    {
+        struct page *head = phys_to_page((pfn & -pow2(order)) << PAGE_SHIFT);
+        if (page_is_buddy(head) && head->priv >= order)
+            return -1;
+    }
+
+    for (unsigned long i = 0; i < nr_pages;)
+    {
+        struct page *page = phys_to_page((pfn + i) << PAGE_SHIFT);
+        if (!page_is_buddy(page))
+        {
+            i++;
+            continue;
+        }
+
+        nr_free += pow2(page->priv);
+        i += pow2(page->priv);
+    }
+
+    return nr_free == (long) nr_pages ? -1 : nr_free;
+}
+
+struct compaction_candidate
+{
+    page_zone *zone;
+    unsigned long pfn;
+    long score;
+};
+
+/**
+ * @brief Pick the blocks that are the cheapest to compact (the ones with the most free pages) and
+ * isolate them. Isolated free pages can't be allocated, and pages freed into isolated blocks stay
+ * in the buddy lists.
+ *
+ * @param cc Compaction control. cc->order must be set; the isolated blocks get filled in.
+ */
+void page_isolate_for_compaction(struct compact_control *cc)
+{
+    struct compaction_candidate best[COMPACT_MAX_BLOCKS];
+    unsigned int nr = 0;
+    const unsigned int block_order = cul::max(cc->order, (unsigned int) PAGEBLOCK_ORDER);
+    const unsigned long nr_pages = pow2(block_order);
+
+    cc->block_order = block_order;
+    cc->nr_blocks = 0;
+
+    /* Zero pool pages can't be migrated, and would keep their blocks from ever being free */
+    page_drain_zero_pools();
+
     for_every_node([&](page_node &node) -> bool {
-        return node.for_every_zone([&](page_zone *zone) -> bool {
-            used_pages += page_zone_get_used_pages(zone);
+        node.for_every_zone([&](page_zone *zone) -> bool {
+            if (!zone->total_pages)
+                return true;
+
+            const unsigned long start = cul::align_up2(zone->start >> PAGE_SHIFT, nr_pages);
+            const unsigned long end = cul::min(zone->end >> PAGE_SHIFT, page_max_pfn) + 1;
+
+            for (unsigned long pfn = start; pfn + nr_pages <= end; pfn += nr_pages)
+            {
+                if (phys_to_nid(pfn << PAGE_SHIFT) != zone->nid ||
+                    phys_to_nid((pfn + nr_pages - 1) << PAGE_SHIFT) != zone->nid)
+                    continue;
+
+                long score;
+                {
+                    scoped_lock<spinlock, true> g{zone->lock};
+                    score = page_zone_compaction_score(zone, pfn, block_order);
+                }
+
+                if (score <= 0)
+                    continue;
+
+                /* Keep the best candidates sorted, highest score first */
+                unsigned int i = nr < COMPACT_MAX_BLOCKS ? nr++ : COMPACT_MAX_BLOCKS;
+                while (i > 0 && best[i - 1].score < score)
+                {
+                    if (i < COMPACT_MAX_BLOCKS)
+                        best[i] = best[i - 1];
+                    i--;
+                }
+
+                if (i < COMPACT_MAX_BLOCKS)
+                    best[i] = compaction_candidate{zone, pfn, score};
+            }
+
             return true;
         });
+
+        return true;
+    });
+
+    for (unsigned int i = 0; i < nr; i++)
+    {
+        auto &c = best[i];
+        scoped_lock<spinlock, true> g{c.zone->lock};
+
+        /* Things may have changed since we looked */
+        if (page_zone_compaction_score(c.zone, c.pfn, block_order) < 0)
+            continue;
+
+        move_freepages_block(c.zone, c.pfn, nr_pages, MIGRATE_ISOLATE);
+        cc->blocks[cc->nr_blocks++] = c.pfn;
+    }
+}
+
+/**
+ * @brief Undo page_isolate_for_compaction, giving the blocks back to the movable free lists
+ *
+ * @param cc Compaction control
+ */
+void page_unisolate(struct compact_control *cc)
+{
+    const unsigned long nr_pages = pow2(cc->block_order);
+
+    for (unsigned int i = 0; i < cc->nr_blocks; i++)
+    {
+        const unsigned long pfn = cc->blocks[i];
+        struct page *first = phys_to_page(pfn << PAGE_SHIFT);
+        page_zone *zone = page_to_node(first).add_pick_zone(pfn << PAGE_SHIFT);
+        scoped_lock<spinlock, true> g{zone->lock};
+
+        for (unsigned long j = 0; j < nr_pages; j += PAGEBLOCK_NR_PAGES)
+            set_pageblock_type(pfn + j, MIGRATE_MOVABLE);
+
+        /* Free every block again, so they get to merge with their (no longer isolated) buddies */
+        for (unsigned long j = 0; j < nr_pages;)
+        {
+            struct page *page = first + j;
+            if (!page_is_buddy(page))
+            {
+                j++;
+                continue;
+            }
+
+            const unsigned int order = page->priv;
+            page_debuddy(page);
+            list_remove(&page->page_allocator_node.list_node);
+            zone->used_pages += pow2(order);
+            page_zone_free_core(zone, page, order);
+            j += pow2(order);
+        }
+    }
+}
+
+static size_t page_node_get_used_pages(page_node &node)
+{
+    unsigned long used_pages = 0;
+    node.for_every_zone([&](page_zone *zone) -> bool {
+        used_pages += page_zone_get_used_pages(zone);
+        return true;
+    });
+
+    return used_pages;
+}
+
+size_t page_get_used_pages()
+{
+    unsigned long used_pages = 0;
+    for_every_node([&](page_node &node) -> bool {
+        used_pages += page_node_get_used_pages(node);
+        return true;
     });
 
     return used_pages;
@@ -546,6 +1283,26 @@ void page_get_stats(struct memstat *m)
     m->kernel_heap_pages = 0;
 }
 
+/**
+ * @brief Get memory statistics for a single NUMA node
+ *
+ * @param nid Node ID
+ * @param m Pointer to a memstat, where total_pages and allocated_pages are filled.
+ * @return 0 on success, -EINVAL if the node is not online
+ */
+int page_get_node_stats(int nid, struct memstat *m)
+{
+    if (!numa_node_online(nid))
+        return -EINVAL;
+
+    m->total_pages = nodes[nid].get_total_pages();
+    m->allocated_pages = page_node_get_used_pages(nodes[nid]);
+    /* The page cache and the kernel heap are not accounted per-node */
+    m->page_cache_pages = 0;
+    m->kernel_heap_pages = 0;
+    return 0;
+}
+
 extern unsigned char kernel_end;
 
 void *kernel_break = &kernel_end;
@@ -586,7 +1343,7 @@ void free_page(struct page *p)
     if (__page_unref(p) == 0)
     {
         p->next_un.next_allocation = NULL;
-        main_node.free_page(p);
+        page_to_node(p).free_page(p);
         // printf("free pages %p, %p\n", page_to_phys(p), __builtin_return_address(0));
     }
 #if 0
@@ -597,16 +1354,32 @@ void free_page(struct page *p)
 #endif
 }
 
-struct page *page_node::allocate_pages(size_t nr_pgs, unsigned long flags)
+#define PAGE_BULK_BATCH 64
+
+static struct page *alloc_pages_list(size_t nr_pgs, unsigned long flags)
 {
     struct page *plist = NULL;
     struct page *ptail = NULL;
+    struct page *batch[PAGE_BULK_BATCH];
 
-    for (size_t i = 0; i < nr_pgs; i++)
+    while (nr_pgs)
     {
-        struct page *p = alloc_order(0, flags);
+        const unsigned long to_alloc = cul::min(nr_pgs, (size_t) PAGE_BULK_BATCH);
+        const unsigned long nr = alloc_pages_bulk(to_alloc, flags, batch);
+
+        for (unsigned long i = 0; i < nr; i++)
+        {
+            struct page *p = batch[i];
+            if (!plist)
+                plist = ptail = p;
+            else
+            {
+                ptail->next_un.next_allocation = p;
+                ptail = p;
+            }
+        }
 
-        if (!p)
+        if (nr < to_alloc)
         {
             if (plist)
                 free_page_list(plist);
@@ -614,15 +1387,7 @@ struct page *page_node::allocate_pages(size_t nr_pgs, unsigned long flags)
             return nullptr;
         }
 
-        if (!plist)
-        {
-            plist = ptail = p;
-        }
-        else
-        {
-            ptail->next_un.next_allocation = p;
-            ptail = p;
-        }
+        nr_pgs -= nr;
     }
 
     // printf("alloc pages %lu = %p, %p\n", nr_pgs, page_to_phys(plist),
@@ -653,6 +1418,14 @@ __always_inline void prepare_pages_after_alloc(struct page *page, unsigned int o
     }
 }
 
+/**
+ * @brief Allocate pages from this node's zones
+ * Note: The pages are not prepared (see prepare_pages_after_alloc)
+ *
+ * @param order Order of the allocation
+ * @param flags GFP flags
+ * @return The pages, or nullptr
+ */
 struct page *page_node::alloc_order(unsigned int order, unsigned long flags)
 {
     struct page *page = nullptr;
@@ -666,29 +1439,226 @@ struct page *page_node::alloc_order(unsigned int order, unsigned long flags)
         page = page_zone_alloc(&zones[zone], flags, order);
 
         if (page)
-            goto out;
+            return page;
         zone--;
     }
 
+    return nullptr;
+}
+
+/**
+ * @brief Allocate pages from this node's zero pools
+ * Note: The pages are not prepared (see prepare_pages_after_alloc)
+ *
+ * @param nr_pages Number of pages wanted
+ * @param flags GFP flags
+ * @param pages Array of at least nr_pages entries
+ * @return Number of pages allocated
+ */
+unsigned long page_node::alloc_zeroed(unsigned long nr_pages, unsigned long flags,
+                                      struct page **pages)
+{
+    unsigned long nr = 0;
+    int zone = ZONE_NORMAL;
+    const int mt = gfp_to_migratetype(flags);
+
+    if (flags & PAGE_ALLOC_4GB_LIMIT)
+        zone = ZONE_DMA32;
+
+    for (; zone >= 0 && nr < nr_pages; zone--)
+        nr += page_zone_alloc_zeroed(&zones[zone], mt, nr_pages - nr, pages + nr);
+
+    return nr;
+}
+
+/**
+ * @brief Allocate pages from the local node, falling back to the other nodes, closest first
+ * Note: The pages are not prepared (see prepare_pages_after_alloc)
+ */
+static struct page *alloc_pages_nodes(unsigned int order, unsigned long flags, int local)
+{
+    int order_list[MAX_NUMA_NODES];
+    struct page *page = nodes[local].alloc_order(order, flags);
+
+    if (!page) [[unlikely]]
+    {
+        unsigned int nr = numa_node_fallback_order(local, order_list);
+        for (unsigned int i = 0; i < nr && !page; i++)
+        {
+            if (order_list[i] == local)
+                continue;
+            page = nodes[order_list[i]].alloc_order(order, flags);
+        }
+    }
+
+    return page;
+}
+
+struct page *alloc_pages(unsigned int order, unsigned long flags)
+{
+    struct page *page = nullptr;
+    const int local = page_local_node();
+
+    if (order == 0 && page_should_zero(flags))
+    {
+        /* Pages from the zero pool are already zeroed, so skip the memset */
+        if (nodes[local].alloc_zeroed(1, flags, &page))
+        {
+            prepare_pages_after_alloc(page, 0, flags | PAGE_ALLOC_NO_ZERO);
+            return page;
+        }
+    }
+
+    page = alloc_pages_nodes(order, flags, local);
+
+    if (!page) [[unlikely]]
+    {
+        /* The zero pools are just a cache. Give them back, which may be enough to get us our
+         * memory (or to let a higher-order block merge).
+         */
+        if (page_drain_zero_pools())
+            page = alloc_pages_nodes(order, flags, local);
+    }
+
+    if (!page && order > 0) [[unlikely]]
+    {
+        /* We may have the memory, just not contiguous. Compact and give it another go. */
+        if (compact_direct(order))
+            page = alloc_pages_nodes(order, flags, local);
+    }
+
     if (!page)
         return nullptr;
 
-out:
     prepare_pages_after_alloc(page, order, flags);
 
     return page;
 }
 
-struct page *alloc_pages(unsigned int order, unsigned long flags)
+/**
+ * @brief Allocate up to nr_pages order-0 pages from this node's zones
+ * Note: The pages are not prepared (see prepare_pages_after_alloc)
+ *
+ * @param nr_pages Number of pages wanted
+ * @param flags GFP flags
+ * @param pages Array of at least nr_pages entries
+ * @return Number of pages allocated
+ */
+unsigned long page_node::alloc_bulk(unsigned long nr_pages, unsigned long flags,
+                                    struct page **pages)
+{
+    unsigned long nr = 0;
+    int zone = ZONE_NORMAL;
+
+    if (flags & PAGE_ALLOC_4GB_LIMIT)
+        zone = ZONE_DMA32;
+
+    for (; zone >= 0 && nr < nr_pages; zone--)
+        nr += page_zone_alloc_bulk(&zones[zone], flags, nr_pages - nr, pages + nr);
+
+    return nr;
+}
+
+/**
+ * @brief Allocate order-0 pages in bulk
+ * This is a lot cheaper than calling alloc_page() in a loop, as it hits the pcpu queues and the
+ * buddy lists in one pass.
+ *
+ * @param nr_pages Number of pages wanted
+ * @param gfp_flags GFP flags
+ * @param pages Array of at least nr_pages entries, filled with the allocated pages
+ * @return Number of pages allocated, which may be less than nr_pages if we ran out of memory
+ */
+unsigned long alloc_pages_bulk(unsigned long nr_pages, unsigned int gfp_flags, struct page **pages)
+{
+    int order_list[MAX_NUMA_NODES];
+    const int local = page_local_node();
+    unsigned long nr = 0;
+
+    if (page_should_zero(gfp_flags))
+    {
+        /* Take what we can from the zero pool, so we only need to memset the rest */
+        nr = nodes[local].alloc_zeroed(nr_pages, gfp_flags, pages);
+        for (unsigned long i = 0; i < nr; i++)
+            prepare_pages_after_alloc(pages[i], 0, gfp_flags | PAGE_ALLOC_NO_ZERO);
+    }
+
+    const unsigned long nr_zeroed = nr;
+    nr += nodes[local].alloc_bulk(nr_pages - nr, gfp_flags, pages + nr);
+
+    if (nr < nr_pages) [[unlikely]]
+    {
+        unsigned int nr_nodes = numa_node_fallback_order(local, order_list);
+        for (unsigned int i = 0; i < nr_nodes && nr < nr_pages; i++)
+        {
+            if (order_list[i] == local)
+                continue;
+            nr += nodes[order_list[i]].alloc_bulk(nr_pages - nr, gfp_flags, pages + nr);
+        }
+
+        /* Last resort: give the zero pools back to the buddy lists, and go around again */
+        if (nr < nr_pages && page_drain_zero_pools())
+        {
+            for (unsigned int i = 0; i < nr_nodes && nr < nr_pages; i++)
+                nr += nodes[order_list[i]].alloc_bulk(nr_pages - nr, gfp_flags, pages + nr);
+        }
+    }
+
+    for (unsigned long i = nr_zeroed; i < nr; i++)
+        prepare_pages_after_alloc(pages[i], 0, gfp_flags);
+
+    return nr;
+}
+
+/**
+ * @brief Free pages in bulk
+ * Drops a reference to every page, and frees the ones that hit zero in a single pass.
+ *
+ * @param pages Array of pages
+ * @param nr_pages Number of pages in the array
+ */
+void free_pages_bulk(struct page **pages, unsigned long nr_pages)
 {
-    auto &node = main_node;
-    return node.alloc_order(order, flags);
+    auto flags = irq_save_and_disable();
+    const unsigned int cpu = get_cpu_nr();
+
+    for (unsigned long i = 0; i < nr_pages; i++)
+    {
+        struct page *p = pages[i];
+        DCHECK(p->ref != 0);
+
+        if (__page_unref(p) != 0)
+            continue;
+
+        page_reset_for_free(p);
+
+        struct page_zone *zone = page_to_node(p).add_pick_zone((unsigned long) page_to_phys(p));
+        const int mt = get_pageblock_type(p);
+
+        if (mt == MIGRATE_ISOLATE) [[unlikely]]
+        {
+            page_zone_free(zone, p, 0);
+            continue;
+        }
+
+        page_pcpu_queue *queue = &zone->pcpu[cpu];
+        queue->free(p, mt);
+
+        if (queue->nr_pages > MAX_PCPU_PAGES) [[unlikely]]
+        {
+            __atomic_add_fetch(&queue->nr_queue_reclaims, 1, __ATOMIC_RELAXED);
+            page_zone_release_pcpu(zone, queue, MAX_PCPU_PAGES / 2);
+        }
+    }
+
+    irq_restore(flags);
 }
 
 void __reclaim_page(struct page *new_page)
 {
     nr_global_pages.add_fetch(1, mem_order::release);
-    auto &node = main_node;
+    /* Not added to a node yet, so page_nids doesn't know about it */
+    auto &node = nodes[phys_to_nid((unsigned long) page_to_phys(new_page))];
     node.add_region((unsigned long) page_to_phys(new_page), PAGE_SIZE);
 }
 
@@ -697,10 +1667,7 @@ void page_node::free_page(struct page *p)
     unsigned long cpu_flags = spin_lock_irqsave(&node_lock);
 
     /* Reset the page */
-    p->flags = 0;
-    p->cache = nullptr;
-    p->next_un.next_allocation = nullptr;
-    p->ref = 0;
+    page_reset_for_free(p);
 
     /* Add it at the beginning since it might be fresh in the cache */
     // list_add(&p->page_allocator_node.list_node, &page_list);
@@ -721,7 +1688,7 @@ void page_node::free_page(struct page *p)
  */
 struct page *alloc_page_list(size_t nr_pages, unsigned int gfp_flags)
 {
-    return main_node.allocate_pages(nr_pages, gfp_flags);
+    return alloc_pages_list(nr_pages, gfp_flags);
 }
 
 /**
@@ -731,5 +1698,66 @@ struct page *alloc_page_list(size_t nr_pages, unsigned int gfp_flags)
  */
 void free_page_list(struct page *pages)
 {
-    free_pages(pages);
+    struct page *batch[PAGE_BULK_BATCH];
+    unsigned long nr = 0;
+
+    while (pages)
+    {
+        batch[nr++] = pages;
+        pages = pages->next_un.next_allocation;
+
+        if (nr == PAGE_BULK_BATCH)
+        {
+            free_pages_bulk(batch, nr);
+            nr = 0;
+        }
+    }
+
+    if (nr)
+        free_pages_bulk(batch, nr);
 }
+
+static bool page_zero_pools_refill()
+{
+    bool more = false;
+
+    for_every_node([&](page_node &node) -> bool {
+        node.for_every_zone([&](page_zone *zone) -> bool {
+            if (!zone->total_pages)
+                return true;
+            for (int mt = 0; mt < MIGRATE_PCPUTYPES; mt++)
+                more |= page_zone_refill_zero_pool(zone, mt);
+            return true;
+        });
+
+        return true;
+    });
+
+    return more;
+}
+
+static void kzerod(void *)
+{
+    while (true)
+    {
+        wait_for_event(&kzerod_wq, __atomic_load_n(&kzerod_wake_pending, __ATOMIC_RELAXED));
+        __atomic_store_n(&kzerod_wake_pending, false, __ATOMIC_RELAXED);
+
+        /* We run at the lowest priority, so everyone else gets to preempt us between batches */
+        while (page_zero_pools_refill())
+            ;
+    }
+}
+
+static void page_zero_pool_init()
+{
+    kzerod_thread = sched_create_thread(kzerod, THREAD_KERNEL, nullptr);
+    CHECK(kzerod_thread != nullptr);
+    kzerod_thread->priority = SCHED_PRIO_VERY_LOW;
+    sched_start_thread(kzerod_thread);
+
+    /* Fill up the pools for the first time */
+    kzerod_kick();
+}
+
+INIT_LEVEL_CORE_AFTER_SCHED_ENTRY(page_zero_pool_init);
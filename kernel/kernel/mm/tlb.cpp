@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2023 Pedro Falcato
+ * This file is part of Onyx, and is released under the terms of the MIT License
+ * check LICENSE at the root directory for more information
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <onyx/cpumask.h>
+#include <onyx/mm/mmu_gather.h>
+#include <onyx/paging.h>
+#include <onyx/percpu.h>
+#include <onyx/process.h>
+#include <onyx/smp.h>
+#include <onyx/vm.h>
+
+PER_CPU_VAR(unsigned long tlb_nr_invals) = 0;
+PER_CPU_VAR(unsigned long nr_tlb_shootdowns) = 0;
+PER_CPU_VAR(unsigned long tlb_nr_lazy_flushes) = 0;
+
+/* The address space last loaded on this CPU, and the tlb_gen we were in sync with when loading it.
+ * Used to detect shootdowns we skipped while lazily holding onto it.
+ */
+PER_CPU_VAR(mm_address_space *tlb_loaded_mm) = nullptr;
+PER_CPU_VAR(unsigned long tlb_loaded_gen) = 0;
+
+static inline bool is_higher_half(unsigned long address)
+{
+    return address >= VM_HIGHER_HALF;
+}
+
+void mmu_gather::add_range(mm_address_space *mm, unsigned long addr, size_t size, bool pin)
+{
+    const unsigned long end = addr + size;
+
+    /* Kernel ranges are global, regardless of what address space we were given */
+    if (is_higher_half(addr))
+    {
+        mm = &kernel_address_space;
+        pin = false;
+    }
+
+    for (unsigned int i = 0; i < nr_ranges; i++)
+    {
+        auto &range = ranges[i];
+        if (range.mm != mm)
+            continue;
+
+        if (addr <= range.end + MMU_GATHER_MERGE_GAP && end + MMU_GATHER_MERGE_GAP >= range.start)
+        {
+            range.start = addr < range.start ? addr : range.start;
+            range.end = end > range.end ? end : range.end;
+
+            if (pin && !range.pinned)
+            {
+                mm->ref();
+                range.pinned = true;
+            }
+
+            return;
+        }
+    }
+
+    if (nr_ranges == MMU_GATHER_MAX_RANGES)
+        flush();
+
+    if (pin)
+        mm->ref();
+
+    ranges[nr_ranges++] = mmu_gather_range{mm, addr, end, pin};
+}
+
+static void mmu_gather_invalidate(void *context)
+{
+    auto tlb = (mmu_gather *) context;
+    auto curr_thread = get_current_thread();
+
+    for (unsigned int i = 0; i < tlb->nr_ranges; i++)
+    {
+        const auto &range = tlb->ranges[i];
+
+        if (is_higher_half(range.start) ||
+            (curr_thread->owner && curr_thread->get_aspace() == range.mm))
+        {
+            paging_invalidate((void *) range.start, (range.end - range.start) >> PAGE_SHIFT);
+            add_per_cpu(tlb_nr_invals, 1);
+        }
+    }
+}
+
+void mmu_gather::flush()
+{
+    if (nr_ranges)
+    {
+        add_per_cpu(nr_tlb_shootdowns, 1);
+
+        auto our_cpu = get_cpu_nr();
+        cpumask mask;
+        bool global = false;
+
+        for (unsigned int i = 0; i < nr_ranges; i++)
+        {
+            if (is_higher_half(ranges[i].start))
+                global = true;
+            else
+                __atomic_add_fetch(&ranges[i].mm->tlb_gen, 1, __ATOMIC_RELAXED);
+        }
+
+        /* Pairs with the fence in mmu_tlb_catch_up. Either we see the CPU in the active mask
+         * and IPI it, or it sees our tlb_gen bump when loading the address space.
+         */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        if (global)
+            mask = cpumask::all_but_one(our_cpu);
+        else
+        {
+            for (unsigned int i = 0; i < nr_ranges; i++)
+                mask |= ranges[i].mm->active_mask;
+            mask.remove_cpu(our_cpu);
+        }
+
+        smp::sync_call_with_local(mmu_gather_invalidate, this, mask, mmu_gather_invalidate, this);
+
+        for (unsigned int i = 0; i < nr_ranges; i++)
+        {
+            if (ranges[i].pinned)
+                ranges[i].mm->unref();
+        }
+
+        nr_ranges = 0;
+    }
+
+    if (free_pages)
+    {
+        free_page_list(free_pages);
+        free_pages = nullptr;
+    }
+}
+
+/**
+ * @brief Catch up on shootdowns this CPU missed while holding \p mm lazily.
+ * Called when \p mm is loaded on the current CPU, after it gets set in the active mask.
+ *
+ * @param mm The address space being loaded
+ */
+void mmu_tlb_catch_up(mm_address_space *mm)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    const unsigned long gen = __atomic_load_n(&mm->tlb_gen, __ATOMIC_RELAXED);
+
+    /* If we're switching to a different address space, loading it already flushed the TLB. If
+     * not, we may have been skipped by shootdowns while running kernel threads on top of it.
+     */
+    if (get_per_cpu(tlb_loaded_mm) == mm && get_per_cpu(tlb_loaded_gen) != gen)
+    {
+        __native_tlb_invalidate_all();
+        add_per_cpu(tlb_nr_lazy_flushes, 1);
+    }
+
+    write_per_cpu(tlb_loaded_mm, mm);
+    write_per_cpu(tlb_loaded_gen, gen);
+}
+
+/**
+ * @brief Invalidates a memory range.
+ *
+ * @param addr The start of the memory range.
+ * @param pages The size of the memory range, in pages.
+ * @param mm The target address space.
+ */
+void mmu_invalidate_range(unsigned long addr, size_t pages, mm_address_space *mm)
+{
+    mmu_gather tlb;
+    tlb.add_range(mm, addr, pages << PAGE_SHIFT);
+}
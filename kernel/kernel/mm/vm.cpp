@@ -18,12 +18,16 @@
 #include <onyx/copy.h>
 #include <onyx/cpu.h>
 #include <onyx/dev.h>
+#include <onyx/exceptions.h>
 #include <onyx/file.h>
 #include <onyx/gen/trace_vm.h>
 #include <onyx/log.h>
+#include <onyx/mm/compaction.h>
 #include <onyx/mm/kasan.h>
+#include <onyx/mm/mmu_gather.h>
 #include <onyx/mm/slab.h>
 #include <onyx/mm/vm_object.h>
+#include <onyx/numa.h>
 #include <onyx/page.h>
 #include <onyx/pagecache.h>
 #include <onyx/paging.h>
@@ -1405,7 +1409,7 @@ int vm_mprotect_in_region(struct mm_address_space *as, struct vm_region *region,
 }
 
 void vm_do_mmu_mprotect(struct mm_address_space *as, void *address, size_t nr_pgs, int old_prots,
-                        int new_prots)
+                        int new_prots, mmu_gather &tlb)
 {
     void *addr = address;
 
@@ -1416,7 +1420,7 @@ void vm_do_mmu_mprotect(struct mm_address_space *as, void *address, size_t nr_pg
         address = (void *) ((unsigned long) address + PAGE_SIZE);
     }
 
-    vm_invalidate_range((unsigned long) addr, nr_pgs);
+    tlb.add_range(as, (unsigned long) addr, nr_pgs << PAGE_SHIFT);
 }
 
 /**
@@ -1436,6 +1440,9 @@ int vm_mprotect(struct mm_address_space *as, void *__addr, size_t size, int prot
     unsigned long limit = addr + size;
 
     scoped_mutex g{as->vm_lock};
+    /* Gather every region's invalidations into a single shootdown, issued before we drop vm_lock
+     */
+    mmu_gather tlb;
 
     while (addr < limit)
     {
@@ -1465,7 +1472,8 @@ int vm_mprotect(struct mm_address_space *as, void *__addr, size_t size, int prot
         if (st < 0)
             return st;
 
-        vm_do_mmu_mprotect(as, (void *) addr, to_shave_off >> PAGE_SHIFT, old_prots, new_prots);
+        vm_do_mmu_mprotect(as, (void *) addr, to_shave_off >> PAGE_SHIFT, old_prots, new_prots,
+                           tlb);
 
         addr += to_shave_off;
         size -= to_shave_off;
@@ -1961,7 +1969,20 @@ int vm_handle_page_fault(struct fault_info *info)
         use_kernel_as ? &kernel_address_space : get_current_address_space();
 
     if (sched_is_preemption_disabled())
+    {
+        /* User accesses done with preemption disabled (e.g under a spinlock) can't sleep to
+         * handle the fault, so they just fail with -EFAULT. Callers are expected to drop their
+         * locks, fault the page in and retry.
+         */
+        if (!info->user && !is_higher_half((void *) info->fault_address) &&
+            exceptions_get_fixup(info->ip) != NO_FIXUP_EXISTS)
+        {
+            info->signal = VM_SIGSEGV;
+            return -1;
+        }
+
         panic("Page fault while preemption was disabled\n");
+    }
     if (irq_is_disabled())
         panic("Page fault while IRQs were disabled\n");
 
@@ -2233,10 +2254,46 @@ ssize_t evict_write(void *buf, size_t size, off_t off)
     return size;
 }
 
+ssize_t compact_write(void *buf, size_t size, off_t off)
+{
+    if (size == 0)
+        return 0;
+
+    compact_all();
+    return size;
+}
+
+/* Reads from numa_stat - per-node page allocator statistics */
+ssize_t numa_stat_read(void *buffer, size_t size, off_t off)
+{
+    char buf[MAX_NUMA_NODES * 80];
+    size_t len = 0;
+
+    for (int i = 0; i < MAX_NUMA_NODES; i++)
+    {
+        struct memstat stat;
+        if (page_get_node_stats(i, &stat) < 0)
+            continue;
+        len += snprintf(buf + len, sizeof(buf) - len,
+                        "node%d total_pages %lu allocated_pages %lu\n", i, stat.total_pages,
+                        stat.allocated_pages);
+    }
+
+    if ((size_t) off >= len)
+        return 0;
+
+    size_t to_copy = cul::min(size, len - off);
+    if (copy_to_user(buffer, buf + off, to_copy) < 0)
+        return -EFAULT;
+    return to_copy;
+}
+
 static struct sysfs_object vm_obj;
 static struct sysfs_object aslr_control;
 static struct sysfs_object kmaps;
 static struct sysfs_object evict_obj;
+static struct sysfs_object numa_stat_obj;
+static struct sysfs_object compact_obj;
 
 /**
  * @brief Initialises sysfs nodes for the vm subsystem.
@@ -2262,6 +2319,14 @@ void vm_sysfs_init(void)
     evict_obj.write = evict_write;
     evict_obj.perms = 0644 | S_IFREG;
 
+    assert(sysfs_init_and_add("numa_stat", &numa_stat_obj, &vm_obj) == 0);
+    numa_stat_obj.read = numa_stat_read;
+    numa_stat_obj.perms = 0444 | S_IFREG;
+
+    assert(sysfs_init_and_add("compact", &compact_obj, &vm_obj) == 0);
+    compact_obj.write = compact_write;
+    compact_obj.perms = 0200 | S_IFREG;
+
     sysfs_add(&vm_obj, nullptr);
 }
 
@@ -2686,6 +2751,48 @@ int vm_add_region(struct mm_address_space *as, struct vm_region *region)
     return vm_insert_region(as, region);
 }
 
+/**
+ * @brief Unmaps the pages of every region overlapping [start, end) from the page tables.
+ * Invalidations and page table frees are gathered in \p tlb.
+ *
+ * @param as The target address space.
+ * @param start The start of the range.
+ * @param end The end of the range.
+ * @param tlb The mmu_gather to use.
+ */
+static void vm_mmu_unmap_regions(struct mm_address_space *as, unsigned long start,
+                                 unsigned long end, mmu_gather &tlb) REQUIRES(as->vm_lock)
+{
+    struct vm_region *region = vm_search(as, (void *) start, end - start);
+    if (!region)
+        return;
+
+    /* vm_search gives us any overlapping region, so rewind to the first one */
+    for (auto node = bst_prev(&as->region_tree, &region->tree_node); node;
+         node = bst_prev(&as->region_tree, node))
+    {
+        auto prev = container_of(node, vm_region, tree_node);
+        if (prev->base + (prev->pages << PAGE_SHIFT) <= start)
+            break;
+        region = prev;
+    }
+
+    for (struct bst_node *node = &region->tree_node; node;
+         node = bst_next(&as->region_tree, node))
+    {
+        region = container_of(node, vm_region, tree_node);
+        if (region->base >= end)
+            break;
+
+        unsigned long reg_end = region->base + (region->pages << PAGE_SHIFT);
+        unsigned long unmap_start = region->base < start ? start : region->base;
+        unsigned long unmap_end = reg_end < end ? reg_end : end;
+
+        vm_mmu_unmap(region->mm, (void *) unmap_start, (unmap_end - unmap_start) >> PAGE_SHIFT,
+                     &tlb);
+    }
+}
+
 int __vm_munmap(struct mm_address_space *as, void *__addr, size_t size) REQUIRES(as->vm_lock)
 {
     unsigned long aligned_start = (unsigned long) __addr & -PAGE_SIZE;
@@ -2697,6 +2804,15 @@ int __vm_munmap(struct mm_address_space *as, void *__addr, size_t size) REQUIRES
 
     size_t found = 0;
 
+    {
+        /* Tear down the page tables for the whole range first, with a single shootdown. Only
+         * then can we start truncating VMOs and destroying regions, as other CPUs may still be
+         * touching their pages through stale TLB entries until the shootdown completes.
+         */
+        mmu_gather tlb;
+        vm_mmu_unmap_regions(as, aligned_start, limit, tlb);
+    }
+
     while (true)
     {
         struct vm_region *region = vm_search(as, (void *) aligned_start, size);
@@ -2712,13 +2828,7 @@ int __vm_munmap(struct mm_address_space *as, void *__addr, size_t size) REQUIRES
 
         bool is_shared = is_mapping_shared(region);
 
-        unsigned long reg_len = region->pages << PAGE_SHIFT;
         unsigned long addr = region->base < aligned_start ? aligned_start : region->base;
-        unsigned long to_unmap = limit - addr < reg_len ? limit - addr : reg_len;
-
-        size_t pages_to_unmap = vm_size_to_pages(to_unmap);
-
-        vm_mmu_unmap(region->mm, (void *) addr, pages_to_unmap);
 
         size_t region_size = region->pages << PAGE_SHIFT;
 
@@ -3143,10 +3253,16 @@ out:
     return ret;
 }
 
-void vm_wp_page(struct mm_address_space *mm, void *vaddr)
+void vm_wp_page(struct mm_address_space *mm, void *vaddr, mmu_gather &tlb)
 {
     if (paging_write_protect(vaddr, mm))
-        mmu_invalidate_range((unsigned long) vaddr, 1, mm);
+    {
+        /* The gather may outlive our hold on vm_lock, so pin the address space. Address spaces
+         * that are already being torn down get no pin, as they can't be revived; they're kept
+         * alive by our caller anyway.
+         */
+        tlb.add_page(mm, (unsigned long) vaddr, !mm->is_ghost_object());
+    }
 }
 
 /**
@@ -3155,10 +3271,16 @@ void vm_wp_page(struct mm_address_space *mm, void *vaddr)
  * @param page The page that needs to be write-protected.
  * @param offset The offset of the page in the VMO.
  * @param vmo A pointer to its VMO.
+ * @param tlb If not null, TLB invalidations are gathered in \p tlb instead of being issued
+ * before returning.
  */
-void vm_wp_page_for_every_region(page *page, size_t page_off, vm_object *vmo)
+void vm_wp_page_for_every_region(page *page, size_t page_off, vm_object *vmo, mmu_gather *tlb)
 {
-    vmo->for_every_mapping([page_off](vm_region *region) NO_THREAD_SAFETY_ANALYSIS -> bool {
+    mmu_gather local_tlb;
+    if (!tlb)
+        tlb = &local_tlb;
+
+    vmo->for_every_mapping([page_off, tlb](vm_region *region) NO_THREAD_SAFETY_ANALYSIS -> bool {
         /* XXX Yuck. We can be called from such stacks such as ~mm_address_space() ->
          * dentry_destroy
          * -> inode_release -> inode_sync -> pagecache_set_dirty -> vm_wp_page_for_every_region.
@@ -3178,7 +3300,7 @@ void vm_wp_page_for_every_region(page *page, size_t page_off, vm_object *vmo)
         {
             /* The page is included in this mapping, so WP it */
             const unsigned long vaddr = region->base + (page_off - mapping_off);
-            vm_wp_page(region->mm, (void *) vaddr);
+            vm_wp_page(region->mm, (void *) vaddr, *tlb);
         }
 
         if (needs_release)
@@ -3416,6 +3538,7 @@ void vm_load_aspace(mm_address_space *aspace, unsigned int cpu)
     if (cpu == -1U) [[unlikely]]
         cpu = get_cpu_nr();
     aspace->active_mask.set_cpu_atomic(cpu);
+    mmu_tlb_catch_up(aspace);
 }
 
 /**
@@ -52,7 +52,7 @@ vm_object *vmo_create(size_t size, void *priv)
  */
 vmo_status_t vmo_commit_phys_page(vm_object *vmo, size_t off, page **ppage)
 {
-    struct page *p = alloc_page(0);
+    struct page *p = alloc_page(PAGE_ALLOC_MOVABLE);
     if (!p)
         return VMO_STATUS_OUT_OF_MEM;
 
@@ -177,7 +177,7 @@ vmo_status_t vmo_get(vm_object *vmo, size_t off, unsigned int flags, struct page
 
     if (!p && is_cow && !may_not_implicit_cow)
     {
-        struct page *new_page = alloc_page(PAGE_ALLOC_NO_ZERO);
+        struct page *new_page = alloc_page(PAGE_ALLOC_MOVABLE | PAGE_ALLOC_NO_ZERO);
         if (!new_page)
         {
             return VMO_STATUS_OUT_OF_MEM;
@@ -694,7 +694,7 @@ struct page *vmo_cow_on_page(vm_object *vmo, size_t off)
         return old_page;
     }
 
-    struct page *new_page = alloc_page(PAGE_ALLOC_NO_ZERO);
+    struct page *new_page = alloc_page(PAGE_ALLOC_MOVABLE | PAGE_ALLOC_NO_ZERO);
     if (!new_page)
         return nullptr;
 
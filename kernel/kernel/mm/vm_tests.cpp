@@ -6,7 +6,10 @@
  * SPDX-License-Identifier: MIT
  */
 
+#include <stdlib.h>
+
 #include <onyx/kunit.h>
+#include <onyx/page.h>
 #include <onyx/vm.h>
 
 // Internal vm.cpp interfaces
@@ -74,3 +77,34 @@ TEST(mmap, test_48_57_bit)
 }
 
 #endif
+
+static int page_ptr_cmp(const void *lhs, const void *rhs)
+{
+    auto a = *(struct page *const *) lhs;
+    auto b = *(struct page *const *) rhs;
+    return a < b ? -1 : a > b;
+}
+
+TEST(pagealloc, test_bulk_alloc)
+{
+    constexpr unsigned long nr_pages = 100;
+    struct page *pages[nr_pages];
+
+    auto nr = alloc_pages_bulk(nr_pages, 0, pages);
+    ASSERT_EQ(nr_pages, nr);
+
+    for (unsigned long i = 0; i < nr; i++)
+    {
+        EXPECT_EQ(1UL, pages[i]->ref);
+        // Zeroing was requested, whether the page came from the zero pool or not
+        for (unsigned long j = 0; j < PAGE_SIZE / sizeof(unsigned long); j++)
+            ASSERT_EQ(0UL, ((unsigned long *) PAGE_TO_VIRT(pages[i]))[j]);
+    }
+
+    // and every page should be unique
+    qsort(pages, nr, sizeof(struct page *), page_ptr_cmp);
+    for (unsigned long i = 1; i < nr; i++)
+        EXPECT_NE(pages[i - 1], pages[i]);
+
+    free_pages_bulk(pages, nr);
+}
@@ -11,6 +11,7 @@
 #include <net/if_arp.h>
 
 #include <onyx/byteswap.h>
+#include <onyx/clock.h>
 #include <onyx/dev.h>
 #include <onyx/init.h>
 #include <onyx/net/netif.h>
@@ -262,6 +263,10 @@ netif *netif_from_name(const char *name)
     return nullptr;
 }
 
+/* Max packets and time spent per NETRX softirq run */
+#define NETIF_RX_BUDGET      300
+#define NETIF_RX_TIME_BUDGET (2 * NS_PER_MS)
+
 struct rx_queue_percpu
 {
     struct list_head to_rx_list;
@@ -310,13 +315,25 @@ void netif_signal_rx(netif *nif)
     softirq_raise(softirq_vector::SOFTIRQ_VECTOR_NETRX);
 }
 
-void netif_do_rxpoll(netif *nif)
+/**
+ * @brief Poll a netif for received packets
+ *
+ * @param nif Netif
+ * @param budget Max number of packets to process
+ * @return Number of packets processed. If it's budget, the netif is still in RX poll mode and
+ * needs to be polled again.
+ */
+static int netif_do_rxpoll(netif *nif, int budget)
 {
+    int work = 0;
+
     __atomic_or_fetch(&nif->flags, NETIF_DOING_RX_POLL, __ATOMIC_RELAXED);
 
     while (true)
     {
-        nif->poll_rx(nif);
+        work += nif->poll_rx(nif, budget - work);
+        if (work >= budget)
+            break;
 
         unsigned int flags, og_flags;
 
@@ -338,24 +355,61 @@ void netif_do_rxpoll(netif *nif)
         if (!(flags & NETIF_DOING_RX_POLL))
             break;
     }
+
+    return work;
 }
 
-int netif_do_rx()
+/**
+ * @brief Process received packets for this CPU's netifs
+ * Stops after NETIF_RX_BUDGET packets or NETIF_RX_TIME_BUDGET ns. Netifs are polled round-robin,
+ * NETIF_RX_WEIGHT packets at a time.
+ *
+ * @return True if there's still work to do
+ */
+bool netif_do_rx()
 {
     auto queue = get_per_cpu_ptr(rx_queue);
+    const hrtime_t deadline = clocksource_get_time() + NETIF_RX_TIME_BUDGET;
+    int budget = NETIF_RX_BUDGET;
+    unsigned long flags;
 
-    scoped_lock g{queue->lock};
-
-    list_for_every (&queue->to_rx_list)
+    while (budget > 0)
     {
-        netif *n = container_of(l, netif, rx_queue_node);
+        flags = spin_lock_irqsave(&queue->lock);
+
+        if (list_is_empty(&queue->to_rx_list))
+        {
+            spin_unlock_irqrestore(&queue->lock, flags);
+            return false;
+        }
+
+        netif *n = container_of(list_first_element(&queue->to_rx_list), netif, rx_queue_node);
+        list_remove(&n->rx_queue_node);
+
+        spin_unlock_irqrestore(&queue->lock, flags);
+
+        /* Poll without the lock, so drivers may signal rx (for other netifs) from here */
+        const int weight = cul::min(budget, NETIF_RX_WEIGHT);
+        const int work = netif_do_rxpoll(n, weight);
+        budget -= work;
 
-        netif_do_rxpoll(n);
+        if (work >= weight)
+        {
+            /* Still has packets, give other netifs a turn first */
+            flags = spin_lock_irqsave(&queue->lock);
+            list_add_tail(&n->rx_queue_node, &queue->to_rx_list);
+            spin_unlock_irqrestore(&queue->lock, flags);
+        }
+
+        if (clocksource_get_time() >= deadline)
+            break;
     }
 
-    list_reset(&queue->to_rx_list);
+    flags = spin_lock_irqsave(&queue->lock);
+    bool more = !list_is_empty(&queue->to_rx_list);
+    spin_unlock_irqrestore(&queue->lock, flags);
 
-    return 0;
+    return more;
 }
 
 int netif_process_pbuf(netif *nif, packetbuf *buf)
@@ -524,6 +524,11 @@ struct file_ops socket_ops = {
     .poll = socket_poll,
 };
 
+bool file_is_socket(struct file *f)
+{
+    return f->f_ino->i_fops->write == socket_write;
+}
+
 auto_file get_socket_fd(int fd)
 {
     struct file *desc = get_file_description(fd);
@@ -976,17 +981,21 @@ int copy_sockaddr(const sockaddr *kaddr, socklen_t kaddrlen, sockaddr *uaddr, so
     return 0;
 }
 
-int sys_accept4(int sockfd, struct sockaddr *addr, socklen_t *slen, int flags)
+/**
+ * @brief Accept a connection on a listening socket and open a file descriptor for it
+ *
+ * @param f Socket file
+ * @param addr User pointer to the peer's address (may be null)
+ * @param slen User pointer to the address length
+ * @param flags accept4 flags
+ * @param fflags File flags to accept with (O_NONBLOCK makes it not block)
+ * @return New file descriptor, or negative error code
+ */
+int socket_accept_file(struct file *f, struct sockaddr *addr, socklen_t *slen, int flags,
+                       unsigned int fflags)
 {
     int st = 0;
-    if (flags & ~ACCEPT4_VALID_FLAGS)
-        return -EINVAL;
-
-    auto f = get_socket_fd(sockfd);
-    if (!f)
-        return -errno;
-
-    socket *sock = file_to_socket(f.get_file());
+    socket *sock = file_to_socket(f);
     socket *new_socket = nullptr;
     inode *inode = nullptr;
     file *newf = nullptr;
@@ -1004,7 +1013,7 @@ int sys_accept4(int sockfd, struct sockaddr *addr, socklen_t *slen, int flags)
         goto out;
     }
 
-    new_socket = sock->accept(f.get_file()->f_flags);
+    new_socket = sock->accept(fflags);
 
     if (!new_socket)
     {
@@ -1064,6 +1073,18 @@ out:
     return st;
 }
 
+int sys_accept4(int sockfd, struct sockaddr *addr, socklen_t *slen, int flags)
+{
+    if (flags & ~ACCEPT4_VALID_FLAGS)
+        return -EINVAL;
+
+    auto f = get_socket_fd(sockfd);
+    if (!f)
+        return -errno;
+
+    return socket_accept_file(f.get_file(), addr, slen, flags, f.get_file()->f_flags);
+}
+
 int sys_accept(int sockfd, struct sockaddr *addr, socklen_t *slen)
 {
     return sys_accept4(sockfd, addr, slen, 0);
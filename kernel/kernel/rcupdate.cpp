@@ -4,9 +4,15 @@
  *
  * SPDX-License-Identifier: LGPL-2.0-only
  */
+#include <assert.h>
+
 #include <onyx/clock.h>
 #include <onyx/cpumask.h>
 #include <onyx/gen/trace_rcupdate.h>
+#include <onyx/init.h>
+#include <onyx/mm/slab.h>
+#include <onyx/mutex.h>
+#include <onyx/page.h>
 #include <onyx/percpu.h>
 #include <onyx/rcupdate.h>
 #include <onyx/scheduler.h>
@@ -14,12 +20,14 @@
 #include <onyx/smp.h>
 #include <onyx/softirq.h>
 #include <onyx/spinlock.h>
+#include <onyx/thread.h>
 #include <onyx/wait.h>
 
 // clang-format off
 /* Implementation of classic RCU as in OLS2001 ("Read-Copy Update"), Paul McKenney's RCU
  * dissertation and various early RCU articles on lwn
- * (https://lwn.net/Kernel/Index/#Read-copy-update).
+ * (https://lwn.net/Kernel/Index/#Read-copy-update), with hierarchical quiescent state reporting
+ * borrowed from Linux's tree RCU.
  * Essentially, the algorithm works like this:
  * rcu_read_lock() and rcu_read_unlock() are non-preemptible sections. Context switches are
  * quiescent states. This minimizes reader overhead to a non-atomic pcpu add.
@@ -34,20 +42,30 @@
  * in one scheduler slice.
  *
  * The RCU global state consists of:
-   struct rcu_ctrlblk
+   struct rcu_state
     {
-        spinlock lock;
-        1) A lock, protecting rcu_ctrlblk from concurrent changes.
         unsigned long curgen;
-        2) The current gen/batch number that is being processed
+        1) The current gen/batch number that is being processed
         unsigned long maxgen;
-        3) The maximum gen/batch number that any given CPU on the system is on.
+        2) The maximum gen/batch number that any given CPU on the system is on.
            This is set in rcu_start_batch. If curgen > maxgen, we don't have grace periods to
            process.
-        cpumask mask __align_cache;
-        4) CPU mask that represents CPUs that have still not gone through a quiescent state since
-           the grace period started.
     };
+ * Both are protected by the root rcu_node's lock.
+ * CPUs that have still not gone through a quiescent state since the grace period started are
+ * tracked in a two-level tree of rcu_nodes. Each leaf covers RCU_FANOUT_LEAF CPUs, and the root
+ * has a bit for each leaf:
+   struct rcu_node
+    {
+        spinlock lock;
+        unsigned long qsmask;
+        1) Mask of CPUs (in a leaf) or leaves (in the root) that have not reported a quiescent
+           state this grace period.
+    };
+ * A CPU reports its quiescent state by clearing its bit in its leaf, under the leaf's lock. Only
+ * the last CPU of each leaf goes up and touches the root, which ends the grace period once its own
+ * mask is empty. This way, CPUs only contend with their RCU_FANOUT_LEAF - 1 siblings, instead of
+ * with every CPU on the system.
  *
  * Each CPU then has its own local state, rcu_pcpublk:
  *
@@ -55,19 +73,24 @@
     {
         unsigned long gen;
         1) The gen/batch this CPU is on, set in rcu_try_batch.
-        struct rcu_cblist current, next;
-        2) Singly linked lists of rcu_heads for current callbacks and next callbacks.
-           Current callbacks are cbs that *may* need processing right now, if we have gone through
-           gen. Next callbacks are queued up in call_rcu and are moved to current when we try to
-           start a batch.
+        struct rcu_cblist current, next, done;
+        2) Singly linked lists of rcu_heads for current callbacks, next callbacks and done
+           callbacks. Current callbacks are cbs that *may* need processing right now, if we have
+           gone through gen. Next callbacks are queued up in call_rcu and are moved to current when
+           we try to start a batch. Done callbacks have gone through their grace period and are
+           waiting for the CPU's rcuo thread.
     };
  * All the queiscent state code runs under softirq, as soon as possible, actioned by rcu_do_quiesc
- * (called by the scheduler) if need be.
- * To attempt to limit latency, we keep a 'onetime_processed_limit' for a
- * limit of callbacks to process at once, as softirq steals time from scheduler threads.
+ * (called by the scheduler) if need be. Callbacks themselves are offloaded to a per-cpu rcuo
+ * kthread, so arbitrarily long batches of callbacks run preemptibly, competing with everything else
+ * instead of stealing time from the scheduler's threads.
  * When call_rcu notices that the 'next' list is getting too long, it attempts to force a
  * queiscent state on the current thread as soon as possible.
  *
+ * Updaters that can't afford to wait for a regular grace period use synchronize_rcu_expedited,
+ * which IPIs every other CPU instead of waiting for them to context switch. See
+ * synchronize_rcu_expedited below.
+ *
  * This RCU implementation is annotated with tracepoints you can use to collect data from userspace.
  *
  * Example of a grace period:
@@ -81,20 +104,25 @@
  *  \- rcu_work()                    |                                  |
  *   \- rcu_try_batch()              |                                  |
  *    \- GP started, wait-           | rcu_check_quiescent_state()      |
- *       iting for all CPUs.         |  \- 1 is cleared off the mask,   |
+ *       iting for all CPUs.         |  \- 1 is cleared off the leaf,   |
  *   \- rcu_check_quiescent_state()  |     0 and 2 pending.             |
- *    \- 0 is cleared off the mask.  |                                  |
+ *    \- 0 is cleared off the leaf.  |                                  |
  *                                   |                                  | rcu_check_quiescent_state()
- *                                   |                                  |  \- 3 is cleared off the mask
- *                                   |                                  |    \- mask is empty, advancing gen and
- *                                   |                                  |       attempting to start a new batch.
+ *                                   |                                  |  \- 2 is cleared off the leaf
+ *                                   |                                  |    \- leaf is empty, clear it off the
+ *                                   |                                  |       root. root is empty, advancing gen
+ *                                   |                                  |       and attempting to start a new batch.
  *                                   |                                  |      \- gen > maxgen, no new GP to be started
  * rcu_do_quiesc()                   |                                  |
  *  \- RCU softirq raised            |                                  |
  *    .                              |                                  |
  * softirq_handle()                  |                                  |
  *  \- rcu_work()                    |                                  |
- *   \- rcu_do_callbacks()           |                                  |
+ *   \- rcu_offload_callbacks()      |                                  |
+ *    \- rcuo/0 woken up             |                                  |
+ *    .                              |                                  |
+ * rcu_cb_thread()                   |                                  |
+ *  \- rcu_do_callbacks()            |                                  |
  */
 // clang-format on
 
@@ -108,24 +136,61 @@
 #endif
 
 /**
- * @brief Global RCU control block data
+ * @brief Global RCU state
+ * Protected by the root node's lock.
  *
- * @lock: Lock that protects the whole data structure
  * @curgen: Current generation/batch we are 'on'.
  * @maxgen: Maximum generation on all CPUs.
- * @mask: Mask of CPUs that have not gone through a quiescent state this grace period.
  */
-struct rcu_ctrlblk
+struct rcu_state
 {
-    spinlock lock;
     unsigned long curgen;
     unsigned long maxgen;
-    cpumask mask __align_cache;
+};
+
+/**
+ * @brief Node in the quiescent state tree
+ *
+ * @lock: Lock that protects qsmask
+ * @qsmask: CPUs (leaves) or leaves (root) that have not reported a quiescent state this grace
+ * period.
+ */
+struct rcu_node
+{
+    spinlock lock;
+    unsigned long qsmask;
 } __align_cache;
 
+/* Each leaf covers 16 CPUs, and the root covers up to 64 leaves (1024 CPUs) */
+#define RCU_FANOUT_LEAF 16
+#define RCU_FANOUT      (sizeof(unsigned long) * 8)
+#define RCU_NR_LEAVES   ((CONFIG_SMP_NR_CPUS + RCU_FANOUT_LEAF - 1) / RCU_FANOUT_LEAF)
+/* Small systems get a single node that's both the root and the leaf */
+#define RCU_NR_NODES (RCU_NR_LEAVES > 1 ? RCU_NR_LEAVES + 1 : 1)
+
+static_assert(RCU_NR_LEAVES <= RCU_FANOUT, "CONFIG_SMP_NR_CPUS is too large for the RCU tree");
+
 const int onetime_processed_limit = 10000;
 
-static struct rcu_ctrlblk rcp;
+static struct rcu_state rcu_state;
+static struct rcu_node rcu_nodes[RCU_NR_NODES];
+
+#define rcu_root_node (&rcu_nodes[0])
+
+static inline struct rcu_node *rcu_leaf_node(unsigned int cpu)
+{
+    if (RCU_NR_NODES == 1)
+        return rcu_root_node;
+    return &rcu_nodes[1 + cpu / RCU_FANOUT_LEAF];
+}
+
+/* kfree_rcu without a batch stashes the rcu_head's offset in func. No function lives this low. */
+#define RCU_KFREE_MAX_OFFSET 4096
+
+static inline bool rcu_is_kfree_offset(void (*func)(struct rcu_head *))
+{
+    return (unsigned long) func < RCU_KFREE_MAX_OFFSET;
+}
 
 struct rcu_cblist
 {
@@ -168,7 +233,11 @@ struct rcu_cblist
                 break;
             processed++;
             struct rcu_head *next = it->next;
-            it->func(it);
+
+            if (rcu_is_kfree_offset(it->func))
+                kfree((char *) it - (unsigned long) it->func);
+            else
+                it->func(it);
 
             it = next;
         }
@@ -204,72 +273,163 @@ struct rcu_cblist
     }
 };
 
+#define KFREE_RCU_BATCH_SIZE 60
+
+/**
+ * @brief Batch of kfree_rcu pointers, freed together after a single grace period
+ *
+ * @head: rcu_head for the whole batch
+ * @nr: Number of pointers
+ * @ptrs: Pointers to kfree
+ */
+struct kfree_rcu_batch
+{
+    struct rcu_head head;
+    unsigned int nr;
+    void *ptrs[KFREE_RCU_BATCH_SIZE];
+};
+
+static struct slab_cache *kfree_rcu_cache;
+
 /**
  * @brief RCU percpu data
  *
  * @gen: Generation this CPU is currently on
  * @current: List of callbacks pertaining to this generation
  * @next: List of callbacks pertaining to next generations
+ * @done: List of callbacks that went through their grace period, waiting for cbthread
+ * @cbthread: This CPU's rcuo thread, that invokes done callbacks
+ * @kfree_batch: kfree_rcu batch being filled up, queued on the next batch
  */
 struct rcu_pcpublk
 {
     unsigned long gen;
-    struct rcu_cblist current, next;
+    struct rcu_cblist current, next, done;
+    struct thread *cbthread;
+    struct kfree_rcu_batch *kfree_batch;
 };
 
 PER_CPU_VAR(struct rcu_pcpublk rcu_percpu);
 
+/* Expedited grace periods, see synchronize_rcu_expedited */
+static DECLARE_MUTEX(rcu_exp_lock);
+static unsigned long rcu_exp_seq;
+static unsigned long rcu_exp_pending;
+static PER_CPU_VAR(bool rcu_exp_need_qs);
+
 /**
  * @brief Attempt to start an RCU batch
  *
  * A batch is only started if we're not in one, or if curgen > maxgen.
- * If it is indeed started, rcp.mask is set to the online cpu mask.
+ * If it is indeed started, every leaf's qsmask is set to its online CPUs, and the root's to
+ * the leaves that have any.
  *
- * @param rpb Current CPU's RCU data
  * @param new_max New maximum generation
  */
-static void rcu_start_batch(struct rcu_pcpublk *rpb, unsigned long new_max)
+static void rcu_start_batch(unsigned long new_max)
 {
-    MUST_HOLD_LOCK(&rcp.lock);
+    struct rcu_node *root = rcu_root_node;
+    MUST_HOLD_LOCK(&root->lock);
 
-    if (rcp.maxgen < new_max)
-        rcp.maxgen = new_max;
+    if (rcu_state.maxgen < new_max)
+        rcu_state.maxgen = new_max;
 
     // If curgen > maxgen, there are no callbacks to be processed
-    if (rcp.curgen > rcp.maxgen)
+    if (rcu_state.curgen > rcu_state.maxgen)
         return;
 
     // We may not start a batch if we're already in one
-    if (!rcp.mask.is_empty())
+    if (root->qsmask)
         return;
 
-    TRACE_EVENT(rcu_grace_period_begin, rcp.curgen, rcp.maxgen);
-    rcp.mask = smp::get_online_cpumask();
+    TRACE_EVENT(rcu_grace_period_begin, rcu_state.curgen, rcu_state.maxgen);
+
+    const cpumask online = smp::get_online_cpumask();
+    unsigned long leafmask[RCU_NR_LEAVES] = {};
+
+    for (unsigned int i = 0; i < get_nr_cpus(); i++)
+    {
+        if (online.is_cpu_set(i))
+            leafmask[i / RCU_FANOUT_LEAF] |= 1UL << (i % RCU_FANOUT_LEAF);
+    }
+
+    if (RCU_NR_NODES == 1)
+    {
+        __atomic_store_n(&root->qsmask, leafmask[0], __ATOMIC_RELAXED);
+        return;
+    }
+
+    unsigned long rootmask = 0;
+
+    for (unsigned int i = 0; i < RCU_NR_LEAVES; i++)
+    {
+        if (!leafmask[i])
+            continue;
+
+        // CPUs of a leaf may report as soon as we drop its lock. The ones that empty it wait for
+        // us on the root's lock.
+        struct rcu_node *leaf = &rcu_nodes[1 + i];
+        scoped_lock g{leaf->lock};
+        __atomic_store_n(&leaf->qsmask, leafmask[i], __ATOMIC_RELAXED);
+        rootmask |= 1UL << i;
+    }
+
+    __atomic_store_n(&root->qsmask, rootmask, __ATOMIC_RELAXED);
 }
 
 __always_inline bool rcu_has_callbacks(rcu_pcpublk *rpb)
 {
     // Current can be !is_empty for a variety of reasons, including if we tried to start a batch
     // without actually starting it. As such, we can only process callbacks if we have gone through
-    // the grace period in ctrlblk.
-    return rcp.curgen > rpb->gen && !rpb->current.is_empty();
+    // the grace period in rcu_state.
+    return __atomic_load_n(&rcu_state.curgen, __ATOMIC_RELAXED) > rpb->gen &&
+           !rpb->current.is_empty();
 }
 
 __always_inline bool rcu_has_batch(rcu_pcpublk *rpb)
 {
-    return rpb->current.is_empty() && !rpb->next.is_empty();
+    return rpb->current.is_empty() && (!rpb->next.is_empty() || rpb->kfree_batch);
 }
 
-static void rcu_do_callbacks(rcu_pcpublk *rpb)
+__always_inline bool rcu_cpu_needs_qs(unsigned int cpu)
+{
+    struct rcu_node *leaf = rcu_leaf_node(cpu);
+    return __atomic_load_n(&leaf->qsmask, __ATOMIC_RELAXED) & (1UL << (cpu % RCU_FANOUT_LEAF));
+}
+
+static void rcu_do_callbacks(struct rcu_cblist *list)
 {
     int processed = 0;
     u64 __trace_timestamp = trace_rcu_rcu_do_callbacks_enabled() ? clocksource_get_time() : 0;
-    processed = rpb->current.call_cbs();
+    processed = list->call_cbs();
 
     if (__trace_timestamp)
         trace_rcu_rcu_do_callbacks(__trace_timestamp, processed);
 }
 
+/**
+ * @brief Hand this CPU's ready callbacks to its rcuo thread
+ * Callbacks get invoked right here until the rcuo threads are up.
+ *
+ * @param rpb Current CPU's RCU data
+ */
+static void rcu_offload_callbacks(rcu_pcpublk *rpb)
+{
+    struct thread *t = __atomic_load_n(&rpb->cbthread, __ATOMIC_ACQUIRE);
+
+    if (!t) [[unlikely]]
+    {
+        rcu_do_callbacks(&rpb->current);
+        return;
+    }
+
+    unsigned long flags = irq_save_and_disable();
+    rpb->current.splice_onto(&rpb->done);
+    irq_restore(flags);
+
+    thread_wake_up(t);
+}
+
 /**
  * @brief Try to start a new RCU batch
  *
@@ -279,33 +439,108 @@ static void rcu_do_callbacks(rcu_pcpublk *rpb)
  */
 static void rcu_try_batch(rcu_pcpublk *rpb)
 {
-    scoped_lock g{rcp.lock};
+    unsigned long flags = irq_save_and_disable();
+
+    // Whatever kfree_rcu batched up so far goes in this batch
+    if (rpb->kfree_batch)
+    {
+        rpb->next.add(&rpb->kfree_batch->head);
+        rpb->kfree_batch = nullptr;
+    }
+
     rpb->next.splice_onto(&rpb->current);
+    irq_restore(flags);
+
+    scoped_lock g{rcu_root_node->lock};
     // Take our gen counter to the next batch
-    rpb->gen = rcp.curgen + 1;
-    rcu_start_batch(rpb, rpb->gen);
+    rpb->gen = rcu_state.curgen + 1;
+    rcu_start_batch(rpb->gen);
 }
 
-static void rcu_check_quiescent_state(rcu_pcpublk *rpb)
+/**
+ * @brief Report a quiescent state for a CPU
+ * Clears the CPU off its leaf, and propagates it up to the root if the leaf is now empty.
+ * The last report ends the grace period.
+ *
+ * @param cpu CPU
+ */
+static void rcu_report_qs(unsigned int cpu)
 {
-    unsigned int curr = get_cpu_nr();
+    struct rcu_node *rnp = rcu_leaf_node(cpu);
+    unsigned long mask = 1UL << (cpu % RCU_FANOUT_LEAF);
 
-    if (!rcp.mask.is_cpu_set(curr))
-        return;
+    spin_lock(&rnp->lock);
 
-    scoped_lock g{rcp.lock};
+    if (!(rnp->qsmask & mask))
+    {
+        // Someone beat us to it (or the grace period was already over)
+        spin_unlock(&rnp->lock);
+        return;
+    }
 
-    rcp.mask.remove_cpu(curr);
+    __atomic_store_n(&rnp->qsmask, rnp->qsmask & ~mask, __ATOMIC_RELAXED);
     TRACE_EVENT(rcu_ack_grace_period);
 
-    if (rcp.mask.is_empty())
+    if (rnp->qsmask)
     {
-        TRACE_EVENT(rcu_grace_period_end);
-        // Attempt to start a new batch by incrementing the current gen and calling rcu_start_batch
-        // with maxgen.
-        rcp.curgen++;
-        rcu_start_batch(rpb, rcp.maxgen);
+        spin_unlock(&rnp->lock);
+        return;
     }
+
+    if (rnp != rcu_root_node)
+    {
+        // We were the last CPU in the leaf. Nothing can refill it until the root is empty, so we
+        // can safely let go of it before going up.
+        spin_unlock(&rnp->lock);
+
+        mask = 1UL << (rnp - &rcu_nodes[1]);
+        rnp = rcu_root_node;
+        spin_lock(&rnp->lock);
+
+        __atomic_store_n(&rnp->qsmask, rnp->qsmask & ~mask, __ATOMIC_RELAXED);
+
+        if (rnp->qsmask)
+        {
+            spin_unlock(&rnp->lock);
+            return;
+        }
+    }
+
+    TRACE_EVENT(rcu_grace_period_end);
+    // Attempt to start a new batch by incrementing the current gen and calling rcu_start_batch
+    // with maxgen.
+    __atomic_store_n(&rcu_state.curgen, rcu_state.curgen + 1, __ATOMIC_RELAXED);
+    rcu_start_batch(rcu_state.maxgen);
+
+    spin_unlock(&rnp->lock);
+}
+
+static void rcu_check_quiescent_state(unsigned int cpu)
+{
+    if (!rcu_cpu_needs_qs(cpu))
+        return;
+
+    rcu_report_qs(cpu);
+}
+
+static void rcu_exp_report()
+{
+    if (__atomic_sub_fetch(&rcu_exp_pending, 1, __ATOMIC_ACQ_REL) == 0)
+        wake_address(&rcu_exp_pending);
+}
+
+/**
+ * @brief Report an expedited quiescent state that the IPI had to defer
+ * Runs from the RCU softirq, which only ever runs outside read-side critical sections.
+ *
+ */
+static void rcu_exp_report_deferred()
+{
+    if (!get_per_cpu(rcu_exp_need_qs))
+        return;
+
+    write_per_cpu(rcu_exp_need_qs, false);
+    rcu_exp_report();
 }
 
 /**
@@ -318,11 +553,13 @@ void rcu_work()
     // This runs under softirq
     rcu_pcpublk *rpb = get_per_cpu_ptr(rcu_percpu);
 
+    rcu_exp_report_deferred();
+
     if (rcu_has_callbacks(rpb))
-        rcu_do_callbacks(rpb);
+        rcu_offload_callbacks(rpb);
     if (rcu_has_batch(rpb))
         rcu_try_batch(rpb);
-    rcu_check_quiescent_state(rpb);
+    rcu_check_quiescent_state(get_cpu_nr());
 }
 
 /**
@@ -340,10 +577,12 @@ void rcu_do_quiesc()
      *    callbacks to process.
      * 2) current is empty but next isn't - we have callbacks to process, so we're going to try and
      *    start a batch if possible
-     * 3) our cpu is set in rcp.mask - we have a quiescent state to process
+     * 3) our cpu is set in our leaf - we have a quiescent state to process
+     * 4) an expedited grace period is waiting on us
      */
 
-    if (rcu_has_callbacks(rpb) || rcu_has_batch(rpb) || rcp.mask.is_cpu_set(get_cpu_nr()))
+    if (rcu_has_callbacks(rpb) || rcu_has_batch(rpb) || rcu_cpu_needs_qs(get_cpu_nr()) ||
+        get_per_cpu(rcu_exp_need_qs))
         softirq_raise(SOFTIRQ_VECTOR_RCU);
 }
 
@@ -369,6 +608,56 @@ void call_rcu(struct rcu_head *head, void (*callback)(struct rcu_head *))
     irq_restore(flags);
 }
 
+static void kfree_rcu_batch_free(struct rcu_head *head)
+{
+    struct kfree_rcu_batch *batch = container_of(head, struct kfree_rcu_batch, head);
+
+    for (unsigned int i = 0; i < batch->nr; i++)
+        kfree(batch->ptrs[i]);
+
+    kmem_cache_free(kfree_rcu_cache, batch);
+}
+
+void __kfree_rcu(struct rcu_head *head, unsigned long offset)
+{
+    DCHECK(offset < RCU_KFREE_MAX_OFFSET);
+
+    // Disabling preemption keeps the RCU softirq (and thus rcu_try_batch) away from our batch
+    sched_disable_preempt();
+
+    rcu_pcpublk *rpb = get_per_cpu_ptr(rcu_percpu);
+    struct kfree_rcu_batch *batch = rpb->kfree_batch;
+
+    if (!batch && kfree_rcu_cache)
+    {
+        batch = (struct kfree_rcu_batch *) kmem_cache_alloc(kfree_rcu_cache, GFP_KERNEL);
+        if (batch)
+        {
+            batch->head.func = kfree_rcu_batch_free;
+            batch->nr = 0;
+            rpb->kfree_batch = batch;
+        }
+    }
+
+    if (!batch) [[unlikely]]
+    {
+        sched_enable_preempt();
+        // No memory for a batch (or too early), queue it by itself
+        call_rcu(head, (void (*)(struct rcu_head *)) offset);
+        return;
+    }
+
+    batch->ptrs[batch->nr++] = (char *) head - offset;
+
+    if (batch->nr == KFREE_RCU_BATCH_SIZE)
+    {
+        rpb->kfree_batch = nullptr;
+        call_rcu(&batch->head, kfree_rcu_batch_free);
+    }
+
+    sched_enable_preempt();
+}
+
 void synchronize_rcu()
 {
     struct sync_token
@@ -395,3 +684,108 @@ void synchronize_rcu()
 
     DCHECK(token.wake == 1);
 }
+
+static void rcu_exp_ipi(void *ctx)
+{
+    // We interrupted whatever this CPU was doing. Read-side critical sections are preempt-disabled
+    // sections, so if preemption was enabled, the CPU is quiescent right now.
+    if (!sched_is_preemption_disabled())
+    {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        return;
+    }
+
+    // Possibly in a reader. The RCU softirq can only run once preemption gets re-enabled, at
+    // which point the CPU has left any read-side critical section it was in.
+    write_per_cpu(rcu_exp_need_qs, true);
+    __atomic_add_fetch(&rcu_exp_pending, 1, __ATOMIC_RELAXED);
+    softirq_raise(SOFTIRQ_VECTOR_RCU);
+}
+
+/**
+ * @brief Wait for a grace period, expedited
+ * Instead of waiting for every CPU to context switch, IPI every other CPU and check if it's in a
+ * read-side critical section. CPUs that are report as soon as they leave it.
+ * This is a lot more expensive than synchronize_rcu (for the whole system), but returns in
+ * roughly the time it takes for the longest reader to finish.
+ *
+ */
+void synchronize_rcu_expedited()
+{
+    TRACE_EVENT_DURATION(rcu_synchronize_rcu_expedited);
+    const unsigned long snap = __atomic_load_n(&rcu_exp_seq, __ATOMIC_ACQUIRE);
+
+    scoped_mutex g{rcu_exp_lock};
+
+    // Expedited grace periods are serialized by rcu_exp_lock. If two of them finished since we
+    // got here, the second one started after us, and it's as good as ours.
+    if (rcu_exp_seq - snap >= 2)
+        return;
+
+    // The bias is ours, dropped once every CPU has seen the IPI
+    rcu_exp_pending = 1;
+
+    // We're not in a read-side critical section ourselves, so leave us out
+    cpumask mask = smp::get_online_cpumask();
+    mask.remove_cpu(get_cpu_nr());
+
+    smp::sync_call(rcu_exp_ipi, nullptr, mask);
+
+    rcu_exp_report();
+
+    wait_for(
+        &rcu_exp_pending,
+        [](void *ptr) -> bool {
+            return __atomic_load_n((unsigned long *) ptr, __ATOMIC_ACQUIRE) == 0;
+        },
+        WAIT_FOR_FOREVER, 0);
+
+    __atomic_store_n(&rcu_exp_seq, rcu_exp_seq + 1, __ATOMIC_RELEASE);
+}
+
+static void rcu_cb_thread(void *arg)
+{
+    rcu_pcpublk *rpb = (rcu_pcpublk *) arg;
+    struct rcu_cblist list = {};
+
+    while (true)
+    {
+        set_current_state(THREAD_UNINTERRUPTIBLE);
+
+        unsigned long flags = irq_save_and_disable();
+        rpb->done.splice_onto(&list);
+        irq_restore(flags);
+
+        if (list.is_empty())
+        {
+            sched_yield();
+            continue;
+        }
+
+        set_current_state(THREAD_RUNNABLE);
+
+        // We're preemptible, no need to hold back
+        while (!list.is_empty())
+            rcu_do_callbacks(&list);
+    }
+}
+
+static void rcu_init()
+{
+    kfree_rcu_cache =
+        kmem_cache_create("kfree_rcu_batch", sizeof(struct kfree_rcu_batch), 0, 0, nullptr);
+    assert(kfree_rcu_cache != nullptr);
+
+    for (unsigned int i = 0; i < get_nr_cpus(); i++)
+    {
+        rcu_pcpublk *rpb = get_per_cpu_ptr_any(rcu_percpu, i);
+        struct thread *t = sched_create_thread(rcu_cb_thread, THREAD_KERNEL, rpb);
+        assert(t != nullptr);
+        sched_start_thread_for_cpu(t, i);
+
+        // Until now, the softirq ran the callbacks itself
+        __atomic_store_n(&rpb->cbthread, t, __ATOMIC_RELEASE);
+    }
+}
+
+INIT_LEVEL_CORE_AFTER_SCHED_ENTRY(rcu_init);
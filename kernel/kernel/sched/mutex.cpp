@@ -9,6 +9,7 @@
 
 #include <onyx/compiler.h>
 #include <onyx/cpu.h>
+#include <onyx/lockstat.h>
 #include <onyx/mutex.h>
 #include <onyx/panic.h>
 #include <onyx/rcupdate.h>
@@ -122,11 +123,19 @@ static bool mutex_spin(mutex *lock)
     return success;
 }
 
-bool mutex_trylock(mutex *lock)
+__always_inline bool __mutex_trylock_any(mutex *lock)
 {
     return __mutex_trylock_fastpath(lock) || __mutex_trylock(lock);
 }
 
+bool mutex_trylock(mutex *lock)
+{
+    if (!__mutex_trylock_any(lock))
+        return false;
+    lockstat_acquired(LOCKSTAT_HOLD(lock), LOCKSTAT_RET_IP(), LOCKSTAT_MUTEX, 0, 0);
+    return true;
+}
+
 static void mutex_prepare_sleep(struct mutex *mutex, int state, struct mutex_waiter *waiter)
 {
     MUST_HOLD_LOCK(&mutex->llock);
@@ -205,33 +214,46 @@ int mutex_lock_slow_path(struct mutex *mutex, int state)
     return ret;
 }
 
-static inline void mutex_postlock(mutex *mtx)
+static inline void mutex_postlock(mutex *mtx, unsigned long ip, unsigned int lockstat_flags,
+                                  u64 wait_start)
 {
+    lockstat_acquired(LOCKSTAT_HOLD(mtx), ip, LOCKSTAT_MUTEX, lockstat_flags, wait_start);
 }
 
-__always_inline int __mutex_lock(struct mutex *mutex, int state)
+__always_inline int __mutex_lock(struct mutex *mutex, int state, unsigned long ip)
     ACQUIRE(mutex) NO_THREAD_SAFETY_ANALYSIS
 {
     MAY_SLEEP();
     int ret = 0;
-    if (!mutex_trylock(mutex)) [[unlikely]]
+    unsigned int lockstat_flags = 0;
+    u64 wait_start = 0;
+
+    if (!__mutex_trylock_any(mutex)) [[unlikely]]
+    {
+        wait_start = lockstat_wait_start();
+        lockstat_flags = LOCKSTAT_CONTENDED | LOCKSTAT_SPUN;
+
         if (!mutex_spin(mutex)) [[unlikely]]
+        {
+            lockstat_flags = LOCKSTAT_CONTENDED;
             ret = mutex_lock_slow_path(mutex, state);
+        }
+    }
 
     if (ret >= 0) [[likely]]
-        mutex_postlock(mutex);
+        mutex_postlock(mutex, ip, lockstat_flags, wait_start);
 
     return ret;
 }
 
 void mutex_lock(struct mutex *mutex)
 {
-    __mutex_lock(mutex, THREAD_UNINTERRUPTIBLE);
+    __mutex_lock(mutex, THREAD_UNINTERRUPTIBLE, LOCKSTAT_RET_IP());
 }
 
 int mutex_lock_interruptible(struct mutex *mutex)
 {
-    return __mutex_lock(mutex, THREAD_INTERRUPTIBLE);
+    return __mutex_lock(mutex, THREAD_INTERRUPTIBLE, LOCKSTAT_RET_IP());
 }
 
 [[gnu::noinline]] void mutex_unlock_wake(struct mutex *mutex)
@@ -253,6 +275,7 @@ int mutex_lock_interruptible(struct mutex *mutex)
 
 void mutex_unlock(struct mutex *mutex) NO_THREAD_SAFETY_ANALYSIS
 {
+    lockstat_release(LOCKSTAT_HOLD(mutex), LOCKSTAT_MUTEX);
     unsigned long word = __atomic_and_fetch(&mutex->counter, MUTEX_HAS_WAITERS, __ATOMIC_RELEASE);
     if (word & MUTEX_HAS_WAITERS) [[unlikely]]
         mutex_unlock_wake(mutex);
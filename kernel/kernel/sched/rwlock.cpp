@@ -8,6 +8,7 @@
 #include <errno.h>
 
 #include <onyx/cpu.h>
+#include <onyx/lockstat.h>
 #include <onyx/rwlock.h>
 #include <onyx/scheduler.h>
 #include <onyx/scoped_lock.h>
@@ -118,9 +119,6 @@ __always_inline void dequeue_thread_rwlock(rwlock *lock, rwlock_waiter *w)
     w->flags &= ~RW_WAITER_QUEUED;
 }
 
-int rwspin_succ = 0;
-int rwspin_fail = 0;
-
 __always_inline bool rw_lock_spin_write(rwlock *lock)
 {
     /* The algorithm goes like this: Try to always fetch the owner thread,
@@ -133,18 +131,18 @@ __always_inline bool rw_lock_spin_write(rwlock *lock)
         // Stop spinning if it's not write locked
         const auto counter = read_once(lock->lock);
         if (counter != RDWR_LOCK_WRITE && counter != 0)
-            return rwspin_fail++, false;
+            return false;
 
         struct thread *thread = counter_to_thread(counter);
 
         if ((counter & RDWR_LOCK_COUNTER_MASK) == 0)
         {
             if (rw_lock_trywrite(lock)) [[likely]]
-                return rwspin_succ++, true;
+                return true;
         }
 
         if (thread && !(thread->flags & THREAD_RUNNING))
-            return rwspin_fail++, false;
+            return false;
 
         cpu_relax();
     }
@@ -166,11 +164,11 @@ __always_inline bool rw_lock_spin_read(rwlock *lock)
         if (!(counter & RDWR_LOCK_WRITE))
         {
             if (rw_lock_tryread(lock) == 0) [[likely]]
-                return rwspin_succ++, true;
+                return true;
         }
 
         if (thread && !(thread->flags & THREAD_RUNNING))
-            return rwspin_fail++, false;
+            return false;
 
         cpu_relax();
     }
@@ -234,13 +232,30 @@ __noinline int __rw_lock_write_slow(rwlock *lock, int state)
     return ret;
 }
 
-__always_inline int __rw_lock_write(rwlock *lock, int state)
+__always_inline int __rw_lock_write(rwlock *lock, int state, unsigned long ip)
 {
     MAY_SLEEP();
+    int ret = 0;
+    unsigned int lockstat_flags = 0;
+    u64 wait_start = 0;
+
     /* Try once before doing the whole preempt disable loop and all */
-    if (!rw_lock_trywrite(lock) && !rw_lock_spin_write(lock)) [[unlikely]]
-        return __rw_lock_write_slow(lock, state);
-    return 0;
+    if (!rw_lock_trywrite(lock)) [[unlikely]]
+    {
+        wait_start = lockstat_wait_start();
+        lockstat_flags = LOCKSTAT_CONTENDED | LOCKSTAT_SPUN;
+
+        if (!rw_lock_spin_write(lock)) [[unlikely]]
+        {
+            lockstat_flags = LOCKSTAT_CONTENDED;
+            ret = __rw_lock_write_slow(lock, state);
+        }
+    }
+
+    if (ret == 0) [[likely]]
+        lockstat_acquired(LOCKSTAT_HOLD(lock), ip, LOCKSTAT_RWLOCK_WRITE, lockstat_flags,
+                          wait_start);
+    return ret;
 }
 
 __noinline int __rw_lock_read_slow(rwlock *lock, int state)
@@ -297,33 +312,50 @@ __noinline int __rw_lock_read_slow(rwlock *lock, int state)
     return ret;
 }
 
-__always_inline int __rw_lock_read(rwlock *lock, int state)
+__always_inline int __rw_lock_read(rwlock *lock, int state, unsigned long ip)
 {
     MAY_SLEEP();
+    int ret = 0;
+    unsigned int lockstat_flags = 0;
+    u64 wait_start = 0;
+
     /* Try once before doing the whole preempt disable loop and all */
-    if (rw_lock_tryread(lock) < 0 && !rw_lock_spin_read(lock)) [[unlikely]]
-        return __rw_lock_read_slow(lock, state);
-    return 0;
+    if (rw_lock_tryread(lock) < 0) [[unlikely]]
+    {
+        wait_start = lockstat_wait_start();
+        lockstat_flags = LOCKSTAT_CONTENDED | LOCKSTAT_SPUN;
+
+        if (!rw_lock_spin_read(lock)) [[unlikely]]
+        {
+            lockstat_flags = LOCKSTAT_CONTENDED;
+            ret = __rw_lock_read_slow(lock, state);
+        }
+    }
+
+    /* Shared holds aren't timed, there may be many at once */
+    if (ret == 0) [[likely]]
+        lockstat_acquired(nullptr, ip, LOCKSTAT_RWLOCK_READ, lockstat_flags, wait_start);
+    return ret;
 }
 
 void rw_lock_write(rwlock *lock)
 {
-    __rw_lock_write(lock, THREAD_UNINTERRUPTIBLE);
+    __rw_lock_write(lock, THREAD_UNINTERRUPTIBLE, LOCKSTAT_RET_IP());
 }
 
 int rw_lock_write_interruptible(rwlock *lock)
 {
-    return __rw_lock_write(lock, THREAD_INTERRUPTIBLE);
+    return __rw_lock_write(lock, THREAD_INTERRUPTIBLE, LOCKSTAT_RET_IP());
 }
 
 void rw_lock_read(rwlock *lock)
 {
-    __rw_lock_read(lock, THREAD_UNINTERRUPTIBLE);
+    __rw_lock_read(lock, THREAD_UNINTERRUPTIBLE, LOCKSTAT_RET_IP());
 }
 
 int rw_lock_read_interruptible(rwlock *lock)
 {
-    return __rw_lock_read(lock, THREAD_INTERRUPTIBLE);
+    return __rw_lock_read(lock, THREAD_INTERRUPTIBLE, LOCKSTAT_RET_IP());
 }
 
 void rwlock_wake(rwlock *lock)
@@ -361,6 +393,7 @@ void rw_unlock_read(rwlock *lock)
 
 void rw_unlock_write(rwlock *lock)
 {
+    lockstat_release(LOCKSTAT_HOLD(lock), LOCKSTAT_RWLOCK_WRITE);
     const bool has_waiters =
         __atomic_and_fetch(&lock->lock, RDWR_LOCK_WRITE_UNLOCK_MASK, __ATOMIC_RELEASE) &
         RDWR_LOCK_WAITERS;
@@ -412,12 +445,20 @@ void rwslock::lock_read() NO_THREAD_SAFETY_ANALYSIS
     sched_disable_preempt();
     unsigned long l;
     unsigned long to_insert;
+    unsigned int lockstat_flags = 0;
+    u64 wait_start = 0;
 
     do
     {
         l = __atomic_load_n(&lock, __ATOMIC_RELAXED);
         while (l & RDWR_LOCK_WRITE || l == RDWR_MAX_COUNTER)
         {
+            if (!lockstat_flags)
+            {
+                wait_start = lockstat_wait_start();
+                lockstat_flags = LOCKSTAT_CONTENDED;
+            }
+
             cpu_relax();
             l = __atomic_load_n(&lock, __ATOMIC_RELAXED);
         }
@@ -425,6 +466,9 @@ void rwslock::lock_read() NO_THREAD_SAFETY_ANALYSIS
         to_insert = l + 1;
     } while (!__atomic_compare_exchange_n(&lock, &l, to_insert, false, __ATOMIC_ACQUIRE,
                                           __ATOMIC_RELAXED));
+
+    lockstat_acquired(nullptr, LOCKSTAT_RET_IP(), LOCKSTAT_RWSLOCK_READ, lockstat_flags,
+                      wait_start);
 }
 
 void rwslock::lock_write() NO_THREAD_SAFETY_ANALYSIS
@@ -432,9 +476,18 @@ void rwslock::lock_write() NO_THREAD_SAFETY_ANALYSIS
     sched_disable_preempt();
     unsigned long expected = 0;
     const unsigned long write_value = RDWR_LOCK_WRITE | get_cpu_nr();
+    unsigned int lockstat_flags = 0;
+    u64 wait_start = 0;
+
     while (!__atomic_compare_exchange_n(&lock, &expected, write_value, false, __ATOMIC_ACQUIRE,
                                         __ATOMIC_RELAXED))
     {
+        if (!lockstat_flags)
+        {
+            wait_start = lockstat_wait_start();
+            lockstat_flags = LOCKSTAT_CONTENDED;
+        }
+
         do
         {
             cpu_relax();
@@ -442,6 +495,9 @@ void rwslock::lock_write() NO_THREAD_SAFETY_ANALYSIS
 
         expected = 0;
     }
+
+    lockstat_acquired(LOCKSTAT_HOLD(this), LOCKSTAT_RET_IP(), LOCKSTAT_RWSLOCK_WRITE,
+                      lockstat_flags, wait_start);
 }
 
 void rwslock::unlock_read() NO_THREAD_SAFETY_ANALYSIS
@@ -452,6 +508,7 @@ void rwslock::unlock_read() NO_THREAD_SAFETY_ANALYSIS
 
 void rwslock::unlock_write() NO_THREAD_SAFETY_ANALYSIS
 {
+    lockstat_release(LOCKSTAT_HOLD(this), LOCKSTAT_RWSLOCK_WRITE);
     __atomic_store_n(&lock, 0, __ATOMIC_RELEASE);
     sched_enable_preempt();
 }
@@ -151,13 +151,23 @@ struct sync_call_queue
 
 void sync_call_queue::handle_calls()
 {
-    scoped_lock<spinlock, true> g{lock};
     const unsigned int cpu = get_cpu_nr();
 
-    list_for_every_safe (&elem_list)
+    /* Calls run without the lock held, so they see the preemption state of whatever we
+     * interrupted (RCU depends on this).
+     */
+    while (true)
     {
-        auto elem = container_of(l, internal::sync_call_elem, node);
-        list_remove(&elem->node);
+        internal::sync_call_elem *elem;
+
+        {
+            scoped_lock<spinlock, true> g{lock};
+            if (list_is_empty(&elem_list))
+                break;
+            elem = container_of(list_first_element(&elem_list), internal::sync_call_elem, node);
+            list_remove(&elem->node);
+        }
+
         elem->control_block->f(elem->control_block->ctx);
         elem->control_block->complete(cpu);
 
@@ -6,17 +6,57 @@
  * SPDX-License-Identifier: MIT
  */
 
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <onyx/clock.h>
+#include <onyx/cpu.h>
+#include <onyx/init.h>
 #include <onyx/irq.h>
 #include <onyx/net/netif.h>
 #include <onyx/panic.h>
 #include <onyx/percpu.h>
 #include <onyx/rcupdate.h>
+#include <onyx/scheduler.h>
 #include <onyx/softirq.h>
+#include <onyx/sysfs.h>
 #include <onyx/tasklet.h>
+#include <onyx/thread.h>
 #include <onyx/timer.h>
+#include <onyx/vm.h>
+
+#include <onyx/utility.hpp>
+
+/* Softirqs run to completion on irq exit and preempt enable, but each vector only does a bounded
+ * amount of work per run, and a run only restarts (for vectors raised in the meanwhile, or that
+ * had work left) SOFTIRQ_MAX_RESTART times or for SOFTIRQ_TIME_BUDGET ns. Whatever is still left
+ * then goes to the per-cpu ksoftirqd thread, which runs at normal priority so it competes with
+ * regular threads. While it's busy, only timers still run inline.
+ */
+#define SOFTIRQ_MAX_RESTART    10
+#define SOFTIRQ_TIME_BUDGET    (2 * NS_PER_MS)
+#define SOFTIRQ_ALL_VECTORS    ((1U << SOFTIRQ_NR_VECTORS) - 1)
+#define SOFTIRQ_INLINE_VECTORS (1U << SOFTIRQ_VECTOR_TIMER)
+
+struct softirq_stats
+{
+    /* Times each vector was run */
+    unsigned long handled[SOFTIRQ_NR_VECTORS];
+    /* Times each vector ran out of budget */
+    unsigned long requeued[SOFTIRQ_NR_VECTORS];
+    /* Times we handed work off to ksoftirqd */
+    unsigned long ksoftirqd_wakeups;
+};
 
 PER_CPU_VAR(unsigned int pending_vectors);
 PER_CPU_VAR(bool handling_softirq);
+static PER_CPU_VAR(struct thread *ksoftirqd);
+static PER_CPU_VAR(bool ksoftirqd_busy);
+static PER_CPU_VAR(struct softirq_stats softirq_stats);
+
+static const char *softirq_names[SOFTIRQ_NR_VECTORS] = {"timer", "netrx", "tasklet", "rcu"};
 
 bool softirq_may_handle()
 {
@@ -28,48 +68,128 @@ bool softirq_may_handle()
 
 bool softirq_pending()
 {
-    return get_per_cpu(pending_vectors) != 0;
-}
+    unsigned int pending = get_per_cpu(pending_vectors);
 
-void softirq_handle()
-{
-    write_per_cpu(handling_softirq, true);
+    /* ksoftirqd will get to it */
+    if (get_per_cpu(ksoftirqd_busy)) [[unlikely]]
+        pending &= SOFTIRQ_INLINE_VECTORS;
 
-    sched_disable_preempt();
+    return pending != 0;
+}
 
-    bool is_disabled = irq_is_disabled();
+static void softirq_mark_pending(unsigned int mask)
+{
+    auto flags = irq_save_and_disable();
 
-    irq_enable();
+    /* This is thread safe because you can't signal other CPUs's softirqs */
+    write_per_cpu(pending_vectors, get_per_cpu(pending_vectors) | mask);
 
-    auto pending = get_per_cpu(pending_vectors);
+    irq_restore(flags);
+}
 
-    if (pending & (1 << SOFTIRQ_VECTOR_TIMER))
+/**
+ * @brief Run a softirq vector
+ *
+ * @param vec Vector
+ * @return True if it ran out of budget and has work left
+ */
+static bool softirq_run_vector(unsigned int vec)
+{
+    switch (vec)
     {
-        timer_handle_events(platform_get_timer());
-        pending &= ~(1 << SOFTIRQ_VECTOR_TIMER);
-    }
-
+        case SOFTIRQ_VECTOR_TIMER:
+            timer_handle_events(platform_get_timer());
+            return false;
 #ifdef CONFIG_NET
-    if (pending & (1 << SOFTIRQ_VECTOR_NETRX))
-    {
-        netif_do_rx();
-        pending &= ~(1 << SOFTIRQ_VECTOR_NETRX);
-    }
+        case SOFTIRQ_VECTOR_NETRX:
+            return netif_do_rx();
 #endif
-
-    if (pending & (1 << SOFTIRQ_VECTOR_TASKLET))
-    {
-        tasklet_run();
-        pending &= ~(1 << SOFTIRQ_VECTOR_TASKLET);
+        case SOFTIRQ_VECTOR_TASKLET:
+            return tasklet_run();
+        case SOFTIRQ_VECTOR_RCU:
+            rcu_work();
+            return false;
     }
 
-    if (pending & (1 << SOFTIRQ_VECTOR_RCU))
+    return false;
+}
+
+/**
+ * @brief Run pending softirqs
+ * Must be called with preemption disabled and irqs enabled.
+ *
+ * @param mask Vectors to run
+ * @param max_restart Max number of passes over the pending vectors
+ * @return Vectors (in mask) that are still pending
+ */
+static unsigned int __softirq_run(unsigned int mask, unsigned int max_restart)
+{
+    struct softirq_stats *stats = get_per_cpu_ptr(softirq_stats);
+    const hrtime_t deadline = clocksource_get_time() + SOFTIRQ_TIME_BUDGET;
+    unsigned int pending;
+
+    while (true)
     {
-        rcu_work();
-        pending &= ~(1 << SOFTIRQ_VECTOR_RCU);
+        irq_disable();
+        pending = get_per_cpu(pending_vectors) & mask;
+        write_per_cpu(pending_vectors, get_per_cpu(pending_vectors) & ~pending);
+        irq_enable();
+
+        unsigned int unfinished = 0;
+
+        while (pending)
+        {
+            unsigned int vec = __builtin_ctz(pending);
+            pending &= ~(1U << vec);
+
+            stats->handled[vec]++;
+            if (softirq_run_vector(vec))
+            {
+                stats->requeued[vec]++;
+                unfinished |= 1U << vec;
+            }
+        }
+
+        if (unfinished)
+            softirq_mark_pending(unfinished);
+
+        pending = get_per_cpu(pending_vectors) & mask;
+        if (!pending || --max_restart == 0 || clocksource_get_time() >= deadline)
+            return pending;
     }
+}
+
+static void ksoftirqd_wake()
+{
+    struct thread *t = get_per_cpu(ksoftirqd);
 
-    write_per_cpu(pending_vectors, pending);
+    /* Too early, we'll get to it on the next softirq run */
+    if (!t) [[unlikely]]
+        return;
+
+    if (get_per_cpu(ksoftirqd_busy))
+        return;
+
+    write_per_cpu(ksoftirqd_busy, true);
+    get_per_cpu_ptr(softirq_stats)->ksoftirqd_wakeups++;
+    thread_wake_up(t);
+}
+
+void softirq_handle()
+{
+    write_per_cpu(handling_softirq, true);
+
+    sched_disable_preempt();
+
+    bool is_disabled = irq_is_disabled();
+
+    irq_enable();
+
+    const unsigned int mask =
+        get_per_cpu(ksoftirqd_busy) ? SOFTIRQ_INLINE_VECTORS : SOFTIRQ_ALL_VECTORS;
+
+    if (__softirq_run(mask, SOFTIRQ_MAX_RESTART))
+        ksoftirqd_wake();
 
     if (is_disabled)
         irq_disable();
@@ -79,25 +199,109 @@ void softirq_handle()
     write_per_cpu(handling_softirq, false);
 }
 
-void softirq_try_handle()
+void softirq_raise(enum softirq_vector vec)
 {
-    if (get_per_cpu(pending_vectors) && softirq_may_handle())
+    softirq_mark_pending(1U << vec);
+
+    if (softirq_pending() && softirq_may_handle())
         softirq_handle();
 }
 
-void softirq_raise(enum softirq_vector vec)
+static void ksoftirqd_main(void *arg)
 {
-    unsigned int mask = (1 << vec);
+    struct thread *current = get_current_thread();
 
-    auto flags = irq_save_and_disable();
+    while (true)
+    {
+        set_current_state(THREAD_UNINTERRUPTIBLE);
 
-    /* This is thread safe because you can't signal other CPUs's softirqs */
-    auto pending = get_per_cpu(pending_vectors) | mask;
+        irq_disable();
 
-    write_per_cpu(pending_vectors, pending);
+        if (!get_per_cpu(pending_vectors))
+        {
+            /* Nothing left, let softirqs run inline again */
+            write_per_cpu(ksoftirqd_busy, false);
+            irq_enable();
+            sched_yield();
+            continue;
+        }
 
-    irq_restore(flags);
+        irq_enable();
+        set_current_state(THREAD_RUNNABLE);
 
-    if (pending && softirq_may_handle())
-        softirq_handle();
+        /* Do a single pass at a time, and let the scheduler decide when we run again */
+        write_per_cpu(handling_softirq, true);
+        sched_disable_preempt();
+        __softirq_run(SOFTIRQ_ALL_VECTORS, 1);
+        sched_enable_preempt_no_softirq();
+        write_per_cpu(handling_softirq, false);
+
+        if (sched_needs_resched(current))
+        {
+            sched_yield();
+            current->flags &= ~THREAD_NEEDS_RESCHED;
+        }
+    }
+}
+
+static struct sysfs_object softirq_obj;
+static struct sysfs_object softirq_stats_obj;
+
+/* Reads from /sys/softirq/stats - per-cpu runs and requeues of every vector */
+static ssize_t softirq_stats_read(void *buffer, size_t size, off_t off)
+{
+    constexpr size_t line_len = 32 + SOFTIRQ_NR_VECTORS * 48;
+    const unsigned int nr_cpus = get_nr_cpus();
+    const size_t buflen = (nr_cpus + 1) * line_len;
+    char *buf = (char *) malloc(buflen);
+    if (!buf)
+        return -ENOMEM;
+
+    size_t len = snprintf(buf, buflen, "cpu");
+    for (unsigned int i = 0; i < SOFTIRQ_NR_VECTORS; i++)
+        len += snprintf(buf + len, buflen - len, " %s %s_requeued", softirq_names[i],
+                        softirq_names[i]);
+    len += snprintf(buf + len, buflen - len, " ksoftirqd\n");
+
+    for (unsigned int i = 0; i < nr_cpus; i++)
+    {
+        struct softirq_stats *stats = other_cpu_get_ptr(softirq_stats, i);
+        len += snprintf(buf + len, buflen - len, "%u", i);
+        for (unsigned int j = 0; j < SOFTIRQ_NR_VECTORS; j++)
+            len += snprintf(buf + len, buflen - len, " %lu %lu", stats->handled[j],
+                            stats->requeued[j]);
+        len += snprintf(buf + len, buflen - len, " %lu\n", stats->ksoftirqd_wakeups);
+    }
+
+    ssize_t st = 0;
+
+    if ((size_t) off < len)
+    {
+        st = cul::min(size, len - off);
+        if (copy_to_user(buffer, buf + off, st) < 0)
+            st = -EFAULT;
+    }
+
+    free(buf);
+    return st;
 }
+
+static void softirq_init()
+{
+    for (unsigned int i = 0; i < get_nr_cpus(); i++)
+    {
+        struct thread *t = sched_create_thread(ksoftirqd_main, THREAD_KERNEL, nullptr);
+        assert(t != nullptr);
+        *other_cpu_get_ptr(ksoftirqd, i) = t;
+        sched_start_thread_for_cpu(t, i);
+    }
+
+    assert(sysfs_init_and_add("softirq", &softirq_obj, nullptr) == 0);
+    softirq_obj.perms = 0755 | S_IFDIR;
+
+    assert(sysfs_init_and_add("stats", &softirq_stats_obj, &softirq_obj) == 0);
+    softirq_stats_obj.read = softirq_stats_read;
+    softirq_stats_obj.perms = 0444 | S_IFREG;
+}
+
+INIT_LEVEL_CORE_AFTER_SCHED_ENTRY(softirq_init);
@@ -6,19 +6,78 @@
  * SPDX-License-Identifier: MIT
  */
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <onyx/compiler.h>
 #include <onyx/cpu.h>
+#include <onyx/init.h>
+#include <onyx/lockstat.h>
+#include <onyx/percpu.h>
 #include <onyx/scheduler.h>
 #include <onyx/spinlock.h>
+#include <onyx/sysfs.h>
 #include <onyx/task_switching.h>
+#include <onyx/vm.h>
 
-__always_inline void post_lock_actions(struct spinlock *lock)
+#include <onyx/utility.hpp>
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "spinlock_owner() assumes the owner is the low half of the lock word"
+#endif
+
+/* Queue node for a waiter. Each CPU has one per nesting level (thread, softirq, irq, nmi), as a
+ * CPU can only wait on a single lock per level.
+ */
+struct qspinlock_node
+{
+    struct qspinlock_node *next;
+    unsigned int locked;
+};
+
+#define QSPINLOCK_MAX_NESTING 4
+
+struct qspinlock_cpu
+{
+    struct qspinlock_node nodes[QSPINLOCK_MAX_NESTING];
+    unsigned int nesting;
+};
+
+struct spinlock_stats
+{
+    /* Acquisitions that missed the fast path */
+    unsigned long contended;
+    /* Acquisitions that had to queue behind other waiters */
+    unsigned long queued;
+};
+
+static PER_CPU_VAR(struct qspinlock_cpu qnodes);
+static PER_CPU_VAR(struct spinlock_stats spin_stats);
+
+static inline u16 *spinlock_owner(struct spinlock *lock)
+{
+    return (u16 *) &lock->lock;
+}
+
+static inline raw_spinlock_t encode_tail(unsigned int cpu, unsigned int idx)
+{
+    return ((cpu + 1) << 2 | idx) << SPINLOCK_TAIL_SHIFT;
+}
+
+static inline struct qspinlock_node *decode_tail(raw_spinlock_t tail)
+{
+    tail >>= SPINLOCK_TAIL_SHIFT;
+    return &other_cpu_get_ptr(qnodes, (tail >> 2) - 1)->nodes[tail & 3];
+}
+
+__always_inline void post_lock_actions(struct spinlock *lock, unsigned long ip,
+                                       unsigned int lockstat_flags, u64 wait_start)
 {
 #ifdef CONFIG_SPINLOCK_DEBUG
     lock->holder = (unsigned long) __builtin_return_address(1);
 #endif
+    lockstat_acquired(LOCKSTAT_HOLD(lock), ip, LOCKSTAT_SPINLOCK, lockstat_flags, wait_start);
 }
 
 __always_inline void post_release_actions(struct spinlock *lock)
@@ -26,6 +85,7 @@ __always_inline void post_release_actions(struct spinlock *lock)
 #ifdef CONFIG_SPINLOCK_DEBUG
     lock->holder = 0xDEADBEEFDEADBEEF;
 #endif
+    lockstat_release(LOCKSTAT_HOLD(lock), LOCKSTAT_SPINLOCK);
 }
 
 __always_inline bool spin_lock_fast_path(struct spinlock *lock, raw_spinlock_t cpu_nr_plus_one)
@@ -35,43 +95,132 @@ __always_inline bool spin_lock_fast_path(struct spinlock *lock, raw_spinlock_t c
                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
 }
 
-__noinline void spin_lock_slow_path(struct spinlock *lock, raw_spinlock_t what_to_insert)
+/**
+ * @brief Spin on the lock word, like a test-and-test-and-set lock
+ * Used when we're nested too deep to have a queue node. This ignores the queue and steals the lock
+ * whenever the owner half is 0: the queue's head may well be a context we interrupted on this same
+ * CPU, so waiting behind it could deadlock.
+ *
+ * @param lock Lock
+ * @param owner Value to put in the owner half
+ */
+static void spin_lock_unqueued(struct spinlock *lock, raw_spinlock_t owner)
 {
-    raw_spinlock_t expected_val = 0;
+    raw_spinlock_t val = __atomic_load_n(&lock->lock, __ATOMIC_RELAXED);
 
     while (true)
     {
-        do
+        if (!(val & SPINLOCK_OWNER_MASK))
         {
+            if (__atomic_compare_exchange_n(&lock->lock, &val, val | owner, false, __ATOMIC_ACQUIRE,
+                                            __ATOMIC_RELAXED))
+                return;
+            continue;
+        }
+
+        cpu_relax();
+        val = __atomic_load_n(&lock->lock, __ATOMIC_RELAXED);
+    }
+}
+
+__noinline void spin_lock_slow_path(struct spinlock *lock, raw_spinlock_t owner)
+{
+    struct qspinlock_cpu *qc = get_per_cpu_ptr(qnodes);
+    struct spinlock_stats *stats = get_per_cpu_ptr(spin_stats);
+    unsigned int idx = qc->nesting++;
+
+    stats->contended++;
+
+    if (idx >= QSPINLOCK_MAX_NESTING) [[unlikely]]
+    {
+        spin_lock_unqueued(lock, owner);
+        qc->nesting--;
+        return;
+    }
+
+    struct qspinlock_node *node = &qc->nodes[idx];
+    struct qspinlock_node *next;
+    node->next = nullptr;
+    node->locked = 0;
+
+    /* Make ourselves the tail of the queue. The release makes our node's initialization visible
+     * to whoever queues behind us.
+     */
+    const raw_spinlock_t tail = encode_tail(owner - 1, idx);
+    raw_spinlock_t val = __atomic_load_n(&lock->lock, __ATOMIC_RELAXED);
+
+    while (!__atomic_compare_exchange_n(&lock->lock, &val, (val & SPINLOCK_OWNER_MASK) | tail,
+                                        false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+
+    if (val & SPINLOCK_TAIL_MASK)
+    {
+        /* There are waiters ahead of us. Link ourselves to the previous tail and spin on our own
+         * node until it hands us the head of the queue.
+         */
+        stats->queued++;
+        __atomic_store_n(&decode_tail(val)->next, node, __ATOMIC_RELEASE);
+
+        while (!__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE))
             cpu_relax();
-        } while (__atomic_load_n(&lock->lock, __ATOMIC_RELAXED) != 0);
+    }
 
-        if (__atomic_compare_exchange_n(&lock->lock, &expected_val, what_to_insert, false,
-                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
-            break;
+    /* We're the head of the queue, so we're the only queued waiter spinning on the owner. The fast
+     * path can't get in (it needs the whole word to be 0), but spin_lock_unqueued can, so the
+     * owner half must still be 0 when we write ours.
+     */
+    while (true)
+    {
+        while ((val = __atomic_load_n(&lock->lock, __ATOMIC_ACQUIRE)) & SPINLOCK_OWNER_MASK)
+            cpu_relax();
 
-        expected_val = 0;
+        /* If we're the last waiter, take the lock and clear the tail in one go. Else, the tail
+         * stays.
+         */
+        const raw_spinlock_t newval = (val & SPINLOCK_TAIL_MASK) == tail ? owner : val | owner;
+        if (__atomic_compare_exchange_n(&lock->lock, &val, newval, false, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED))
+            break;
     }
+
+    if ((val & SPINLOCK_TAIL_MASK) == tail)
+        goto out;
+
+    /* Wait for our successor to finish linking itself, and make it the new head */
+    while (!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)))
+        cpu_relax();
+
+    __atomic_store_n(&next->locked, 1, __ATOMIC_RELEASE);
+out:
+    qc->nesting--;
 }
 
 void __spin_lock(struct spinlock *lock)
 {
     raw_spinlock_t what_to_insert = get_cpu_nr() + 1;
+    unsigned int lockstat_flags = 0;
+    u64 wait_start = 0;
+
     if (!spin_lock_fast_path(lock, what_to_insert)) [[unlikely]]
+    {
+        wait_start = lockstat_wait_start();
         spin_lock_slow_path(lock, what_to_insert);
+        lockstat_flags = LOCKSTAT_CONTENDED;
+    }
 
-    post_lock_actions(lock);
+    post_lock_actions(lock, LOCKSTAT_RET_IP(), lockstat_flags, wait_start);
 }
 
 void __spin_unlock(struct spinlock *lock)
 {
 #ifdef CONFIG_SPINLOCK_DEBUG
-    assert(lock->lock > 0);
+    assert((lock->lock & SPINLOCK_OWNER_MASK) > 0);
 #endif
 
     post_release_actions(lock);
 
-    __atomic_store_n(&lock->lock, 0, __ATOMIC_RELEASE);
+    /* Leave the tail alone, the head of the queue is spinning on the owner half */
+    __atomic_store_n(spinlock_owner(lock), 0, __ATOMIC_RELEASE);
 }
 
 int spin_try_lock(struct spinlock *lock)
@@ -88,6 +237,53 @@ int spin_try_lock(struct spinlock *lock)
         return 1;
     }
 
-    post_lock_actions(lock);
+    post_lock_actions(lock, LOCKSTAT_RET_IP(), 0, 0);
     return 0;
 }
+
+static struct sysfs_object spinlock_obj;
+static struct sysfs_object spinlock_stats_obj;
+
+/* Reads from /sys/spinlock/stats - "<cpu> <contended> <queued>" for every CPU */
+static ssize_t spinlock_stats_read(void *buffer, size_t size, off_t off)
+{
+    constexpr size_t line_len = 64;
+    const unsigned int nr_cpus = get_nr_cpus();
+    const size_t buflen = (nr_cpus + 1) * line_len;
+    char *buf = (char *) malloc(buflen);
+    if (!buf)
+        return -ENOMEM;
+
+    size_t len = snprintf(buf, buflen, "cpu contended queued\n");
+
+    for (unsigned int i = 0; i < nr_cpus; i++)
+    {
+        struct spinlock_stats *stats = other_cpu_get_ptr(spin_stats, i);
+        len += snprintf(buf + len, buflen - len, "%u %lu %lu\n", i, stats->contended,
+                        stats->queued);
+    }
+
+    ssize_t st = 0;
+
+    if ((size_t) off < len)
+    {
+        st = cul::min(size, len - off);
+        if (copy_to_user(buffer, buf + off, st) < 0)
+            st = -EFAULT;
+    }
+
+    free(buf);
+    return st;
+}
+
+static void spinlock_sysfs_init()
+{
+    assert(sysfs_init_and_add("spinlock", &spinlock_obj, nullptr) == 0);
+    spinlock_obj.perms = 0755 | S_IFDIR;
+
+    assert(sysfs_init_and_add("stats", &spinlock_stats_obj, &spinlock_obj) == 0);
+    spinlock_stats_obj.read = spinlock_stats_read;
+    spinlock_stats_obj.perms = 0444 | S_IFREG;
+}
+
+INIT_LEVEL_CORE_AFTER_SCHED_ENTRY(spinlock_sysfs_init);
@@ -15,6 +15,9 @@
 #include <onyx/softirq.h>
 #include <onyx/tasklet.h>
 
+/* Max tasklets run per TASKLET softirq run */
+#define TASKLET_BUDGET 64
+
 PER_CPU_VAR(struct list_head pending_tasklet_list);
 
 void tasklet_ctor(unsigned int cpu)
@@ -41,27 +44,46 @@ void tasklet_schedule(tasklet *t)
     softirq_raise(SOFTIRQ_VECTOR_TASKLET);
 }
 
-void tasklet_run()
+bool tasklet_run()
 {
     struct list_head to_run;
+    unsigned int budget = TASKLET_BUDGET;
     // Disable IRQs for a bit, while we copy the list
     // We copy it so we hold the noirq context for as little time as possible
     auto flags = irq_save_and_disable();
 
     auto list = get_per_cpu_ptr(pending_tasklet_list);
 
+    if (list_is_empty(list))
+    {
+        irq_restore(flags);
+        return false;
+    }
+
     list_move(&to_run, list);
 
     irq_restore(flags);
 
     list_for_every_safe (&to_run)
     {
+        if (budget-- == 0)
+            break;
         tasklet *t = container_of(l, tasklet, list_node);
         t->flags.or_fetch(TASKLET_RUNNING, mem_order::acquire);
         t->func(t->context);
         list_remove(&t->list_node);
         t->flags.store(0, mem_order::release);
     }
+
+    if (list_is_empty(&to_run))
+        return false;
+
+    // Out of budget, put the rest back in front of anything scheduled in the meanwhile
+    flags = irq_save_and_disable();
+    list_splice(&to_run, list);
+    irq_restore(flags);
+
+    return true;
 }
 
 INIT_LEVEL_CORE_PERCPU_CTOR(tasklet_ctor);
@@ -10,6 +10,7 @@
 
 #include <onyx/bus_type.h>
 #include <onyx/device_tree.h>
+#include <onyx/numa.h>
 #include <onyx/page.h>
 #include <onyx/panic.h>
 #include <onyx/serial.h>
@@ -74,6 +75,31 @@ int fdt_get_cells(const void *fdt, int nodeoffset, const char *name)
     return (int) val;
 }
 
+/**
+ * @brief Read a single-cell property
+ *
+ * @param fdt Pointer to the FDT
+ * @param nodeoffset Offset of the node
+ * @param name Name of the property
+ * @param val Pointer to where to store the value
+ * @return 0 on success, negative FDT error codes
+ */
+static int fdt_get_u32(const void *fdt, int nodeoffset, const char *name, uint32_t *val)
+{
+    const fdt32_t *c;
+    int len;
+
+    c = (const fdt32_t *) fdt_getprop(fdt, nodeoffset, name, &len);
+    if (!c)
+        return len;
+
+    if (len != sizeof(*c))
+        return -FDT_ERR_BADVALUE;
+
+    *val = fdt32_to_cpu(*c);
+    return 0;
+}
+
 /**
  * @brief Retrieve a value from a reg field
  *
@@ -200,6 +226,8 @@ void handle_memory_node(int offset, int addr_cells, int size_cells)
 
     int nr_ranges = reg_len / ((addr_cells + size_cells) * sizeof(uint32_t));
     unsigned int reg_offset = 0;
+    uint32_t nid;
+    bool has_nid = fdt_get_u32(fdt_, offset, "numa-node-id", &nid) == 0;
 
     for (int i = 0; i < nr_ranges; i++)
     {
@@ -207,6 +235,9 @@ void handle_memory_node(int offset, int addr_cells, int size_cells)
         start = read_reg(reg, reg_offset, addr_cells);
         size = read_reg(reg, reg_offset + addr_cells, size_cells);
 
+        if (has_nid)
+            numa_add_memblk(nid, start, start + size);
+
         bootmem_add_range(start, size);
         memory_size += size;
 
@@ -217,6 +248,44 @@ void handle_memory_node(int offset, int addr_cells, int size_cells)
     }
 }
 
+/**
+ * @brief Handle cpu@ nodes in the device tree, for NUMA affinity
+ *
+ */
+static void handle_cpu_node(int offset, int addr_cells)
+{
+    uint32_t nid;
+    int reg_len;
+    const void *reg;
+
+    if (fdt_get_u32(fdt_, offset, "numa-node-id", &nid) < 0)
+        return;
+
+    if (reg = fdt_getprop(fdt_, offset, "reg", &reg_len); !reg)
+        return;
+
+    numa_add_cpu_hwid(read_reg(reg, 0, addr_cells), nid);
+}
+
+/**
+ * @brief Handle the distance-map node, which describes the distance between NUMA nodes
+ *
+ */
+static void handle_distance_map(int offset)
+{
+    int len;
+    const fdt32_t *matrix = (const fdt32_t *) fdt_getprop(fdt_, offset, "distance-matrix", &len);
+    if (!matrix)
+        return;
+
+    /* The matrix is a list of <from to distance> triplets */
+    for (int i = 0; i < len / (int) (sizeof(fdt32_t) * 3); i++)
+    {
+        numa_set_distance(fdt32_to_cpu(matrix[i * 3]), fdt32_to_cpu(matrix[i * 3 + 1]),
+                          fdt32_to_cpu(matrix[i * 3 + 2]));
+    }
+}
+
 void figure_out_initrd_from_chosen(int offset)
 {
     int len;
@@ -323,6 +392,14 @@ void early_walk()
         {
             figure_out_initrd_from_chosen(offset);
         }
+        else if (!strncmp(name, "cpu@", strlen("cpu@")))
+        {
+            handle_cpu_node(offset, address_cell_stack[depth]);
+        }
+        else if (!strcmp(name, "distance-map"))
+        {
+            handle_distance_map(offset);
+        }
     }
 }
 
@@ -8,6 +8,7 @@
 
 #include <err.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -506,6 +507,162 @@ void add_traced_event(int fd, const char *name)
         err(1, "KTRACEENABLE");
 }
 
+#define LOCKSTAT_ENABLE "/sys/lockstat/enable"
+#define LOCKSTAT_STATS  "/sys/lockstat/stats"
+
+struct lockstat_line
+{
+    char type[32];
+    unsigned long site;
+    unsigned long acquired;
+    unsigned long contended;
+    unsigned long spun;
+    unsigned long wait_total;
+    unsigned long wait_max;
+    unsigned long hold_total;
+    unsigned long hold_max;
+};
+
+enum lockstat_sort
+{
+    SORT_WAIT = 0,
+    SORT_CONTENDED,
+    SORT_HOLD,
+    SORT_ACQUIRED
+};
+
+static enum lockstat_sort lockstat_sort_key;
+
+static unsigned long lockstat_key(const struct lockstat_line *l)
+{
+    switch (lockstat_sort_key)
+    {
+        case SORT_CONTENDED:
+            return l->contended;
+        case SORT_HOLD:
+            return l->hold_total;
+        case SORT_ACQUIRED:
+            return l->acquired;
+        default:
+            return l->wait_total;
+    }
+}
+
+static int lockstat_cmp(const void *a, const void *b)
+{
+    unsigned long ka = lockstat_key(a);
+    unsigned long kb = lockstat_key(b);
+    return ka < kb ? 1 : ka > kb ? -1 : 0;
+}
+
+static void lockstat_write(const char *path, const char *val)
+{
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        err(1, "open(%s)", path);
+    if (write(fd, val, strlen(val)) < 0)
+        err(1, "write(%s)", path);
+    close(fd);
+}
+
+static void lockstat_print(int top_n)
+{
+    FILE *file = fopen(LOCKSTAT_STATS, "r");
+    if (!file)
+        err(1, "fopen(" LOCKSTAT_STATS ")");
+
+    struct lockstat_line *lines = NULL;
+    size_t nr_lines = 0;
+    char buf[256];
+
+    while (fgets(buf, sizeof(buf), file))
+    {
+        struct lockstat_line l;
+
+        if (buf[0] == '#')
+        {
+            fputs(buf, stderr);
+            continue;
+        }
+
+        /* This also skips the header */
+        if (sscanf(buf, "%31s %lx %lu %lu %lu %lu %lu %lu %lu", l.type, &l.site, &l.acquired,
+                   &l.contended, &l.spun, &l.wait_total, &l.wait_max, &l.hold_total,
+                   &l.hold_max) != 9)
+            continue;
+
+        lines = reallocarray(lines, nr_lines + 1, sizeof(struct lockstat_line));
+        if (!lines)
+            err(1, "reallocarray");
+        lines[nr_lines++] = l;
+    }
+
+    fclose(file);
+
+    qsort(lines, nr_lines, sizeof(struct lockstat_line), lockstat_cmp);
+    maybe_init_symbols();
+
+    printf("%-14s %-48s %10s %10s %10s %12s %10s %12s %10s\n", "type", "site", "acquired",
+           "contended", "spun", "wait(us)", "wmax(us)", "hold(us)", "hmax(us)");
+
+    for (size_t i = 0; i < nr_lines && (int) i < top_n; i++)
+    {
+        struct lockstat_line *l = &lines[i];
+        char symbuf[100];
+
+        if (kfd == -1 || symbolize_symbolize(ctx, l->site, symbuf, sizeof(symbuf)) < 0)
+            snprintf(symbuf, sizeof(symbuf), "%#lx", l->site);
+
+        printf("%-14s %-48s %10lu %10lu %10lu %12lu %10lu %12lu %10lu\n", l->type, symbuf,
+               l->acquired, l->contended, l->spun, l->wait_total / NS_PER_US,
+               l->wait_max / NS_PER_US, l->hold_total / NS_PER_US, l->hold_max / NS_PER_US);
+    }
+
+    free(lines);
+}
+
+/**
+ * Lockstat mode: if given a program, reset and enable lockstat, run it and stop recording once it
+ * exits. Then print the top N lock call sites.
+ */
+static int lockstat_main(char **argv, char **envp, int top_n)
+{
+    if (argv[0])
+    {
+        lockstat_write(LOCKSTAT_STATS, "0");
+        lockstat_write(LOCKSTAT_ENABLE, "1");
+
+        pid_t pid = fork();
+        if (pid < 0)
+            err(1, "fork");
+
+        if (pid == 0)
+        {
+            if (execve(argv[0], argv, envp) < 0)
+                err(1, "execve");
+        }
+
+        if (waitpid(pid, NULL, 0) < 0)
+            err(1, "waitpid");
+
+        lockstat_write(LOCKSTAT_ENABLE, "0");
+    }
+
+    lockstat_print(top_n);
+    return 0;
+}
+
+static void print_usage(void)
+{
+    printf("Usage: trace program [args...]\n"
+           "       trace -l [-n N] [-s wait|contended|hold|acquired] [program [args...]]\n");
+    printf("Traces kernel events while running program, and prints them to stdout as JSON.\n");
+    printf("\n  -l       Print a table of the most contended locks (needs CONFIG_LOCKSTAT).\n"
+           "           If given a program, only record while it runs.\n");
+    printf("  -n N     Number of lock call sites to print (default 20)\n");
+    printf("  -s KEY   Sort lock call sites by KEY (default wait)\n");
+}
+
 int main(int argc, char **argv, char **envp)
 {
     u8 *endbuf;
@@ -513,6 +670,48 @@ int main(int argc, char **argv, char **envp)
     u8 *end;
     int cpufds[256];
     int ncpus = 0;
+    int lockstat = 0;
+    int top_n = 20;
+    int c;
+
+    while ((c = getopt(argc, argv, "+hln:s:")) != -1)
+    {
+        switch (c)
+        {
+            case 'l':
+                lockstat = 1;
+                break;
+            case 'n':
+                top_n = atoi(optarg);
+                break;
+            case 's':
+                if (!strcmp(optarg, "contended"))
+                    lockstat_sort_key = SORT_CONTENDED;
+                else if (!strcmp(optarg, "hold"))
+                    lockstat_sort_key = SORT_HOLD;
+                else if (!strcmp(optarg, "acquired"))
+                    lockstat_sort_key = SORT_ACQUIRED;
+                else if (!strcmp(optarg, "wait"))
+                    lockstat_sort_key = SORT_WAIT;
+                else
+                    errx(1, "unknown sort key %s", optarg);
+                break;
+            case 'h':
+            case '?':
+                print_usage();
+                return c != 'h';
+        }
+    }
+
+    if (lockstat)
+        return lockstat_main(argv + optind, envp, top_n);
+
+    if (optind >= argc)
+    {
+        print_usage();
+        return 1;
+    }
+
     int fd = open("/dev/ktrace", O_RDWR | O_CLOEXEC);
     if (fd < 0)
         err(1, "open(/dev/ktrace)");
@@ -544,7 +743,7 @@ int main(int argc, char **argv, char **envp)
 
     if (pid == 0)
     {
-        if (execve(argv[1], argv + 1, envp) < 0)
+        if (execve(argv[optind], argv + optind, envp) < 0)
             err(1, "execve");
     }
 